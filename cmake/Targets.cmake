@@ -18,9 +18,9 @@ endif()
 
 if (DISABLE_DHT)
 	set(cxx_definitions ${cxx_definitions} LIBED2K_DISABLE_DHT)
-	set(executables conn dumper)
+	set(executables conn dumper bench)
 else()
-	set(executables conn dumper kad)
+	set(executables conn dumper kad bench)
 	file(GLOB sources_kad src/kademlia/*.cpp)
 	source_group("Source files\\kademlia" FILES ${sources_kad})
 	if (DHT_VERBOSE)
@@ -2,6 +2,7 @@
 #define __ADD_TRANSFER_PARAMS_HPP__
 
 #include "libed2k/hasher.hpp"
+#include "libed2k/sha1.hpp"
 #include "libed2k/storage_defs.hpp"
 #include "libed2k/peer.hpp"
 #include "libed2k/bitfield.hpp"
@@ -23,6 +24,8 @@ namespace libed2k
         std::string file_path; // full filename in UTF8 always!
         size_type  file_size;
         std::vector<md4_hash> piece_hashses;
+        sha1_hash aich_root;                // trusted AICH root hash, all zeros when unknown
+        std::vector<sha1_hash> aich_hashes; // hashes of all AICH blocks of file, may be empty
         std::vector<char>* resume_data;
         storage_mode_t storage_mode;
         bool duplicate_is_error;
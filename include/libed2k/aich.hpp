@@ -0,0 +1,120 @@
+#ifndef __LIBED2K_AICH__
+#define __LIBED2K_AICH__
+
+#include <vector>
+#include <utility>
+
+#include <boost/cstdint.hpp>
+
+#include "libed2k/sha1.hpp"
+#include "libed2k/size_type.hpp"
+
+namespace libed2k
+{
+    /**
+      * hashes of AICH tree nodes needed to recover one part, each hash goes with
+      * identifier of its node - path from root starting by 1, then 1 for left and 0 for right branch
+     */
+    typedef std::vector<std::pair<boost::uint32_t, sha1_hash> > aich_recovery;
+
+    /**
+      * splits piece data into AICH_BLOCK_SIZE blocks and hashes each of them
+     */
+    class aich_piece_hasher
+    {
+    public:
+        aich_piece_hasher() : m_block_bytes(0) {}
+
+        void update(const char* data, int len);
+
+        /**
+          * hash the incomplete last block
+          * @return hashes of all blocks of piece
+         */
+        const std::vector<sha1_hash>& final();
+    private:
+        sha1_hasher m_hasher;
+        int m_block_bytes;                  //!< bytes of current block hashed so far
+        std::vector<sha1_hash> m_blocks;
+    };
+
+    /**
+      * Advanced Intelligent Corruption Handling hash set of file
+      * leaves of the tree are hashes of AICH_BLOCK_SIZE blocks, they are stored per part,
+      * inner nodes are computed on demand, tree layout and node identifiers are compatible with eMule
+     */
+    class aich_hashset
+    {
+    public:
+        aich_hashset();
+        explicit aich_hashset(size_type file_size);
+
+        size_type file_size() const { return m_file_size; }
+        int num_parts() const { return int(m_parts.size()); }
+
+        /**
+          * @return count of AICH blocks in part of file
+         */
+        static int blocks_in_part(size_type file_size, int part);
+
+        /**
+          * @return count of AICH blocks in file
+         */
+        static int total_blocks(size_type file_size);
+
+        /**
+          * corrupted part can be recovered by AICH blocks when file has more than one block
+         */
+        static bool recoverable(size_type file_size);
+
+        bool has_part(int part) const;
+        const std::vector<sha1_hash>& part(int part) const { return m_parts[part]; }
+
+        /**
+          * @param blocks hashes of part's blocks, ignored when count doesn't match blocks_in_part
+         */
+        void set_part(int part, const std::vector<sha1_hash>& blocks);
+
+        bool complete() const { return m_file_size > 0 && m_have == num_parts(); }
+
+        /**
+          * set hashes of all blocks of file in order
+          * @return false when count of hashes doesn't match file size
+         */
+        bool assign(const std::vector<sha1_hash>& blocks);
+
+        /**
+          * @return hashes of all blocks of file in order, empty when hash set isn't complete
+         */
+        std::vector<sha1_hash> blocks() const;
+
+        /**
+          * @return root hash, hash set must be complete
+         */
+        sha1_hash root() const;
+
+        /**
+          * collect hashes of siblings on the path from root to part and hashes of part's blocks
+          * @return false when hash set isn't complete or file isn't recoverable
+         */
+        bool recovery_data(int part, aich_recovery& rd) const;
+
+        /**
+          * check recovery data of part against trusted root hash
+          * @param blocks receives verified hashes of part's blocks
+         */
+        static bool verify(const sha1_hash& root, size_type file_size, int part,
+            const aich_recovery& rd, std::vector<sha1_hash>& blocks);
+    private:
+        struct node;
+
+        sha1_hash node_hash(const node& n) const;
+        void append_blocks(const node& n, aich_recovery& rd) const;
+
+        size_type m_file_size;
+        std::vector<std::vector<sha1_hash> > m_parts;   //!< empty vector for parts without hashes
+        int m_have;                                     //!< count of parts with hashes
+    };
+}
+
+#endif
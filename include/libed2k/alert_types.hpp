@@ -11,7 +11,9 @@
 #include "libed2k/socket_io.hpp"
 #include "libed2k/entry.hpp"
 #include "libed2k/add_transfer_params.hpp"
+#include <sstream>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_array.hpp>
 
 namespace libed2k
 {
@@ -796,6 +798,36 @@ namespace libed2k
         }
     };
 
+    struct read_piece_alert: transfer_alert
+    {
+        read_piece_alert(transfer_handle const& h, int p, boost::shared_array<char> d, int s)
+            : transfer_alert(h), buffer(d), piece(p), size(s)
+        {}
+
+        read_piece_alert(transfer_handle const& h, int p, error_code e)
+            : transfer_alert(h), ec(e), piece(p), size(0)
+        {}
+
+        boost::shared_array<char> buffer;
+        error_code ec;
+        int piece;
+        int size;
+
+        virtual std::auto_ptr<alert> clone() const
+        { return std::auto_ptr<alert>(new read_piece_alert(*this)); }
+        virtual char const* what() const { return "read piece"; }
+        const static int static_category = alert::storage_notification;
+        virtual int category() const { return static_category; }
+        virtual std::string message() const
+        {
+            std::ostringstream str;
+            str << transfer_alert::message() << " piece " << piece;
+            if (ec) str << " read failed: " << ec.message();
+            else str << " successful read " << size << " bytes";
+            return str.str();
+        }
+    };
+
     struct transfer_params_alert : alert
     {
         const static int static_category = alert::status_notification;
@@ -817,6 +849,32 @@ namespace libed2k
         error_code          m_ec;
     };
 
+    /**
+      * transfer parameters of several shared files at once
+     */
+    struct transfer_params_batch_alert : alert
+    {
+        const static int static_category = alert::status_notification;
+        typedef std::vector<std::pair<add_transfer_params, error_code> > params_list;
+
+        transfer_params_batch_alert(const params_list& params) : m_params(params)
+        {}
+
+        virtual std::auto_ptr<alert> clone() const
+                { return std::auto_ptr<alert>(new transfer_params_batch_alert(*this)); }
+
+        virtual char const* what() const { return "transfer parameters batch ready"; }
+        virtual int category() const { return static_category; }
+        virtual std::string message() const
+        {
+            char msg[100];
+            snprintf(msg, sizeof(msg), "%d transfer params ready", int(m_params.size()));
+            return msg;
+        }
+
+        params_list m_params;
+    };
+
     struct portmap_log_alert : alert
     {
         portmap_log_alert(int t, std::string const& m) : map_type(t), msg(m)
@@ -6,7 +6,10 @@
 #include <boost/mpl/identity.hpp>
 #include <boost/type_traits/is_fundamental.hpp>
 #include <boost/type_traits/is_class.hpp>
+#include <string>
+#include <cstring>
 #include "libed2k/error_code.hpp"
+#include "libed2k/assert.hpp"
 
 namespace libed2k
 {
@@ -73,7 +76,15 @@ namespace libed2k
             typedef boost::mpl::bool_<false> is_loading;
             typedef boost::mpl::bool_<true> is_saving;
 
-            ed2k_oarchive(std::ostream& container) : m_container(container)
+            ed2k_oarchive(std::ostream& container) : m_container(&container), m_buffer(0)
+            {
+            }
+
+            /**
+              * append data to buffer directly, without stream layer
+              * reuse buffer with preserved capacity to avoid allocations
+             */
+            explicit ed2k_oarchive(std::string& buffer) : m_container(0), m_buffer(&buffer)
             {
             }
 
@@ -84,7 +95,8 @@ namespace libed2k
 
             std::ostream& container()
             {
-                return (m_container);
+                LIBED2K_ASSERT(m_container);
+                return (*m_container);
             }
 
             template<typename T>
@@ -117,8 +129,14 @@ namespace libed2k
             template<typename T>
             void raw_write(T p, size_t nSize)
             {
-                m_container.write(p, nSize);
-                if (!m_container.good())
+                if (m_buffer)
+                {
+                    m_buffer->append(p, nSize);
+                    return;
+                }
+
+                m_container->write(p, nSize);
+                if (!m_container->good())
                 {
                     throw libed2k::libed2k_exception(libed2k::errors::unexpected_ostream_error);
                 }
@@ -139,7 +157,8 @@ namespace libed2k
                 val.serialize(*this);
             }
 
-            std::ostream& m_container;
+            std::ostream* m_container;
+            std::string*  m_buffer;
         };
 
         class ed2k_iarchive
@@ -149,21 +168,31 @@ namespace libed2k
             typedef boost::mpl::bool_<false> is_saving;
 
 
-            ed2k_iarchive(std::istream& container) : m_container(container)
+            ed2k_iarchive(std::istream& container) : m_container(&container), m_data(0), m_size(0), m_pos(0)
+            {
+                m_container->seekg (0, std::ios::end);
+                m_length = m_container->tellg();
+                m_container->seekg (0, std::ios::beg);
+            }
+
+            /**
+              * read directly from memory buffer without stream layer, every read is bounds-checked
+              * buffer must live until archive is destroyed
+             */
+            ed2k_iarchive(const char* data, size_t size) : m_container(0), m_data(data), m_size(size), m_pos(0), m_length(0)
             {
-                m_container.seekg (0, std::ios::end);
-                m_length = m_container.tellg();
-                m_container.seekg (0, std::ios::beg);
             }
 
             size_t bytes_left() const
             {
-                return m_length - m_container.tellg();
+                if (!m_container) return m_size - m_pos;
+                return m_length - m_container->tellg();
             }
 
             std::istream& container()
             {
-                return (m_container);
+                LIBED2K_ASSERT(m_container);
+                return (*m_container);
             }
 
             template<typename T>
@@ -183,12 +212,60 @@ namespace libed2k
             template<typename T>
             void raw_read(T t, size_t nSize)
             {
-                m_container.read(t, nSize);
+                if (!m_container)
+                {
+                    memcpy(t, read_span(nSize), nSize);
+                    return;
+                }
+
+                m_container->read(t, nSize);
+
+                if (!m_container->good())
+                {
+                    throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
+                }
+            }
+
+            /**
+              * take nSize bytes from memory buffer without copying
+              * returned pointer is valid while buffer is alive, available in memory buffer mode only
+             */
+            const char* read_span(size_t nSize)
+            {
+                LIBED2K_ASSERT(!m_container);
 
-                if (!m_container.good())
+                if (nSize > m_size - m_pos)
                 {
                     throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
                 }
+
+                const char* p = m_data + m_pos;
+                m_pos += nSize;
+                return p;
+            }
+
+            /**
+              * pass nSize bytes, throws ec when data is shorter
+             */
+            void skip(size_t nSize, errors::error_code_enum ec = errors::unexpected_istream_error)
+            {
+                if (nSize > bytes_left())
+                {
+                    throw libed2k::libed2k_exception(ec);
+                }
+
+                if (!m_container)
+                {
+                    m_pos += nSize;
+                    return;
+                }
+
+                m_container->seekg(nSize, std::ios::cur);
+
+                if (!m_container->good())
+                {
+                    throw libed2k::libed2k_exception(ec);
+                }
             }
 
             // you must resize string to appropriate size before load
@@ -199,17 +276,20 @@ namespace libed2k
 
                 if (nSize != 0)
                 {
-                    char* v = new char[nSize];
-                    raw_read(&v[0], nSize);
-                    str.assign(&v[0], nSize);
-                    delete [] v;
+                    if (m_container)
+                        raw_read(&str[0], nSize);
+                    else
+                        str.assign(read_span(nSize), nSize);
                 }
 
                 return *this;
             }
 
         private:
-            std::istream& m_container;
+            std::istream*   m_container;
+            const char*     m_data;
+            size_t          m_size;
+            size_t          m_pos;
 
             template<typename T>
             inline void deserialize_impl(T & val, typename boost::enable_if<boost::is_fundamental<T> >::type* = 0)
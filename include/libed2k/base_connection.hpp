@@ -72,7 +72,13 @@ namespace libed2k{
         virtual void do_write(int quota = (std::numeric_limits<int>::max)());
 
         template<typename T>
-        void write_struct(const T& t) { write_message(make_message(t)); }
+        void write_struct(const T& t)
+        {
+            libed2k_header header = serialize_message(t, m_write_body);
+            copy_send_buffer(reinterpret_cast<const char*>(&header), header_size);
+            copy_send_buffer(m_write_body.c_str(), m_write_body.size());
+            do_write();
+        }
 
         void write_message(const message& msg);
 
@@ -119,10 +125,7 @@ namespace libed2k{
             {
                 if (!m_in_container.empty())
                 {
-                    boost::iostreams::stream_buffer<base_connection::Device> buffer(
-                        &m_in_container[0], m_in_header.m_size - 1);
-                    std::istream in_array_stream(&buffer);
-                    archive::ed2k_iarchive ia(in_array_stream);
+                    archive::ed2k_iarchive ia(&m_in_container[0], m_in_header.m_size - 1);
                     ia >> t;
                 }
             }
@@ -162,6 +165,7 @@ namespace libed2k{
         socket_buffer m_in_container; //!< buffer for incoming messages
         socket_buffer m_in_gzip_container; //!< buffer for compressed data
         chained_buffer m_send_buffer;  //!< buffer for outgoing messages
+        std::string m_write_body;      //!< reusable buffer for serializing outgoing messages
         tcp::endpoint m_remote;
 
         // upload and download channel state
@@ -0,0 +1,100 @@
+#ifndef __LIBED2K_BLOCK_COMPRESSOR__
+#define __LIBED2K_BLOCK_COMPRESSOR__
+
+#include <string>
+#include <list>
+#include <map>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "libed2k/hasher.hpp"
+#include "libed2k/size_type.hpp"
+
+namespace libed2k
+{
+    struct session_settings;
+
+    /**
+      * compresses uploaded blocks for OP_COMPRESSEDPART packets
+      * recently compressed blocks are cached, so repeated requests of the same block aren't compressed again
+      * every file is probed by its first blocks and isn't compressed anymore when none of them shrinks
+      * compression time is limited by budget per second, blocks over budget are sent as is
+     */
+    class block_compressor
+    {
+    public:
+        typedef boost::shared_ptr<const std::string> block;
+
+        enum
+        {
+            probe_blocks = 4,       //!< blocks compressed before file compressibility is decided
+            min_saving = 10,        //!< compression must save this percent of block size
+            entry_overhead = 64     //!< cache size charge of each entry besides compressed data
+        };
+
+        /**
+          * @param settings upload_compression_level, upload_compression_budget
+          *        and compressed_cache_size are read on each call
+         */
+        explicit block_compressor(const session_settings& settings);
+
+        /**
+          * @param offset block offset in file
+          * @return compressed block or empty pointer when block must be sent as is
+         */
+        block compress_block(const md4_hash& file, size_type offset, const char* data, int size);
+
+        /**
+          * restore compression budget, call it once per second
+         */
+        void second_tick();
+
+        /**
+          * forget file stats and cached blocks of file
+         */
+        void remove_file(const md4_hash& file);
+
+        size_t cached_bytes() const { return m_cached_bytes; }
+        size_t cached_blocks() const { return m_cache.size(); }
+        boost::uint64_t cache_hits() const { return m_hits; }
+
+        /**
+          * file was probed and its blocks don't shrink
+         */
+        bool incompressible(const md4_hash& file) const;
+    private:
+        struct cache_key
+        {
+            cache_key(const md4_hash& f, size_type o, int s) : file(f), offset(o), size(s) {}
+            bool operator<(const cache_key& k) const;
+
+            md4_hash    file;
+            size_type   offset;
+            int         size;
+        };
+
+        struct file_stat
+        {
+            file_stat() : probed(0), shrunk(0) {}
+            int probed;
+            int shrunk;
+        };
+
+        typedef std::list<std::pair<cache_key, block> > lru_list;
+        typedef std::map<cache_key, lru_list::iterator> cache_map;
+
+        void insert(const cache_key& key, const block& b, size_t limit);
+        void erase(lru_list::iterator i);
+
+        const session_settings& m_settings;
+        lru_list m_lru;                             //!< most recently used entries first
+        cache_map m_cache;
+        size_t m_cached_bytes;
+        boost::uint64_t m_hits;
+        std::map<md4_hash, file_stat> m_files;
+        boost::int64_t m_spent;                     //!< microseconds spent in compression in current second
+    };
+}
+
+#endif
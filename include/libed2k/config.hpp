@@ -212,6 +212,16 @@ POSSIBILITY OF SUCH DAMAGE.
 #define LIBED2K_USE_IFCONF 1
 #define LIBED2K_HAS_SALEN 0
 
+// preadv and pwritev appeared in glibc 2.10
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 10))
+#define LIBED2K_USE_PREADV 1
+#endif
+
+// recvmmsg appeared in glibc 2.12, sendmmsg in glibc 2.14
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 14))
+#define LIBED2K_USE_MMSG 1
+#endif
+
 // ==== MINGW ===
 #elif defined __MINGW32__
 #define LIBED2K_MINGW
@@ -436,6 +446,16 @@ namespace libed2k
 #define LIBED2K_USE_READV 1
 #endif
 
+// positioned vectored I/O saves the seek before each operation
+#ifndef LIBED2K_USE_PREADV
+#define LIBED2K_USE_PREADV 0
+#endif
+
+// batched datagram I/O, one system call per batch of UDP packets
+#ifndef LIBED2K_USE_MMSG
+#define LIBED2K_USE_MMSG 0
+#endif
+
 #ifndef LIBED2K_NO_FPU
 #define LIBED2K_NO_FPU 0
 #endif
@@ -462,6 +482,12 @@ namespace libed2k
 #define LIBED2K_HAS_STRDUP 1
 #endif
 
+#ifdef _MSC_VER
+#define LIBED2K_THREAD_LOCAL __declspec(thread)
+#else
+#define LIBED2K_THREAD_LOCAL __thread
+#endif
+
 #if !defined LIBED2K_IOV_MAX
 #ifdef IOV_MAX
 #define LIBED2K_IOV_MAX IOV_MAX
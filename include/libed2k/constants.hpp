@@ -11,6 +11,9 @@ namespace libed2k
     const size_t HIGHEST_LOWID_ED2K = 16777216;
     const size_t MAX_ED2K_PACKET_LEN = 2*BLOCK_SIZE;
     const size_t MAX_COLLECTION_SIZE = BLOCK_SIZE; // tentative collection size
+    const size_type OLD_MAX_FILE_SIZE = 4290048000ull;  //!< largest file of clients without large files support
+    const size_type AICH_BLOCK_SIZE = 184320;   //!< AICH tree leaf size, part holds 53 such blocks
+    const size_t COMPRESSED_PART_SIZE = 10240;  //!< max compressed data in one OP_COMPRESSEDPART packet, as eMule sends
     const int LIBED2K_SERVER_CONN_MAX_SIZE = 250000;  //!< max packet body size for server connection
 
     enum protocol_type
@@ -862,26 +862,7 @@ void tag_list<size_type>::load(archive::ed2k_iarchive& ar)
             boost::uint16_t nLength;
             ar & nLength;
 
-#ifdef WIN32
-			// windows generates exceptions independent by exceptions flags in stream
-			try
-			{
-                ar.container().seekg((nLength/8) + 1, std::ios::cur);
-			}
-			catch(std::ios_base::failure&)
-			{
-				throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-			}
-#else
-			ar.container().seekg((nLength/8) + 1, std::ios::cur);
-#endif
-
-
-            // check status
-            if (!ar.container().good())
-            {
-                throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-            }
+            ar.skip((nLength/8) + 1);
 
             continue;
         }
@@ -891,25 +872,7 @@ void tag_list<size_type>::load(archive::ed2k_iarchive& ar)
             uint8_t len;
             ar & len;
 
-#ifdef WIN32
-            // windows generates exceptions independent by exceptions flags in stream
-            try
-            {
-                ar.container().seekg((len), std::ios::cur);
-            }
-            catch (std::ios_base::failure&)
-            {
-                throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-            }
-#else
-            ar.container().seekg((len), std::ios::cur);
-#endif
-
-            // check status
-            if (!ar.container().good())
-            {
-                throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-            }
+            ar.skip(len);
 
             continue;
         }
@@ -38,10 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libed2k/socket.hpp>
 #include <libed2k/session_settings.hpp>
 #include <libed2k/allocator.hpp>
-
-#ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-#include <boost/pool/pool.hpp>
-#endif
+#include <libed2k/slab_arena.hpp>
 
 #ifdef LIBED2K_DISK_STATS
 #include <fstream>
@@ -85,16 +82,24 @@ namespace libed2k
 
         int in_use() const { return m_in_use; }
 
+        // peak, reserved and fragmented buffers of the pool. Only
+        // in_use is counted when the pool allocator is disabled
+        slab_arena::stats_t arena_stats() const;
+
+        // takes effect for memory reserved after the call
+        void set_settings(session_settings const& s);
+
     protected:
 
-        void free_buffer_impl(char* buf, mutex::scoped_lock& l);
+        void free_buffer_impl(char* buf);
 
         // number of bytes per block. The ED2K
         // protocol defines the block size to BLOCK_SIZE.
         const int m_block_size;
 
-        // number of disk buffers currently allocated
-        int m_in_use;
+        // number of disk buffers currently allocated. Buffers
+        // are allocated and freed without locking the pool
+        volatile long m_in_use;
 
         session_settings m_settings;
 
@@ -103,13 +108,13 @@ namespace libed2k
         mutable mutex m_pool_mutex;
 
 #ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-        // memory pool for read and write operations
-        // and disk cache
-        boost::pool<page_aligned_allocator> m_pool;
+        // memory for read and write operations and disk
+        // cache, carved from hugepage backed slabs
+        slab_arena m_arena;
 #endif
 
 #if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        int m_allocations;
+        volatile long m_allocations;
 #endif
 #ifdef LIBED2K_DISK_STATS
     public:
@@ -43,17 +43,23 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/noncopyable.hpp>
 #include <boost/shared_array.hpp>
 #include <boost/optional.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <deque>
 #include <list>
+#include <set>
+#include <map>
 
 #include <libed2k/config.hpp>
 #include <libed2k/thread.hpp>
 #include <libed2k/disk_buffer_pool.hpp>
 #include <libed2k/constants.hpp>
+#include <libed2k/mpsc_queue.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/identity.hpp>
 #include <boost/multi_index/mem_fun.hpp>
 
 namespace libed2k
@@ -61,6 +67,8 @@ namespace libed2k
     using boost::multi_index::multi_index_container;
     using boost::multi_index::ordered_non_unique;
     using boost::multi_index::ordered_unique;
+    using boost::multi_index::sequenced;
+    using boost::multi_index::identity;
     using boost::multi_index::indexed_by;
     using boost::multi_index::member;
     using boost::multi_index::const_mem_fun;
@@ -106,6 +114,7 @@ namespace libed2k
             , read_and_hash
             , cache_piece
             , finalize_file
+            , aich_hash
         };
 
         action_t action;
@@ -134,6 +143,9 @@ namespace libed2k
 
         boost::shared_ptr<entry> resume_data;
 
+        // hashes of AICH blocks of the piece, set by aich_hash
+        boost::shared_ptr<std::vector<sha1_hash> > aich_blocks;
+
         // the error code from the file operation
         error_code error;
 
@@ -158,6 +170,8 @@ namespace libed2k
         cache_status()
             : blocks_written(0)
             , writes(0)
+            , flushes(0)
+            , write_syscalls(0)
             , blocks_read(0)
             , blocks_read_hit(0)
             , reads(0)
@@ -178,13 +192,35 @@ namespace libed2k
             , cumulative_hash_time(0)
             , cumulative_sort_time(0)
             , total_read_back(0)
+            , pieces_hashed(0)
+            , pieces_read_back(0)
             , read_queue_size(0)
+            , read_cache_pieces(0)
+            , read_cache_frequent_pieces(0)
+            , read_cache_recent_target(0)
+            , ghost_hits(0)
+            , peak_used_buffers(0)
+            , reserved_buffers(0)
+            , fragmented_buffers(0)
         {}
 
+        // read cache counters of one transfer, in blocks
+        struct transfer_counters
+        {
+            transfer_counters(): blocks_read(0), blocks_read_hit(0) {}
+            size_type blocks_read;
+            size_type blocks_read_hit;
+        };
+
         // the number of blocks written
         size_type blocks_written;
         // the number of write operations used
         size_type writes;
+        // the number of write cache flushes and the file system
+        // calls they took, write_syscalls / flushes is the cost
+        // of one flush
+        size_type flushes;
+        size_type write_syscalls;
         // (blocks_written - writes) / blocks_written represents the
         // "cache hit" ratio in the write cache
         // the number of blocks read
@@ -223,21 +259,87 @@ namespace libed2k
         boost::uint32_t cumulative_hash_time;
         boost::uint32_t cumulative_sort_time;
         int total_read_back;
+        // pieces hash checked and how many of them were read back
+        // from disk, since blocks are hashed while they are in the
+        // write cache it's only when the cache runs out of space
+        int pieces_hashed;
+        int pieces_read_back;
         int read_queue_size;
+
+        // the number of pieces in the read cache and how many
+        // of them were read more than once. Pieces read only
+        // once are evicted first while there are more of them
+        // than read_cache_recent_target
+        int read_cache_pieces;
+        int read_cache_frequent_pieces;
+        int read_cache_recent_target;
+
+        // the number of read cache misses on pieces evicted
+        // lately. Each of them adapts read_cache_recent_target
+        size_type ghost_hits;
+
+        // the maximum of total_used_buffers so far, the number of
+        // buffers the reserved memory can hold and how many free
+        // ones can't be released since others of their slab are used
+        int peak_used_buffers;
+        int reserved_buffers;
+        int fragmented_buffers;
+
+        // hits and misses of the read cache per transfer
+        std::map<md4_hash, transfer_counters> transfers;
     };
 
-    // this is a singleton consisting of the thread and a queue
-    // of disk io jobs
-    struct LIBED2K_EXTRA_EXPORT disk_io_thread : disk_buffer_pool
+    struct disk_io_thread;
+
+    // completed disk jobs on their way to the network thread. Disk
+    // and hash threads push them without locking, the first push after
+    // a dispatch posts one handler, which calls back every job queued
+    // until the queue is found empty
+    class LIBED2K_EXTRA_EXPORT completion_queue
+        : public boost::enable_shared_from_this<completion_queue>
+        , boost::noncopyable
     {
-        disk_io_thread(io_service& ios
-            , boost::function<void()> const& queue_callback
-            , file_pool& fp
-            , int block_size = BLOCK_SIZE);
-        ~disk_io_thread();
+    public:
+        completion_queue(io_service& ios);
+        ~completion_queue();
 
-        void abort();
-        void join();
+        // may be called from any thread
+        void post(disk_io_job const& j, int ret);
+
+        // the number of handlers posted to the io_service
+        // and the number of jobs they called back
+        boost::int64_t dispatches() const { return m_dispatches; }
+        boost::int64_t completions() const { return m_completions; }
+
+    private:
+        struct completion : mpsc_queue::node
+        {
+            completion(disk_io_job const& j, int r): job(j), ret(r) {}
+            disk_io_job job;
+            int ret;
+        };
+
+        // runs in the network thread
+        void dispatch();
+
+        io_service& m_ios;
+        mpsc_queue m_queue;
+
+        // 1 while a dispatch is posted or running
+        volatile long m_pending;
+
+        // only touched by dispatch()
+        boost::int64_t m_dispatches;
+        boost::int64_t m_completions;
+    };
+
+    // one thread performing blocking disk io operations with
+    // its own job queue and cache. A storage is served by a
+    // single worker at a time, which keeps its jobs in order
+    struct LIBED2K_EXTRA_EXPORT disk_io_worker : boost::noncopyable
+    {
+        disk_io_worker(disk_io_thread& owner, int index);
+        ~disk_io_worker();
 
         // aborts read operations
         void stop(boost::intrusive_ptr<piece_manager> s);
@@ -247,10 +349,6 @@ namespace libed2k
             , boost::function<void(int, disk_io_job const&)> const& f
             = boost::function<void(int, disk_io_job const&)>());
 
-        // keep track of the number of bytes in the job queue
-        // at any given time. i.e. the sum of all buffer_size.
-        // this is used to slow down the download global download
-        // speed when the queue buffer size is too big.
         size_type queue_buffer_size() const;
         bool can_write() const;
 
@@ -278,6 +376,17 @@ namespace libed2k
 
         struct cached_piece_entry
         {
+            cached_piece_entry()
+                : piece(0)
+                , num_blocks(0)
+                , num_contiguous_blocks(0)
+                , next_block_to_hash(0)
+                , frequent(false)
+                , read_end(0)
+                , refcount(0)
+                , need_readback(false)
+            {}
+
             int piece;
             // storage this piece belongs to
             boost::intrusive_ptr<piece_manager> storage;
@@ -296,17 +405,34 @@ namespace libed2k
             // is used to determine if flushing a range would force us
             // to read it back later when hashing
             int next_block_to_hash;
+            // read cache pieces start in the recent list and move
+            // to the frequent list once data of them is read again.
+            // Write cache pieces always stay in the recent list
+            bool frequent;
+            // the end offset of the last read from this piece
+            int read_end;
+            // blocks of the piece are hashed with m_piece_mutex unlocked,
+            // the piece is neither flushed nor evicted while it's set
+            int refcount;
+            // blocks after the partial hash were flushed or couldn't be
+            // hashed, the piece is read back when it completes, so its
+            // blocks don't wait in the cache for the gap to be filled
+            bool need_readback;
 
             std::pair<void*, int> storage_piece_pair() const
             { return std::pair<void*, int>(storage.get(), piece); }
+
+            // pieces are ordered by list first, then by last use
+            std::pair<bool, libed2k::ptime> lru_key() const
+            { return std::pair<bool, libed2k::ptime>(frequent, expire); }
         };
 
         typedef multi_index_container<
             cached_piece_entry, indexed_by<
                 ordered_unique<const_mem_fun<cached_piece_entry, std::pair<void*, int>
                 , &cached_piece_entry::storage_piece_pair> >
-                , ordered_non_unique<member<cached_piece_entry, libed2k::ptime
-                    , &cached_piece_entry::expire> >
+                , ordered_non_unique<const_mem_fun<cached_piece_entry, std::pair<bool, libed2k::ptime>
+                    , &cached_piece_entry::lru_key> >
                 >
             > cache_t;
 
@@ -314,6 +440,7 @@ namespace libed2k
         typedef cache_t::nth_index<1>::type cache_lru_index_t;
 
     private:
+        friend struct disk_io_thread;
 
         int add_job(disk_io_job const& j
             , mutex::scoped_lock& l
@@ -323,6 +450,28 @@ namespace libed2k
         bool test_error(disk_io_job& j);
         void post_callback(disk_io_job const& j, int ret);
 
+        // clears m_exceeded_write_queue when the write queue
+        // dropped below the low watermark
+        void check_write_queue(mutex::scoped_lock& l);
+
+        // moves all queued jobs of the storage to another worker,
+        // the storage must not have been started by this worker
+        void move_jobs(piece_manager* s, disk_io_worker& w
+            , mutex::scoped_lock& l, mutex::scoped_lock& wl);
+
+        // called by a hash thread when the piece of j is verified
+        void hash_done(disk_io_job const& j, int ret, int hash_time);
+        // posts the results of verified pieces and resumes the jobs
+        // held for their storages, called by the worker thread
+        void finish_hashed(mutex::scoped_lock& l);
+
+        // reads the next slot of a fast file check and lets a hash thread
+        // verify it, returns like piece_manager::check_files
+        int check_next_slot(disk_io_job& j);
+        // called by a hash thread when a slot of a fast file check is hashed
+        void check_hash_done(disk_io_job const& j, int hash_time);
+        void wait_for_check_hashes();
+
         // cache operations
         cache_piece_index_t::iterator find_cached_piece(
             cache_t& cache, disk_io_job const& j
@@ -348,6 +497,7 @@ namespace libed2k
         int flush_contiguous_blocks(cached_piece_entry& p
             , mutex::scoped_lock& l, int lower_limit = 0, bool avoid_readback = false);
         int flush_range(cached_piece_entry& p, int start, int end, mutex::scoped_lock& l);
+        int hash_cached_blocks(cached_piece_entry& p, mutex::scoped_lock& l);
         int cache_block(disk_io_job& j
             , boost::function<void(int,disk_io_job const&)>& handler
             , int cache_expire
@@ -356,6 +506,15 @@ namespace libed2k
         // read cache operations
         int clear_oldest_read_piece(int num_blocks, ignore_t ignore
             , mutex::scoped_lock& l);
+        cache_lru_index_t::iterator read_cache_victim(ignore_t ignore);
+        // bookkeeping of a read cache piece about to be erased,
+        // evicted pieces are remembered in the ghost lists
+        void read_piece_removed(cached_piece_entry const& p, bool evicted);
+        // returns true if the piece was evicted lately and
+        // adapts the recent list target to the list it was in
+        bool ghost_hit(disk_io_job const& j);
+        void forget_ghosts(md4_hash const& info_hash);
+        void count_read(disk_io_job const& j, bool hit, mutex::scoped_lock& l);
         int read_into_piece(cached_piece_entry& p, int start_block
             , int options, int num_blocks, mutex::scoped_lock& l);
         int cache_read_block(disk_io_job const& j, mutex::scoped_lock& l);
@@ -371,8 +530,15 @@ namespace libed2k
         int cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
             , bool& hit, int options, mutex::scoped_lock& l);
 
+        // the engine this worker belongs to, it owns the
+        // buffer pool shared by all workers
+        disk_io_thread& m_pool;
+        const int m_index;
+        const int m_block_size;
+
         // this mutex only protects m_jobs, m_queue_buffer_size,
-        // m_exceeded_write_queue and m_abort
+        // m_exceeded_write_queue, m_abort, m_started, m_hashing,
+        // m_parked, m_hashed, m_idle and m_check_hashing
         mutable mutex m_queue_mutex;
         event m_signal;
         bool m_abort;
@@ -380,6 +546,25 @@ namespace libed2k
         std::deque<disk_io_job> m_jobs;
         size_type m_queue_buffer_size;
 
+        // storages this worker picked jobs of. Their cache
+        // lives here, so they can't be moved to another worker
+        std::set<piece_manager*> m_started;
+
+        // storages with a piece being verified by a hash thread
+        // and their jobs waiting for it
+        std::set<piece_manager*> m_hashing;
+        std::deque<disk_io_job> m_parked;
+
+        // pieces verified by hash threads, their storages are
+        // updated by this worker
+        std::deque<std::pair<disk_io_job, int> > m_hashed;
+
+        // true while the worker waits for jobs
+        bool m_idle;
+
+        // slots of fast file checks being hashed by hash threads
+        int m_check_hashing;
+
         libed2k::ptime m_last_file_check;
 
         // this protects the piece cache and related members
@@ -390,6 +575,24 @@ namespace libed2k
         // read cache
         cache_t m_read_pieces;
 
+        // keys of read cache pieces evicted lately, the first list
+        // holds pieces evicted from the recent list and the second
+        // the ones evicted from the frequent list. Pieces are told
+        // by info hash, a storage at the address of a destroyed one
+        // doesn't inherit its history
+        typedef std::pair<md4_hash, int> ghost_key;
+        typedef multi_index_container<
+            ghost_key, indexed_by<
+                sequenced<>
+                , ordered_unique<identity<ghost_key> >
+                >
+            > ghost_list_t;
+        ghost_list_t m_ghosts[2];
+        // storages forget their ghosts from any thread when
+        // they're destroyed, possibly while this worker holds
+        // m_piece_mutex, so the lists have their own lock
+        mutable mutex m_ghost_mutex;
+
         void flip_stats(libed2k::ptime now);
 
         // total number of blocks in use by both the read
@@ -439,6 +642,106 @@ namespace libed2k
 
         boost::function<void()> m_queue_callback;
 
+        session_settings m_settings;
+
+        // reference to the file_pool which is a member of
+        // the session_impl object
+        file_pool& m_file_pool;
+
+        // thread for performing blocking disk io operations
+        thread m_disk_io_thread;
+    };
+
+    // the disk engine. It consists of the disk buffer pool, the
+    // disk io workers and the threads hashing finished pieces.
+    // Jobs of a storage are routed to the worker serving the
+    // device of its save path
+    struct LIBED2K_EXTRA_EXPORT disk_io_thread : disk_buffer_pool
+    {
+        disk_io_thread(io_service& ios
+            , boost::function<void()> const& queue_callback
+            , file_pool& fp
+            , int block_size = BLOCK_SIZE
+            , int io_threads = 1
+            , int hash_threads = 0);
+        ~disk_io_thread();
+
+        void abort();
+        void join();
+
+        // aborts read operations
+        void stop(boost::intrusive_ptr<piece_manager> s);
+
+        // drops read cache history of a storage in all workers,
+        // called when the storage is destroyed
+        void forget_ghosts(md4_hash const& info_hash);
+
+        // returns the disk write queue size of the worker
+        // the job was queued to
+        int add_job(disk_io_job const& j
+            , boost::function<void(int, disk_io_job const&)> const& f
+            = boost::function<void(int, disk_io_job const&)>());
+
+        // keep track of the number of bytes in the job queue
+        // at any given time. i.e. the sum of all buffer_size.
+        // this is used to slow down the download global download
+        // speed when the queue buffer size is too big.
+        size_type queue_buffer_size() const;
+        bool can_write() const;
+
+        void get_cache_info(md4_hash const& ih
+            , std::vector<cached_piece_info>& ret) const;
+
+        // the sum of all workers' stats, average times
+        // are the ones of the slowest worker
+        cache_status status() const;
+
+        int io_threads() const { return m_num_workers; }
+
+        completion_queue const& completions() const { return *m_completions; }
+
+    private:
+        friend struct disk_io_worker;
+
+        // a piece read by a worker and waiting to be hashed
+        struct hash_job
+        {
+            hash_job(): worker(0), check(false) {}
+            disk_io_job job;
+            partial_hash ph;
+            std::vector<file::iovec_t> bufs;
+            disk_io_worker* worker;
+            // a slot of a fast file check, job.offset is the piece
+            bool check;
+        };
+
+        // returns the worker serving the storage, m_route_mutex must be held
+        disk_io_worker& route(piece_manager* s, mutex::scoped_lock& l);
+
+        // forgets the route of a storage when w has nothing of it anymore
+        void release_route(disk_io_worker& w, piece_manager* s);
+
+        // moves jobs of a storage not started yet from a backlogged
+        // worker to the idle one. Returns false if there is nothing to take
+        bool steal_jobs(disk_io_worker& thief);
+
+        // wakes up an idle worker when w has jobs waiting
+        void wake_idle(disk_io_worker& w, mutex::scoped_lock& l);
+
+        bool hash_offload() const { return !m_hash_threads.empty(); }
+        void post_hash(hash_job const& hj);
+        void hash_thread_fun();
+
+        // called by each worker when it exits
+        void worker_done();
+
+        io_service& m_ios;
+        boost::function<void()> m_queue_callback;
+
+        // reference to the file_pool which is a member of
+        // the session_impl object
+        file_pool& m_file_pool;
+
         // this keeps the io_service::run() call blocked from
         // returning. When shutting down, it's possible that
         // the event queue is drained before the disk_io_thread
@@ -451,16 +754,26 @@ namespace libed2k
         // exist anymore, and crash. This prevents that.
         boost::optional<io_service::work> m_work;
 
-        // reference to the file_pool which is a member of
-        // the session_impl object
-        file_pool& m_file_pool;
+        // shared with the posted dispatch handler, which may
+        // run after the disk_io_thread is destructed
+        boost::shared_ptr<completion_queue> m_completions;
+
+        // protects m_routes, m_devices, m_running and m_abort. When it's held
+        // together with the queue mutex of a worker, it's locked first
+        mutable mutex m_route_mutex;
+        std::map<piece_manager*, int> m_routes;
+        std::map<boost::uint64_t, int> m_devices;
+        int m_running;
+        bool m_abort;
 
-        // when completion notifications are queued, they're stuck
-        // in this list
-        std::list<std::pair<disk_io_job, int> > m_queued_completions;
+        const int m_num_workers;
+        std::vector<boost::shared_ptr<disk_io_worker> > m_workers;
 
-        // thread for performing blocking disk io operations
-        thread m_disk_io_thread;
+        mutex m_hash_mutex;
+        condition m_hash_signal;
+        std::deque<hash_job> m_hash_jobs;
+        bool m_hash_abort;
+        std::vector<boost::shared_ptr<thread> > m_hash_threads;
     };
 
 }
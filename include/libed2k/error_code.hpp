@@ -132,6 +132,7 @@ namespace libed2k
             failed_hash_check,
             invalid_escaped_string,
             file_params_making_was_cancelled,
+            known_store_corrupted,
             num_errors
         };
     }
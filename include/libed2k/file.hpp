@@ -9,6 +9,7 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "libed2k/config.hpp"
 #include "libed2k/error_code.hpp"
@@ -166,7 +167,18 @@ namespace libed2k
         known_file_list     m_known_file_list;
 
         known_file_collection();
-        add_transfer_params extract_transfer_params(time_t, const std::string&);
+
+        /**
+          * index entries by change time, size and file name
+          * must be called after the collection was loaded or changed
+         */
+        void build_index();
+
+        /**
+          * find entry by its index key, the first matched entry wins
+          * empty parameters are returned when nothing was found
+         */
+        add_transfer_params extract_transfer_params(time_t, size_type, const std::string&);
 
         template<typename Archive>
         void serialize(Archive& ar)
@@ -176,6 +188,77 @@ namespace libed2k
         }
 
         void dump() const;
+    private:
+        struct entry_key
+        {
+            time_t      m_mtime;
+            size_type   m_size;
+            std::string m_filename;   //!< file name without BOM
+
+            entry_key(time_t mtime, size_type size, const std::string& filename) :
+                m_mtime(mtime), m_size(size), m_filename(filename) {}
+
+            bool operator==(const entry_key& k) const
+            {
+                return m_mtime == k.m_mtime && m_size == k.m_size && m_filename == k.m_filename;
+            }
+        };
+
+        struct entry_key_hash
+        {
+            std::size_t operator()(const entry_key& k) const;
+        };
+
+        typedef boost::unordered_map<entry_key, size_t, entry_key_hash> entry_index;
+        entry_index m_index;    //!< key -> position in m_known_file_list
+    };
+
+    /**
+      * binary known files store read through memory mapping
+      * only compact index is resident, names and piece hashes stay in the mapped file
+      * and pages are read by OS when transfer parameters are extracted
+      * all numbers are stored in network byte order, see known_file_store::write for layout
+      * store is read only after open, like known.met the application saves newly hashed files
+      * and writes known.met from export_collection when it needs it
+     */
+    class known_file_store : boost::noncopyable
+    {
+    public:
+        enum { version = 1 };
+
+        known_file_store();
+
+        bool open(const std::string& filepath, error_code& ec);
+        void close();
+        bool is_open() const { return m_view.data() != 0; }
+        size_t size() const { return m_count; }
+
+        /**
+          * same as known_file_collection::extract_transfer_params
+         */
+        add_transfer_params extract_transfer_params(time_t, size_type, const std::string&) const;
+
+        /**
+          * convert collection to the store file, known.met import
+         */
+        static bool write(const std::string& filepath, const known_file_collection& kfc, error_code& ec);
+
+        /**
+          * append all entries to collection, known.met export
+         */
+        void export_collection(known_file_collection& kfc) const;
+    private:
+        const char* record(size_t n) const;
+        std::string record_name(const char* rec) const;
+        void record_hashset(const char* rec, std::vector<md4_hash>& hashes) const;
+
+        file_view m_view;
+        size_t m_count;
+        size_type m_names_offset;
+        size_type m_hashes_offset;
+
+        typedef boost::unordered_multimap<std::size_t, boost::uint32_t> record_index;
+        record_index m_index;   //!< hash of change time, size and file name -> record
     };
 
     /**
@@ -217,17 +300,57 @@ namespace libed2k
 
     struct file2atp : public std::binary_function<const std::string&, bool&, std::pair<add_transfer_params, error_code> >
     {
+        enum read_flags_t
+        {
+            // hash straight from memory mapped file instead of reading copies of blocks
+            read_mapped = 1,
+            // drop hashed data from the page cache behind the cursor
+            drop_cache = 2,
+            // build AICH hash set of file too
+            hash_aich = 4
+        };
+
+        // blocks of a piece read at once into its lane buffer
+        enum { hash_run_blocks = 8 };
+
+        explicit file2atp(int flags = 0) : m_flags(flags) {}
+
         std::pair<add_transfer_params, error_code> operator()(const std::string&, const bool&);
+
+        /**
+          * hash pieces [first, last) of opened file into hashes
+          * hashes must be already resized to pieces count
+          * @param flags read_flags_t combination
+          * @param aich_blocks receives AICH block hashes of pieces when not null,
+          *        it must be already resized to aich_hashset::total_blocks
+         */
+        static void hash_pieces(file& f, size_type file_size, int first, int last,
+            std::vector<md4_hash>& hashes, const bool& cancel, error_code& ec, int flags = 0,
+            std::vector<sha1_hash>* aich_blocks = 0);
+
+        /**
+          * add terminal hash when it is needed and calculate file hash from piece hashes
+          * AICH root hash is calculated when AICH block hashes are present
+         */
+        static void complete(add_transfer_params& atp);
+
+        int m_flags;
     };
 
     class transfer_params_maker
     {
     public:
-        transfer_params_maker(alert_manager& am, const std::string& known_filepath);
+        /**
+          * @param hashing_threads count of threads hashing files concurrently
+          * @param read_flags file2atp::read_flags_t combination
+          * @param known_store_filepath known_file_store file used instead of known.met, it is
+          *        imported from known.met when it is absent or older, empty string disables store
+         */
+        transfer_params_maker(alert_manager& am, const std::string& known_filepath,
+            int hashing_threads = 1, int read_flags = 0, const std::string& known_store_filepath = std::string());
         virtual ~transfer_params_maker();
         bool start();
         void stop();
-        void operator()();
 
         size_t order_size();
         std::string current_filepath();
@@ -238,18 +361,75 @@ namespace libed2k
         void make_transfer_params(const std::string& filepath);
         void cancel_transfer_params(const std::string& filepath);
     protected:
-        virtual void process_item();
+        /**
+          * executed in one of hashing threads
+          * @param filepath in UTF-8
+          * @param cancel becomes true when this file processing was cancelled
+         */
+        virtual void process_item(const std::string& filepath, const bool& cancel);
+
+        /**
+          * take parameters from known files or hash file when it isn't known
+         */
+        std::pair<add_transfer_params, error_code> make_params(const std::string& filepath, const bool& cancel);
+
+        /**
+          * hash file like file2atp, but pieces of file are split into ranges for idle hashing threads
+         */
+        std::pair<add_transfer_params, error_code> hash_file(const std::string& filepath, const bool& cancel);
+
         alert_manager&      m_am;
         mutable bool        m_abort;                //!< cancel thread
-        mutable bool        m_abort_current;       //!< cancel one file
-        std::string         m_current_filepath;     //!< current file path
     private:
+        /**
+          * one file hashing by piece ranges, owned by thread which took file from order
+         */
+        struct hashing_job
+        {
+            hashing_job(const std::string& filepath, size_type file_size, int pieces_count, const bool& cancel) :
+                m_filepath(filepath), m_file_size(file_size), m_hashes(pieces_count), m_pending(0), m_cancel(cancel)
+            {}
+
+            std::string             m_filepath;
+            size_type               m_file_size;
+            std::vector<md4_hash>   m_hashes;
+            std::vector<sha1_hash>  m_aich;     //!< AICH block hashes, empty when they aren't built
+            int                     m_pending;  //!< ranges not hashed yet
+            error_code              m_ec;       //!< first range error
+            const bool&             m_cancel;
+        };
+
+        struct piece_range
+        {
+            boost::shared_ptr<hashing_job> m_job;
+            int m_first;
+            int m_last;
+        };
+
+        struct worker_state
+        {
+            worker_state() : m_abort_current(false) {}
+            std::string m_filepath;             //!< current file path
+            mutable bool m_abort_current;       //!< cancel current file
+        };
+
+        void worker(size_t index);
+        void load_known_files();
+        void read_known_met();
+        void hash_range(const piece_range& range);
+
         std::string m_known_filepath;
+        std::string m_known_store_filepath;
+        int m_read_flags;
         known_file_collection m_kfc;
-        boost::shared_ptr<boost::thread> m_thread;
+        known_file_store m_kfs;
+        bool m_known_loaded;
+        std::vector<boost::shared_ptr<boost::thread> > m_threads;
+        std::vector<worker_state> m_workers;
 
         boost::mutex m_mutex;
         std::deque<std::string>    m_order;
+        std::deque<piece_range>    m_ranges;        //!< pieces of large files waiting for idle thread
         std::queue<std::string>    m_cancel_order;  //!< order for store signals to cancel after
         boost::condition           m_condition;
 
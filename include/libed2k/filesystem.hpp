@@ -91,6 +91,8 @@ namespace libed2k
         time_t atime;
         time_t mtime;
         time_t ctime;
+        boost::uint64_t inode;  //!< zero on windows
+        boost::uint64_t device; //!< device the file resides on, drive number on windows
         enum {
 #if defined LIBED2K_WINDOWS
             directory = _S_IFDIR,
@@ -191,6 +193,8 @@ namespace libed2k
             no_atime = 16,
             random_access = 32,
             lock_file = 64,
+            // writes return when data reached the disk
+            dsync = 128,
 
             attribute_hidden = 0x1000,
             attribute_executable = 0x2000,
@@ -246,8 +250,16 @@ namespace libed2k
 
         size_type writev(size_type file_offset, iovec_t const* bufs, int num_bufs, error_code& ec);
         size_type readv(size_type file_offset, iovec_t const* bufs, int num_bufs, error_code& ec);
+
+        // the number of system calls readv() and writev() issued
+        // from the calling thread, including seeks and syncs
+        static boost::uint32_t io_calls();
         void hint_read(size_type file_offset, int len);
 
+        // tell the OS that the range won't be read soon and
+        // its pages may be dropped from the page cache
+        void drop_cache(size_type file_offset, size_type len);
+
         size_type get_size(error_code& ec) const;
 
         // return the offset of the first byte that
@@ -287,6 +299,30 @@ namespace libed2k
         mutable int m_cluster_size;
 #endif
     };
+
+    // read only view of a file region mapped into memory. Reading
+    // from the view doesn't copy data from the page cache. If the
+    // file is truncated while it's mapped, reading the missing pages
+    // raises SIGBUS on posix systems
+    struct LIBED2K_EXPORT file_view: boost::noncopyable
+    {
+        file_view();
+        ~file_view();
+
+        // the view is advised for sequential access, offset
+        // doesn't need to be aligned
+        bool map(file const& f, size_type offset, size_type len, error_code& ec);
+        void unmap();
+
+        char const* data() const { return m_data; }
+        size_type size() const { return m_size; }
+
+    private:
+        void* m_base;
+        size_type m_base_size;
+        char const* m_data;
+        size_type m_size;
+    };
 }
 
 #endif // LIBED2K_FILE_UTIL_HPP_INCLUDED
@@ -191,6 +191,41 @@ namespace libed2k
 	private:
 		MD4_CTX m_context;
 	};
+
+    /**
+      * hashes several independent streams at once - every stream gets own lane in SIMD registers
+      * SSE2, AVX2 and AVX-512 kernels (4, 8 and 16 lanes) are selected at runtime by CPU features
+      * result of each stream is equal to hasher result on the same data
+     */
+    class multi_hasher
+    {
+    public:
+        enum { max_lanes = 16 };
+
+        explicit multi_hasher(int streams);
+
+        int streams() const { return static_cast<int>(m_contexts.size()); }
+
+        /**
+          * update each stream n with len bytes from data[n]
+         */
+        void update(const char* const* data, int len);
+        md4_hash final(int stream);
+
+        /**
+          * lanes count of current kernel, 1 when SIMD isn't available
+         */
+        static int lanes();
+
+        /**
+          * select the widest kernel not wider than lanes and supported by CPU
+          * may be called while other threads hash
+          * @return lanes count of selected kernel
+         */
+        static int set_lanes(int lanes);
+    private:
+        std::vector<MD4_CTX> m_contexts;
+    };
 }
 
 #endif // LIBED2K_HASHER_HPP_INCLUDED
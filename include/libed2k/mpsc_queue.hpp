@@ -0,0 +1,137 @@
+#ifndef __LIBED2K_MPSC_QUEUE__
+#define __LIBED2K_MPSC_QUEUE__
+
+#include <boost/noncopyable.hpp>
+
+#include "libed2k/config.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace libed2k
+{
+    namespace atomics
+    {
+        /**
+          * sequentially consistent operations on words shared between threads
+         */
+#ifdef _MSC_VER
+        template<typename T>
+        inline T* exchange(T* volatile* p, T* v)
+        { return static_cast<T*>(_InterlockedExchangePointer((void* volatile*)p, v)); }
+
+        template<typename T>
+        inline T* load(T* volatile const* p) { _ReadWriteBarrier(); T* v = *p; _ReadWriteBarrier(); return v; }
+
+        template<typename T>
+        inline void store(T* volatile* p, T* v) { _InterlockedExchangePointer((void* volatile*)p, v); }
+
+        inline long exchange(volatile long* p, long v) { return _InterlockedExchange(p, v); }
+
+        inline long load(volatile const long* p) { _ReadWriteBarrier(); long v = *p; _ReadWriteBarrier(); return v; }
+
+        inline long fetch_add(volatile long* p, long v) { return _InterlockedExchangeAdd(p, v); }
+
+        inline bool compare_exchange(volatile long* p, long expected, long v)
+        { return _InterlockedCompareExchange(p, v, expected) == expected; }
+#else
+        template<typename T>
+        inline T* exchange(T* volatile* p, T* v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+
+        template<typename T>
+        inline T* load(T* volatile const* p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+
+        template<typename T>
+        inline void store(T* volatile* p, T* v) { __atomic_store_n(p, v, __ATOMIC_SEQ_CST); }
+
+        inline long exchange(volatile long* p, long v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+
+        inline long load(volatile const long* p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+
+        inline long fetch_add(volatile long* p, long v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+
+        inline bool compare_exchange(volatile long* p, long expected, long v)
+        {
+            return __atomic_compare_exchange_n(p, &expected, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        }
+#endif
+    }
+
+    /**
+      * intrusive multiple producers single consumer queue
+      * producers never lock nor wait, they link nodes in order of their push
+      * the consumer can see a push in progress as the end of queue, then the node
+      * and nodes after it are popped later
+     */
+    class mpsc_queue : boost::noncopyable
+    {
+    public:
+        struct node
+        {
+            node() : next(0) {}
+            node* volatile next;
+        };
+
+        mpsc_queue() : m_head(&m_stub), m_tail(&m_stub) {}
+
+        /**
+          * may be called from any thread
+         */
+        void push(node* n)
+        {
+            n->next = 0;
+            node* prev = atomics::exchange(&m_head, n);
+            atomics::store(&prev->next, n);
+        }
+
+        /**
+          * consumer only
+          * @return oldest node or 0 when queue is empty or a push is in progress
+         */
+        node* pop()
+        {
+            node* tail = m_tail;
+            node* next = atomics::load(&tail->next);
+
+            if (tail == &m_stub)
+            {
+                if (!next) return 0;
+                m_tail = next;
+                tail = next;
+                next = atomics::load(&next->next);
+            }
+
+            if (next)
+            {
+                m_tail = next;
+                return tail;
+            }
+
+            // the last node is popped only when stub is linked after it
+            if (tail != atomics::load(&m_head)) return 0;
+            push(&m_stub);
+
+            next = atomics::load(&tail->next);
+            if (!next) return 0;
+            m_tail = next;
+            return tail;
+        }
+
+        /**
+          * consumer only
+          * @return false when there are nodes pushed or being pushed
+         */
+        bool empty() const
+        {
+            return m_tail == &m_stub && atomics::load(&m_head) == &m_stub;
+        }
+
+    private:
+        node* volatile m_head;  //!< last pushed node
+        node* m_tail;           //!< oldest node not popped yet, or stub
+        node m_stub;
+    };
+}
+
+#endif
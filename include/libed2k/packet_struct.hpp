@@ -16,6 +16,7 @@
 #include "libed2k/util.hpp"
 #include "libed2k/assert.hpp"
 #include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/error_code.hpp"
 #include <sstream>
 
@@ -1260,6 +1261,131 @@ namespace libed2k
         }
     };
 
+    struct client_aich_hash_request
+    {
+        md4_hash m_hFile;
+
+        template<typename Archive>
+        void serialize(Archive& ar){
+            ar & m_hFile;
+        }
+    };
+
+    struct client_aich_hash_answer
+    {
+        md4_hash m_hFile;
+        sha1_hash m_hRoot;
+
+        void serialize(archive::ed2k_iarchive& ar){
+            ar & m_hFile;
+            ar.raw_read(reinterpret_cast<char*>(m_hRoot.begin()), sha1_hash::size);
+        }
+
+        void serialize(archive::ed2k_oarchive& ar){
+            ar & m_hFile;
+            ar.raw_write(reinterpret_cast<const char*>(m_hRoot.begin()), sha1_hash::size);
+        }
+    };
+
+    struct client_aich_request
+    {
+        md4_hash m_hFile;
+        boost::uint16_t m_nPart;
+        sha1_hash m_hRoot;
+
+        void serialize(archive::ed2k_iarchive& ar){
+            ar & m_hFile & m_nPart;
+            ar.raw_read(reinterpret_cast<char*>(m_hRoot.begin()), sha1_hash::size);
+        }
+
+        void serialize(archive::ed2k_oarchive& ar){
+            ar & m_hFile & m_nPart;
+            ar.raw_write(reinterpret_cast<const char*>(m_hRoot.begin()), sha1_hash::size);
+        }
+    };
+
+    /**
+      * answer without data has file hash only
+      * node identifiers are 16 bit, files over OLD_MAX_FILE_SIZE use 32 bit identifiers in second list
+     */
+    struct client_aich_answer
+    {
+        md4_hash m_hFile;
+        boost::uint16_t m_nPart;
+        sha1_hash m_hRoot;
+        aich_recovery m_hashes;
+        bool m_bHasData;
+        bool m_bLarge;
+
+        client_aich_answer() : m_nPart(0), m_bHasData(false), m_bLarge(false) {}
+
+        void serialize(archive::ed2k_iarchive& ar){
+            ar & m_hFile;
+            m_bHasData = ar.bytes_left() > 0;
+            if (!m_bHasData) return;
+
+            ar & m_nPart;
+            ar.raw_read(reinterpret_cast<char*>(m_hRoot.begin()), sha1_hash::size);
+
+            boost::uint16_t count;
+            ar & count;
+            read_hashes<boost::uint16_t>(ar, count);
+
+            if (ar.bytes_left() >= sizeof(count))
+            {
+                ar & count;
+                read_hashes<boost::uint32_t>(ar, count);
+                m_bLarge = count > 0;
+            }
+        }
+
+        void serialize(archive::ed2k_oarchive& ar){
+            ar & m_hFile;
+            if (!m_bHasData) return;
+
+            ar & m_nPart;
+            ar.raw_write(reinterpret_cast<const char*>(m_hRoot.begin()), sha1_hash::size);
+
+            boost::uint16_t none = 0;
+            boost::uint16_t count = static_cast<boost::uint16_t>(m_hashes.size());
+
+            if (m_bLarge)
+            {
+                ar & none & count;
+                write_hashes<boost::uint32_t>(ar);
+            }
+            else
+            {
+                ar & count;
+                write_hashes<boost::uint16_t>(ar);
+                ar & none;
+            }
+        }
+
+    private:
+        template<typename Ident>
+        void read_hashes(archive::ed2k_iarchive& ar, boost::uint16_t count){
+            for (boost::uint16_t i = 0; i < count; ++i)
+            {
+                Ident ident;
+                sha1_hash h;
+                ar & ident;
+                ar.raw_read(reinterpret_cast<char*>(h.begin()), sha1_hash::size);
+                m_hashes.push_back(std::make_pair(boost::uint32_t(ident), h));
+            }
+        }
+
+        template<typename Ident>
+        void write_hashes(archive::ed2k_oarchive& ar){
+            for (aich_recovery::const_iterator i = m_hashes.begin(); i != m_hashes.end(); ++i)
+            {
+                Ident ident = static_cast<Ident>(i->first);
+                ar & ident;
+                ar.raw_write(reinterpret_cast<const char*>(i->second.begin()), sha1_hash::size);
+            }
+        }
+    };
+
     struct client_start_upload
     {
         md4_hash m_hFile;
@@ -1667,6 +1793,22 @@ namespace libed2k
         static const proto_type value = OP_HASHSETANSWER;
         static const proto_type protocol = OP_EDONKEYPROT;
     };
+    template<> struct packet_type<client_aich_hash_request> {
+        static const proto_type value = OP_AICHFILEHASHREQ;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_hash_answer> {
+        static const proto_type value = OP_AICHFILEHASHANS;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_request> {
+        static const proto_type value = OP_AICHREQUEST;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_answer> {
+        static const proto_type value = OP_AICHANSWER;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
     template<> struct packet_type<client_start_upload> {
         static const proto_type value = OP_STARTUPLOADREQ;
         static const proto_type protocol = OP_EDONKEYPROT;
@@ -1899,22 +2041,29 @@ namespace libed2k
     inline size_t body_size(const client_sending_part<size_type>&s, const std::string& body)
     { return body.size() + s.m_end_offset - s.m_begin_offset; }
 
+    /**
+      * serialize packet into body in one pass and return its header
+      * body is cleared before, so reused buffer doesn't allocate when it has enough capacity
+     */
+    template <typename T>
+    inline libed2k_header serialize_message(const T& t, std::string& body)
+    {
+        libed2k_header header;
+        body.clear();
+        archive::ed2k_oarchive oa(body);
+        oa << const_cast<T&>(t);
+        header.m_protocol = packet_type<T>::protocol;
+        // packet size without protocol type and packet body size field plus one byte for opcode
+        header.m_size = body_size(t, body) + 1;
+        header.m_type = packet_type<T>::value;
+        return header;
+    }
+
 	template <typename T>
 	inline message make_message(const T& t)
 	{
 		message msg;
-
-		msg.first.m_protocol = packet_type<T>::protocol;
-		boost::iostreams::back_insert_device<std::string> inserter(msg.second);
-		boost::iostreams::stream<boost::iostreams::back_insert_device<std::string> >
-			s(inserter);
-		// Serialize the data first so we know how large it is.
-		archive::ed2k_oarchive oa(s);
-		oa << const_cast<T&>(t);
-		s.flush();
-		// packet size without protocol type and packet body size field plus one byte for opcode
-		msg.first.m_size = body_size(t, msg.second) + 1;
-		msg.first.m_type = packet_type<T>::value;
+		msg.first = serialize_message(t, msg.second);
 		return msg;
 	}
 
@@ -1924,13 +2073,8 @@ namespace libed2k
     inline udp_message make_udp_message(const T& t) {
         udp_message msg;
         msg.first.m_protocol = packet_type<T>::protocol;
-        boost::iostreams::back_insert_device<std::string> inserter(msg.second);
-        boost::iostreams::stream<boost::iostreams::back_insert_device<std::string> >
-            s(inserter);
-        // Serialize the data first so we know how large it is.
-        archive::ed2k_oarchive oa(s);
+        archive::ed2k_oarchive oa(msg.second);
         oa << const_cast<T&>(t);
-        s.flush();
         msg.first.m_type = packet_type<T>::value;
         return msg;
     };
@@ -1,31 +1,35 @@
 #ifndef __LIBED2K_PEER__
 #define __LIBED2K_PEER__
 
+#include "libed2k/config.hpp"
 #include "libed2k/socket.hpp"
 
 namespace libed2k {
 
     class peer_connection;
 
-    // Now it's only ipv4_peer
+    /**
+      * peer list record of policy, allocated from session pools as ipv4_peer or ipv6_peer
+      * transfers keep tens of thousands of them, so address is stored as bytes in
+      * derived record and flags are packed into bitfields
+     */
     class peer
     {
     public:
-        peer(const tcp::endpoint& ep, bool conn, int src):
-            endpoint(ep), connection(NULL), last_connected(0), next_connect(0),
-            connectable(conn), seed(false), failcount(0), fast_reconnects(0),
+        peer(boost::uint16_t listen_port, bool conn, int src):
+            connection(NULL), last_connected(0), next_connect(0), port(listen_port),
+            failcount(0), connectable(conn), seed(false), fast_reconnects(0),
             trust_points(0), source(src)
 #ifndef LIBED2K_DISABLE_DHT
             , added_to_dht(false)
+#endif
+#if LIBED2K_USE_IPV6
+            , is_v6_addr(false)
 #endif
         {}
 
-        ip::address address() const { return endpoint.address(); }
-        boost::uint16_t port() const { return endpoint.port(); }
-
-        void set_failcount(peer* p, int f);
-
-        tcp::endpoint endpoint;
+        ip::address address() const;
+        tcp::endpoint ip() const { return tcp::endpoint(address(), port); }
 
         // if the peer is connected now, this
         // will refer to a valid peer_connection
@@ -39,20 +43,22 @@ namespace libed2k {
         // the next time to connect this peer 
         boost::uint16_t next_connect;
 
+        boost::uint16_t port;
+
+        // the number of failed connection attempts this peer has
+        unsigned failcount:5;
+
         // incoming peers (that don't advertize their listen port)
         // will not be considered connectable. Peers that
         // we have a listen port for will be assumed to be.
-        bool connectable;
+        bool connectable:1;
 
         // this is true if the peer is a seed
-        bool seed;
-
-        // the number of failed connection attempts this peer has
-        unsigned failcount;
+        bool seed:1;
 
         // the number of times we have allowed a fast
         // reconnect for this peer.
-        unsigned fast_reconnects;
+        unsigned fast_reconnects:4;
 
         // for every valid piece we receive where this
         // peer was one of the participants, we increase
@@ -60,19 +66,57 @@ namespace libed2k {
         // where this peer was a participant, we decrease
         // this value. If it sinks below a threshold, its
         // considered a bad peer and will be banned.
-        signed trust_points; // [-7, 8]
+        signed trust_points:4; // [-7, 7]
 
         // a bitmap combining the peer_source flags
         // from peer_info.
-        unsigned source;
+        unsigned source:6;
 
 #ifndef LIBED2K_DISABLE_DHT
         // this is set to true when this peer as been
         // pinged by the DHT
-        bool added_to_dht;
+        bool added_to_dht:1;
+#endif
+
+#if LIBED2K_USE_IPV6
+        // the record is ipv6_peer
+        bool is_v6_addr:1;
 #endif
     };
 
+    /**
+      * 6 bytes of endpoint: address bytes here and port in base
+     */
+    struct ipv4_peer : peer
+    {
+        ipv4_peer(const tcp::endpoint& ep, bool conn, int src):
+            peer(ep.port(), conn, src), addr(ep.address().to_v4().to_bytes())
+        {}
+
+        ip::address_v4::bytes_type addr;
+    };
+
+#if LIBED2K_USE_IPV6
+    struct ipv6_peer : peer
+    {
+        ipv6_peer(const tcp::endpoint& ep, bool conn, int src):
+            peer(ep.port(), conn, src), addr(ep.address().to_v6().to_bytes())
+        {
+            is_v6_addr = true;
+        }
+
+        ip::address_v6::bytes_type addr;
+    };
+#endif
+
+    inline ip::address peer::address() const
+    {
+#if LIBED2K_USE_IPV6
+        if (is_v6_addr) return ip::address_v6(static_cast<const ipv6_peer*>(this)->addr);
+#endif
+        return ip::address_v4(static_cast<const ipv4_peer*>(this)->addr);
+    }
+
     class peer_entry
     {
     public:
@@ -1,6 +1,7 @@
 #ifndef __LIBED2K_PEER_CONNECTION__
 #define __LIBED2K_PEER_CONNECTION__
 
+#include <vector>
 #include <boost/smart_ptr.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/asio.hpp>
@@ -16,6 +17,7 @@
 #include "libed2k/peer_request.hpp"
 #include "libed2k/piece_picker.hpp"
 #include "libed2k/peer_info.hpp"
+#include "libed2k/upload_queue.hpp"
 
 #define DECODE_PACKET(packet_struct, name)       \
     packet_struct name;                          \
@@ -35,6 +37,25 @@ namespace libed2k
     }
     struct disk_io_job;
 
+    /**
+      * what decides which connection is closed first when there are too many
+     */
+    struct disconnect_rank
+    {
+        size_type minute_payload;   //!< payload bytes of the last minute
+        bool busy;                  //!< requests pending or upload slot
+        bool useful;                //!< has pieces we want, or wants ours when we seed
+        ptime last_receive;
+
+        bool idle() const { return minute_payload == 0 && !busy; }
+    };
+
+    /**
+      * true when l goes before r: it moved less payload in the last minute,
+      * isn't busy, is less useful for the transfer or was silent for longer
+     */
+    bool disconnect_before(const disconnect_rank& l, const disconnect_rank& r);
+
     struct pending_block
     {
         pending_block(const piece_block& b, size_type fsize);
@@ -58,6 +79,10 @@ namespace libed2k
         // busy request at a time in each peer's queue
         bool busy:1;
 
+        // time critical requests are queued ahead of
+        // the others and sent first
+        bool time_critical:1;
+
         piece_block block;
         // data size, it is useful to store compressed block size
         size_type data_size;
@@ -126,6 +151,18 @@ namespace libed2k
         // is called once every second by the main loop
         void second_tick(int tick_interval_ms);
 
+        /**
+          * payload bytes sent and received in the last minute
+         */
+        size_type minute_payload() const;
+
+        /**
+          * connection has requests pending in either direction or upload slot
+         */
+        bool is_busy() const;
+
+        disconnect_rank get_disconnect_rank() const;
+
         // DRAFT
         enum message_type
         {
@@ -201,6 +238,22 @@ namespace libed2k
 
         misc_options get_misc_options() const { return m_misc_options; }
         misc_options2 get_misc_options2() const { return m_misc_options2; }
+        bool supports_aich() const { return m_misc_options.m_nAICHVersion > 0; }
+        void write_aich_request(const md4_hash& file_hash, int part, const sha1_hash& root);
+
+        /**
+          * upload queue decisions of session second tick
+         */
+        void grant_upload_slot();
+        void revoke_upload_slot();
+        void send_queue_rank(int rank);
+
+        upload_queue::client_id upload_client() const;
+
+        /**
+          * only the connection which asked for upload holds client's slot and place in upload queue
+         */
+        bool is_upload_client(const upload_queue::client_id& client) const;
 
         net_identifier get_network_point() const;
         md4_hash get_connection_hash() const { return m_hClient; }
@@ -218,6 +271,19 @@ namespace libed2k
         void send_block_requests();
         void cancel_all_requests();
 
+        // adds a block to the request queue
+        // returns true if successful, false otherwise
+        enum flags_t { req_time_critical = 1, req_busy = 2 };
+
+        // requests time critical blocks may take over the desired queue size
+        enum { time_critical_queue_slots = 4 };
+        bool add_request(const piece_block& b, int flags = 0);
+        bool requesting(const piece_block& b) const;
+
+        // estimated time to receive all requested blocks
+        // and extra_bytes more at the current download rate
+        time_duration download_queue_time(int extra_bytes = 0) const;
+
         void assign_bandwidth(int channel, int amount);
         int bandwidth_throttle(int channel) const
         { return m_bandwidth_channel[channel].throttle(); }
@@ -249,13 +315,8 @@ namespace libed2k
         bool has_download_bandwidth();
 
         void request_block();
-        // adds a block to the request queue
-        // returns true if successful, false otherwise
-        enum flags_t { req_time_critical = 1, req_busy = 2 };
-        bool add_request(const piece_block& b, int flags = 0);
         void abort_all_requests();
         void abort_expired_requests();
-        bool requesting(const piece_block& b) const;
         size_t num_requesting_busy_blocks() const;
         int outstanding_bytes() const;
 
@@ -297,12 +358,18 @@ namespace libed2k
         void write_file_status(const md4_hash& file_hash, const bitfield& status);
         void write_hashset_request(const md4_hash& file_hash);
         void write_hashset_answer(const md4_hash& file_hash, const std::vector<md4_hash>& hash_set);
+        void write_aich_hash_request(const md4_hash& file_hash);
+        void write_aich_hash_answer(const md4_hash& file_hash, const sha1_hash& root);
+        // empty recovery data tells the peer we can't recover the part
+        void write_aich_answer(const md4_hash& file_hash, int part, const sha1_hash& root, const aich_recovery& rd);
         void write_start_upload(const md4_hash& file_hash);
         void write_queue_ranking(boost::uint16_t rank);
         void write_accept_upload();
+        void write_out_parts();
         void write_cancel_transfer();
         void write_request_parts(client_request_parts_64 rp);
         void write_part(const peer_request& r);
+        void write_compressed_part(const peer_request& r, const std::string& data);
 
         // protocol handlers
         void on_hello(const error_code& error);
@@ -317,6 +384,10 @@ namespace libed2k
         void on_file_status(const error_code& error);
         void on_hashset_request(const error_code& error);
         void on_hashset_answer(const error_code& error);
+        void on_aich_hash_request(const error_code& error);
+        void on_aich_hash_answer(const error_code& error);
+        void on_aich_request(const error_code& error);
+        void on_aich_answer(const error_code& error);
         void on_start_upload(const error_code& error);
         void on_queue_ranking(const error_code& error);
         void on_accept_upload(const error_code& error);
@@ -357,6 +428,11 @@ namespace libed2k
         ptime m_last_sent;
         time_duration m_timeout;
 
+        // payload of the last full minute and total payload at its end
+        size_type m_last_minute_payload;
+        size_type m_minute_base;
+        int m_minute_ticks;
+
         // if this peer is receiving a piece, this
         // points to a disk buffer that the data is
         // read into. This eliminates a memcopy from
@@ -453,6 +529,10 @@ namespace libed2k
         // this peer
         bool m_failed;
 
+        // this connection asked for upload and represents
+        // the client in upload queue
+        bool m_upload_requested;
+
         int m_disk_recv_buffer_size;
 
         // this flag will active after hello -> hello_answer order
@@ -493,6 +573,16 @@ namespace libed2k
         static bool range_below_zero(const range& r) { return r.start < 0; }
         std::vector<range> m_payloads;
     };
+
+    typedef std::pair<disconnect_rank, boost::intrusive_ptr<peer_connection> > ranked_connection;
+
+    /**
+      * moves connections to close to the front, references keep them
+      * alive while they are closed and erased from their containers
+      * @param idle_only connections with payload or requests are kept
+      * @return count of connections to close, at most num
+     */
+    int select_disconnects(std::vector<ranked_connection>& peers, int num, bool idle_only);
 }
 
 #endif
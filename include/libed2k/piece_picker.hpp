@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
 #include <vector>
+#include <deque>
 #include <bitset>
 #include <utility>
 
@@ -170,10 +171,34 @@ namespace libed2k
 			boost::int16_t requested;
 		};
 		
+		// a piece with a deadline, its blocks are requested
+		// ahead of the picked ones
+		struct time_critical_piece
+		{
+			ptime deadline;
+			int piece;
+			// deadline_flags_t of transfer_handle
+			int flags;
+			bool operator<(const time_critical_piece& rhs) const
+			{ return deadline < rhs.deadline; }
+		};
+
 		piece_picker();
 
 		void get_availability(std::vector<int>& avail) const;
 
+		// pieces with deadlines are kept in deadline order, pieces with
+		// equal deadlines in the order they were set. Setting a deadline
+		// of a piece again replaces the previous one
+		void set_piece_deadline(int index, ptime deadline, int flags);
+
+		// returns false when the piece has no deadline, flags
+		// receives the flags it was set with
+		bool reset_piece_deadline(int index, int* flags = 0);
+		void clear_piece_deadlines() { m_time_critical_pieces.clear(); }
+		std::deque<time_critical_piece> const& time_critical_pieces() const
+		{ return m_time_critical_pieces; }
+
 		// increases the peer count for the given piece
 		// (is used when a HAVE message is received)
 		void inc_refcount(int index);
@@ -181,6 +206,9 @@ namespace libed2k
 
 		// increases the peer count for the given piece
 		// (is used when a BITFIELD message is received)
+		// a bitfield with all pieces counts as a seed. Few pieces
+		// are moved to their new priority right away, otherwise
+		// the priority buckets are rebuilt on the next pick
 		void inc_refcount(bitfield const& bitmask);
 		// decreases the peer count for the given piece
 		// (used when a peer disconnects)
@@ -254,7 +282,7 @@ namespace libed2k
 		// are added to interesting_blocks, and busy blocks are
 		// added to backup_blocks. num blocks is the number of
 		// blocks to be picked. Blocks are not picked from pieces
-		// that are being downloaded
+		// that are being downloaded. ignore is sorted by piece index
 		int add_blocks(int piece, bitfield const& pieces
 			, std::vector<piece_block>& interesting_blocks
 			, std::vector<piece_block>& backup_blocks
@@ -571,6 +599,9 @@ namespace libed2k
 		// second entry in m_downloads and so on.
 		std::vector<block_info> m_block_info;
 
+		// pieces with deadlines, in deadline order
+		std::deque<time_critical_piece> m_time_critical_pieces;
+
 		int m_blocks_per_piece;
 		int m_blocks_in_last_piece;
 
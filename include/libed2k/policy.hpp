@@ -65,6 +65,10 @@ namespace libed2k {
                 m_peers.begin(), m_peers.end(), a, peer_address_compare());
         }
 
+        // peer records come from session pools, ipv4_peer or ipv6_peer by address
+        peer* allocate_peer(const tcp::endpoint& ep, bool conn, int src);
+        void free_peer(peer* p);
+
         void update_peer(peer* p, int src, int flags, tcp::endpoint const& remote, char const* destination);
         bool insert_peer(peer* p, peers_t::iterator iter, int flags);
 
@@ -0,0 +1,151 @@
+#ifndef __LIBED2K_RESUME_LOG__
+#define __LIBED2K_RESUME_LOG__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <fstream>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+
+#include "libed2k/hasher.hpp"
+#include "libed2k/entry.hpp"
+#include "libed2k/error_code.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/filesystem.hpp"
+
+namespace libed2k
+{
+    /**
+      * resume log write statistics, see session::resume_status
+     */
+    struct resume_log_status
+    {
+        resume_log_status() : logical_bytes(0), changed_bytes(0), logged_bytes(0), compacted_bytes(0),
+            log_size(0), live_size(0), transfers(0), records(0), compactions(0)
+        {}
+
+        size_type logical_bytes;    //!< full resume data of checkpointed transfers, what one file per transfer would write
+        size_type changed_bytes;    //!< changed resume data values and pieces
+        size_type logged_bytes;     //!< bytes appended to the log
+        size_type compacted_bytes;  //!< bytes written by compactions
+        size_type log_size;         //!< current log file size
+        size_type live_size;        //!< log size when every transfer has one full record
+        int transfers;              //!< transfers in the log
+        int records;                //!< records appended since log was opened
+        int compactions;
+
+        /**
+          * bytes written to disk per changed byte
+         */
+        double write_amplification() const
+        {
+            return changed_bytes ? double(logged_bytes + compacted_bytes) / changed_bytes : 0.;
+        }
+    };
+
+    /**
+      * session wide append-only log of transfers resume data
+      * checkpoint appends one batch with records of changed transfers only - top level
+      * resume data values differing from the logged ones and changed bytes of "pieces"
+      * writer thread appends batches, each synced to disk, and compacts log to one full
+      * record per transfer when it grows over compact ratio of live data
+      * record layout: uint32 payload size, uint8 type, transfer hash, bencoded payload
+     */
+    class resume_log : boost::noncopyable
+    {
+    public:
+        enum { version = 1 };
+        enum { min_compact_size = 1024 * 1024 };    //!< smaller logs aren't compacted
+        enum { max_record_size = 16 * 1024 * 1024 }; //!< longer records are taken for garbage on replay
+
+        enum record_type
+        {
+            record_full = 0,    //!< whole resume data
+            record_delta = 1,   //!< d3:setd...e5:unsetl...e6:pieces<uint32 index, uint8 value>...e
+            record_erase = 2    //!< transfer was removed, no payload
+        };
+
+        struct checkpoint_entry
+        {
+            md4_hash hash;
+            boost::shared_ptr<entry> resume_data;   //!< empty for removed transfer
+        };
+
+        typedef std::vector<checkpoint_entry> checkpoint;
+
+        resume_log();
+        ~resume_log();
+
+        /**
+          * replay log and start writer thread, log is created when it doesn't exist
+          * @param compact_ratio log is compacted when its size is over ratio * live size
+         */
+        bool open(const std::string& filepath, int compact_ratio, error_code& ec);
+
+        /**
+          * write posted checkpoints and stop writer thread
+         */
+        void close();
+        bool is_open() const { return m_writer.get() != 0; }
+
+        /**
+          * @return false when log has no resume data of transfer
+         */
+        bool resume_data(const md4_hash& hash, std::vector<char>& buf) const;
+
+        /**
+          * queue checkpoint to writer thread, cp is left empty
+         */
+        void post(checkpoint& cp);
+        void erase(const md4_hash& hash);
+
+        /**
+          * wait until posted checkpoints are written
+         */
+        void flush();
+
+        resume_log_status status() const;
+    private:
+        typedef std::map<std::string, std::string> value_map;  //!< key -> bencoded value
+
+        struct transfer_state
+        {
+            value_map values;
+            std::string pieces;
+        };
+
+        typedef std::map<md4_hash, transfer_state> state_map;
+
+        void writer();
+        void write_batch(checkpoint& cp);
+        bool encode(checkpoint_entry& ce, std::vector<char>& out);
+        bool compact(error_code& ec);
+        bool replay(std::ifstream& in, size_type file_size, size_type& valid_size);
+        bool apply(record_type type, const md4_hash& hash, const char* payload, int size);
+
+        static void append_record(record_type type, const md4_hash& hash, const std::string& payload,
+            std::vector<char>& out);
+        static std::string full_payload(const transfer_state& ts);
+
+        std::string m_filepath;
+        int m_compact_ratio;
+        file m_log;
+
+        mutable boost::mutex m_mutex;
+        boost::condition m_condition;
+        std::deque<checkpoint> m_batches;
+        bool m_writing;
+        bool m_abort;
+        state_map m_states;
+        resume_log_status m_status;
+        boost::shared_ptr<boost::thread> m_writer;
+    };
+}
+
+#endif
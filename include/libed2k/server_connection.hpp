@@ -142,13 +142,9 @@ namespace libed2k
 
         m_write_order.push_back(std::make_pair(libed2k_header(), std::string()));
 
-        boost::iostreams::back_insert_device<std::string> inserter(m_write_order.back().second);
-        boost::iostreams::stream<boost::iostreams::back_insert_device<std::string> > s(inserter);
-
         // Serialize the data first so we know how large it is.
-        archive::ed2k_oarchive oa(s);
+        archive::ed2k_oarchive oa(m_write_order.back().second);
         oa << t;
-        s.flush();
         std::string compressed_string = compress_output_data(m_write_order.back().second);
 
         if (!compressed_string.empty())
@@ -14,6 +14,7 @@
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/kademlia/kad_packet_struct.hpp"
 #include "libed2k/session_status.hpp"
+#include "libed2k/resume_log.hpp"
 #include "libed2k/filesystem.hpp"
 #include "libed2k/session_settings.hpp"
 #include "libed2k/entry.hpp"
@@ -102,6 +103,23 @@ namespace libed2k {
         void make_transfer_parameters(const std::string& filepath);
         void cancel_transfer_parameters(const std::string& filepath);
 
+        /**
+          * scan directory recursively and report its files by transfer_params_batch_alert
+          * files are re-hashed only when they were changed, see session_settings::m_share_cache_file
+         */
+        void share_directory(const std::string& dirpath);
+
+        /**
+          * write changed resume data of all transfers to resume log now
+          * log is written by its own thread, see session_settings::m_resume_log_file
+         */
+        void checkpoint_resume_data();
+
+        /**
+          * resume log sizes and write amplification
+         */
+        resume_log_status resume_status() const;
+
         // protocols used by add_port_mapping()
         enum protocol_type { udp = 1, tcp = 2 };
         void start_natpmp();
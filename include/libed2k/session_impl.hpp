@@ -6,7 +6,7 @@
 #include <map>
 #include <set>
 
-#include <boost/pool/object_pool.hpp>
+#include <boost/pool/pool.hpp>
 
 #include "libed2k/socket.hpp"
 #include "libed2k/stat.hpp"
@@ -20,6 +20,10 @@
 #include "libed2k/alert.hpp"
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/file.hpp"
+#include "libed2k/share_scanner.hpp"
+#include "libed2k/block_compressor.hpp"
+#include "libed2k/upload_queue.hpp"
+#include "libed2k/resume_log.hpp"
 #include "libed2k/disk_io_thread.hpp"
 #include "libed2k/file_pool.hpp"
 #include "libed2k/bandwidth_manager.hpp"
@@ -137,7 +141,7 @@ namespace libed2k {
             alert_manager m_alerts;
 
             /** file hasher closed in self thread */
-            transfer_params_maker   m_tpm;
+            share_scanner           m_tpm;
             lowid_callbacks_map     lowid_conn_dict;
         };
 
@@ -239,6 +243,7 @@ namespace libed2k {
             /** find peer connections */
             boost::intrusive_ptr<peer_connection> find_peer_connection(const net_identifier& np) const;
             boost::intrusive_ptr<peer_connection> find_peer_connection(const md4_hash& hash) const;
+            boost::intrusive_ptr<peer_connection> find_upload_client(const upload_queue::client_id& client) const;
             peer_connection_handle add_peer_connection(net_identifier np, error_code& ec);
 
             int max_connections() const { return m_settings.connections_limit; }
@@ -282,6 +287,15 @@ namespace libed2k {
 
             void on_tick(error_code const& e);
 
+            /**
+              * ask changed transfers for resume data, the batch is posted to resume
+              * log when all of them were handed to add_resume_checkpoint
+             */
+            void checkpoint_resume_data();
+            void add_resume_checkpoint(boost::shared_ptr<transfer> const& t
+                , boost::shared_ptr<entry> const& rd);
+            resume_log_status resume_status() const;
+
             // let transfers connect to peers if they want to
             // if there are any trasfers and any free slots
             void connect_new_peers();
@@ -311,9 +325,21 @@ namespace libed2k {
             boost::intrusive_ptr<peer_connection> initialize_peer(client_id_type nIP, int nPort);
 
             void update_connections_limit();
+
+            /**
+              * close num least useful connections, see disconnect_before
+              * @param idle_only close connections without payload in the last minute and nothing pending only
+              * @return number of closed connections
+             */
+            int evict_connections(int num, bool idle_only, const error_code& ec);
             void update_rate_settings();
             void update_active_transfers();
 
+            /**
+              * tick upload queue and send its decisions to connected clients
+             */
+            void update_upload_slots(ptime now);
+
 			void start_natpmp();
 			void start_upnp();
 
@@ -413,12 +439,15 @@ namespace libed2k {
 
 
             tcp::resolver m_host_resolver;
-            boost::object_pool<peer> m_peer_pool;
 
             int add_port_mapping(int t, int external_port, int local_port);
             void delete_port_mapping(int handle);
 
-            boost::object_pool<peer> m_ipv4_peer_pool;
+            // policy peer records, see peer.hpp
+            boost::pool<> m_ipv4_peer_pool;
+#if LIBED2K_USE_IPV6
+            boost::pool<> m_ipv6_peer_pool;
+#endif
 
             // this vector is used to store the block_info
             // objects pointed to by partial_piece_info returned
@@ -433,6 +462,19 @@ namespace libed2k {
             // this pool is used to allocate and recycle compressed data buffers
             boost::pool<> m_z_buffers;
 
+            // compressed upload blocks cache and compression budget
+            block_compressor m_block_compressor;
+
+            // upload slots and clients waiting for them
+            upload_queue m_upload_queue;
+
+            // session wide resume data checkpoints, see session_settings::m_resume_log_file
+            resume_log m_resume_log;
+
+            // checkpoint being collected and disk jobs it waits for
+            resume_log::checkpoint m_checkpoint;
+            int m_checkpoint_jobs;
+
             // used to skipping data in connections
             std::vector<char> m_skip_buffer;
 
@@ -511,6 +553,10 @@ namespace libed2k {
 
             ptime m_created;
             int session_time() const { return total_seconds(time_now() - m_created); }
+            ptime m_last_checkpoint;
+
+            // the last time idle connections were closed for new peers
+            ptime m_last_turnover;
 
             duration_timer m_second_timer;
             // the timer used to fire the tick
@@ -82,6 +82,9 @@ namespace libed2k
             , unchoke_slots_limit(8)
             , half_open_limit(0)
             , connections_limit(200)
+            , peer_turnover(4)
+            , peer_turnover_cutoff(90)
+            , peer_turnover_interval(300)
             , enable_outgoing_utp(true)
             , enable_incoming_utp(true)
             , utp_target_delay(100) // milliseconds
@@ -107,14 +110,36 @@ namespace libed2k
             , user_agent_str(md4_hash::emule.toString())
             , ignore_resume_timestamps(false)
             , no_recheck_incomplete_resume(false)
+            , fast_recheck(true)
+            , resume_checkpoint_interval(60)
+            , resume_log_compact_ratio(4)
             , seeding_outgoing_connections(false)
             , alert_queue_size(1000)
+            , hashing_threads(1)
+            , hashing_mapped_reads(false)
+            , hashing_drop_cache(false)
+            , hashing_aich(true)
+            , upload_compression_level(0)
+            , upload_compression_budget(100)
+            , compressed_cache_size((8*1024*1024) / BLOCK_SIZE)
+            , aich_trust_sources(2)
+            , aich_recovery_timeout(60)
+            , upload_slots_min(3)
+            , upload_slot_min_rate(1024)
+            , upload_slot_bytes(PIECE_SIZE)
+            , upload_slot_time(3600)
+            , upload_queue_size(5000)
+            , upload_queue_reask_timeout(3600)
             // Disk IO settings
             , file_pool_size(40)
+            , disk_io_threads(1)
+            , disk_hash_threads(0)
             , max_queued_disk_bytes(16*1024*1024)
             , max_queued_disk_bytes_low_watermark(0)
             , cache_size((16*1024*1024) / BLOCK_SIZE)
             , cache_buffer_chunk_size((16*16*1024) / BLOCK_SIZE)
+            , disk_buffer_hugepages(true)
+            , disk_buffer_numa_node(-1)
             , cache_expiry(5*60)
             , use_read_cache(true)
             , explicit_read_cache(false)
@@ -122,6 +147,8 @@ namespace libed2k
             , disk_io_read_mode(0)
             , coalesce_reads(false)
             , coalesce_writes(false)
+            , flush_whole_pieces(true)
+            , dsync_writes(false)
             , optimize_hashing_for_speed(true)
             , file_checks_delay_per_block(0)
             , disk_cache_algorithm(avoid_readback)
@@ -134,6 +161,7 @@ namespace libed2k
             , lock_disk_cache(false)
 #endif
             , volatile_read_cache(false)
+            , adaptive_read_cache(true)
             , default_cache_min_age(1)
             , no_atime_storage(true)
             , read_job_every(10)
@@ -214,16 +242,27 @@ namespace libed2k
         int download_rate_limit;
         int upload_rate_limit;
 
-        // the max number of unchoke slots in the session (might be
-        // overridden by unchoke algorithm)
+        // the max number of upload slots in the session, the upload
+        // queue adds slots up to it while total upload rate rises.
+        // -1 means unlimited
         int unchoke_slots_limit;
 
         // the max number of half-open TCP connections
         int half_open_limit;
 
-        // the max number of connections in the session
+        // the max number of connections in the session, the least useful
+        // connections are closed when there are more of them
         int connections_limit;
 
+        // every peer_turnover_interval seconds, when the number of connections
+        // is over peer_turnover_cutoff percent of connections_limit, up to
+        // peer_turnover percent of connections which didn't move payload in
+        // the last minute and have nothing pending are closed to make room
+        // for new peers
+        int peer_turnover;
+        int peer_turnover_cutoff;
+        int peer_turnover_interval;
+
         // when set to true, libtorrent will try to make outgoing utp connections
         bool enable_outgoing_utp;
 
@@ -300,6 +339,19 @@ namespace libed2k
         //!< known.met file
         std::string m_known_file;
 
+        //!< memory mapped known files store, imported from m_known_file when it is newer
+        //!< keeps piece hashes of known files out of memory, empty string reads known.met directly
+        std::string m_known_store_file;
+
+        //!< fingerprint cache of files in shared directories, see session::share_directory
+        //!< empty string disables the cache and every file is hashed on each scan
+        std::string m_share_cache_file;
+
+        //!< session resume log, changed transfers are checkpointed there every resume_checkpoint_interval
+        //!< and their resume data is taken from the log when transfer is added without it
+        //!< empty string disables the log, resume data is saved by transfer_handle::save_resume_data only
+        std::string m_resume_log_file;
+
         //!< users files and directories
         //!< second parameter true for recursive search and false otherwise
         fd_list m_fd_list;
@@ -322,6 +374,21 @@ namespace libed2k
         // we have none of the files and go straight to download
         bool no_recheck_incomplete_resume;
 
+        // when files are checked without valid resume data, slots in
+        // sparse regions of the files are taken as missing without
+        // reading them and slots with data are hashed by the disk hash
+        // threads while the next ones are read. Pieces are expected in
+        // their own slots, compact storage is checked the regular way
+        bool fast_recheck;
+
+        // seconds between checkpoints of the resume log, only transfers
+        // with changed resume data are written, see m_resume_log_file
+        int resume_checkpoint_interval;
+
+        // the resume log is rewritten with one record per transfer when
+        // it grows over this many times the size of that
+        int resume_log_compact_ratio;
+
         // this controls whether or not seeding (and complete) transfers
         // attempt to make outgoing connections or not.
         bool seeding_outgoing_connections;
@@ -329,6 +396,75 @@ namespace libed2k
         // the max alert queue size
         int alert_queue_size;
 
+        // the number of threads hashing shared files. Several files are
+        // hashed at once and pieces of large files are split between
+        // idle threads. Applied when the session starts
+        int hashing_threads;
+
+        // when set to true, shared files are hashed straight from memory
+        // mapped views instead of copying each block into a buffer.
+        // A file truncated by another process while it's hashed raises
+        // SIGBUS on posix systems, so it's disabled by default
+        bool hashing_mapped_reads;
+
+        // when set to true, hashed regions of shared files are dropped
+        // from the OS page cache, so a full rescan doesn't evict data
+        // cached for uploads
+        bool hashing_drop_cache;
+
+        // when set to true, AICH hash sets of shared files are built while
+        // they are hashed, peers use them to recover corrupted parts by
+        // re-downloading only bad 180 KB blocks, hash sets of downloads
+        // are hashed together with the MD4 of each part they verify
+        bool hashing_aich;
+
+        // zlib level of blocks uploaded to peers supporting data compression.
+        // A block is sent compressed only when it shrinks at least by 10%,
+        // files whose first blocks don't shrink are uploaded as is.
+        // 0 disables compression of uploads and compressed downloads.
+        // Blocks are compressed on the network thread, so it's off by default
+        int upload_compression_level;
+
+        // milliseconds of upload compression allowed per second. Blocks
+        // requested when the budget is spent are sent uncompressed.
+        // -1 means unlimited
+        int upload_compression_budget;
+
+        // the cache of compressed upload blocks, specified in BLOCK_SIZE
+        // blocks. Blocks requested again are taken from the cache instead
+        // of being compressed again
+        int compressed_cache_size;
+
+        // AICH root hash reported by peers is trusted when this number of
+        // peers with distinct addresses report it and nobody reports another
+        // one. Root hashes given in add_transfer_params are always trusted
+        int aich_trust_sources;
+
+        // seconds to wait for AICH recovery data of a corrupted part before
+        // the next peer is asked. The whole part is downloaded again when no
+        // peer can recover it
+        int aich_recovery_timeout;
+
+        // the upload queue never goes below this number of slots
+        int upload_slots_min;
+
+        // bytes per second, slots are removed when the average rate
+        // per slot falls below it
+        int upload_slot_min_rate;
+
+        // a slot is given to the next queued client after it uploaded
+        // this many bytes or lasted upload_slot_time seconds, when
+        // other clients wait
+        size_type upload_slot_bytes;
+        int upload_slot_time;
+
+        // the max number of clients waiting in the upload queue, others
+        // get queue full ranking
+        int upload_queue_size;
+
+        // seconds a disconnected client keeps its place in the upload queue
+        int upload_queue_reask_timeout;
+
         /********************
          * Disk IO settings *
          ********************/
@@ -347,6 +483,19 @@ namespace libed2k
         // limits so their sum is slightly below it.
         int file_pool_size;
 
+        // the number of disk I/O threads. Every storage is served by one
+        // thread at a time, chosen by the device of its save path, so a
+        // slow disk doesn't stall transfers on the other ones. Idle threads
+        // take over storages which didn't start yet from busy ones.
+        // Each thread has its own cache and write queue limit.
+        // Applied when the session starts
+        int disk_io_threads;
+
+        // the number of threads verifying downloaded pieces. Disk I/O threads
+        // only read the piece and go on with other storages while it's hashed.
+        // 0 hashes pieces in disk I/O threads. Applied when the session starts
+        int disk_hash_threads;
+
         // the maximum number of bytes a connection may have
         // pending in the disk write queue before its download
         // rate is being throttled. This prevents fast downloads
@@ -374,10 +523,21 @@ namespace libed2k
 
         // this is the number of disk buffer blocks (BLOCK_SIZE)
         // that should be allocated at a time. It must be
-        // at least 1. Lower number saves memory at the expense
-        // of more heap allocations
+        // at least 1. Memory is reserved in slabs of at least
+        // 2 MB, this only matters when it needs more than that
         int cache_buffer_chunk_size;
 
+        // when true, disk buffer slabs are mapped on reserved
+        // hugepages when there are any, otherwise transparent
+        // hugepages are requested for them. Fewer TLB misses
+        // when hashing and copying blocks
+        bool disk_buffer_hugepages;
+
+        // the NUMA node disk buffer memory is preferably taken
+        // from, -1 leaves it to the default policy. Only
+        // supported on linux
+        int disk_buffer_numa_node;
+
         // the number of seconds a write cache entry sits
         // idle in the cache before it's forcefully flushed
         // to disk. Default is 5 minutes.
@@ -404,6 +564,18 @@ namespace libed2k
         bool coalesce_reads;
         bool coalesce_writes;
 
+        // when true, blocks of a piece stay in the write cache
+        // until the whole piece is there and it's written by
+        // one vectored write, instead of every time
+        // write_cache_line_size contiguous blocks are cached.
+        // Cache pressure and hash jobs still flush parts of pieces
+        bool flush_whole_pieces;
+
+        // when true, writes to files return once the data is
+        // on the disk (RWF_DSYNC, or a data sync after the
+        // write where it isn't supported)
+        bool dsync_writes;
+
         // if this is set to false, the hashing will be
         // optimized for memory usage instead of the
         // number of read operations
@@ -468,6 +640,14 @@ namespace libed2k
         // expected to be hit again. It would save some memory
         bool volatile_read_cache;
 
+        // when true, pieces read only once are evicted from
+        // the read cache before pieces read repeatedly. How many
+        // of them to keep adapts to misses on pieces evicted
+        // lately, so a hash check or a single fast peer doesn't
+        // flush pieces many peers download. When false, the read
+        // cache is a plain LRU
+        bool adaptive_read_cache;
+
         // this is the default minimum time any read cache line
         // is kept in the cache.
         int default_cache_min_age;
@@ -78,6 +78,22 @@ namespace libed2k
 		int num_connected;
 		int num_fin_sent;
 		int num_close_wait;
+
+		// packet buffers of uTP sockets taken from the
+		// size classed pools of the socket manager
+		int packet_buffers_in_use;
+		int packet_buffers_reserved;
+
+		// maximum of buffers in use of each pool
+		int small_packet_buffers_peak;
+		int mtu_packet_buffers_peak;
+
+		// packets bigger than the MTU class, allocated on the heap
+		size_type heap_packets;
+
+		// packets of the pooled sizes allocated on the heap
+		// because their pool had no memory
+		size_type packet_pool_fallbacks;
 	};
 
 	struct LIBED2K_EXPORT session_status
@@ -115,6 +131,7 @@ namespace libed2k
 		int num_peers;
 		int num_unchoked;
 		int allowed_upload_slots;
+		int upload_queue_length;
 
 		int up_bandwidth_queue;
 		int down_bandwidth_queue;
@@ -0,0 +1,35 @@
+#ifndef LIBED2K_SHA1_HPP_INCLUDED
+#define LIBED2K_SHA1_HPP_INCLUDED
+
+#include <boost/cstdint.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/peer_id.hpp"
+
+namespace libed2k
+{
+    /**
+      * self implemented SHA-1 (FIPS 180-1), it hashes AICH trees
+     */
+    class LIBED2K_EXTRA_EXPORT sha1_hasher
+    {
+    public:
+        sha1_hasher() { reset(); }
+        sha1_hasher(const char* data, int len)
+        {
+            reset();
+            update(data, len);
+        }
+
+        sha1_hasher& update(const char* data, int len);
+        sha1_hash final();
+        void reset();
+
+    private:
+        boost::uint32_t m_state[5];
+        boost::uint64_t m_count;        //!< bytes hashed so far
+        unsigned char m_buffer[64];     //!< incomplete 64-byte block
+    };
+}
+
+#endif
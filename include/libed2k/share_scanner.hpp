@@ -0,0 +1,115 @@
+#ifndef __LIBED2K_SHARE_SCANNER__
+#define __LIBED2K_SHARE_SCANNER__
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "libed2k/file.hpp"
+
+namespace libed2k
+{
+    /**
+      * shared file fingerprint with its hashes
+      * file isn't re-hashed while its inode, size, change and modification times are the same
+     */
+    struct share_cache_entry
+    {
+        share_cache_entry() : m_inode(0), m_size(0), m_mtime(0), m_ctime(0) {}
+        share_cache_entry(const file_status& fs, const add_transfer_params& atp);
+
+        bool match(const file_status& fs) const;
+        add_transfer_params params(const std::string& filepath) const;
+
+        boost::uint64_t m_inode;
+        boost::uint64_t m_size;
+        boost::uint64_t m_mtime;
+        boost::uint64_t m_ctime;
+        md4_hash        m_hash;
+        container_holder<boost::uint32_t, std::vector<md4_hash> > m_hashset;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_inode;
+            ar & m_size;
+            ar & m_mtime;
+            ar & m_ctime;
+            ar & m_hash;
+            ar & m_hashset;
+        }
+    };
+
+    /**
+      * walks shared directories in hashing threads and reports their files by transfer_params_batch_alert
+      * only files missed in fingerprint cache are hashed, cache is stored on stop and loaded on first scan
+      * on linux shared directories are watched by inotify and changed files are reported again
+      * paths out of shared directories are processed by transfer_params_maker as usual
+     */
+    class share_scanner : public transfer_params_maker
+    {
+    public:
+        enum { batch_size = 256 };  //!< max files in one alert
+
+        /**
+          * @param cache_filepath fingerprint cache file, empty disables cache persistence
+         */
+        share_scanner(alert_manager& am, const std::string& known_filepath, const std::string& cache_filepath,
+            int hashing_threads = 1, int read_flags = 0, const std::string& known_store_filepath = std::string());
+        ~share_scanner();
+
+        bool start();
+        void stop();
+
+        /**
+          * scan directory recursively and watch it for changes
+          * @param dirpath in UTF-8
+         */
+        void share_directory(const std::string& dirpath);
+
+        /**
+          * write fingerprint cache to file
+         */
+        bool save_cache();
+
+        /**
+          * count of files were hashed since start, files taken from cache aren't counted
+         */
+        size_t hashed_files();
+    protected:
+        virtual void process_item(const std::string& filepath, const bool& cancel);
+    private:
+        typedef std::map<std::string, share_cache_entry> cache_map;
+
+        bool shared(const std::string& filepath);
+        void scan_directory(const std::string& dirpath);
+        void load_cache();
+        void post_result(const std::string& filepath, const add_transfer_params& atp, const error_code& ec);
+        void flush(bool force);
+
+        void add_watch(const std::string& dirpath);
+        void watcher();
+
+        std::string m_cache_filepath;
+        boost::mutex m_cache_mutex;
+        bool m_cache_loaded;
+        cache_map m_cache;
+        size_t m_hashed;
+
+        std::set<std::string> m_roots;  //!< shared directories
+        transfer_params_batch_alert::params_list m_batch;
+
+        bool m_running;                 //!< started and not stopped yet
+        int m_inotify;
+        volatile long m_watch_abort;    //!< written by stop(), read by watcher thread
+        std::map<int, std::string> m_watches;   //!< inotify watch descriptor -> directory
+        boost::shared_ptr<boost::thread> m_watcher;
+    };
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef __LIBED2K_SLAB_ARENA__
+#define __LIBED2K_SLAB_ARENA__
+
+#include <map>
+#include <set>
+#include <cstddef>
+
+#include <boost/noncopyable.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/thread.hpp"
+
+namespace libed2k
+{
+    /**
+      * allocator of fixed size buffers carved from big slabs of memory
+      * slabs are 2 MB aligned to be backed by hugepages, reserved ones when available
+      * otherwise transparent ones. Each thread keeps a few free buffers of each arena
+      * it uses, so most allocations and frees don't lock it. Buffers are taken from the
+      * slab with the lowest address first, so slabs at the end get empty and can be released
+     */
+    class LIBED2K_EXTRA_EXPORT slab_arena : boost::noncopyable
+    {
+    public:
+        struct stats_t
+        {
+            stats_t(): in_use(0), peak_in_use(0), cached(0), reserved(0),
+                slabs(0), hugepage_slabs(0), fragmented(0) {}
+
+            int in_use;         //!< buffers handed out
+            int peak_in_use;    //!< maximum of in_use since arena was created
+            int cached;         //!< free buffers held by thread caches
+            int reserved;       //!< buffers all slabs can hold
+            int slabs;
+            int hugepage_slabs; //!< slabs mapped on reserved hugepages
+            int fragmented;     //!< free buffers of slabs which can't be released
+        };
+
+        /**
+          * size of a hugepage, slabs are multiples of it
+         */
+        static const std::size_t hugepage_size = 2 * 1024 * 1024;
+
+        /**
+          * buffers of thread cache, refills and flushes move half of them
+         */
+        static const int thread_cache_size = 8;
+
+        /**
+          * arenas a thread caches buffers for at once, the least recently used
+          * cache is flushed when the thread takes one more arena
+         */
+        static const int thread_cache_slots = 4;
+
+        explicit slab_arena(int buffer_size);
+        ~slab_arena();
+
+        /**
+          * applies to slabs mapped later
+          * @param min_buffers slab holds at least this count of buffers
+          * @param hugepages map slabs on reserved hugepages and advise transparent hugepages
+          * @param numa_node prefer memory of this NUMA node, -1 for the default policy
+         */
+        void set_policy(int min_buffers, bool hugepages, int numa_node);
+
+        /**
+          * allocate() returns 0 instead of mapping more than max_slabs slabs
+          * @param max_slabs 0 for no limit
+         */
+        void set_limit(int max_slabs);
+
+        /**
+          * may be called from any thread
+          * @return 0 when no memory for new slab
+         */
+        char* allocate();
+        void free(char* buf);
+
+        bool owns(char const* buf) const;
+
+        /**
+          * flushes cache of the calling thread and unmaps slabs without used buffers
+          * caches of other threads are flushed on their next call or when they exit
+         */
+        void release_memory();
+
+        stats_t stats() const;
+        int buffer_size() const { return m_buffer_size; }
+
+        /**
+          * returns buffers cached by the calling thread to their arenas
+          * called when a thread using arenas exits
+         */
+        static void drain_thread();
+
+    private:
+        struct slab
+        {
+            std::size_t size;
+            int buffers;        //!< buffers slab can hold
+            char* free_list;    //!< freed buffers, linked through their first bytes
+            int carved;         //!< buffers from this index were never handed out
+            int used;           //!< buffers handed out, including ones in thread caches
+            bool hugepages;
+        };
+
+        struct thread_cache;
+        struct thread_caches;
+        friend struct thread_cache;
+        friend struct thread_caches;
+
+        thread_cache& local_cache();
+        static thread_caches*& caches();
+
+        /**
+          * returns buffers of cache to its arena when it still exists
+         */
+        static void drop(thread_cache& c);
+
+        /**
+          * move buffers between thread cache and slabs, under arena lock
+         */
+        void refill(thread_cache& c);
+        void flush(thread_cache& c, int count);
+
+        char* take(mutex::scoped_lock& l);
+        void put(char* buf, mutex::scoped_lock& l);
+        bool map_slab(mutex::scoped_lock& l);
+        std::map<char*, slab>::iterator find_slab(char const* buf);
+
+        const int m_buffer_size;
+        const long m_id;                //!< identifies the arena to thread caches
+
+        mutable mutex m_mutex;
+        std::map<char*, slab> m_slabs;  //!< by base address
+        std::set<char*> m_available;    //!< bases of slabs having free buffers
+
+        int m_min_buffers;
+        bool m_hugepages;
+        int m_numa_node;
+        int m_max_slabs;
+
+        volatile long m_in_use;
+        volatile long m_peak_in_use;
+        volatile long m_flush_epoch;    //!< caches filled before it are flushed
+    };
+}
+
+#endif
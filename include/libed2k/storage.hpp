@@ -52,6 +52,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/transfer_info.hpp"
 #include "libed2k/piece_picker.hpp"
 #include "libed2k/intrusive_ptr_base.hpp"
@@ -94,10 +95,20 @@ namespace libed2k
     struct LIBED2K_EXTRA_EXPORT partial_hash
     {
         partial_hash(): offset(0) {}
+
+        void update(char const* data, int len)
+        {
+            h.update(data, len);
+            if (aich) aich->update(data, len);
+        }
+
         // the number of bytes in the piece that has been hashed
         int offset;
         // the md4 context
         hasher h;
+        // AICH blocks of the piece hashed in the same pass,
+        // set when the transfer builds its AICH hash set
+        boost::shared_ptr<aich_piece_hasher> aich;
     };
 
     struct LIBED2K_EXPORT storage_interface
@@ -284,6 +295,7 @@ namespace libed2k
     };
 
     struct disk_io_thread;
+    struct disk_io_worker;
 
     class LIBED2K_EXTRA_EXPORT piece_manager
         : public intrusive_ptr_base<piece_manager>
@@ -291,6 +303,7 @@ namespace libed2k
     {
     friend class invariant_access;
     friend struct disk_io_thread;
+    friend struct disk_io_worker;
     public:
 
         piece_manager(
@@ -341,6 +354,9 @@ namespace libed2k
 
         void async_hash(int piece, boost::function<void(int, disk_io_job const&)> const& f);
 
+        // hashes AICH blocks of the piece, they are passed in disk_io_job::aich_blocks
+        void async_aich_hash(int piece, boost::function<void(int, disk_io_job const&)> const& f);
+
         void async_release_files(
             boost::function<void(int, disk_io_job const&)> const& handler
             = boost::function<void(int, disk_io_job const&)>());
@@ -405,6 +421,14 @@ namespace libed2k
         // this function returns true if the checking is complete
         int check_files(int& current_slot, int& have_piece, error_code& error);
 
+        // fast check of storages keeping pieces in their own slots.
+        // Slots in sparse regions are skipped without reading them and
+        // the next slot with data is read into bufs to be hashed by the
+        // caller, slot is -1 when nothing was read. Returns like check_files
+        bool can_check_fast() const;
+        int check_next_slot(int& slot, std::vector<file::iovec_t>& bufs, error_code& error);
+        int checked_slots() const { return m_current_slot; }
+
 #ifndef LIBED2K_NO_DEPRECATE
         bool compact_allocation() const
         { return m_storage_mode == storage_mode_compact; }
@@ -436,6 +460,19 @@ namespace libed2k
             , int offset
             , int num_bufs);
 
+        // extends the partial hash of the piece by blocks starting at offset.
+        // returns false when the blocks don't follow the hashed part of the
+        // piece, they have to be hashed again once the gap is filled
+        bool hash_blocks(int piece_index, int offset
+            , file::iovec_t const* bufs, int num_bufs);
+
+        // number of bytes at the start of the piece in its partial hash
+        int hashed_bytes(int piece_index) const;
+
+        // hash state of a piece from its first byte, it hashes AICH
+        // blocks too when hashing_aich is set and the file is recoverable
+        partial_hash start_hash() const;
+
         size_type physical_offset(int piece_index, int offset);
 
         void finalize_file(int index);
@@ -451,7 +488,21 @@ namespace libed2k
             , int current_slot);
 
         void switch_to_full_mode();
-        md4_hash hash_for_piece_impl(int piece, int* readback = 0);
+        // aich_blocks are set when the partial hash of the piece hashed them
+        md4_hash hash_for_piece_impl(int piece, int* readback = 0
+            , std::vector<sha1_hash>* aich_blocks = 0);
+
+        enum { no_hash_buffers = -2 };
+
+        // takes the partial hash of the piece and reads the rest of the piece
+        // into disk buffers, so it can be hashed by another thread.
+        // returns the number of bytes read, -1 when reading fails and the
+        // storage error is set, or no_hash_buffers when buffers can't be
+        // allocated. Unless no_hash_buffers is returned the caller frees bufs
+        int read_piece_for_hash(int piece, partial_hash& ph, std::vector<file::iovec_t>& bufs);
+
+        // reads the piece and hashes its AICH blocks, returns the number of bytes read
+        int aich_hash_impl(int piece, std::vector<sha1_hash>& blocks);
 
         int release_files_impl() { return m_storage->release_files(); }
         int delete_files_impl() { return m_storage->delete_files(); }
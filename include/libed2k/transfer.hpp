@@ -3,12 +3,14 @@
 #define __LIBED2K_TRANSFER__
 
 #include <set>
+#include <deque>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/function.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
 
 #include "libed2k/lazy_entry.hpp"
 #include "libed2k/policy.hpp"
@@ -20,6 +22,7 @@
 #include "libed2k/stat.hpp"
 #include "libed2k/transfer_handle.hpp"
 #include "libed2k/bandwidth_limit.hpp"
+#include "libed2k/peer_request.hpp"
 
 namespace libed2k
 {
@@ -145,6 +148,19 @@ namespace libed2k
         void set_sequential_download(bool sd);
         bool is_sequential_download() const { return m_sequential_download; }
 
+        // time critical pieces are requested ahead of the others
+        // in deadline order from the peers expected to deliver
+        // them first. Blocks which may miss the deadline are also
+        // requested from a second peer
+        void set_piece_deadline(int piece, int deadline_ms, int flags);
+        void set_range_deadline(size_type offset, size_type length, int deadline_ms, int flags);
+        void reset_piece_deadline(int piece);
+        void clear_piece_deadlines();
+
+        // posts read_piece_alert with piece data once it is read
+        // from disk, the piece must have passed the hash check
+        void read_piece(int piece);
+
         int queue_position() const { return m_sequence_number; }
 
         void second_tick(stat& accumulator, int tick_interval_ms, const ptime& now);
@@ -196,6 +212,23 @@ namespace libed2k
         // this is done when a piece fails
         void restore_piece_state(int index);
 
+        // --------------------------------------------
+        // AICH
+        // --------------------------------------------
+        const aich_hashset& aich() const { return m_aich; }
+
+        // trusted AICH root hash, all zeros while it is unknown
+        const sha1_hash& aich_root() const { return m_aich_root; }
+
+        // peer reported AICH root hash of the file, it becomes
+        // trusted when enough peers agree on it
+        void aich_root_received(const sha1_hash& root, peer_connection* c);
+
+        // peer answered AICH request of a failed piece, part is -1
+        // in answer without recovery data, the peer can't recover it
+        void aich_recovery_received(int part, const sha1_hash& root,
+            const aich_recovery& rd, peer_connection* c);
+
         bool has_picker() const { return m_picker.get() != 0; }
         piece_picker& picker() { return *m_picker; }
 
@@ -252,6 +285,19 @@ namespace libed2k
         void save_resume_data(int flags);
 		bool need_save_resume_data() const { return m_need_save_resume_data; }
 
+        void set_need_save_resume()
+        {
+            m_need_save_resume_data = true;
+            m_need_resume_checkpoint = true;
+        }
+
+        /**
+          * asks disk thread for resume data changed since the last checkpoint, it is
+          * handed to session_impl::add_resume_checkpoint when the storage part is written
+          * returns false when resume data wasn't changed or can't be saved now
+         */
+        bool resume_checkpoint();
+
         bool should_check_file() const;
 
         /** call after transfer checking completed */
@@ -286,8 +332,23 @@ namespace libed2k
         void on_transfer_aborted(int ret, disk_io_job const& j);
         void on_transfer_paused(int ret, disk_io_job const& j);
         void on_save_resume_data(int ret, disk_io_job const& j);
+        void on_resume_checkpoint(int ret, disk_io_job const& j);
         void on_resume_data_checked(int ret, disk_io_job const& j);
         void on_piece_checked(int ret, disk_io_job const& j);
+
+        // asks next peer supporting AICH for recovery data of failed piece
+        // returns false when there is no peer to ask
+        bool request_aich_recovery(int index);
+
+        // gives up recovery, the whole piece is downloaded again
+        void aich_recovery_failed(int index);
+
+        void on_aich_recovery_hashed(int ret, disk_io_job const& j, std::vector<sha1_hash> const& trusted);
+        void on_aich_part_hashed(int ret, disk_io_job const& j);
+
+        // called when AICH hashes of a part are added to the hash set
+        void aich_part_added();
+
         void on_piece_verified(int ret, disk_io_job const& j, boost::function<void(int)> f);
 
         void handle_disk_write(const disk_io_job& j, peer_connection* c);
@@ -317,6 +378,19 @@ namespace libed2k
         void write_resume_data(entry& rd) const;
         void read_resume_data(lazy_entry const& rd);
 
+        struct read_piece_struct
+        {
+            boost::shared_array<char> piece_data;
+            int blocks_left;
+            bool fail;
+            error_code error;
+        };
+        void on_disk_read_complete(int ret, disk_io_job const& j,
+                                   peer_request r, boost::shared_ptr<read_piece_struct> rp);
+
+        void add_time_critical_piece(int piece, int deadline_ms, int flags);
+        void request_time_critical_pieces();
+
         // this is the upload and download statistics for the whole transfer.
         // it's updated from all its peers once every second.
         stat m_stat;
@@ -428,11 +502,32 @@ namespace libed2k
         // whenever something is downloaded
         bool m_need_save_resume_data;
 
+        // the same for checkpoints of session resume log, which
+        // don't change the flag above
+        bool m_need_resume_checkpoint;
+
         /** current error on this transfer */
         error_code m_error;
 
         // the number of seconds since the last active state
         boost::uint16_t m_last_active;
+
+        // failed piece waiting for AICH recovery data stays finished
+        // in the picker, so its blocks aren't downloaded meanwhile
+        struct aich_recovery_state
+        {
+            std::set<tcp::endpoint> asked;  // peers asked for recovery data
+            tcp::endpoint peer;             // peer asked now, unset while stored blocks are hashed
+            ptime deadline;
+        };
+
+        // AICH hash set, parts are added as they pass verification
+        aich_hashset m_aich;
+        sha1_hash m_aich_root;
+
+        // root hashes reported by peers until one is trusted
+        std::map<sha1_hash, std::set<address> > m_aich_votes;
+        std::map<int, aich_recovery_state> m_aich_recovering;
     };
 
     extern shared_file_entry transfer2sfe(const std::pair<md4_hash, boost::shared_ptr<transfer> >& tran);
@@ -291,6 +291,16 @@ namespace libed2k
         std::vector<int> piece_priorities() const;
         bool is_sequential_download() const;
         void set_sequential_download(bool sd) const;
+
+        // pieces with deadlines are downloaded first, read_piece_alert
+        // is posted for pieces with alert_when_available once they pass
+        // the hash check. Deadlines are in milliseconds from now
+        enum deadline_flags_t { alert_when_available = 1 };
+        void set_piece_deadline(int index, int deadline, int flags = 0) const;
+        void set_range_deadline(size_type offset, size_type length, int deadline, int flags = 0) const;
+        void reset_piece_deadline(int index) const;
+        void clear_piece_deadlines() const;
+        void read_piece(int index) const;
         void set_upload_limit(int limit) const;
         int upload_limit() const;
         void set_download_limit(int limit) const;
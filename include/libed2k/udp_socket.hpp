@@ -42,6 +42,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libed2k/deadline_timer.hpp"
 
 #include <deque>
+#include <vector>
 #include <boost/function/function4.hpp>
 
 namespace libed2k
@@ -61,6 +62,9 @@ namespace libed2k
 
         enum flags_t { dont_drop = 1, peer_connection = 2 };
 
+        // upper limit of datagrams received or sent with one system call
+        enum { max_batch_size = 64 };
+
         bool is_open() const
         {
             return m_ipv4_sock.is_open()
@@ -93,6 +97,36 @@ namespace libed2k
 
         void set_buf_size(int s);
 
+        // max datagrams picked up per read wakeup and sent per system call,
+        // 1 turns batching off
+        void set_batch_size(int s);
+        int batch_size() const { return m_batch_size; }
+
+        // while the socket is corked sent packets are queued and go out
+        // in batches when it is uncorked. Incoming datagrams are dispatched
+        // corked, so replies to a batch of requests are sent as a batch too
+        void cork() { ++m_cork; }
+        void uncork();
+
+        // false once the kernel rejected UDP segmentation offload,
+        // batches are sent a packet per message from then on
+        bool segmentation_offload() const { return m_gso; }
+
+        struct batched_packet
+        {
+            udp::endpoint ep;
+            int offset; // in m_send_batch_buf
+            int size;
+        };
+
+        // splits packets [begin, end) of a batch into the messages of one
+        // system call and returns their count. first[n] is the index of the
+        // first packet of message n, first[count] is end. With segmentation
+        // offload a message carries a run of equally sized packets to one
+        // endpoint, the last one may be shorter, otherwise a single packet
+        static int split_batch(std::vector<batched_packet> const& batch
+            , int begin, int end, bool gso, int* first);
+
         template <class SocketOption>
         void set_option(SocketOption const& opt, error_code& ec)
         {
@@ -160,6 +194,12 @@ namespace libed2k
 
         void drain_queue();
 
+        void dispatch(udp::endpoint const& ep, char const* buf, int size);
+        void read_batch(udp::socket* s);
+        udp::socket& socket_for(udp::endpoint const& ep);
+        void send_now(udp::endpoint const& ep, char const* p, int len, error_code& ec);
+        void flush_sends();
+
         void wrap(udp::endpoint const& ep, char const* p, int len, error_code& ec);
         void wrap(char const* hostname, int port, char const* p, int len, error_code& ec);
         void unwrap(error_code const& e, char const* buf, int size);
@@ -246,6 +286,19 @@ namespace libed2k
         // operations hanging on this socket
         int m_outstanding_ops;
 
+        int m_batch_size;
+        int m_cork;
+
+        // packets sent while corked
+        std::vector<batched_packet> m_send_batch;
+        std::vector<char> m_send_batch_buf;
+
+        // datagrams received after the one of the read wakeup
+        std::vector<char> m_read_batch_buf;
+
+        // cleared when the kernel rejects UDP segmentation offload
+        bool m_gso;
+
 #if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
         bool m_started;
         int m_magic;
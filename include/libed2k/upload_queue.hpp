@@ -0,0 +1,157 @@
+#ifndef __LIBED2K_UPLOAD_QUEUE__
+#define __LIBED2K_UPLOAD_QUEUE__
+
+#include <vector>
+#include <map>
+
+#include "libed2k/hasher.hpp"
+#include "libed2k/address.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/time.hpp"
+
+namespace libed2k
+{
+    struct session_settings;
+
+    /**
+      * eMule style upload queue, clients are identified by user hash and address
+      * since user hashes aren't verified, clients without hash are never queued and get no credits
+      * clients asking for upload wait in queue and get free upload slots in order of score,
+      * which is waiting time multiplied by credit modifier of data the client uploaded to us
+      * disconnected clients keep their place until reask timeout, but get slot only when connected
+      * slot is taken back when others wait and it uploaded upload_slot_bytes, lasted upload_slot_time
+      * or stayed idle, the client is queued again at the end then
+      * slot count starts at upload_slots_min, slots are added while total upload rate rises and
+      * removed when rate per slot collapses or the last added slot didn't raise total rate
+     */
+    class upload_queue
+    {
+    public:
+        enum request_result { granted, queued, queue_full };
+
+        typedef std::pair<md4_hash, address> client_id;
+
+        enum
+        {
+            adjust_interval = 10,       //!< seconds between slot count adjustments
+            probe_interval = 6,         //!< adjustments without change before one more slot is tried
+            rank_interval = 30,         //!< min seconds between queue ranking updates of client
+            slot_idle_time = 60,        //!< slot which didn't upload this long is taken when others wait
+            credit_expiry = 24 * 3600   //!< credits of clients not seen this long are forgotten
+        };
+
+        /**
+          * changes of second tick the session sends to clients
+         */
+        struct tick_result
+        {
+            std::vector<client_id> granted;                     //!< accept upload
+            std::vector<client_id> revoked;                     //!< out of parts, client was queued again
+            std::vector<std::pair<client_id, int> > ranks;      //!< queue ranking updates
+        };
+
+        /**
+          * @param settings unchoke_slots_limit and upload_* settings are read on each call
+         */
+        explicit upload_queue(const session_settings& settings);
+
+        /**
+          * client asked for upload slot, it is queued or gets free slot when nobody waits with better score
+          * @param rank position of queued client
+          * @return queue_full for client without hash
+         */
+        request_result request(const client_id& client, const md4_hash& file, ptime now, int& rank);
+
+        /**
+          * client connection closed, it loses slot and keeps its place in queue
+         */
+        void disconnected(const client_id& client);
+
+        /**
+          * client doesn't want upload anymore, it loses slot and its place in queue
+         */
+        void release(const client_id& client);
+
+        /**
+          * payload sent to and received from client, counted for credits and slot rates
+         */
+        void uploaded(const client_id& client, int bytes);
+        void downloaded(const client_id& client, int bytes);
+
+        /**
+          * call it once per second
+         */
+        void second_tick(ptime now, tick_result& res);
+
+        bool has_slot(const client_id& client) const { return m_slots.count(client) != 0; }
+
+        /**
+          * @return 1 based position in queue, 0 when client isn't queued
+         */
+        int rank(const client_id& client, ptime now) const;
+
+        /**
+          * eMule credit modifier in range 1..10
+         */
+        float credit_modifier(const client_id& client) const;
+
+        int slots() const { return m_slots.size(); }
+        int target_slots() const { return m_target; }
+        int waiting() const { return m_waiting.size(); }
+    private:
+        struct waiting_client
+        {
+            md4_hash file;
+            ptime enqueued;
+            ptime last_ask;
+            ptime last_rank_sent;
+            int last_rank;
+            bool connected;
+        };
+
+        struct slot
+        {
+            md4_hash file;
+            ptime start;
+            ptime last_upload;
+            size_type bytes;        //!< uploaded in this slot session
+            size_type tick_bytes;   //!< bytes on previous second tick
+            size_type period_bytes; //!< uploaded since last slot count adjustment
+        };
+
+        struct credit
+        {
+            credit() : uploaded(0), downloaded(0) {}
+            size_type uploaded;
+            size_type downloaded;
+            ptime last_seen;
+        };
+
+        typedef std::map<client_id, waiting_client> waiting_map;
+        typedef std::map<client_id, slot> slot_map;
+        typedef std::map<client_id, credit> credit_map;
+        typedef std::vector<std::pair<double, waiting_map::iterator> > ranking;
+
+        double score(const waiting_map::value_type& w, ptime now) const;
+        void rank_clients(ptime now, ranking& r);
+        void grant(waiting_map::iterator w, ptime now);
+        void requeue(slot_map::iterator s, ptime now, tick_result& res);
+        void adjust_slots(int rate);
+        bool demand() const;
+
+        const session_settings& m_settings;
+        waiting_map m_waiting;
+        slot_map m_slots;
+        credit_map m_credits;
+
+        int m_target;               //!< slot count the queue fills up to
+        int m_ticks;                //!< seconds since last adjustment
+        size_type m_period_bytes;   //!< uploaded since last adjustment
+        int m_last_rate;            //!< total upload rate of previous adjustment period
+        int m_change_slot_rate;     //!< rate per slot when slot count was changed last time
+        int m_stable;               //!< adjustments since slot count change
+        bool m_added;               //!< last change added a slot
+    };
+}
+
+#endif
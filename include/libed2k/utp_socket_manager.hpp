@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libed2k/socket_type.hpp"
 #include "libed2k/session_status.hpp"
 #include "libed2k/enum_net.hpp"
+#include "libed2k/slab_arena.hpp"
 
 namespace libed2k
 {
@@ -81,6 +82,17 @@ namespace libed2k
         int loss_multiplier() const { return m_sett.utp_loss_multiplier; }
         bool allow_dynamic_sock_buf() const { return m_sett.utp_dynamic_sock_buf; }
 
+        // buffers of sent packets waiting for ACK and of received packets
+        // waiting to be read. Header only packets and MTU sized ones are
+        // carved from slabs and reused, bigger ones come from the heap, as
+        // do the others when their pool can't get memory
+        enum { small_packet_size = 128, mtu_packet_size = 1600 };
+        char* allocate_packet(int size);
+        void release_packet(char* p, int size);
+
+        // limits each packet pool to this count of slabs, 0 for no limit
+        void set_packet_pool_limit(int slabs);
+
         void mtu_for_dest(address const& addr, int& link_mtu, int& utp_mtu);
         void set_sock_buf(int size);
         int num_sockets() const { return m_utp_sockets.size(); }
@@ -115,6 +127,15 @@ namespace libed2k
         // the buffer size of the socket. This is used
         // to now lower the buffer size
         int m_sock_buf_size;
+
+        slab_arena m_small_packets;
+        slab_arena m_mtu_packets;
+        size_type m_heap_packets;
+
+        // packets of the pooled sizes allocated on the heap, the
+        // total and the ones not released yet
+        size_type m_pool_fallbacks;
+        int m_pool_fallbacks_in_use;
     };
 }
 
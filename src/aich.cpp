@@ -0,0 +1,253 @@
+#include <map>
+
+#include "libed2k/aich.hpp"
+#include "libed2k/constants.hpp"
+#include "libed2k/util.hpp"
+#include "libed2k/assert.hpp"
+
+namespace libed2k
+{
+    // node of the tree covers [offset, offset + size) of file, nodes over several parts are split
+    // on part boundaries and others on block boundaries, left branches get the bigger half
+    struct aich_hashset::node
+    {
+        node(size_type o, size_type s, bool l, boost::uint32_t i) :
+            offset(o), size(s), left(l), ident(i) {}
+
+        size_type base() const { return (size <= PIECE_SIZE) ? AICH_BLOCK_SIZE : PIECE_SIZE; }
+        bool leaf() const { return size <= base(); }
+
+        size_type left_size() const
+        {
+            size_type blocks = div_ceil(size, base());
+            return ((left ? blocks + 1 : blocks) / 2) * base();
+        }
+
+        node left_child() const { return node(offset, left_size(), true, (ident << 1) | 1); }
+
+        node right_child() const
+        {
+            size_type l = left_size();
+            return node(offset + l, size - l, false, ident << 1);
+        }
+
+        size_type offset;
+        size_type size;
+        bool left;
+        boost::uint32_t ident;
+    };
+
+    namespace
+    {
+        sha1_hash combine(const sha1_hash& l, const sha1_hash& r)
+        {
+            sha1_hasher h;
+            h.update((const char*)l.begin(), sha1_hash::size);
+            h.update((const char*)r.begin(), sha1_hash::size);
+            return h.final();
+        }
+
+        typedef std::map<boost::uint32_t, sha1_hash> ident_map;
+
+        // part node and its subtree use hashes of blocks, ancestors are computed
+        // and other nodes are taken from recovery data
+        template<typename Node>
+        bool verify_node(const Node& n, size_type part_begin, size_type part_end,
+            const ident_map& hashes, std::vector<sha1_hash>& blocks, sha1_hash& out)
+        {
+            bool crosses = n.offset < part_end && part_begin < n.offset + n.size;
+
+            if (n.leaf() || !crosses)
+            {
+                ident_map::const_iterator itr = hashes.find(n.ident);
+                if (itr == hashes.end()) return false;
+                out = itr->second;
+                if (crosses) blocks.push_back(out);
+                return true;
+            }
+
+            sha1_hash l, r;
+            if (!verify_node(n.left_child(), part_begin, part_end, hashes, blocks, l) ||
+                !verify_node(n.right_child(), part_begin, part_end, hashes, blocks, r))
+                return false;
+
+            out = combine(l, r);
+            return true;
+        }
+    }
+
+    void aich_piece_hasher::update(const char* data, int len)
+    {
+        while (len > 0)
+        {
+            int n = std::min(len, int(AICH_BLOCK_SIZE) - m_block_bytes);
+            m_hasher.update(data, n);
+            m_block_bytes += n;
+            data += n;
+            len -= n;
+
+            if (m_block_bytes == AICH_BLOCK_SIZE)
+            {
+                m_blocks.push_back(m_hasher.final());
+                m_block_bytes = 0;
+            }
+        }
+    }
+
+    const std::vector<sha1_hash>& aich_piece_hasher::final()
+    {
+        if (m_block_bytes > 0)
+        {
+            m_blocks.push_back(m_hasher.final());
+            m_block_bytes = 0;
+        }
+
+        return m_blocks;
+    }
+
+    aich_hashset::aich_hashset() : m_file_size(0), m_have(0)
+    {
+    }
+
+    aich_hashset::aich_hashset(size_type file_size) :
+        m_file_size(file_size), m_parts(div_ceil(file_size, PIECE_SIZE)), m_have(0)
+    {
+    }
+
+    int aich_hashset::blocks_in_part(size_type file_size, int part)
+    {
+        size_type part_size = std::min(PIECE_SIZE, file_size - part * PIECE_SIZE);
+        return int(div_ceil(part_size, AICH_BLOCK_SIZE));
+    }
+
+    int aich_hashset::total_blocks(size_type file_size)
+    {
+        int parts = int(div_ceil(file_size, PIECE_SIZE));
+        if (parts == 0) return 0;
+        return (parts - 1) * blocks_in_part(file_size, 0) + blocks_in_part(file_size, parts - 1);
+    }
+
+    bool aich_hashset::recoverable(size_type file_size)
+    {
+        return file_size > AICH_BLOCK_SIZE;
+    }
+
+    bool aich_hashset::has_part(int part) const
+    {
+        return part >= 0 && part < num_parts() && !m_parts[part].empty();
+    }
+
+    void aich_hashset::set_part(int part, const std::vector<sha1_hash>& blocks)
+    {
+        if (part < 0 || part >= num_parts()) return;
+        if (int(blocks.size()) != blocks_in_part(m_file_size, part)) return;
+        if (m_parts[part].empty()) ++m_have;
+        m_parts[part] = blocks;
+    }
+
+    bool aich_hashset::assign(const std::vector<sha1_hash>& blocks)
+    {
+        if (int(blocks.size()) != total_blocks(m_file_size)) return false;
+
+        std::vector<sha1_hash>::const_iterator itr = blocks.begin();
+        for (int part = 0; part < num_parts(); ++part)
+        {
+            int count = blocks_in_part(m_file_size, part);
+            set_part(part, std::vector<sha1_hash>(itr, itr + count));
+            itr += count;
+        }
+
+        return true;
+    }
+
+    std::vector<sha1_hash> aich_hashset::blocks() const
+    {
+        std::vector<sha1_hash> res;
+        if (!complete()) return res;
+
+        res.reserve(total_blocks(m_file_size));
+        for (int part = 0; part < num_parts(); ++part)
+            res.insert(res.end(), m_parts[part].begin(), m_parts[part].end());
+
+        return res;
+    }
+
+    sha1_hash aich_hashset::root() const
+    {
+        LIBED2K_ASSERT(complete());
+        return node_hash(node(0, m_file_size, true, 1));
+    }
+
+    bool aich_hashset::recovery_data(int part, aich_recovery& rd) const
+    {
+        rd.clear();
+        if (!complete() || !recoverable(m_file_size) || part < 0 || part >= num_parts())
+            return false;
+
+        size_type part_begin = part * PIECE_SIZE;
+        node n(0, m_file_size, true, 1);
+
+        // go down to the part node and take sibling of each node on the way
+        while (n.offset != part_begin || n.size > PIECE_SIZE)
+        {
+            node l = n.left_child();
+            node r = n.right_child();
+
+            if (part_begin < r.offset)
+            {
+                rd.push_back(std::make_pair(r.ident, node_hash(r)));
+                n = l;
+            }
+            else
+            {
+                rd.push_back(std::make_pair(l.ident, node_hash(l)));
+                n = r;
+            }
+        }
+
+        append_blocks(n, rd);
+        return true;
+    }
+
+    bool aich_hashset::verify(const sha1_hash& root, size_type file_size, int part,
+        const aich_recovery& rd, std::vector<sha1_hash>& blocks)
+    {
+        blocks.clear();
+        if (!recoverable(file_size) || part < 0 || part >= int(div_ceil(file_size, PIECE_SIZE)))
+            return false;
+
+        ident_map hashes(rd.begin(), rd.end());
+        size_type part_begin = part * PIECE_SIZE;
+        size_type part_end = std::min(part_begin + PIECE_SIZE, file_size);
+        sha1_hash res;
+
+        if (!verify_node(node(0, file_size, true, 1), part_begin, part_end, hashes, blocks, res) ||
+            res != root || int(blocks.size()) != blocks_in_part(file_size, part))
+        {
+            blocks.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    sha1_hash aich_hashset::node_hash(const node& n) const
+    {
+        if (n.leaf())
+            return m_parts[n.offset / PIECE_SIZE][(n.offset % PIECE_SIZE) / AICH_BLOCK_SIZE];
+
+        return combine(node_hash(n.left_child()), node_hash(n.right_child()));
+    }
+
+    void aich_hashset::append_blocks(const node& n, aich_recovery& rd) const
+    {
+        if (n.leaf())
+        {
+            rd.push_back(std::make_pair(n.ident, node_hash(n)));
+            return;
+        }
+
+        append_blocks(n.left_child(), rd);
+        append_blocks(n.right_child(), rd);
+    }
+}
@@ -31,6 +31,8 @@ namespace libed2k
         m_channel_state[upload_channel] = peer_info::bw_idle;
         m_channel_state[download_channel] = peer_info::bw_idle;
         m_disconnecting = false;
+        // most of packets fit, larger ones grow buffer once
+        m_write_body.reserve(1024);
     }
 
     void base_connection::disconnect(const error_code& ec, int error)
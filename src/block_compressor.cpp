@@ -0,0 +1,124 @@
+#include "libed2k/block_compressor.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/constants.hpp"
+#include "libed2k/time.hpp"
+#include "libed2k/log.hpp"
+
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.c"
+
+namespace libed2k
+{
+    bool block_compressor::cache_key::operator<(const cache_key& k) const
+    {
+        if (file != k.file) return file < k.file;
+        if (offset != k.offset) return offset < k.offset;
+        return size < k.size;
+    }
+
+    block_compressor::block_compressor(const session_settings& settings) :
+        m_settings(settings), m_cached_bytes(0), m_hits(0), m_spent(0)
+    {
+    }
+
+    block_compressor::block block_compressor::compress_block(
+        const md4_hash& file, size_type offset, const char* data, int size)
+    {
+        if (m_settings.upload_compression_level <= 0 || size <= 0) return block();
+
+        cache_key key(file, offset, size);
+        cache_map::iterator itr = m_cache.find(key);
+
+        if (itr != m_cache.end())
+        {
+            ++m_hits;
+            m_lru.splice(m_lru.begin(), m_lru, itr->second);
+            return itr->second->second;
+        }
+
+        file_stat& fs = m_files[file];
+        if (fs.probed >= probe_blocks && fs.shrunk == 0) return block();
+
+        if (m_settings.upload_compression_budget >= 0 &&
+            m_spent >= boost::int64_t(m_settings.upload_compression_budget) * 1000)
+            return block();
+
+        // output buffer is limited by required saving, so deflate stops as soon as block doesn't fit
+        boost::shared_ptr<std::string> out(new std::string(size - size * min_saving / 100, '\0'));
+        mz_ulong len = out->size();
+
+        ptime start = time_now_hires();
+        int rc = mz_compress2((unsigned char*)&(*out)[0], &len,
+                              (const unsigned char*)data, size, m_settings.upload_compression_level);
+        m_spent += total_microseconds(time_now_hires() - start);
+
+        block res;
+
+        if (rc == MZ_OK)
+        {
+            out->resize(len);
+            res = out;
+        }
+        else if (rc != MZ_BUF_ERROR)
+        {
+            ERR("block compression error " << mz_error(rc));
+        }
+
+        if (fs.probed < probe_blocks)
+        {
+            ++fs.probed;
+            if (res) ++fs.shrunk;
+            if (fs.probed == probe_blocks && fs.shrunk == 0)
+            {
+                DBG("file " << file << " is incompressible, upload it as is");
+            }
+        }
+
+        insert(key, res, size_t(m_settings.compressed_cache_size) * BLOCK_SIZE);
+        return res;
+    }
+
+    void block_compressor::second_tick()
+    {
+        m_spent = 0;
+    }
+
+    void block_compressor::remove_file(const md4_hash& file)
+    {
+        m_files.erase(file);
+
+        cache_map::iterator itr = m_cache.lower_bound(cache_key(file, 0, 0));
+        while (itr != m_cache.end() && itr->first.file == file)
+        {
+            lru_list::iterator i = itr->second;
+            ++itr;
+            erase(i);
+        }
+    }
+
+    bool block_compressor::incompressible(const md4_hash& file) const
+    {
+        std::map<md4_hash, file_stat>::const_iterator itr = m_files.find(file);
+        return itr != m_files.end() && itr->second.probed >= probe_blocks && itr->second.shrunk == 0;
+    }
+
+    void block_compressor::insert(const cache_key& key, const block& b, size_t limit)
+    {
+        size_t charge = (b ? b->size() : 0) + entry_overhead;
+        if (charge > limit) return;
+
+        while (!m_lru.empty() && m_cached_bytes + charge > limit)
+            erase(--m_lru.end());
+
+        m_lru.push_front(std::make_pair(key, b));
+        m_cache.insert(std::make_pair(key, m_lru.begin()));
+        m_cached_bytes += charge;
+    }
+
+    void block_compressor::erase(lru_list::iterator i)
+    {
+        m_cached_bytes -= (i->second ? i->second->size() : 0) + entry_overhead;
+        m_cache.erase(i->first);
+        m_lru.erase(i);
+    }
+}
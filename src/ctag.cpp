@@ -402,29 +402,10 @@ void array_tag::load(archive::ed2k_iarchive& ar)
         // avoid huge memory allocation on incorrect tags
         if (nSize > MAX_ED2K_PACKET_LEN)
         {
-            int nSignLength = -1*nSize;
-
-			// windows throw exceptions always
-#ifdef WIN32
-			try
-			{
-                ar.container().seekg(nSize, std::ios::cur);   // go to end of blob
-			}
-			catch(std::ios_base::failure&)
-			{
-				throw libed2k::libed2k_exception(libed2k::errors::blob_tag_too_long);
-			}
-#else
-			ar.container().seekg(nSize, std::ios::cur);   // go to end of blob
-#endif
-
-
-            if (!ar.container().good())
+            if (nSize > ar.bytes_left())
             {
                 throw libed2k::libed2k_exception(libed2k::errors::blob_tag_too_long);
             }
-
-            ar.container().seekg(nSignLength, std::ios::cur);   // go back
         }
 
         m_value.resize(nSize);
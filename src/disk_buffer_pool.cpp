@@ -32,6 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <libed2k/disk_buffer_pool.hpp>
 #include <libed2k/assert.hpp>
+#include <libed2k/mpsc_queue.hpp>
 #include <algorithm>
 
 #if LIBED2K_USE_MLOCK && !defined LIBED2K_WINDOWS
@@ -48,7 +49,7 @@ namespace libed2k
         : m_block_size(block_size)
         , m_in_use(0)
 #ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-        , m_pool(block_size, m_settings.cache_buffer_chunk_size)
+        , m_arena(block_size)
 #endif
     {
 #if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
@@ -86,7 +87,7 @@ namespace libed2k
 #ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
         return true;
 #else
-        return m_pool.is_from(buffer);
+        return m_arena.owns(buffer);
 #endif
     }
 
@@ -99,15 +100,16 @@ namespace libed2k
 
     char* disk_buffer_pool::allocate_buffer(char const* category)
     {
-        mutex::scoped_lock l(m_pool_mutex);
         LIBED2K_ASSERT(m_magic == 0x1337);
 #ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
         char* ret = page_aligned_allocator::malloc(m_block_size);
 #else
-        char* ret = (char*)m_pool.malloc();
-        m_pool.set_next_size(m_settings.cache_buffer_chunk_size);
+        // the arena keeps free buffers per thread, most
+        // allocations don't lock anything
+        char* ret = m_arena.allocate();
 #endif
-        ++m_in_use;
+        if (ret == 0) return 0;
+        atomics::fetch_add(&m_in_use, 1);
 #if LIBED2K_USE_MLOCK
         if (m_settings.lock_disk_cache)
         {
@@ -120,14 +122,16 @@ namespace libed2k
 #endif
 
 #if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        ++m_allocations;
+        atomics::fetch_add(&m_allocations, 1);
 #endif
 #ifdef LIBED2K_DISK_STATS
+        mutex::scoped_lock l(m_pool_mutex);
         ++m_categories[category];
         m_buf_to_category[ret] = category;
         m_log << log_time() << " " << category << ": " << m_categories[category] << "\n";
+        l.unlock();
 #endif
-        LIBED2K_ASSERT(ret == 0 || is_disk_buffer(ret, l));
+        LIBED2K_ASSERT(is_disk_buffer(ret));
         return ret;
     }
 
@@ -156,36 +160,36 @@ namespace libed2k
         // sort the pointers in order to maximize cache hits
         std::sort(bufvec, end);
 
-        mutex::scoped_lock l(m_pool_mutex);
         for (; bufvec != end; ++bufvec)
         {
             char* buf = *bufvec;
             LIBED2K_ASSERT(buf);
-            free_buffer_impl(buf, l);;
+            free_buffer_impl(buf);
         }
     }
 
     void disk_buffer_pool::free_buffer(char* buf)
     {
-        mutex::scoped_lock l(m_pool_mutex);
-        free_buffer_impl(buf, l);
+        free_buffer_impl(buf);
     }
 
-    void disk_buffer_pool::free_buffer_impl(char* buf, mutex::scoped_lock& l)
+    void disk_buffer_pool::free_buffer_impl(char* buf)
     {
         LIBED2K_ASSERT(buf);
         LIBED2K_ASSERT(m_magic == 0x1337);
-        LIBED2K_ASSERT(is_disk_buffer(buf, l));
+        LIBED2K_ASSERT(is_disk_buffer(buf));
 #if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        --m_allocations;
+        atomics::fetch_add(&m_allocations, -1);
 #endif
 #ifdef LIBED2K_DISK_STATS
+        mutex::scoped_lock l(m_pool_mutex);
         LIBED2K_ASSERT(m_categories.find(m_buf_to_category[buf])
             != m_categories.end());
         std::string const& category = m_buf_to_category[buf];
         --m_categories[category];
         m_log << log_time() << " " << category << ": " << m_categories[category] << "\n";
         m_buf_to_category.erase(buf);
+        l.unlock();
 #endif
 #if LIBED2K_USE_MLOCK
         if (m_settings.lock_disk_cache)
@@ -200,17 +204,36 @@ namespace libed2k
 #ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
         page_aligned_allocator::free(buf);
 #else
-        m_pool.free(buf);
+        m_arena.free(buf);
 #endif
-        --m_in_use;
+        atomics::fetch_add(&m_in_use, -1);
     }
 
     void disk_buffer_pool::release_memory()
     {
         LIBED2K_ASSERT(m_magic == 0x1337);
 #ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-        mutex::scoped_lock l(m_pool_mutex);
-        m_pool.release_memory();
+        m_arena.release_memory();
+#endif
+    }
+
+    slab_arena::stats_t disk_buffer_pool::arena_stats() const
+    {
+#ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
+        slab_arena::stats_t ret;
+        ret.in_use = m_in_use;
+        return ret;
+#else
+        return m_arena.stats();
+#endif
+    }
+
+    void disk_buffer_pool::set_settings(session_settings const& s)
+    {
+        m_settings = s;
+#ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
+        m_arena.set_policy(s.cache_buffer_chunk_size, s.disk_buffer_hugepages
+            , s.disk_buffer_numa_node);
 #endif
     }
 }
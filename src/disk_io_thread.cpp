@@ -72,57 +72,555 @@ namespace libed2k
     disk_io_thread::disk_io_thread(io_service& ios
         , boost::function<void()> const& queue_callback
         , file_pool& fp
-        , int block_size)
+        , int block_size
+        , int io_threads
+        , int hash_threads)
         : disk_buffer_pool(block_size)
+        , m_ios(ios)
+        , m_queue_callback(queue_callback)
+        , m_file_pool(fp)
+        , m_work(io_service::work(m_ios))
+        , m_completions(new completion_queue(m_ios))
+        , m_running(0)
+        , m_abort(false)
+        , m_num_workers((std::max)(io_threads, 1))
+        , m_hash_abort(false)
+    {
+        for (int i = 0; i < hash_threads; ++i)
+            m_hash_threads.push_back(boost::shared_ptr<thread>(
+                new thread(boost::bind(&disk_io_thread::hash_thread_fun, this))));
+
+        // workers look for jobs of each other as soon as
+        // they're started, so the list is filled under the lock
+        mutex::scoped_lock l(m_route_mutex);
+        for (int i = 0; i < m_num_workers; ++i)
+        {
+            m_workers.push_back(boost::shared_ptr<disk_io_worker>(new disk_io_worker(*this, i)));
+            ++m_running;
+        }
+    }
+
+    disk_io_thread::~disk_io_thread()
+    {
+        LIBED2K_ASSERT(m_abort == true);
+    }
+
+    void disk_io_thread::abort()
+    {
+        mutex::scoped_lock l(m_route_mutex);
+        m_abort = true;
+
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+        {
+            disk_io_worker& w = **i;
+            mutex::scoped_lock wl(w.m_queue_mutex);
+            disk_io_job j;
+            w.m_waiting_to_shutdown = true;
+            j.action = disk_io_job::abort_thread;
+            j.start_time = libed2k::time_now_hires();
+            w.m_jobs.insert(w.m_jobs.begin(), j);
+            w.m_signal.signal(wl);
+        }
+    }
+
+    void disk_io_thread::join()
+    {
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+        {
+            disk_io_worker& w = **i;
+            w.m_disk_io_thread.join();
+            mutex::scoped_lock l(w.m_queue_mutex);
+            LIBED2K_ASSERT(w.m_abort == true);
+            w.m_jobs.clear();
+        }
+
+        for (std::vector<boost::shared_ptr<thread> >::iterator i = m_hash_threads.begin()
+            , end(m_hash_threads.end()); i != end; ++i)
+            (*i)->join();
+    }
+
+    void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
+    {
+        mutex::scoped_lock l(m_route_mutex);
+        route(s.get(), l).stop(s);
+    }
+
+    void disk_io_thread::forget_ghosts(md4_hash const& info_hash)
+    {
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+            (*i)->forget_ghosts(info_hash);
+    }
+
+    int disk_io_thread::add_job(disk_io_job const& j
+        , boost::function<void(int, disk_io_job const&)> const& f)
+    {
+        if (j.action == disk_io_job::update_settings)
+        {
+            // every worker gets its own copy of the settings
+            LIBED2K_ASSERT(j.buffer);
+            session_settings const* s = ((session_settings*)j.buffer);
+            for (int i = 1; i < m_num_workers; ++i)
+            {
+                disk_io_job c(j);
+                c.buffer = (char*)new session_settings(*s);
+                m_workers[i]->add_job(c);
+            }
+            return m_workers[0]->add_job(j, f);
+        }
+
+        if (!j.storage) return m_workers[0]->add_job(j, f);
+
+        mutex::scoped_lock l(m_route_mutex);
+        disk_io_worker& w = route(j.storage.get(), l);
+        int ret = w.add_job(j, f);
+        wake_idle(w, l);
+        return ret;
+    }
+
+    size_type disk_io_thread::queue_buffer_size() const
+    {
+        size_type ret = 0;
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::const_iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+            ret += (*i)->queue_buffer_size();
+        return ret;
+    }
+
+    bool disk_io_thread::can_write() const
+    {
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::const_iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+            if (!(*i)->can_write()) return false;
+        return true;
+    }
+
+    void disk_io_thread::get_cache_info(md4_hash const& ih, std::vector<cached_piece_info>& ret) const
+    {
+        ret.clear();
+        std::vector<cached_piece_info> pieces;
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::const_iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+        {
+            (*i)->get_cache_info(ih, pieces);
+            ret.insert(ret.end(), pieces.begin(), pieces.end());
+        }
+    }
+
+    cache_status disk_io_thread::status() const
+    {
+        if (m_num_workers == 1) return m_workers[0]->status();
+
+        cache_status ret;
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::const_iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+        {
+            cache_status s = (*i)->status();
+            ret.blocks_written += s.blocks_written;
+            ret.writes += s.writes;
+            ret.flushes += s.flushes;
+            ret.write_syscalls += s.write_syscalls;
+            ret.blocks_read += s.blocks_read;
+            ret.blocks_read_hit += s.blocks_read_hit;
+            ret.reads += s.reads;
+            ret.queued_bytes += s.queued_bytes;
+            ret.cache_size += s.cache_size;
+            ret.read_cache_size += s.read_cache_size;
+            ret.average_queue_time = (std::max)(ret.average_queue_time, s.average_queue_time);
+            ret.average_read_time = (std::max)(ret.average_read_time, s.average_read_time);
+            ret.average_write_time = (std::max)(ret.average_write_time, s.average_write_time);
+            ret.average_hash_time = (std::max)(ret.average_hash_time, s.average_hash_time);
+            ret.average_job_time = (std::max)(ret.average_job_time, s.average_job_time);
+            ret.average_sort_time = (std::max)(ret.average_sort_time, s.average_sort_time);
+            ret.job_queue_length += s.job_queue_length;
+            ret.cumulative_job_time += s.cumulative_job_time;
+            ret.cumulative_read_time += s.cumulative_read_time;
+            ret.cumulative_write_time += s.cumulative_write_time;
+            ret.cumulative_hash_time += s.cumulative_hash_time;
+            ret.cumulative_sort_time += s.cumulative_sort_time;
+            ret.total_read_back += s.total_read_back;
+            ret.pieces_hashed += s.pieces_hashed;
+            ret.pieces_read_back += s.pieces_read_back;
+            ret.read_queue_size += s.read_queue_size;
+            ret.read_cache_pieces += s.read_cache_pieces;
+            ret.read_cache_frequent_pieces += s.read_cache_frequent_pieces;
+            ret.read_cache_recent_target += s.read_cache_recent_target;
+            ret.ghost_hits += s.ghost_hits;
+            for (std::map<md4_hash, cache_status::transfer_counters>::const_iterator k = s.transfers.begin()
+                , end(s.transfers.end()); k != end; ++k)
+            {
+                cache_status::transfer_counters& c = ret.transfers[k->first];
+                c.blocks_read += k->second.blocks_read;
+                c.blocks_read_hit += k->second.blocks_read_hit;
+            }
+        }
+        ret.total_used_buffers = in_use();
+
+        slab_arena::stats_t as = arena_stats();
+        ret.peak_used_buffers = as.peak_in_use;
+        ret.reserved_buffers = as.reserved;
+        ret.fragmented_buffers = as.fragmented;
+        return ret;
+    }
+
+    disk_io_worker& disk_io_thread::route(piece_manager* s, mutex::scoped_lock& l)
+    {
+        std::map<piece_manager*, int>::iterator i = m_routes.find(s);
+        if (i != m_routes.end()) return *m_workers[i->second];
+
+        int index = 0;
+        if (m_num_workers > 1)
+        {
+            // the save path may not exist yet, use the
+            // device of its closest existing parent
+            std::string path = s->save_path();
+            file_status st;
+            error_code ec;
+            stat_file(path, &st, ec);
+            while (ec && has_parent_path(path))
+            {
+                path = parent_path(path);
+                stat_file(path, &st, ec);
+            }
+
+            // devices are spread over the workers in order of appearance
+            boost::uint64_t device = ec ? 0 : st.device;
+            std::map<boost::uint64_t, int>::iterator d = m_devices.find(device);
+            if (d == m_devices.end())
+                d = m_devices.insert(std::make_pair(device, int(m_devices.size()) % m_num_workers)).first;
+            index = d->second;
+        }
+
+        m_routes.insert(std::make_pair(s, index));
+        return *m_workers[index];
+    }
+
+    void disk_io_thread::release_route(disk_io_worker& w, piece_manager* s)
+    {
+        mutex::scoped_lock l(m_route_mutex);
+        mutex::scoped_lock wl(w.m_queue_mutex);
+
+        if (w.m_hashing.count(s)) return;
+        for (std::deque<disk_io_job>::const_iterator i = w.m_jobs.begin()
+            , end(w.m_jobs.end()); i != end; ++i)
+            if (i->storage.get() == s) return;
+        for (disk_io_worker::read_jobs_t::const_iterator i = w.m_sorted_read_jobs.begin()
+            , end(w.m_sorted_read_jobs.end()); i != end; ++i)
+            if (i->second.storage.get() == s) return;
+
+        w.m_started.erase(s);
+        std::map<piece_manager*, int>::iterator i = m_routes.find(s);
+        if (i != m_routes.end() && i->second == w.m_index) m_routes.erase(i);
+    }
+
+    bool disk_io_thread::steal_jobs(disk_io_worker& thief)
+    {
+        mutex::scoped_lock l(m_route_mutex);
+        if (m_abort) return false;
+
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+        {
+            disk_io_worker& w = **i;
+            if (&w == &thief) continue;
+
+            mutex::scoped_lock wl(w.m_queue_mutex);
+            if (w.m_idle || w.m_abort) continue;
+
+            // storages the worker has already served have their cache
+            // there, take the first one it didn't get to yet
+            for (std::deque<disk_io_job>::iterator j = w.m_jobs.begin()
+                , end(w.m_jobs.end()); j != end; ++j)
+            {
+                piece_manager* s = j->storage.get();
+                if (s == 0 || w.m_started.count(s)) continue;
+
+                mutex::scoped_lock tl(thief.m_queue_mutex);
+                w.move_jobs(s, thief, wl, tl);
+                m_routes[s] = thief.m_index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void disk_io_thread::wake_idle(disk_io_worker& w, mutex::scoped_lock& l)
+    {
+        if (m_num_workers == 1) return;
+
+        {
+            // the worker will take the job itself
+            mutex::scoped_lock wl(w.m_queue_mutex);
+            if (w.m_idle) return;
+        }
+
+        for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+            , end(m_workers.end()); i != end; ++i)
+        {
+            disk_io_worker& t = **i;
+            if (&t == &w) continue;
+
+            mutex::scoped_lock tl(t.m_queue_mutex);
+            if (!t.m_idle || t.m_abort) continue;
+            t.m_signal.signal(tl);
+            return;
+        }
+    }
+
+    void disk_io_thread::post_hash(hash_job const& hj)
+    {
+        mutex::scoped_lock l(m_hash_mutex);
+        m_hash_jobs.push_back(hj);
+        m_hash_signal.signal_all(l);
+    }
+
+    void disk_io_thread::hash_thread_fun()
+    {
+        for (;;)
+        {
+            mutex::scoped_lock l(m_hash_mutex);
+            while (m_hash_jobs.empty() && !m_hash_abort) m_hash_signal.wait(l);
+            if (m_hash_jobs.empty()) return;
+
+            hash_job hj = m_hash_jobs.front();
+            m_hash_jobs.pop_front();
+            l.unlock();
+
+            libed2k::ptime hash_start = libed2k::time_now_hires();
+
+            for (std::vector<file::iovec_t>::iterator i = hj.bufs.begin()
+                , end(hj.bufs.end()); i != end; ++i)
+            {
+                hj.ph.update((char const*)i->iov_base, i->iov_len);
+                free_buffer((char*)i->iov_base);
+            }
+
+            disk_io_job const& j = hj.job;
+            if (hj.check)
+            {
+                // the slot holds its own piece or nothing useful
+                disk_io_job cj = j;
+                if (j.storage->info()->hash_for_piece(j.offset) != hj.ph.h.final()) cj.offset = -1;
+                hj.worker->check_hash_done(cj, int(total_microseconds(libed2k::time_now_hires() - hash_start)));
+                continue;
+            }
+
+            int ret = (j.storage->info()->hash_for_piece(j.piece) == hj.ph.h.final())?0:-2;
+            if (ret == 0 && hj.ph.aich)
+                hj.job.aich_blocks.reset(new std::vector<sha1_hash>(hj.ph.aich->final()));
+            hj.worker->hash_done(j, ret, int(total_microseconds(libed2k::time_now_hires() - hash_start)));
+        }
+    }
+
+    void disk_io_thread::worker_done()
+    {
+        mutex::scoped_lock l(m_route_mutex);
+        if (--m_running > 0) return;
+        l.unlock();
+
+        // workers wait for their pieces to be hashed
+        // before they exit, the hash threads are done
+        mutex::scoped_lock hl(m_hash_mutex);
+        m_hash_abort = true;
+        m_hash_signal.signal_all(hl);
+        hl.unlock();
+
+        // release the io_service to allow the run() call to return
+        // we do this once we stop posting new callbacks to it.
+        m_work.reset();
+    }
+
+// ------- disk_io_worker ------
+
+    disk_io_worker::disk_io_worker(disk_io_thread& owner, int index)
+        : m_pool(owner)
+        , m_index(index)
+        , m_block_size(owner.block_size())
         , m_abort(false)
         , m_waiting_to_shutdown(false)
         , m_queue_buffer_size(0)
+        , m_idle(false)
+        , m_check_hashing(0)
         , m_last_file_check(libed2k::time_now_hires())
         , m_last_stats_flip(libed2k::time_now())
         , m_physical_ram(0)
         , m_exceeded_write_queue(false)
-        , m_ios(ios)
-        , m_queue_callback(queue_callback)
-        , m_work(io_service::work(m_ios))
-        , m_file_pool(fp)
-        , m_disk_io_thread(boost::bind(&disk_io_thread::thread_fun, this))
+        , m_ios(owner.m_ios)
+        , m_queue_callback(owner.m_queue_callback)
+        , m_file_pool(owner.m_file_pool)
+        , m_disk_io_thread(boost::bind(&disk_io_worker::thread_fun, this))
     {
         // don't do anything in here. Essentially all members
         // of this object are owned by the newly created thread.
         // initialize stuff in thread_fun().
     }
 
-    disk_io_thread::~disk_io_thread()
+    disk_io_worker::~disk_io_worker()
     {
         LIBED2K_ASSERT(m_abort == true);
     }
 
-    void disk_io_thread::abort()
+    bool disk_io_worker::can_write() const
     {
         mutex::scoped_lock l(m_queue_mutex);
-        disk_io_job j;
-        m_waiting_to_shutdown = true;
-        j.action = disk_io_job::abort_thread;
-        j.start_time = libed2k::time_now_hires();
-        m_jobs.insert(m_jobs.begin(), j);
+        return !m_exceeded_write_queue;
+    }
+
+    void disk_io_worker::check_write_queue(mutex::scoped_lock& l)
+    {
+        if (!m_exceeded_write_queue) return;
+
+        int low_watermark = m_settings.max_queued_disk_bytes_low_watermark == 0
+            || m_settings.max_queued_disk_bytes_low_watermark >= m_settings.max_queued_disk_bytes
+            ? size_type(m_settings.max_queued_disk_bytes) * 7 / 8
+            : m_settings.max_queued_disk_bytes_low_watermark;
+
+        if (m_queue_buffer_size < low_watermark
+            || m_settings.max_queued_disk_bytes == 0)
+        {
+            m_exceeded_write_queue = false;
+            // we just dropped below the high watermark of number of bytes
+            // queued for writing to the disk. Notify the session so that it
+            // can trigger all the connections waiting for this event
+            if (m_queue_callback) m_ios.post(m_queue_callback);
+        }
+    }
+
+    void disk_io_worker::move_jobs(piece_manager* s, disk_io_worker& w
+        , mutex::scoped_lock& l, mutex::scoped_lock& wl)
+    {
+        LIBED2K_ASSERT(m_started.count(s) == 0);
+
+        for (std::deque<disk_io_job>::iterator i = m_jobs.begin(); i != m_jobs.end();)
+        {
+            if (i->storage.get() != s)
+            {
+                ++i;
+                continue;
+            }
+            if (i->action == disk_io_job::write)
+            {
+                LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
+                m_queue_buffer_size -= i->buffer_size;
+                w.m_queue_buffer_size += i->buffer_size;
+            }
+            w.m_jobs.push_back(*i);
+            i = m_jobs.erase(i);
+        }
+
+        check_write_queue(l);
+        if (w.m_queue_buffer_size >= w.m_settings.max_queued_disk_bytes
+            && w.m_settings.max_queued_disk_bytes > 0)
+            w.m_exceeded_write_queue = true;
+        w.m_signal.signal(wl);
+    }
+
+    void disk_io_worker::hash_done(disk_io_job const& j, int ret, int hash_time)
+    {
+        mutex::scoped_lock l(m_queue_mutex);
+        m_hash_time.add_sample(hash_time);
+        m_cache_stats.cumulative_hash_time += hash_time / 1000;
+
+        // the storage is only modified by the worker thread
+        m_hashed.push_back(std::make_pair(j, ret));
         m_signal.signal(l);
     }
 
-    void disk_io_thread::join()
+    void disk_io_worker::finish_hashed(mutex::scoped_lock& l)
+    {
+        while (!m_hashed.empty())
+        {
+            std::pair<disk_io_job, int> h = m_hashed.front();
+            m_hashed.pop_front();
+            disk_io_job const& j = h.first;
+
+            if (h.second == -2)
+            {
+                l.unlock();
+                j.storage->mark_failed(j.piece);
+                l.lock();
+            }
+            post_callback(j, h.second);
+
+            // jobs of the storage held while the piece was hashed go
+            // back to the front of the queue in the order they came
+            piece_manager* s = j.storage.get();
+            m_hashing.erase(s);
+            std::deque<disk_io_job> parked;
+            parked.swap(m_parked);
+            for (std::deque<disk_io_job>::reverse_iterator i = parked.rbegin()
+                , end(parked.rend()); i != end; ++i)
+            {
+                if (i->storage.get() == s) m_jobs.push_front(*i);
+                else m_parked.push_front(*i);
+            }
+        }
+    }
+
+    int disk_io_worker::check_next_slot(disk_io_job& j)
     {
-        m_disk_io_thread.join();
+        disk_io_thread::hash_job hj;
+        int slot;
+        int ret = j.storage->check_next_slot(slot, hj.bufs, j.error);
+        j.piece = j.storage->checked_slots();
+        j.offset = -1;
+        if (slot < 0) return ret;
+
+        if (!m_pool.hash_offload())
+        {
+            for (std::vector<file::iovec_t>::iterator i = hj.bufs.begin()
+                , end(hj.bufs.end()); i != end; ++i)
+            {
+                hj.ph.h.update((char const*)i->iov_base, i->iov_len);
+                m_pool.free_buffer((char*)i->iov_base);
+            }
+            if (j.storage->info()->hash_for_piece(slot) == hj.ph.h.final()) j.offset = slot;
+            return ret;
+        }
+
+        // each hash thread has at most one slot waiting
+        // for it while the next ones are read
         mutex::scoped_lock l(m_queue_mutex);
-        LIBED2K_ASSERT(m_abort == true);
-        m_jobs.clear();
+        while (m_check_hashing >= int(m_pool.m_hash_threads.size()))
+        {
+            m_signal.wait(l);
+            m_signal.clear(l);
+        }
+        ++m_check_hashing;
+        l.unlock();
+
+        hj.job = j;
+        hj.job.offset = slot;
+        hj.worker = this;
+        hj.check = true;
+        m_pool.post_hash(hj);
+        return ret;
     }
 
-    bool disk_io_thread::can_write() const
+    void disk_io_worker::check_hash_done(disk_io_job const& j, int hash_time)
     {
         mutex::scoped_lock l(m_queue_mutex);
-        return !m_exceeded_write_queue;
+        m_hash_time.add_sample(hash_time);
+        m_cache_stats.cumulative_hash_time += hash_time / 1000;
+        // the progress was posted when the slot was read
+        if (j.offset >= 0) post_callback(j, piece_manager::need_full_check);
+        --m_check_hashing;
+        m_signal.signal(l);
     }
 
-    void disk_io_thread::flip_stats(libed2k::ptime now)
+    void disk_io_worker::wait_for_check_hashes()
+    {
+        mutex::scoped_lock l(m_queue_mutex);
+        while (m_check_hashing > 0)
+        {
+            m_signal.wait(l);
+            m_signal.clear(l);
+        }
+    }
+
+    void disk_io_worker::flip_stats(libed2k::ptime now)
     {
         // calling mean() will actually reset the accumulators
         m_cache_stats.average_queue_time = m_queue_time.mean();
@@ -135,7 +633,7 @@ namespace libed2k
         m_last_stats_flip = now;
     }
 
-    void disk_io_thread::get_cache_info(md4_hash const& ih, std::vector<cached_piece_info>& ret) const
+    void disk_io_worker::get_cache_info(md4_hash const& ih, std::vector<cached_piece_info>& ret) const
     {
         mutex::scoped_lock l(m_piece_mutex);
         ret.clear();
@@ -174,13 +672,14 @@ namespace libed2k
         }
     }
 
-    cache_status disk_io_thread::status() const
+    cache_status disk_io_worker::status() const
     {
         mutex::scoped_lock l(m_piece_mutex);
-        m_cache_stats.total_used_buffers = in_use();
+        m_cache_stats.total_used_buffers = m_pool.in_use();
         m_cache_stats.queued_bytes = m_queue_buffer_size;
 
         cache_status ret = m_cache_stats;
+        ret.read_cache_pieces = m_read_pieces.size();
 
         ret.job_queue_length = m_jobs.size() + m_sorted_read_jobs.size();
         ret.read_queue_size = m_sorted_read_jobs.size();
@@ -189,7 +688,7 @@ namespace libed2k
     }
 
     // aborts read operations
-    void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
+    void disk_io_worker::stop(boost::intrusive_ptr<piece_manager> s)
     {
         mutex::scoped_lock l(m_queue_mutex);
         // read jobs are aborted, write and move jobs are syncronized
@@ -223,16 +722,36 @@ namespace libed2k
     struct update_last_use
     {
         update_last_use(int exp): expire(exp) {}
-        void operator()(disk_io_thread::cached_piece_entry& p)
+        void operator()(disk_io_worker::cached_piece_entry& p)
+        {
+            LIBED2K_ASSERT(p.storage);
+            p.expire = libed2k::time_now() + libed2k::seconds(expire);
+        }
+        int expire;
+    };
+
+    // reading data of a piece again moves it to the frequent list.
+    // Reading on through the piece doesn't, so a hash check or a
+    // single peer downloading the piece leaves it in the recent list
+    struct update_last_read
+    {
+        update_last_read(int exp, disk_io_job const& j, bool adaptive)
+            : expire(exp), start(j.offset), end(j.offset + j.buffer_size), promote(adaptive) {}
+        void operator()(disk_io_worker::cached_piece_entry& p)
         {
             LIBED2K_ASSERT(p.storage);
             p.expire = libed2k::time_now() + libed2k::seconds(expire);
+            if (promote && start < p.read_end) p.frequent = true;
+            p.read_end = end;
         }
         int expire;
+        int start;
+        int end;
+        bool promote;
     };
 
-    disk_io_thread::cache_piece_index_t::iterator disk_io_thread::find_cached_piece(
-        disk_io_thread::cache_t& cache
+    disk_io_worker::cache_piece_index_t::iterator disk_io_worker::find_cached_piece(
+        disk_io_worker::cache_t& cache
         , disk_io_job const& j, mutex::scoped_lock& l)
     {
         cache_piece_index_t& idx = cache.get<0>();
@@ -242,7 +761,7 @@ namespace libed2k
         return i;
     }
 
-    void disk_io_thread::flush_expired_pieces()
+    void disk_io_worker::flush_expired_pieces()
     {
         libed2k::ptime now = libed2k::time_now();
 
@@ -269,7 +788,7 @@ namespace libed2k
                 // there's no need to keep it around
                 int piece_size = i->storage->info()->piece_size(i->piece);
                 int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
-                erase = i->next_block_to_hash == blocks_in_piece;
+                erase = i->next_block_to_hash == blocks_in_piece || i->need_readback;
             }
 
             if (erase) widx.erase(i++);
@@ -278,19 +797,23 @@ namespace libed2k
 
         if (m_settings.explicit_read_cache) return;
 
-        // flush read cache
+        // flush read cache, both lists are ordered by last use
         std::vector<char*> bufs;
         cache_lru_index_t& ridx = m_read_pieces.get<1>();
-        i = ridx.begin();
-        while (i != ridx.end() && now - i->expire > cut_off)
+        for (int frequent = 0; frequent < 2; ++frequent)
         {
-            drain_piece_bufs(const_cast<cached_piece_entry&>(*i), bufs, l);
-            ridx.erase(i++);
+            i = ridx.lower_bound(std::pair<bool, libed2k::ptime>(frequent, libed2k::min_time()));
+            while (i != ridx.end() && i->frequent == bool(frequent) && now - i->expire > cut_off)
+            {
+                drain_piece_bufs(const_cast<cached_piece_entry&>(*i), bufs, l);
+                read_piece_removed(*i, true);
+                ridx.erase(i++);
+            }
         }
-        if (!bufs.empty()) free_multiple_buffers(&bufs[0], bufs.size());
+        if (!bufs.empty()) m_pool.free_multiple_buffers(&bufs[0], bufs.size());
     }
 
-    int disk_io_thread::drain_piece_bufs(cached_piece_entry& p, std::vector<char*>& buf
+    int disk_io_worker::drain_piece_bufs(cached_piece_entry& p, std::vector<char*>& buf
         , mutex::scoped_lock& l)
     {
         int piece_size = p.storage->info()->piece_size(p.piece);
@@ -311,7 +834,7 @@ namespace libed2k
     }
 
     // returns the number of blocks that were freed
-    int disk_io_thread::free_piece(cached_piece_entry& p, mutex::scoped_lock& l)
+    int disk_io_worker::free_piece(cached_piece_entry& p, mutex::scoped_lock& l)
     {
         int piece_size = p.storage->info()->piece_size(p.piece);
         int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
@@ -330,25 +853,19 @@ namespace libed2k
             --m_cache_stats.cache_size;
             --m_cache_stats.read_cache_size;
         }
-        if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+        if (!buffers.empty()) m_pool.free_multiple_buffers(&buffers[0], buffers.size());
         return ret;
     }
 
     // returns the number of blocks that were freed
-    int disk_io_thread::clear_oldest_read_piece(
+    int disk_io_worker::clear_oldest_read_piece(
         int num_blocks, ignore_t ignore, mutex::scoped_lock& l)
     {
         LIBED2K_INVARIANT_CHECK;
 
         cache_lru_index_t& idx = m_read_pieces.get<1>();
-        if (idx.empty()) return 0;
-
-        cache_lru_index_t::iterator i = idx.begin();
-        if (i->piece == ignore.piece && i->storage == ignore.storage)
-        {
-            ++i;
-            if (i == idx.end()) return 0;
-        }
+        cache_lru_index_t::iterator i = read_cache_victim(ignore);
+        if (i == idx.end()) return 0;
 
         // don't replace an entry that hasn't expired yet
         if (libed2k::time_now() < i->expire) return 0;
@@ -398,13 +915,100 @@ namespace libed2k
                 --num_blocks;
             }
         }
-        if (i->num_blocks == 0) idx.erase(i);
+        if (i->num_blocks == 0)
+        {
+            read_piece_removed(*i, true);
+            idx.erase(i);
+        }
 
-        if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+        if (!buffers.empty()) m_pool.free_multiple_buffers(&buffers[0], buffers.size());
         return blocks;
     }
 
-    int contiguous_blocks(disk_io_thread::cached_piece_entry const& b)
+    // the recent list gives up pieces while it's bigger than its
+    // target, the oldest frequent piece goes otherwise
+    disk_io_worker::cache_lru_index_t::iterator disk_io_worker::read_cache_victim(ignore_t ignore)
+    {
+        cache_lru_index_t& idx = m_read_pieces.get<1>();
+        int frequent = m_cache_stats.read_cache_frequent_pieces;
+        int recent = int(m_read_pieces.size()) - frequent;
+
+        cache_lru_index_t::iterator i = idx.begin();
+        if (frequent > 0 && (recent == 0 || recent <= m_cache_stats.read_cache_recent_target))
+            i = idx.lower_bound(std::pair<bool, libed2k::ptime>(true, libed2k::min_time()));
+
+        if (i != idx.end() && i->piece == ignore.piece && i->storage == ignore.storage)
+            ++i;
+        return i;
+    }
+
+    void disk_io_worker::read_piece_removed(cached_piece_entry const& p, bool evicted)
+    {
+        if (p.frequent) --m_cache_stats.read_cache_frequent_pieces;
+        LIBED2K_ASSERT(m_cache_stats.read_cache_frequent_pieces >= 0);
+        if (!evicted || !m_settings.adaptive_read_cache) return;
+
+        // remember about as many pieces as the cache holds
+        mutex::scoped_lock l(m_ghost_mutex);
+        ghost_list_t& ghosts = m_ghosts[p.frequent];
+        ghosts.push_back(ghost_key(p.storage->info()->info_hash(), p.piece));
+        size_t limit = (std::max)(m_read_pieces.size(), size_t(16));
+        while (ghosts.size() > limit) ghosts.pop_front();
+    }
+
+    bool disk_io_worker::ghost_hit(disk_io_job const& j)
+    {
+        if (!m_settings.adaptive_read_cache) return false;
+
+        mutex::scoped_lock l(m_ghost_mutex);
+        ghost_key key(j.storage->info()->info_hash(), j.piece);
+        for (int list = 0; list < 2; ++list)
+        {
+            ghost_list_t::nth_index<1>::type& idx = m_ghosts[list].get<1>();
+            ghost_list_t::nth_index<1>::type::iterator i = idx.find(key);
+            if (i == idx.end()) continue;
+            idx.erase(i);
+
+            // a miss on a piece evicted from the recent list means the
+            // recent list was too short, and vice versa. The step is
+            // bigger when the other ghost list is longer
+            int recent = int(m_ghosts[0].size()) + 1;
+            int frequent = int(m_ghosts[1].size()) + 1;
+            int& target = m_cache_stats.read_cache_recent_target;
+            if (list == 0) target += (std::max)(frequent / recent, 1);
+            else target -= (std::max)(recent / frequent, 1);
+            target = (std::max)(0, (std::min)(target, int(m_read_pieces.size()) + 1));
+
+            ++m_cache_stats.ghost_hits;
+            return true;
+        }
+        return false;
+    }
+
+    void disk_io_worker::forget_ghosts(md4_hash const& info_hash)
+    {
+        mutex::scoped_lock l(m_ghost_mutex);
+        for (int list = 0; list < 2; ++list)
+        {
+            for (ghost_list_t::iterator i = m_ghosts[list].begin(); i != m_ghosts[list].end();)
+            {
+                if (i->first == info_hash) i = m_ghosts[list].erase(i);
+                else ++i;
+            }
+        }
+    }
+
+    void disk_io_worker::count_read(disk_io_job const& j, bool hit, mutex::scoped_lock& l)
+    {
+        cache_status::transfer_counters& c = m_cache_stats.transfers[j.storage->info()->info_hash()];
+        ++m_cache_stats.blocks_read;
+        ++c.blocks_read;
+        if (!hit) return;
+        ++m_cache_stats.blocks_read_hit;
+        ++c.blocks_read_hit;
+    }
+
+    int contiguous_blocks(disk_io_worker::cached_piece_entry const& b)
     {
         int ret = 0;
         int current = 0;
@@ -423,7 +1027,7 @@ namespace libed2k
         return ret;
     }
 
-    int disk_io_thread::flush_contiguous_blocks(cached_piece_entry& p
+    int disk_io_worker::flush_contiguous_blocks(cached_piece_entry& p
         , mutex::scoped_lock& l, int lower_limit, bool avoid_readback)
     {
         // first find the largest range of contiguous  blocks
@@ -434,30 +1038,21 @@ namespace libed2k
         int blocks_in_piece = (p.storage->info()->piece_size(p.piece)
             + m_block_size - 1) / m_block_size;
 
-        if (avoid_readback)
+        // blocks which aren't hashed yet would be read back
+        // to hash the piece, only the hashed ones are flushed
+        int limit = avoid_readback && !p.need_readback ? p.next_block_to_hash : blocks_in_piece;
+        for (int i = 0; i < limit; ++i)
         {
-            start = p.next_block_to_hash;
-            for (int i = p.next_block_to_hash; i < blocks_in_piece; ++i)
-            {
-                if (p.blocks[i].buf) ++current;
-                else break;
-            }
-        }
-        else
-        {
-            for (int i = 0; i < blocks_in_piece; ++i)
+            if (p.blocks[i].buf) ++current;
+            else
             {
-                if (p.blocks[i].buf) ++current;
-                else
+                if (current > len)
                 {
-                    if (current > len)
-                    {
-                        len = current;
-                        pos = start;
-                    }
-                    current = 0;
-                    start = i + 1;
+                    len = current;
+                    pos = start;
                 }
+                current = 0;
+                start = i + 1;
             }
         }
         if (current > len)
@@ -471,14 +1066,14 @@ namespace libed2k
         return len;
     }
 
-    bool cmp_contiguous(disk_io_thread::cached_piece_entry const& lhs
-        , disk_io_thread::cached_piece_entry const& rhs)
+    bool cmp_contiguous(disk_io_worker::cached_piece_entry const& lhs
+        , disk_io_worker::cached_piece_entry const& rhs)
     {
         return lhs.num_contiguous_blocks < rhs.num_contiguous_blocks;
     }
 
     // flushes 'blocks' blocks from the cache
-    int disk_io_thread::flush_cache_blocks(mutex::scoped_lock& l
+    int disk_io_worker::flush_cache_blocks(mutex::scoped_lock& l
         , int blocks, ignore_t ignore, int options)
     {
         // first look if there are any read cache entries that can
@@ -506,6 +1101,7 @@ namespace libed2k
                 cache_lru_index_t::iterator i = idx.begin();
                 if (i == idx.end()) return ret;
                 tmp = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+                if (i->num_blocks > 0) return ret;
                 idx.erase(i);
                 blocks -= tmp;
                 ret += tmp;
@@ -533,15 +1129,16 @@ namespace libed2k
                 cache_lru_index_t::iterator piece = i;
                 ++i;
 
-                if (!piece->blocks[p.next_block_to_hash].buf) continue;
+                // blocks before next_block_to_hash are in the partial hash
+                // of the piece already, they go to disk without a read-back.
+                // Pieces which are read back anyway are flushed entirely
                 int piece_size = p.storage->info()->piece_size(p.piece);
                 int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
-                int start = p.next_block_to_hash;
-                int end = start + 1;
-                while (end < blocks_in_piece && p.blocks[end].buf) ++end;
-                tmp = flush_range(p, start, end, l);
+                int end = p.need_readback ? blocks_in_piece : p.next_block_to_hash;
+                if (end == 0 || p.num_blocks == 0) continue;
+                tmp = flush_range(p, 0, end, l);
                 p.num_contiguous_blocks = contiguous_blocks(p);
-                if (p.num_blocks == 0 && p.next_block_to_hash == blocks_in_piece)
+                if (p.num_blocks == 0 && (p.next_block_to_hash == blocks_in_piece || p.need_readback))
                     idx.erase(piece);
                 blocks -= tmp;
                 ret += tmp;
@@ -549,16 +1146,24 @@ namespace libed2k
             }
 
             // if we still need to flush blocks, flush the largest contiguous blocks
-            // regardless of if we'll have to read them back later
+            // regardless of if we'll have to read them back later. Entries
+            // without blocks are kept for next_block_to_hash, they're skipped
             while (blocks > 0)
             {
-                cache_lru_index_t::iterator i = std::max_element(idx.begin(), idx.end(), &cmp_contiguous);
-                if (i == idx.end() || i->num_blocks == 0) return ret;
+                cache_lru_index_t::iterator i = idx.end();
+                for (cache_lru_index_t::iterator k = idx.begin(); k != idx.end(); ++k)
+                {
+                    if (k->num_blocks == 0 || k->refcount > 0) continue;
+                    if (i == idx.end() || cmp_contiguous(*i, *k)) i = k;
+                }
+                if (i == idx.end()) return ret;
                 tmp = flush_contiguous_blocks(const_cast<cached_piece_entry&>(*i), l);
+                if (tmp == 0) return ret;
                 // at this point, we will for sure need a read-back for
                 // this piece anyway. We might as well save some time looping
                 // over the disk cache by deleting the entry
                 if (i->num_blocks == 0) idx.erase(i);
+                else const_cast<cached_piece_entry&>(*i).num_contiguous_blocks = contiguous_blocks(*i);
                 blocks -= tmp;
                 ret += tmp;
             }
@@ -566,12 +1171,13 @@ namespace libed2k
         return ret;
     }
 
-    int disk_io_thread::flush_range(cached_piece_entry& p
+    int disk_io_worker::flush_range(cached_piece_entry& p
         , int start, int end, mutex::scoped_lock& l)
     {
         LIBED2K_INVARIANT_CHECK;
 
         LIBED2K_ASSERT(start < end);
+        if (p.refcount > 0) return 0;
 
         int piece_size = p.storage->info()->piece_size(p.piece);
 #ifdef LIBED2K_DISK_STATS
@@ -591,6 +1197,7 @@ namespace libed2k
 
         end = (std::min)(end, blocks_in_piece);
         int num_write_calls = 0;
+        boost::uint32_t io_calls = file::io_calls();
         libed2k::ptime write_start = libed2k::time_now_hires();
         for (int i = start; i <= end; ++i)
         {
@@ -640,14 +1247,17 @@ namespace libed2k
                 offset += m_block_size;
             }
             buffer_size += block_size;
+            // the partial hash can't be extended past this block anymore
+            if (i >= p.next_block_to_hash) p.need_readback = true;
             LIBED2K_ASSERT(p.num_blocks > 0);
             --p.num_blocks;
             ++m_cache_stats.blocks_written;
             --m_cache_stats.cache_size;
-            if (i == p.next_block_to_hash) ++p.next_block_to_hash;
         }
 
         libed2k::ptime done = libed2k::time_now_hires();
+        if (num_write_calls > 0) ++m_cache_stats.flushes;
+        m_cache_stats.write_syscalls += file::io_calls() - io_calls;
 
         int ret = 0;
         disk_io_job j;
@@ -670,7 +1280,7 @@ namespace libed2k
             p.blocks[i].buf = 0;
             ++ret;
         }
-        if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+        if (!buffers.empty()) m_pool.free_multiple_buffers(&buffers[0], buffers.size());
 
         if (num_write_calls > 0)
         {
@@ -690,7 +1300,7 @@ namespace libed2k
     }
 
     // returns -1 on failure
-    int disk_io_thread::cache_block(disk_io_job& j
+    int disk_io_worker::cache_block(disk_io_job& j
         , boost::function<void(int,disk_io_job const&)>& handler
         , int cache_expire
         , mutex::scoped_lock& l)
@@ -708,7 +1318,7 @@ namespace libed2k
         if (blocks_in_piece <= 1) return -1;
 
 #ifdef LIBED2K_DISK_STATS
-        rename_buffer(j.buffer, "write cache");
+        m_pool.rename_buffer(j.buffer, "write cache");
 #endif
 
         p.piece = j.piece;
@@ -716,7 +1326,8 @@ namespace libed2k
         p.expire = libed2k::time_now() + libed2k::seconds(j.cache_min_time);
         p.num_blocks = 1;
         p.num_contiguous_blocks = 1;
-        p.next_block_to_hash = 0;
+        // the piece may have been in the cache before
+        p.next_block_to_hash = j.storage->hashed_bytes(j.piece) / m_block_size;
         p.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
         if (!p.blocks) return -1;
         int block = j.offset / m_block_size;
@@ -727,12 +1338,54 @@ namespace libed2k
         cache_lru_index_t& idx = m_pieces.get<1>();
         LIBED2K_ASSERT(p.storage);
         idx.insert(p);
+        if (block == p.next_block_to_hash)
+        {
+            cache_piece_index_t::iterator i = find_cached_piece(m_pieces, j, l);
+            hash_cached_blocks(const_cast<cached_piece_entry&>(*i), l);
+        }
         return 0;
     }
 
+    // extends the partial hash of the piece by the cached blocks following
+    // its hashed part. Blocks received out of order wait in the cache until
+    // the gap before them is filled, so the piece is hashed from memory
+    int disk_io_worker::hash_cached_blocks(cached_piece_entry& p, mutex::scoped_lock& l)
+    {
+        if (p.need_readback) return 0;
+        int piece_size = p.storage->info()->piece_size(p.piece);
+        int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+        int start = p.next_block_to_hash;
+        int end = start;
+        while (end < blocks_in_piece && p.blocks[end].buf) ++end;
+        if (end == start) return 0;
+
+        file::iovec_t* iov = LIBED2K_ALLOCA(file::iovec_t, end - start);
+        for (int i = start; i < end; ++i)
+        {
+            iov[i - start].iov_base = p.blocks[i].buf;
+            iov[i - start].iov_len = (std::min)(piece_size - i * m_block_size, m_block_size);
+        }
+
+        // the blocks stay in the cache while they are hashed
+        ++p.refcount;
+        l.unlock();
+        bool hashed = p.storage->hash_blocks(p.piece, start * m_block_size, iov, end - start);
+        l.lock();
+        --p.refcount;
+
+        if (!hashed)
+        {
+            // the partial hash went out of step with the cache
+            p.need_readback = true;
+            return 0;
+        }
+        p.next_block_to_hash = end;
+        return end - start;
+    }
+
     // fills a piece with data from disk, returns the total number of bytes
     // read or -1 if there was an error
-    int disk_io_thread::read_into_piece(cached_piece_entry& p, int start_block
+    int disk_io_worker::read_into_piece(cached_piece_entry& p, int start_block
         , int options, int num_blocks, mutex::scoped_lock& l)
     {
         LIBED2K_ASSERT(num_blocks > 0);
@@ -752,7 +1405,7 @@ namespace libed2k
         boost::scoped_array<char> buf;
         for (int i = start_block; i < blocks_in_piece
             && ((options & ignore_cache_size)
-                || in_use() < m_settings.cache_size); ++i)
+                || m_pool.in_use() < m_settings.cache_size); ++i)
         {
             int block_size = (std::min)(piece_size - piece_offset, m_block_size);
             LIBED2K_ASSERT(piece_offset <= piece_size);
@@ -761,12 +1414,12 @@ namespace libed2k
             // free it and allocate a new one
             if (p.blocks[i].buf)
             {
-                free_buffer(p.blocks[i].buf);
+                m_pool.free_buffer(p.blocks[i].buf);
                 --p.num_blocks;
                 --m_cache_stats.cache_size;
                 --m_cache_stats.read_cache_size;
             }
-            p.blocks[i].buf = allocate_buffer("read cache");
+            p.blocks[i].buf = m_pool.allocate_buffer("read cache");
 
             // the allocation failed, break
             if (p.blocks[i].buf == 0)
@@ -867,7 +1520,7 @@ namespace libed2k
 
     // returns -1 on read error, -2 if there isn't any space in the cache
     // or the number of bytes read
-    int disk_io_thread::cache_read_block(disk_io_job const& j, mutex::scoped_lock& l)
+    int disk_io_worker::cache_read_block(disk_io_job const& j, mutex::scoped_lock& l)
     {
         LIBED2K_INVARIANT_CHECK;
 
@@ -885,13 +1538,13 @@ namespace libed2k
 
         int blocks_to_read = blocks_in_piece - start_block;
         blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
-            + m_cache_stats.read_cache_size - in_use())/2, 3));
+            + m_cache_stats.read_cache_size - m_pool.in_use())/2, 3));
         blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
         if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
 
-        if (in_use() + blocks_to_read > m_settings.cache_size)
+        if (m_pool.in_use() + blocks_to_read > m_settings.cache_size)
         {
-            int clear = in_use() + blocks_to_read - m_settings.cache_size;
+            int clear = m_pool.in_use() + blocks_to_read - m_settings.cache_size;
             if (flush_cache_blocks(l, clear, ignore_t(j.piece, j.storage.get())
                 , dont_flush_write_blocks) < clear)
                 return -2;
@@ -910,13 +1563,18 @@ namespace libed2k
         int ret = read_into_piece(p, start_block, 0, blocks_to_read, l);
 
         LIBED2K_ASSERT(p.storage);
-        if (ret >= 0) idx.insert(p);
+        if (ret >= 0)
+        {
+            p.frequent = ghost_hit(j);
+            if (p.frequent) ++m_cache_stats.read_cache_frequent_pieces;
+            idx.insert(p);
+        }
 
         return ret;
     }
 
 #ifdef LIBED2K_DEBUG
-    void disk_io_thread::check_invariant() const
+    void disk_io_worker::check_invariant() const
     {
         int cached_write_blocks = 0;
         cache_piece_index_t const& idx = m_pieces.get<0>();
@@ -936,7 +1594,7 @@ namespace libed2k
                 if (p.blocks[k].buf)
                 {
 #if !defined LIBED2K_DISABLE_POOL_ALLOCATOR && defined LIBED2K_EXPENSIVE_INVARIANT_CHECKS
-                    LIBED2K_ASSERT(is_disk_buffer(p.blocks[k].buf));
+                    LIBED2K_ASSERT(m_pool.is_disk_buffer(p.blocks[k].buf));
 #endif
                     ++blocks;
                 }
@@ -946,11 +1604,13 @@ namespace libed2k
         }
 
         int cached_read_blocks = 0;
+        int frequent_pieces = 0;
         for (cache_t::const_iterator i = m_read_pieces.begin()
             , end(m_read_pieces.end()); i != end; ++i)
         {
             cached_piece_entry const& p = *i;
             LIBED2K_ASSERT(p.blocks);
+            if (p.frequent) ++frequent_pieces;
 
             int piece_size = p.storage->info()->piece_size(p.piece);
             int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
@@ -960,7 +1620,7 @@ namespace libed2k
                 if (p.blocks[k].buf)
                 {
 #if !defined LIBED2K_DISABLE_POOL_ALLOCATOR && defined LIBED2K_EXPENSIVE_INVARIANT_CHECKS
-                    LIBED2K_ASSERT(is_disk_buffer(p.blocks[k].buf));
+                    LIBED2K_ASSERT(m_pool.is_disk_buffer(p.blocks[k].buf));
 #endif
                     ++blocks;
                 }
@@ -970,13 +1630,18 @@ namespace libed2k
         }
 
         LIBED2K_ASSERT(cached_read_blocks == m_cache_stats.read_cache_size);
+        LIBED2K_ASSERT(frequent_pieces == m_cache_stats.read_cache_frequent_pieces);
         LIBED2K_ASSERT(cached_read_blocks + cached_write_blocks == m_cache_stats.cache_size);
 
 #ifdef LIBED2K_DISK_STATS
-        int read_allocs = m_categories.find(std::string("read cache"))->second;
-        int write_allocs = m_categories.find(std::string("write cache"))->second;
-        LIBED2K_ASSERT(cached_read_blocks == read_allocs);
-        LIBED2K_ASSERT(cached_write_blocks == write_allocs);
+        // buffer categories are counted for all workers
+        if (m_pool.io_threads() == 1)
+        {
+            int read_allocs = m_pool.m_categories.find(std::string("read cache"))->second;
+            int write_allocs = m_pool.m_categories.find(std::string("write cache"))->second;
+            LIBED2K_ASSERT(cached_read_blocks == read_allocs);
+            LIBED2K_ASSERT(cached_write_blocks == write_allocs);
+        }
 #endif
 
         // when writing, there may be a one block difference, right before an old piece
@@ -988,7 +1653,7 @@ namespace libed2k
     // reads the full piece specified by j into the read cache
     // returns the iterator to it and whether or not it already
     // was in the cache (hit).
-    int disk_io_thread::cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
+    int disk_io_worker::cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
         , bool& hit, int options, mutex::scoped_lock& l)
     {
         LIBED2K_INVARIANT_CHECK;
@@ -1035,6 +1700,11 @@ namespace libed2k
             hit = false;
             if (ret < 0) return ret;
             LIBED2K_ASSERT(pe.storage);
+            pe.frequent = ghost_hit(j);
+            if (pe.frequent) ++m_cache_stats.read_cache_frequent_pieces;
+            // the block this job reads counts as read, another
+            // reader starting over in the piece promotes it
+            pe.read_end = j.buffer ? j.offset + j.buffer_size : 0;
             p = idx.insert(pe).first;
         }
         else
@@ -1048,7 +1718,7 @@ namespace libed2k
     }
 
     // cache the entire piece and hash it
-    int disk_io_thread::read_piece_from_cache_and_hash(disk_io_job const& j, md4_hash& h)
+    int disk_io_worker::read_piece_from_cache_and_hash(disk_io_job const& j, md4_hash& h)
     {
         LIBED2K_ASSERT(j.buffer);
 
@@ -1059,9 +1729,9 @@ namespace libed2k
         int piece_size = j.storage->info()->piece_size(j.piece);
         int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
 
-        if (in_use() + blocks_in_piece >= m_settings.cache_size)
+        if (m_pool.in_use() + blocks_in_piece >= m_settings.cache_size)
         {
-            flush_cache_blocks(l, in_use() - m_settings.cache_size + blocks_in_piece);
+            flush_cache_blocks(l, m_pool.in_use() - m_settings.cache_size + blocks_in_piece);
         }
 
         cache_piece_index_t::iterator p;
@@ -1086,7 +1756,12 @@ namespace libed2k
         LIBED2K_ASSERT(ret > 0);
         if (ret < 0) return ret;
         cache_piece_index_t& idx = m_read_pieces.get<0>();
-        if (p->num_blocks == 0) idx.erase(p);
+        if (p->num_blocks == 0)
+        {
+            read_piece_removed(*p, false);
+            idx.erase(p);
+            p = idx.end();
+        }
         else idx.modify(p, update_last_use(j.cache_min_time));
 
         // if read cache is disabled or we exceeded the
@@ -1094,23 +1769,22 @@ namespace libed2k
         // also, if the piece wasn't in the cache when
         // the function was called, and we're using an
         // explicit read cache, remove it again
-        if (in_use() >= m_settings.cache_size
+        if (m_pool.in_use() >= m_settings.cache_size
             || !m_settings.use_read_cache
             || (m_settings.explicit_read_cache && !hit))
         {
-            LIBED2K_ASSERT(!m_read_pieces.empty());
-            LIBED2K_ASSERT(p->piece == j.piece);
-            LIBED2K_ASSERT(p->storage == j.storage);
             if (p != m_read_pieces.end())
             {
+                LIBED2K_ASSERT(p->piece == j.piece);
+                LIBED2K_ASSERT(p->storage == j.storage);
                 free_piece(const_cast<cached_piece_entry&>(*p), l);
+                read_piece_removed(*p, false);
                 m_read_pieces.erase(p);
             }
         }
 
         ret = j.buffer_size;
-        ++m_cache_stats.blocks_read;
-        if (hit) ++m_cache_stats.blocks_read_hit;
+        count_read(j, hit, l);
         return ret;
     }
 
@@ -1120,7 +1794,7 @@ namespace libed2k
     // this is similar to copy_from_piece() but it
     // doesn't do anything but determining if it's a
     // cache hit or not
-    bool disk_io_thread::is_cache_hit(cached_piece_entry& p
+    bool disk_io_worker::is_cache_hit(cached_piece_entry& p
         , disk_io_job const& j, mutex::scoped_lock& l)
     {
         int block = j.offset / m_block_size;
@@ -1144,7 +1818,7 @@ namespace libed2k
         return p.blocks[start_block].buf != 0;
     }
 
-    int disk_io_thread::copy_from_piece(cached_piece_entry& p, bool& hit
+    int disk_io_worker::copy_from_piece(cached_piece_entry& p, bool& hit
         , disk_io_job const& j, mutex::scoped_lock& l)
     {
         LIBED2K_ASSERT(j.buffer);
@@ -1178,15 +1852,15 @@ namespace libed2k
 
             int blocks_to_read = end_block - block;
             blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
-                + m_cache_stats.read_cache_size - in_use())/2, 3));
+                + m_cache_stats.read_cache_size - m_pool.in_use())/2, 3));
             blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
             blocks_to_read = (std::max)(blocks_to_read, min_blocks_to_read);
             if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
 
             // if we don't have enough space for the new piece, try flushing something else
-            if (in_use() + blocks_to_read > m_settings.cache_size)
+            if (m_pool.in_use() + blocks_to_read > m_settings.cache_size)
             {
-                int clear = in_use() + blocks_to_read - m_settings.cache_size;
+                int clear = m_pool.in_use() + blocks_to_read - m_settings.cache_size;
                 if (flush_cache_blocks(l, clear, ignore_t(p.piece, p.storage.get())
                     , dont_flush_write_blocks) < clear)
                     return -2;
@@ -1231,11 +1905,11 @@ namespace libed2k
             }
             ++block;
         }
-        if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+        if (!buffers.empty()) m_pool.free_multiple_buffers(&buffers[0], buffers.size());
         return j.buffer_size;
     }
 
-    int disk_io_thread::try_read_from_cache(disk_io_job const& j, bool& hit, int flags)
+    int disk_io_worker::try_read_from_cache(disk_io_job const& j, bool& hit, int flags)
     {
         LIBED2K_ASSERT(j.buffer);
         LIBED2K_ASSERT(j.cache_min_time >= 0);
@@ -1277,39 +1951,93 @@ namespace libed2k
 
         ret = copy_from_piece(const_cast<cached_piece_entry&>(*p), hit, j, l);
         if (ret < 0) return ret;
-        if (p->num_blocks == 0) idx.erase(p);
-        else idx.modify(p, update_last_use(j.cache_min_time));
+        if (p->num_blocks == 0)
+        {
+            read_piece_removed(*p, false);
+            idx.erase(p);
+        }
+        else
+        {
+            bool frequent = p->frequent;
+            idx.modify(p, update_last_read(j.cache_min_time, j, m_settings.adaptive_read_cache));
+            if (p->frequent && !frequent) ++m_cache_stats.read_cache_frequent_pieces;
+        }
 
         ret = j.buffer_size;
-        ++m_cache_stats.blocks_read;
-        if (hit) ++m_cache_stats.blocks_read_hit;
+        count_read(j, hit, l);
         return ret;
     }
 
-    size_type disk_io_thread::queue_buffer_size() const
+    size_type disk_io_worker::queue_buffer_size() const
     {
         mutex::scoped_lock l(m_queue_mutex);
         return m_queue_buffer_size;
     }
 
-    typedef std::list<std::pair<disk_io_job, int> > job_queue_t;
-    void completion_queue_handler(job_queue_t* completed_jobs)
+    completion_queue::completion_queue(io_service& ios)
+        : m_ios(ios)
+        , m_pending(0)
+        , m_dispatches(0)
+        , m_completions(0)
     {
-        boost::shared_ptr<job_queue_t> holder(completed_jobs);
+    }
 
-        for (job_queue_t::iterator i = completed_jobs->begin()
-            , end(completed_jobs->end()); i != end; ++i)
+    completion_queue::~completion_queue()
+    {
+        // the dispatch holds a reference to the queue,
+        // nobody is going to call these back
+        while (!m_queue.empty())
         {
-            LIBED2K_TRY
+            mpsc_queue::node* n = m_queue.pop();
+            if (n) delete static_cast<completion*>(n);
+        }
+    }
+
+    void completion_queue::post(disk_io_job const& j, int ret)
+    {
+        m_queue.push(new completion(j, ret));
+
+        // the job is visible to a running dispatch before it gives
+        // up m_pending, so it either takes the job or we post anew
+        if (atomics::compare_exchange(&m_pending, 0, 1))
+            m_ios.post(boost::bind(&completion_queue::dispatch, shared_from_this()));
+    }
+
+    void completion_queue::dispatch()
+    {
+        ++m_dispatches;
+
+        for (;;)
+        {
+            while (mpsc_queue::node* n = m_queue.pop())
             {
-                i->first.callback(i->second, i->first);
+                boost::scoped_ptr<completion> c(static_cast<completion*>(n));
+                ++m_completions;
+                LIBED2K_TRY
+                {
+                    c->job.callback(c->ret, c->job);
+                }
+                LIBED2K_CATCH(std::exception&)
+                {}
             }
-            LIBED2K_CATCH(std::exception&)
-            {}
+
+            // a job being pushed right now, let the
+            // network thread run other handlers meanwhile
+            if (!m_queue.empty())
+            {
+                m_ios.post(boost::bind(&completion_queue::dispatch, shared_from_this()));
+                return;
+            }
+
+            atomics::exchange(&m_pending, 0);
+
+            // a job pushed after the queue was found empty
+            // and before m_pending was cleared is ours
+            if (m_queue.empty() || !atomics::compare_exchange(&m_pending, 0, 1)) return;
         }
     }
 
-    int disk_io_thread::add_job(disk_io_job const& j
+    int disk_io_worker::add_job(disk_io_job const& j
         , mutex::scoped_lock& l
         , boost::function<void(int, disk_io_job const&)> const& f)
     {
@@ -1333,7 +2061,7 @@ namespace libed2k
             {
                 // this is OK because the disk_buffer pool has its
                 // own mutex to protect the pool allocator
-                const_cast<disk_io_job&>(j).buffer = allocate_buffer("send buffer");
+                const_cast<disk_io_job&>(j).buffer = m_pool.allocate_buffer("send buffer");
             }
             int ret = try_read_from_cache(j, hit, cache_only);
             if (hit && ret >= 0)
@@ -1341,12 +2069,10 @@ namespace libed2k
                 LIBED2K_ASSERT(f);
                 const_cast<disk_io_job&>(j).callback.swap(
                     const_cast<boost::function<void(int, disk_io_job const&)>&>(f));
-                job_queue_t* q = new job_queue_t;
-                q->push_back(std::make_pair(j, ret));
-                m_ios.post(boost::bind(completion_queue_handler, q));
+                post_callback(j, ret);
                 return m_queue_buffer_size;
             }
-            free_buffer(j.buffer);
+            m_pool.free_buffer(j.buffer);
             const_cast<disk_io_job&>(j).buffer = 0;
         }
 */
@@ -1357,7 +2083,7 @@ namespace libed2k
         return m_queue_buffer_size;
     }
 
-    int disk_io_thread::add_job(disk_io_job const& j
+    int disk_io_worker::add_job(disk_io_job const& j
         , boost::function<void(int, disk_io_job const&)> const& f)
     {
         LIBED2K_ASSERT(!m_abort);
@@ -1369,7 +2095,7 @@ namespace libed2k
         return add_job(j, l, f);
     }
 
-    bool disk_io_thread::test_error(disk_io_job& j)
+    bool disk_io_worker::test_error(disk_io_job& j)
     {
         LIBED2K_ASSERT(j.storage);
         error_code const& ec = j.storage->error();
@@ -1388,10 +2114,10 @@ namespace libed2k
         return false;
     }
 
-    void disk_io_thread::post_callback(disk_io_job const& j, int ret)
+    void disk_io_worker::post_callback(disk_io_job const& j, int ret)
     {
         if (!j.callback) return;
-        m_queued_completions.push_back(std::make_pair(j, ret));
+        m_pool.m_completions->post(j, ret);
     }
 
     enum action_flags_t
@@ -1420,6 +2146,7 @@ namespace libed2k
         , read_operation + cancel_on_abort // read_and_hash
         , read_operation + cancel_on_abort // cache_piece
         , 0 // finalize_file
+        , 0 // aich_hash
     };
 
     bool should_cancel_on_abort(disk_io_job const& j)
@@ -1440,10 +2167,12 @@ namespace libed2k
         return action_flags[j.action] & buffer_operation;
     }
 
-    void disk_io_thread::thread_fun()
+    void disk_io_worker::thread_fun()
     {
 #ifdef LIBED2K_DISK_STATS
-        m_log.open("disk_io_thread.log", std::ios::trunc);
+        char log_name[50];
+        snprintf(log_name, sizeof(log_name), "disk_io_thread%d.log", m_index);
+        m_log.open(log_name, std::ios::trunc);
 #endif
 
         // figure out how much physical RAM there is in
@@ -1503,30 +2232,35 @@ namespace libed2k
 
 
             mutex::scoped_lock jl(m_queue_mutex);
+            finish_hashed(jl);
 
-            if (m_queued_completions.size() >= 30 || (m_jobs.empty() && !m_queued_completions.empty()))
+            // when aborting, pieces being hashed are waited for,
+            // their results and held jobs are still to be posted
+            if (m_jobs.empty() && m_sorted_read_jobs.empty() && (!m_abort || !m_hashing.empty()))
             {
-                job_queue_t* q = new job_queue_t;
-                q->swap(m_queued_completions);
-                m_ios.post(boost::bind(completion_queue_handler, q));
-            }
-
+                // take jobs of another worker rather than wait
+                if (!m_abort && m_pool.io_threads() > 1)
+                {
+                    jl.unlock();
+                    if (m_pool.steal_jobs(*this)) continue;
+                    jl.lock();
+                }
 
-            libed2k::ptime job_start;
-            while (m_jobs.empty() && m_sorted_read_jobs.empty() && !m_abort)
-            {
                 // if there hasn't been an event in one second
                 // see if we should flush the cache
 //              if (!m_signal.timed_wait(jl, boost::posix_time::seconds(1)))
 //                  flush_expired_pieces();
+                m_idle = true;
                 m_signal.wait(jl);
                 m_signal.clear(jl);
+                m_idle = false;
 
-                job_start = libed2k::time_now();
+                libed2k::ptime job_start = libed2k::time_now();
                 if (job_start >= m_last_stats_flip + libed2k::seconds(1)) flip_stats(job_start);
+                continue;
             }
 
-            if (m_abort && m_jobs.empty())
+            if (m_abort && m_jobs.empty() && m_hashing.empty())
             {
                 jl.unlock();
 
@@ -1551,9 +2285,8 @@ namespace libed2k
 
                 m_pieces.clear();
                 m_read_pieces.clear();
-                // release the io_service to allow the run() call to return
-                // we do this once we stop posting new callbacks to it.
-                m_work.reset();
+                l.unlock();
+                m_pool.worker_done();
                 return;
             }
 
@@ -1593,28 +2326,24 @@ namespace libed2k
                 // and use it later
                 j = m_jobs.front();
                 m_jobs.pop_front();
+
+                if (j.storage)
+                {
+                    // the storage waits for a piece to be hashed, its
+                    // jobs are held to keep them in order
+                    if (m_hashing.count(j.storage.get()))
+                    {
+                        m_parked.push_back(j);
+                        continue;
+                    }
+                    m_started.insert(j.storage.get());
+                }
+
                 if (j.action == disk_io_job::write)
                 {
                     LIBED2K_ASSERT(m_queue_buffer_size >= j.buffer_size);
                     m_queue_buffer_size -= j.buffer_size;
-
-                    if (m_exceeded_write_queue)
-                    {
-                        int low_watermark = m_settings.max_queued_disk_bytes_low_watermark == 0
-                            || m_settings.max_queued_disk_bytes_low_watermark >= m_settings.max_queued_disk_bytes
-                            ? size_type(m_settings.max_queued_disk_bytes) * 7 / 8
-                            : m_settings.max_queued_disk_bytes_low_watermark;
-
-                        if (m_queue_buffer_size < low_watermark
-                            || m_settings.max_queued_disk_bytes == 0)
-                        {
-                            m_exceeded_write_queue = false;
-                            // we just dropped below the high watermark of number of bytes
-                            // queued for writing to the disk. Notify the session so that it
-                            // can trigger all the connections waiting for this event
-                            if (m_queue_callback) m_ios.post(m_queue_callback);
-                        }
-                    }
+                    check_write_queue(jl);
                 }
 
                 jl.unlock();
@@ -1679,10 +2408,7 @@ namespace libed2k
             else
             {
                 // the job queue is empty, pick the next read job
-                // from the sorted job list. So we don't need the
-                // job queue lock anymore
-                jl.unlock();
-
+                // from the sorted job list
                 immediate_jobs_in_row = 0;
 
                 LIBED2K_ASSERT(!m_sorted_read_jobs.empty());
@@ -1720,6 +2446,15 @@ namespace libed2k
                 LIBED2K_ASSERT(to_erase != elevator_job_pos);
                 last_elevator_pos = to_erase->first;
                 m_sorted_read_jobs.erase(to_erase);
+
+                if (m_hashing.count(j.storage.get()))
+                {
+                    m_parked.push_back(j);
+                    continue;
+                }
+
+                // we don't need the job queue lock anymore
+                jl.unlock();
             }
 
             m_queue_time.add_sample(total_microseconds(now - j.start_time));
@@ -1727,7 +2462,7 @@ namespace libed2k
             // if there's a buffer in this job, it will be freed
             // when this holder is destructed, unless it has been
             // released.
-            disk_buffer_holder holder(*this
+            disk_buffer_holder holder(m_pool
                 , operation_has_buffer(j) ? j.buffer : 0);
 
             flush_expired_pieces();
@@ -1794,6 +2529,8 @@ namespace libed2k
                         else
                             m_settings.cache_size = m_physical_ram / 8 / m_block_size;
                     }
+                    // the buffer pool is shared by the workers
+                    if (m_index == 0) m_pool.set_settings(m_settings);
                     break;
                 }
                 case disk_io_job::abort_torrent:
@@ -1849,6 +2586,7 @@ namespace libed2k
                         if (i->storage == j.storage)
                         {
                             drain_piece_bufs(const_cast<cached_piece_entry&>(*i), buffers, l);
+                            read_piece_removed(*i, false);
                             i = m_read_pieces.erase(i);
                         }
                         else
@@ -1856,9 +2594,22 @@ namespace libed2k
                             ++i;
                         }
                     }
+                    forget_ghosts(j.storage->info()->info_hash());
+                    m_cache_stats.transfers.erase(j.storage->info()->info_hash());
+
+                    // the storage may go to another worker
+                    // when it has nothing cached here
+                    bool cached = false;
+                    for (cache_t::iterator i = m_pieces.begin(); i != m_pieces.end(); ++i)
+                    {
+                        if (i->storage != j.storage) continue;
+                        cached = true;
+                        break;
+                    }
                     l.unlock();
-                    if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
-                    release_memory();
+                    if (!buffers.empty()) m_pool.free_multiple_buffers(&buffers[0], buffers.size());
+                    m_pool.release_memory();
+                    if (!cached) m_pool.release_route(*this, j.storage.get());
                     break;
                 }
                 case disk_io_job::abort_thread:
@@ -1910,7 +2661,7 @@ namespace libed2k
 #endif
                     LIBED2K_INVARIANT_CHECK;
                     LIBED2K_ASSERT(j.buffer == 0);
-                    j.buffer = allocate_buffer("send buffer");
+                    j.buffer = m_pool.allocate_buffer("send buffer");
                     LIBED2K_ASSERT(j.buffer_size <= m_block_size);
                     if (j.buffer == 0)
                     {
@@ -1928,7 +2679,7 @@ namespace libed2k
                         break;
                     }
 
-                    disk_buffer_holder read_holder(*this, j.buffer);
+                    disk_buffer_holder read_holder(m_pool, j.buffer);
 
                     // read the entire piece and verify the piece hash
                     // since we need to check the hash, this function
@@ -1958,7 +2709,7 @@ namespace libed2k
                     LIBED2K_ASSERT(j.buffer == read_holder.get());
                     read_holder.release();
 #if LIBED2K_DISK_STATS
-                    rename_buffer(j.buffer, "released send buffer");
+                    m_pool.rename_buffer(j.buffer, "released send buffer");
 #endif
                     break;
                 }
@@ -1970,6 +2721,41 @@ namespace libed2k
                     j.storage->finalize_file(j.piece);
                     break;
                 }
+                case disk_io_job::aich_hash:
+                {
+#ifdef LIBED2K_DISK_STATS
+                    m_log << log_time() << " aich_hash " << j.piece << std::endl;
+#endif
+                    LIBED2K_ASSERT(!j.storage->error());
+                    mutex::scoped_lock l(m_piece_mutex);
+                    LIBED2K_INVARIANT_CHECK;
+
+                    // the piece is read from disk, write its cached blocks first
+                    cache_piece_index_t& idx = m_pieces.get<0>();
+                    cache_piece_index_t::iterator i = find_cached_piece(m_pieces, j, l);
+                    if (i != idx.end())
+                    {
+                        flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+                        if (test_error(j))
+                        {
+                            ret = -1;
+                            break;
+                        }
+                    }
+                    l.unlock();
+
+                    j.aich_blocks.reset(new std::vector<sha1_hash>());
+                    int readback = j.storage->aich_hash_impl(j.piece, *j.aich_blocks);
+                    if (test_error(j))
+                    {
+                        ret = -1;
+                        break;
+                    }
+
+                    m_cache_stats.total_read_back += readback / m_block_size;
+                    ret = 0;
+                    break;
+                }
                 case disk_io_job::read:
                 {
                     if (test_error(j))
@@ -1981,7 +2767,7 @@ namespace libed2k
                     m_log << log_time();
 #endif
                     LIBED2K_INVARIANT_CHECK;
-                    if (j.buffer == 0) j.buffer = allocate_buffer("send buffer");
+                    if (j.buffer == 0) j.buffer = m_pool.allocate_buffer("send buffer");
                     LIBED2K_ASSERT(j.buffer_size <= m_block_size);
                     if (j.buffer == 0)
                     {
@@ -2002,7 +2788,7 @@ namespace libed2k
                         break;
                     }
 
-                    disk_buffer_holder read_holder(*this, j.buffer);
+                    disk_buffer_holder read_holder(m_pool, j.buffer);
 
                     bool hit;
                     ret = try_read_from_cache(j, hit);
@@ -2037,8 +2823,9 @@ namespace libed2k
                             ret = -1;
                             break;
                         }
-                        ++m_cache_stats.blocks_read;
                         hit = false;
+                        mutex::scoped_lock l(m_piece_mutex);
+                        count_read(j, hit, l);
                     }
                     if (!hit)
                     {
@@ -2049,7 +2836,7 @@ namespace libed2k
                     LIBED2K_ASSERT(j.buffer == read_holder.get());
                     read_holder.release();
 #if LIBED2K_DISK_STATS
-                    rename_buffer(j.buffer, "released send buffer");
+                    m_pool.rename_buffer(j.buffer, "released send buffer");
 #endif
                     break;
                 }
@@ -2064,9 +2851,9 @@ namespace libed2k
                     LIBED2K_ASSERT(!j.storage->error());
                     LIBED2K_ASSERT(j.cache_min_time >= 0);
 
-                    if (in_use() >= m_settings.cache_size)
+                    if (m_pool.in_use() >= m_settings.cache_size)
                     {
-                        flush_cache_blocks(l, in_use() - m_settings.cache_size + 1);
+                        flush_cache_blocks(l, m_pool.in_use() - m_settings.cache_size + 1);
                         if (test_error(j)) break;
                     }
                     LIBED2K_ASSERT(!j.storage->error());
@@ -2084,7 +2871,7 @@ namespace libed2k
                         LIBED2K_ASSERT(p->blocks[block].buf == 0);
                         if (p->blocks[block].buf)
                         {
-                            free_buffer(p->blocks[block].buf);
+                            m_pool.free_buffer(p->blocks[block].buf);
                             --m_cache_stats.cache_size;
                             --const_cast<cached_piece_entry&>(*p).num_blocks;
                         }
@@ -2100,7 +2887,7 @@ namespace libed2k
                         p->blocks[block].buf = j.buffer;
                         p->blocks[block].callback.swap(j.callback);
 #ifdef LIBED2K_DISK_STATS
-                        rename_buffer(j.buffer, "write cache");
+                        m_pool.rename_buffer(j.buffer, "write cache");
 #endif
                         ++m_cache_stats.cache_size;
                         ++const_cast<cached_piece_entry&>(*p).num_blocks;
@@ -2109,17 +2896,28 @@ namespace libed2k
                             const_cast<cached_piece_entry&>(*p).num_contiguous_blocks = contiguous_blocks(*p);
                         }
                         idx.modify(p, update_last_use(j.cache_min_time));
+                        if (block == p->next_block_to_hash)
+                            hash_cached_blocks(const_cast<cached_piece_entry&>(*p), l);
                         // we might just have created a contiguous range
                         // that meets the requirement to be flushed. try it
-                        // if we're in avoid_readback mode, don't do this. Only flush
-                        // pieces when we need more space in the cache (which will avoid
-                        // flushing blocks out-of-order) or when we issue a hash job,
-                        // wich indicates the piece is completely downloaded
-                        flush_contiguous_blocks(const_cast<cached_piece_entry&>(*p)
-                            , l, m_settings.write_cache_line_size
-                            , m_settings.disk_cache_algorithm == session_settings::avoid_readback);
-
-                        if (p->num_blocks == 0 && p->next_block_to_hash == 0) idx.erase(p);
+                        // if we're in avoid_readback mode, only blocks in the
+                        // partial hash are flushed, the rest waits for the gap
+                        // before it to be filled.
+                        // with flush_whole_pieces the piece goes to the disk
+                        // at once when all its blocks are hashed
+                        if (m_settings.flush_whole_pieces && !p->need_readback)
+                        {
+                            if (p->next_block_to_hash == blocks_in_piece)
+                                flush_range(const_cast<cached_piece_entry&>(*p), 0, INT_MAX, l);
+                        }
+                        else
+                        {
+                            flush_contiguous_blocks(const_cast<cached_piece_entry&>(*p)
+                                , l, m_settings.write_cache_line_size
+                                , m_settings.disk_cache_algorithm == session_settings::avoid_readback);
+                        }
+
+                        if (p->num_blocks == 0 && (p->next_block_to_hash == 0 || p->need_readback)) idx.erase(p);
                         test_error(j);
                         LIBED2K_ASSERT(!j.storage->error());
                     }
@@ -2132,6 +2930,7 @@ namespace libed2k
                             libed2k::ptime start = libed2k::time_now_hires();
                             file::iovec_t iov = {j.buffer, j.buffer_size};
                             ret = j.storage->write_impl(&iov, j.piece, j.offset, 1);
+                            if (ret == j.buffer_size) j.storage->hash_blocks(j.piece, j.offset, &iov, 1);
                             l.lock();
                             if (ret < 0)
                             {
@@ -2152,9 +2951,9 @@ namespace libed2k
                     // free it at the end
                     holder.release();
 
-                    if (in_use() > m_settings.cache_size)
+                    if (m_pool.in_use() > m_settings.cache_size)
                     {
-                        flush_cache_blocks(l, in_use() - m_settings.cache_size);
+                        flush_cache_blocks(l, m_pool.in_use() - m_settings.cache_size);
                         test_error(j);
                     }
                     LIBED2K_ASSERT(!j.storage->error());
@@ -2198,6 +2997,7 @@ namespace libed2k
                     if (i != idx.end())
                     {
                         LIBED2K_ASSERT(i->storage);
+                        hash_cached_blocks(const_cast<cached_piece_entry&>(*i), l);
                         int ret = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
                         idx.erase(i);
                         if (test_error(j))
@@ -2214,10 +3014,45 @@ namespace libed2k
                         break;
                     }
 
+                    if (m_pool.hash_offload())
+                    {
+                        // read the rest of the piece and let a hash thread
+                        // verify it, jobs of the storage are held meanwhile
+                        disk_io_thread::hash_job hj;
+                        int readback = j.storage->read_piece_for_hash(j.piece, hj.ph, hj.bufs);
+                        if (test_error(j))
+                        {
+                            for (std::vector<file::iovec_t>::iterator i = hj.bufs.begin()
+                                , end(hj.bufs.end()); i != end; ++i)
+                                m_pool.free_buffer((char*)i->iov_base);
+                            ret = -1;
+                            j.storage->mark_failed(j.piece);
+                            break;
+                        }
+
+                        // when buffers can't be allocated the piece is hashed here
+                        if (readback != piece_manager::no_hash_buffers)
+                        {
+                            m_cache_stats.total_read_back += readback / m_block_size;
+                            ++m_cache_stats.pieces_hashed;
+                            if (readback > 0) ++m_cache_stats.pieces_read_back;
+                            hj.job = j;
+                            hj.worker = this;
+
+                            mutex::scoped_lock jl(m_queue_mutex);
+                            m_hashing.insert(j.storage.get());
+                            jl.unlock();
+
+                            m_pool.post_hash(hj);
+                            continue;
+                        }
+                    }
+
                     libed2k::ptime hash_start = libed2k::time_now_hires();
 
                     int readback = 0;
-                    md4_hash h = j.storage->hash_for_piece_impl(j.piece, &readback);
+                    std::vector<sha1_hash> aich_blocks;
+                    md4_hash h = j.storage->hash_for_piece_impl(j.piece, &readback, &aich_blocks);
                     if (test_error(j))
                     {
                         ret = -1;
@@ -2226,11 +3061,16 @@ namespace libed2k
                     }
 
                     m_cache_stats.total_read_back += readback / m_block_size;
+                    ++m_cache_stats.pieces_hashed;
+                    if (readback > 0) ++m_cache_stats.pieces_read_back;
 
                     ret = (j.storage->info()->hash_for_piece(j.piece) == h)?0:-2;
                     if (ret == -2) j.storage->mark_failed(j.piece);
+                    if (ret == 0 && !aich_blocks.empty())
+                        j.aich_blocks.reset(new std::vector<sha1_hash>(aich_blocks));
 
                     libed2k::ptime done = libed2k::time_now_hires();
+                    mutex::scoped_lock jl(m_queue_mutex);
                     m_hash_time.add_sample(total_microseconds(done - hash_start));
                     m_cache_stats.cumulative_hash_time += total_milliseconds(done - hash_start);
                     break;
@@ -2273,7 +3113,7 @@ namespace libed2k
                         }
                     }
                     l.unlock();
-                    release_memory();
+                    m_pool.release_memory();
 
                     ret = j.storage->release_files_impl();
                     if (ret != 0) test_error(j);
@@ -2295,6 +3135,7 @@ namespace libed2k
                         if (i->storage == j.storage)
                         {
                             free_piece(const_cast<cached_piece_entry&>(*i), l);
+                            read_piece_removed(*i, false);
                             i = m_read_pieces.erase(i);
                         }
                         else
@@ -2302,8 +3143,9 @@ namespace libed2k
                             ++i;
                         }
                     }
+                    forget_ghosts(j.storage->info()->info_hash());
                     l.unlock();
-                    release_memory();
+                    m_pool.release_memory();
                     ret = 0;
                     break;
                 }
@@ -2343,8 +3185,8 @@ namespace libed2k
                     }
                     idx.erase(start, end);
                     l.unlock();
-                    if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
-                    release_memory();
+                    if (!buffers.empty()) m_pool.free_multiple_buffers(&buffers[0], buffers.size());
+                    m_pool.release_memory();
 
                     ret = j.storage->delete_files_impl();
                     if (ret != 0) test_error(j);
@@ -2367,7 +3209,12 @@ namespace libed2k
                     m_log << log_time() << " check_files" << std::endl;
 #endif
                     int piece_size = j.storage->info()->piece_length();
-                    for (int processed = 0; processed < 4 * 1024 * 1024; processed += piece_size)
+                    // the fast check reads ahead of the hash threads
+                    const bool fast = m_settings.fast_recheck && j.storage->can_check_fast();
+                    int batch_size = 4 * 1024 * 1024;
+                    if (fast) batch_size = (std::max)(batch_size, piece_size * 2 * int(m_pool.m_hash_threads.size()));
+
+                    for (int processed = 0; processed < batch_size; processed += piece_size)
                     {
                         libed2k::ptime now = libed2k::time_now_hires();
                         LIBED2K_ASSERT(now >= m_last_file_check);
@@ -2391,7 +3238,8 @@ namespace libed2k
                         libed2k::ptime hash_start = libed2k::time_now_hires();
                         if (m_waiting_to_shutdown) break;
 
-                        ret = j.storage->check_files(j.piece, j.offset, j.error);
+                        if (fast) ret = check_next_slot(j);
+                        else ret = j.storage->check_files(j.piece, j.offset, j.error);
 
                         libed2k::ptime done = libed2k::time_now_hires();
                         m_hash_time.add_sample(total_microseconds(done - hash_start));
@@ -2404,6 +3252,10 @@ namespace libed2k
                         } LIBED2K_CATCH(std::exception&) {}
                         if (ret != piece_manager::need_full_check) break;
                     }
+
+                    // results of the slots come before the end of the check
+                    if (fast) wait_for_check_hashes();
+
                     if (test_error(j))
                     {
                         ret = piece_manager::fatal_disk_error;
@@ -2415,8 +3267,10 @@ namespace libed2k
                     if (ret == piece_manager::need_full_check)
                     {
                         // offset needs to be reset to 0 so that the disk
-                        // job sorting can be done correctly
+                        // job sorting can be done correctly. The fast check
+                        // counts the last slot before it reports the end
                         j.offset = 0;
+                        if (j.piece >= j.storage->info()->num_pieces()) j.piece = 0;
                         add_job(j, j.callback);
                         continue;
                     }
@@ -2469,7 +3323,7 @@ namespace libed2k
 #if LIBED2K_DISK_STATS
                 if ((j.action == disk_io_job::read || j.action == disk_io_job::read_and_hash)
                     && j.buffer != 0)
-                    rename_buffer(j.buffer, "posted send buffer");
+                    m_pool.rename_buffer(j.buffer, "posted send buffer");
 #endif
                 post_callback(j, ret);
             } LIBED2K_CATCH(std::exception&) {
@@ -9,8 +9,12 @@
 #include "libed2k/log.hpp"
 #include "libed2k/file.hpp"
 #include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/util.hpp"
 #include "libed2k/thread.hpp"
+#include "libed2k/io.hpp"
+
+#include <boost/bind.hpp>
 
 #ifdef WIN32
 #include <windows.h>
@@ -576,7 +580,10 @@ namespace libed2k
             m_hash_list.m_collection.assign(hSet.begin(), hSet.end());
             m_list.add_tag(make_string_tag(libed2k::filename(filename), FT_FILENAME, true));
             m_list.add_tag(make_string_tag(libed2k::filename(filename), FT_FILENAME, true));  // write same name for backward compatibility
-            m_list.add_tag(make_typed_tag(static_cast<boost::uint32_t>(libed2k::file_size(filename)), FT_FILESIZE, true));
+            if (fs.file_size > 0xffffffffLL)
+                m_list.add_tag(make_typed_tag(static_cast<boost::uint64_t>(fs.file_size), FT_FILESIZE, true));
+            else
+                m_list.add_tag(make_typed_tag(static_cast<boost::uint32_t>(fs.file_size), FT_FILESIZE, true));
             m_list.add_tag(make_typed_tag(fs_trans.u.nLowPart, FT_ATTRANSFERRED, true));
             m_list.add_tag(make_typed_tag(fs_trans.u.nHighPart, FT_ATTRANSFERREDHI, true));
             m_list.add_tag(make_typed_tag(nRequested, FT_ATREQUESTED, true));
@@ -597,81 +604,124 @@ namespace libed2k
     {
     }
 
-    add_transfer_params known_file_collection::extract_transfer_params(time_t write_ts, const std::string& filepath)
+    static std::size_t known_key_hash(time_t mtime, size_type size, const std::string& filename)
     {
-        add_transfer_params atp;
+        std::size_t seed = 0;
+        boost::hash_combine(seed, mtime);
+        boost::hash_combine(seed, size);
+        boost::hash_combine(seed, filename);
+        return seed;
+    }
 
-        for (size_t n = 0; n < m_known_file_list.m_collection.size(); n++)
+    static size_type known_entry_size(const known_file_entry& entry)
+    {
+        size_type size = 0;
+
+        for (size_t j = 0; j < entry.m_list.size(); j++)
         {
-            // pass files when change time isn't equal
-            if (write_ts != static_cast<time_t>(m_known_file_list.m_collection[n].m_nLastChanged))
-            {
+            const boost::shared_ptr<base_tag> p = entry.m_list[j];
+
+            if (!is_int_tag(p))
                 continue;
-            }
 
-            // ok, we have equal change time - let's check filepath
-            if (bom_filter(filename(filepath)) != bom_filter(m_known_file_list.m_collection[n].m_list.getStringTagByNameId(FT_FILENAME)))
-            {
-                DBG("orig: " << convert_to_native(filepath)
-                    << " isn't equal: " << convert_to_native(bom_filter(m_known_file_list.m_collection[n].m_list.getStringTagByNameId(FT_FILENAME))));
+            if (p->getNameId() == FT_FILESIZE)
+                size += p->asInt();
+            else if (p->getNameId() == FT_FILESIZE_HI)
+                size += (p->asInt() << 32);
+        }
+
+        return size;
+    }
+
+    /**
+      * hashes and statistics of known file without path and piece hashes
+     */
+    static void known_entry_params(const known_file_entry& entry, add_transfer_params& atp)
+    {
+        atp.file_size = known_entry_size(entry);
+        atp.file_hash = entry.m_hFile;
+
+        for (size_t j = 0; j < entry.m_list.size(); j++)
+        {
+            const boost::shared_ptr<base_tag> p = entry.m_list[j];
+            // we process only int tags - check only ints
+            if (!is_int_tag(p))
                 continue;
+
+            switch(p->getNameId())
+            {
+                case FT_ATTRANSFERRED:
+                    atp.transferred += p->asInt();
+                    break;
+                case FT_ATTRANSFERREDHI:
+                    atp.transferred += (p->asInt() << 32);
+                    break;
+                case FT_ATREQUESTED:
+                    atp.requested = p->asInt();
+                    break;
+                case FT_ATACCEPTED:
+                    atp.accepted = p->asInt();
+                    break;
+                case FT_ULPRIORITY:
+                    atp.priority = p->asInt();
+                    break;
+                default:
+                    // ignore unused tags like
+                    // FT_PERMISSIONS
+                    // FT_AICH_HASH:
+                    // and all kad tags
+                    // also FT_FILENAME and FT_FILESIZE are checked by index
+                    break;
             }
+        }
+    }
 
-            atp.file_path = filepath;
-            atp.file_hash = m_known_file_list.m_collection[n].m_hFile;
+    std::size_t known_file_collection::entry_key_hash::operator()(const entry_key& k) const
+    {
+        return known_key_hash(k.m_mtime, k.m_size, k.m_filename);
+    }
+
+    void known_file_collection::build_index()
+    {
+        m_index.clear();
+        m_index.rehash(m_known_file_list.m_collection.size());
+
+        for (size_t n = 0; n < m_known_file_list.m_collection.size(); n++)
+        {
+            const known_file_entry& entry = m_known_file_list.m_collection[n];
+
+            // insert doesn't replace existing key, so the first entry wins like in linear search
+            m_index.insert(std::make_pair(entry_key(static_cast<time_t>(entry.m_nLastChanged), known_entry_size(entry),
+                bom_filter(entry.m_list.getStringTagByNameId(FT_FILENAME))), n));
+        }
+
+        DBG("known files index: " << m_index.size() << " of " << m_known_file_list.m_collection.size());
+    }
+
+    add_transfer_params known_file_collection::extract_transfer_params(time_t write_ts, size_type file_size, const std::string& filepath)
+    {
+        add_transfer_params atp;
+        entry_index::const_iterator itr = m_index.find(entry_key(write_ts, file_size, bom_filter(filename(filepath))));
+
+        if (itr != m_index.end())
+        {
+            const known_file_entry& entry = m_known_file_list.m_collection[itr->second];
+            known_entry_params(entry, atp);
 
-            if (m_known_file_list.m_collection[n].m_hash_list.m_collection.empty())
+            if (entry.m_hash_list.m_collection.empty())
             {
                 // when file contain only one hash - we save main hash directly into container
-                atp.piece_hashses.push_back(m_known_file_list.m_collection[n].m_hFile);
+                atp.piece_hashses.push_back(entry.m_hFile);
             }
             else
             {
-                atp.piece_hashses = m_known_file_list.m_collection[n].m_hash_list.m_collection;
-            }
-
-            for (size_t j = 0; j < m_known_file_list.m_collection[n].m_list.size(); j++)
-            {
-                const boost::shared_ptr<base_tag> p = m_known_file_list.m_collection[n].m_list[j];
-                // we process only int tags - check only ints
-                if (!is_int_tag(p))
-                    continue;
-
-                switch(p->getNameId())
-                {
-                    case FT_FILESIZE:
-                        atp.file_size = p->asInt();
-                        break;
-                    case FT_ATTRANSFERRED:
-                        atp.transferred += p->asInt();
-                        break;
-                    case FT_ATTRANSFERREDHI:
-                        atp.transferred += (p->asInt() << 32);
-                        break;
-                    case FT_ATREQUESTED:
-                        atp.requested = p->asInt();
-                        break;
-                    case FT_ATACCEPTED:
-                        atp.accepted = p->asInt();
-                        break;
-                    case FT_ULPRIORITY:
-                        atp.priority = p->asInt();
-                        break;
-                    default:
-                        // ignore unused tags like
-                        // FT_PERMISSIONS
-                        // FT_AICH_HASH:
-                        // and all kad tags
-                        // also FT_FILENAME was already checked
-                        break;
-                }
+                atp.piece_hashses = entry.m_hash_list.m_collection;
             }
 
             atp.file_path = filepath;
             atp.seed_mode  = true;
             DBG("metadata was migrated for {" << convert_to_native(filepath) << "}{"
                     << atp.file_hash.toString() << "}{" << atp.file_size << "}");
-            break;
         }
 
         return atp;
@@ -685,26 +735,308 @@ namespace libed2k
         }
     }
 
-    transfer_params_maker::transfer_params_maker(alert_manager& am, const std::string& known_filepath) :
+    // known files store layout
+    const char KNOWN_STORE_MAGIC[4] = { 'K', 'F', 'S', 'T' };
+    const size_t KNOWN_STORE_HEADER_SIZE = 32;
+    const size_t KNOWN_STORE_RECORD_SIZE = 72;
+
+    known_file_store::known_file_store() : m_count(0), m_names_offset(0), m_hashes_offset(0)
+    {
+    }
+
+    bool known_file_store::open(const std::string& filepath, error_code& ec)
+    {
+        close();
+
+        file f(filepath, file::read_only, ec);
+        if (ec) return false;
+        size_type fsize = f.get_size(ec);
+        if (ec) return false;
+
+        if (fsize < static_cast<size_type>(KNOWN_STORE_HEADER_SIZE))
+        {
+            ec = errors::known_store_corrupted;
+            return false;
+        }
+
+        // view stays valid when file is closed
+        if (!m_view.map(f, 0, fsize, ec)) return false;
+
+        const char* ptr = m_view.data();
+        bool valid = std::equal(KNOWN_STORE_MAGIC, KNOWN_STORE_MAGIC + sizeof(KNOWN_STORE_MAGIC), ptr);
+        ptr += sizeof(KNOWN_STORE_MAGIC);
+        valid = valid && detail::read_uint32(ptr) == version;
+        m_count = detail::read_uint32(ptr);
+        detail::read_uint32(ptr); // reserved
+        m_names_offset = detail::read_uint64(ptr);
+        m_hashes_offset = detail::read_uint64(ptr);
+
+        valid = valid &&
+            static_cast<size_type>(KNOWN_STORE_HEADER_SIZE + static_cast<boost::uint64_t>(m_count)*KNOWN_STORE_RECORD_SIZE) <= m_names_offset &&
+            m_names_offset <= m_hashes_offset && m_hashes_offset <= fsize;
+
+        m_index.rehash(valid ? m_count : 0);
+
+        // hash counts come from file, check them alone before any arithmetic may wrap
+        const boost::uint64_t max_hashes = valid ? (fsize - m_hashes_offset) / md4_hash::size : 0;
+
+        for (size_t n = 0; valid && n < m_count; ++n)
+        {
+            const char* rec = record(n) + md4_hash::size;
+            size_type size = detail::read_uint64(rec);
+            time_t mtime = static_cast<time_t>(detail::read_uint64(rec));
+            detail::read_uint64(rec); // transferred
+            boost::uint64_t first_hash = detail::read_uint64(rec);
+            boost::uint32_t hashes = detail::read_uint32(rec);
+            boost::uint32_t name_offset = detail::read_uint32(rec);
+            rec += 8; // requested and accepted
+            boost::uint16_t name_len = detail::read_uint16(rec);
+
+            valid = m_names_offset + name_offset + name_len <= m_hashes_offset &&
+                first_hash <= max_hashes && hashes <= max_hashes - first_hash;
+
+            if (valid)
+            {
+                m_index.insert(std::make_pair(known_key_hash(mtime, size, record_name(record(n))),
+                    static_cast<boost::uint32_t>(n)));
+            }
+        }
+
+        if (!valid)
+        {
+            close();
+            ec = errors::known_store_corrupted;
+            return false;
+        }
+
+        DBG("known files store: " << m_count << " entries mapped");
+        return true;
+    }
+
+    void known_file_store::close()
+    {
+        m_view.unmap();
+        m_index.clear();
+        m_count = 0;
+        m_names_offset = 0;
+        m_hashes_offset = 0;
+    }
+
+    add_transfer_params known_file_store::extract_transfer_params(time_t write_ts, size_type file_size, const std::string& filepath) const
+    {
+        add_transfer_params atp;
+        std::string name = bom_filter(filename(filepath));
+        std::pair<record_index::const_iterator, record_index::const_iterator> range =
+            m_index.equal_range(known_key_hash(write_ts, file_size, name));
+
+        // the first matched entry wins like in known_file_collection
+        boost::uint32_t found = m_count;
+
+        for (record_index::const_iterator itr = range.first; itr != range.second; ++itr)
+        {
+            const char* rec = record(itr->second) + md4_hash::size;
+            size_type size = detail::read_uint64(rec);
+            time_t mtime = static_cast<time_t>(detail::read_uint64(rec));
+
+            if (itr->second < found && size == file_size && mtime == write_ts && record_name(record(itr->second)) == name)
+            {
+                found = itr->second;
+            }
+        }
+
+        if (found == m_count) return atp;
+
+        const char* rec = record(found);
+        atp.file_hash = md4_hash(reinterpret_cast<const md4_hash::md4hash_container&>(*rec));
+        rec += md4_hash::size;
+        atp.file_size = detail::read_uint64(rec);
+        detail::read_uint64(rec); // mtime
+        atp.transferred = detail::read_uint64(rec);
+        rec += 16; // hashes and name offset
+        atp.requested = detail::read_uint32(rec);
+        atp.accepted = detail::read_uint32(rec);
+        rec += 2; // name length
+        atp.priority = detail::read_uint8(rec);
+
+        // piece hashes are read only here
+        record_hashset(record(found), atp.piece_hashses);
+
+        if (atp.piece_hashses.empty())
+        {
+            // when file contain only one hash - we save main hash directly into container
+            atp.piece_hashses.push_back(atp.file_hash);
+        }
+
+        atp.file_path = filepath;
+        atp.seed_mode = true;
+        DBG("metadata was taken from store for {" << convert_to_native(filepath) << "}{"
+                << atp.file_hash.toString() << "}{" << atp.file_size << "}");
+        return atp;
+    }
+
+    bool known_file_store::write(const std::string& filepath, const known_file_collection& kfc, error_code& ec)
+    {
+        const std::deque<known_file_entry>& entries = kfc.m_known_file_list.m_collection;
+        std::vector<char> records(KNOWN_STORE_HEADER_SIZE + entries.size()*KNOWN_STORE_RECORD_SIZE);
+        std::string names;
+        std::vector<char> hashes;
+
+        for (size_t n = 0; n < entries.size(); ++n)
+        {
+            add_transfer_params atp;
+            known_entry_params(entries[n], atp);
+            std::string name = bom_filter(entries[n].m_list.getStringTagByNameId(FT_FILENAME));
+            name.resize(std::min<size_t>(name.size(), 0xffff));
+            const std::vector<md4_hash>& hset = entries[n].m_hash_list.m_collection;
+
+            char* ptr = &records[KNOWN_STORE_HEADER_SIZE + n*KNOWN_STORE_RECORD_SIZE];
+            ptr = std::copy(atp.file_hash.begin(), atp.file_hash.end(), ptr);
+            detail::write_uint64(atp.file_size, ptr);
+            detail::write_uint64(entries[n].m_nLastChanged, ptr);
+            detail::write_uint64(atp.transferred, ptr);
+            detail::write_uint64(hashes.size() / md4_hash::size, ptr);
+            detail::write_uint32(hset.size(), ptr);
+            detail::write_uint32(names.size(), ptr);
+            detail::write_uint32(atp.requested, ptr);
+            detail::write_uint32(atp.accepted, ptr);
+            detail::write_uint16(name.size(), ptr);
+            detail::write_uint8(atp.priority, ptr);
+
+            names += name;
+
+            for (size_t i = 0; i < hset.size(); ++i)
+            {
+                hashes.insert(hashes.end(), hset[i].begin(), hset[i].end());
+            }
+        }
+
+        char* ptr = &records[0];
+        ptr = std::copy(KNOWN_STORE_MAGIC, KNOWN_STORE_MAGIC + sizeof(KNOWN_STORE_MAGIC), ptr);
+        detail::write_uint32(version, ptr);
+        detail::write_uint32(entries.size(), ptr);
+        detail::write_uint32(0, ptr);
+        detail::write_uint64(records.size(), ptr);
+        detail::write_uint64(records.size() + names.size(), ptr);
+
+        std::string tmp_filepath = filepath + ".tmp";
+
+        {
+            std::ofstream fstream(convert_to_native(tmp_filepath).c_str(), std::ios_base::binary | std::ios_base::out);
+
+            if (fstream)
+            {
+                fstream.write(&records[0], records.size());
+                fstream.write(names.data(), names.size());
+                if (!hashes.empty()) fstream.write(&hashes[0], hashes.size());
+            }
+
+            if (!fstream)
+            {
+                ec.assign(errno, get_posix_category());
+                return false;
+            }
+        }
+
+        // replace store atomically - it may be mapped by other maker
+        rename(tmp_filepath, filepath, ec);
+        return !ec;
+    }
+
+    void known_file_store::export_collection(known_file_collection& kfc) const
+    {
+        for (size_t n = 0; n < m_count; ++n)
+        {
+            const char* rec = record(n);
+            known_file_entry entry;
+            entry.m_hFile = md4_hash(reinterpret_cast<const md4_hash::md4hash_container&>(*rec));
+            rec += md4_hash::size;
+            boost::uint64_t size = detail::read_uint64(rec);
+            entry.m_nLastChanged = static_cast<boost::uint32_t>(detail::read_uint64(rec));
+            __file_size transferred;
+            transferred.nQuadPart = detail::read_uint64(rec);
+            rec += 16; // hashes and name offset
+            boost::uint32_t requested = detail::read_uint32(rec);
+            boost::uint32_t accepted = detail::read_uint32(rec);
+            rec += 2; // name length
+            boost::uint8_t priority = detail::read_uint8(rec);
+            std::string name = record_name(record(n));
+
+            record_hashset(record(n), entry.m_hash_list.m_collection);
+            entry.m_list.add_tag(make_string_tag(name, FT_FILENAME, true));
+            entry.m_list.add_tag(make_string_tag(name, FT_FILENAME, true));  // write same name for backward compatibility
+
+            if (size > 0xffffffffULL)
+                entry.m_list.add_tag(make_typed_tag(size, FT_FILESIZE, true));
+            else
+                entry.m_list.add_tag(make_typed_tag(static_cast<boost::uint32_t>(size), FT_FILESIZE, true));
+
+            entry.m_list.add_tag(make_typed_tag(transferred.u.nLowPart, FT_ATTRANSFERRED, true));
+            entry.m_list.add_tag(make_typed_tag(transferred.u.nHighPart, FT_ATTRANSFERREDHI, true));
+            entry.m_list.add_tag(make_typed_tag(requested, FT_ATREQUESTED, true));
+            entry.m_list.add_tag(make_typed_tag(accepted, FT_ATACCEPTED, true));
+            entry.m_list.add_tag(make_typed_tag(priority, FT_ULPRIORITY, true));
+            kfc.m_known_file_list.m_collection.push_back(entry);
+        }
+    }
+
+    const char* known_file_store::record(size_t n) const
+    {
+        LIBED2K_ASSERT(n < m_count);
+        return m_view.data() + KNOWN_STORE_HEADER_SIZE + n*KNOWN_STORE_RECORD_SIZE;
+    }
+
+    std::string known_file_store::record_name(const char* rec) const
+    {
+        rec += md4_hash::size + 36;
+        boost::uint32_t offset = detail::read_uint32(rec);
+        rec += 8;
+        boost::uint16_t len = detail::read_uint16(rec);
+        return std::string(m_view.data() + m_names_offset + offset, len);
+    }
+
+    void known_file_store::record_hashset(const char* rec, std::vector<md4_hash>& hashes) const
+    {
+        rec += md4_hash::size + 24;
+        boost::uint64_t first = detail::read_uint64(rec);
+        boost::uint32_t count = detail::read_uint32(rec);
+        const char* ptr = m_view.data() + m_hashes_offset + first*md4_hash::size;
+        hashes.resize(count);
+
+        for (size_t n = 0; n < count; ++n, ptr += md4_hash::size)
+        {
+            hashes[n] = md4_hash(reinterpret_cast<const md4_hash::md4hash_container&>(*ptr));
+        }
+    }
+
+    transfer_params_maker::transfer_params_maker(alert_manager& am, const std::string& known_filepath,
+        int hashing_threads, int read_flags, const std::string& known_store_filepath) :
             m_am(am),
             m_abort(false),
-            m_abort_current(false),
-            m_current_filepath(""),
-            m_known_filepath(known_filepath)
+            m_known_filepath(known_filepath),
+            m_known_store_filepath(known_store_filepath),
+            m_read_flags(read_flags),
+            m_known_loaded(false),
+            m_workers(std::max(hashing_threads, 1))
     {
     }
 
     bool transfer_params_maker::start()
     {
-        LIBED2K_ASSERT(!m_thread);
-        m_thread.reset(new boost::thread(boost::ref(*this)));
-#ifdef WIN32
-        HANDLE th = m_thread->native_handle();
-        if (!SetThreadPriority(th, THREAD_PRIORITY_IDLE))
+        LIBED2K_ASSERT(m_threads.empty());
+
+        for (size_t n = 0; n < m_workers.size(); ++n)
         {
-            ERR("Unable to set idle priority to hasher thread");
-        }
+            m_threads.push_back(boost::shared_ptr<boost::thread>(
+                new boost::thread(boost::bind(&transfer_params_maker::worker, this, n))));
+#ifdef WIN32
+            HANDLE th = m_threads.back()->native_handle();
+            if (!SetThreadPriority(th, THREAD_PRIORITY_IDLE))
+            {
+                ERR("Unable to set idle priority to hasher thread");
+            }
 #endif
+        }
+
         return true;
     }
 
@@ -717,19 +1049,26 @@ namespace libed2k
     {
         boost::mutex::scoped_lock lock(m_mutex);
         m_order.clear();
-        m_abort_current = true;
+
+        for (size_t n = 0; n < m_workers.size(); ++n)
+        {
+            m_workers[n].m_abort_current = true;
+        }
+
         m_abort = true;
-        m_condition.notify_one();
+        m_condition.notify_all();
 
         lock.unlock();
 
-        // when thread exists - wait it
-        if (m_thread.get())
+        // when threads exist - wait them
+        for (size_t n = 0; n < m_threads.size(); ++n)
         {
-            m_thread->join();
+            m_threads[n]->join();
         }
 
-        m_thread.reset();   //!< remove thread
+        m_threads.clear();   //!< remove threads
+        LIBED2K_ASSERT(m_ranges.empty());
+        m_known_loaded = false;
         m_abort = false;
     }
 
@@ -742,14 +1081,21 @@ namespace libed2k
     std::string transfer_params_maker::current_filepath()
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        return m_current_filepath;
+
+        for (size_t n = 0; n < m_workers.size(); ++n)
+        {
+            if (!m_workers[n].m_filepath.empty())
+                return m_workers[n].m_filepath;
+        }
+
+        return std::string();
     }
 
     void transfer_params_maker::make_transfer_params(const std::string& filepath)
     {
         boost::mutex::scoped_lock lock(m_mutex);
         m_order.push_front(filepath);
-        m_condition.notify_one();
+        m_condition.notify_all();
     }
 
     void transfer_params_maker::cancel_transfer_params(const std::string& filepath)
@@ -765,15 +1111,56 @@ namespace libed2k
             return;
         }
 
-        if (m_current_filepath == filepath)
+        for (size_t n = 0; n < m_workers.size(); ++n)
         {
-            m_abort_current = true;               // erase flag available only on current iteration
+            if (m_workers[n].m_filepath == filepath)
+            {
+                m_workers[n].m_abort_current = true;    // erase flag available only on current iteration
+            }
         }
 
         m_cancel_order.push(filepath);  // this alert will emit after current file processing completed
     }
 
-    void transfer_params_maker::operator()()
+    void transfer_params_maker::load_known_files()
+    {
+        m_kfs.close();
+        m_kfc = known_file_collection();
+        bool loaded = false;
+
+        if (!m_known_store_filepath.empty())
+        {
+            file_status known_fs, store_fs;
+            error_code known_ec, store_ec;
+            stat_file(m_known_filepath, &known_fs, known_ec);
+            stat_file(m_known_store_filepath, &store_fs, store_ec);
+
+            // import known.met when store wasn't created yet or known.met was changed after it
+            if (!m_known_filepath.empty() && !known_ec && (store_ec || store_fs.mtime < known_fs.mtime))
+            {
+                read_known_met();
+                loaded = true;
+
+                if (!known_file_store::write(m_known_store_filepath, m_kfc, store_ec))
+                {
+                    ERR("unable to write known files store {" << store_ec.message() << "}");
+                }
+            }
+
+            if (m_kfs.open(m_known_store_filepath, store_ec))
+            {
+                // piece hashes are read from store on demand
+                m_kfc = known_file_collection();
+                return;
+            }
+
+            DBG("known files store wasn't opened {" << store_ec.message() << "}");
+        }
+
+        if (!loaded) read_known_met();
+    }
+
+    void transfer_params_maker::read_known_met()
     {
         // when we have known filepath path - attempt to extract its content
         if (!m_known_filepath.empty())
@@ -795,12 +1182,27 @@ namespace libed2k
             }
         }
 
+        m_kfc.build_index();
+    }
+
+    void transfer_params_maker::worker(size_t index)
+    {
+        // first thread loads known files, others wait it before processing files
+        if (index == 0)
+        {
+            load_known_files();
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_known_loaded = true;
+            m_condition.notify_all();
+        }
+
+        worker_state& ws = m_workers[index];
 
         while(1)
         {
             boost::mutex::scoped_lock lock(m_mutex);
-            m_current_filepath.clear();
-            m_abort_current = false;
+            ws.m_filepath.clear();
+            ws.m_abort_current = false;
 
             if (m_abort) { break; }
 
@@ -811,23 +1213,143 @@ namespace libed2k
                 m_cancel_order.pop();
             }
 
-            if(m_order.empty())
+            // help to complete files in progress before take new one
+            if (!m_ranges.empty())
             {
-                m_condition.wait(lock);
+                piece_range range = m_ranges.front();
+                m_ranges.pop_front();
+                lock.unlock();
+                hash_range(range);
+                continue;
             }
 
-            if (!m_order.empty())
+            if (m_order.empty() || !m_known_loaded)
             {
-                m_current_filepath = m_order.back();
-                m_order.pop_back();
+                m_condition.wait(lock);
+                continue;
             }
 
+            ws.m_filepath = m_order.back();
+            m_order.pop_back();
+
             lock.unlock();
 
-            if (!m_current_filepath.empty()) process_item();
+            process_item(ws.m_filepath, ws.m_abort_current);
         }
 
-        DBG("transfer_params_maker {thread exit}");
+        DBG("transfer_params_maker {thread " << index << " exit}");
+    }
+
+    void file2atp::hash_pieces(file& f, size_type file_size, int first, int last,
+        std::vector<md4_hash>& hashes, const bool& cancel, error_code& ec, int flags,
+        std::vector<sha1_hash>* aich_blocks)
+    {
+        // full pieces are hashed together in multi_hasher lanes, the short last piece alone.
+        // Every lane reads a run of its own piece, so the file is read in long
+        // contiguous chunks instead of one block of each piece in turn
+        int full_last = std::min<int>(last, file_size / PIECE_SIZE);
+        int group_size = std::max(multi_hasher::lanes(), 1);
+        const size_type run_size = hash_run_blocks * BLOCK_SIZE;
+        std::vector<char> buffer((flags & read_mapped) ? 0 : group_size * run_size);
+        std::vector<const char*> blocks(group_size);
+        file_view view;
+        // AICH blocks of each piece follow blocks of all full pieces before it
+        const int aich_per_part = aich_hashset::blocks_in_part(file_size, 0);
+
+        for (int i = first; i < last; )
+        {
+            int group = (i < full_last) ? std::min(group_size, full_last - i) : 1;
+            size_type piece_offset = i*PIECE_SIZE;
+            size_type group_bytes = std::min<size_type>(group*PIECE_SIZE, file_size - piece_offset);
+            size_type in_piece_capacity = std::min<size_type>(libed2k::PIECE_SIZE, file_size - piece_offset);
+            size_type offset = 0;
+            multi_hasher piece_hash(group);
+            std::vector<aich_piece_hasher> aich_hash(aich_blocks ? group : 0);
+
+            // let the OS read next pieces while these are hashed
+            if (i + group < last)
+            {
+                f.hint_read(piece_offset + group_bytes,
+                    static_cast<int>(std::min<size_type>(group_size*PIECE_SIZE, file_size - piece_offset - group_bytes)));
+            }
+
+            if ((flags & read_mapped) && !view.map(f, piece_offset, group_bytes, ec))
+                return;
+
+            while(in_piece_capacity > 0)
+            {
+                size_type run = std::min(run_size, in_piece_capacity);
+
+                for (int n = 0; n < group; ++n)
+                {
+                    if (flags & read_mapped)
+                    {
+                        blocks[n] = view.data() + n*PIECE_SIZE + offset;
+                        continue;
+                    }
+
+                    blocks[n] = &buffer[n*run_size];
+                    file::iovec_t b = {&buffer[n*run_size], run};
+                    f.readv(piece_offset + n*PIECE_SIZE + offset, &b, 1, ec);
+
+                    if (ec)
+                        return;
+                }
+
+                if (cancel)
+                {
+                    ec = errors::file_params_making_was_cancelled;
+                    return;
+                }
+
+                piece_hash.update(&blocks[0], run);
+                for (size_t n = 0; n < aich_hash.size(); ++n)
+                    aich_hash[n].update(blocks[n], run);
+
+                in_piece_capacity -= run;
+                offset += run;
+            }
+
+            for (int n = 0; n < group; ++n)
+            {
+                hashes[i + n] = piece_hash.final(n);
+            }
+
+            for (size_t n = 0; n < aich_hash.size(); ++n)
+            {
+                const std::vector<sha1_hash>& b = aich_hash[n].final();
+                std::copy(b.begin(), b.end(), aich_blocks->begin() + (i + n) * aich_per_part);
+            }
+
+            view.unmap();
+            if (flags & drop_cache) f.drop_cache(piece_offset, group_bytes);
+            i += group;
+        }
+    }
+
+    void file2atp::complete(add_transfer_params& atp)
+    {
+        if (size_type(atp.piece_hashses.size()) * libed2k::PIECE_SIZE == atp.file_size)
+        {
+            atp.piece_hashses.push_back(libed2k::md4_hash::terminal);
+        }
+        // calculate full file hash
+        if (atp.piece_hashses.size() > 1)
+        {
+            atp.file_hash = hasher(reinterpret_cast<const char*>(&atp.piece_hashses[0]), atp.piece_hashses.size()*MD4_DIGEST_LENGTH).final();
+        }
+        else
+        {
+            atp.file_hash = atp.piece_hashses[0];
+        }
+
+        if (!atp.aich_hashes.empty())
+        {
+            aich_hashset hs(atp.file_size);
+            if (hs.assign(atp.aich_hashes)) atp.aich_root = hs.root();
+        }
+
+        atp.seed_mode   = true;
     }
 
     std::pair<add_transfer_params, error_code> file2atp::operator()(const std::string& filepath, const bool& cancel)
@@ -857,94 +1379,156 @@ namespace libed2k
 
             // prepare results vector
             atp.piece_hashses.resize(pieces_count);
-            size_type capacity = atp.file_size;
-            size_type offset = 0;
-            char chBlock[BLOCK_SIZE];
+            if (m_flags & hash_aich) atp.aich_hashes.resize(aich_hashset::total_blocks(atp.file_size));
+            hash_pieces(f, atp.file_size, 0, pieces_count, atp.piece_hashses, cancel, ec, m_flags,
+                (m_flags & hash_aich) ? &atp.aich_hashes : 0);
+            if (!ec) complete(atp);
+        }
+        else
+        {
+            // when is not error - file size is zero
+            if (!ec)
+                ec = errors::filesize_is_zero;
+        }
 
-            for (int i = 0; i < pieces_count; ++i)
-            {
-                hasher piece_hash;
-                size_type in_piece_capacity = std::min<size_type>(libed2k::PIECE_SIZE, capacity);
+        DBG("file2atp{" << convert_to_native(filepath) << "} res: {" << ec.message() << "}");
+        return res_pair;
+    }
 
-                while(in_piece_capacity > 0)
-                {
-                    size_type current_block_size =  std::min(libed2k::BLOCK_SIZE, in_piece_capacity);
-                    file::iovec_t b = {chBlock, current_block_size};
-                    f.readv(offset, &b, 1, ec);
+    void transfer_params_maker::hash_range(const piece_range& range)
+    {
+        hashing_job& job = *range.m_job;
+        error_code ec;
 
-                    if (!ec && cancel)
-                        ec = errors::file_params_making_was_cancelled;
+        if (!job.m_cancel)
+        {
+            // each range uses own file handle - file position isn't shared between threads
+            file f(job.m_filepath, file::read_only, ec);
+            if (!ec) file2atp::hash_pieces(f, job.m_file_size, range.m_first, range.m_last, job.m_hashes, job.m_cancel, ec,
+                m_read_flags, job.m_aich.empty() ? 0 : &job.m_aich);
+        }
+        else
+        {
+            ec = errors::file_params_making_was_cancelled;
+        }
 
-                    if (ec)
-                        break;
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (ec && !job.m_ec) job.m_ec = ec;
+        --job.m_pending;
+        m_condition.notify_all();
+    }
 
-                    piece_hash.update(chBlock, current_block_size);
-                    capacity -= current_block_size;
-                    in_piece_capacity -= current_block_size;
-                    offset += current_block_size;
-                }
+    std::pair<add_transfer_params, error_code> transfer_params_maker::hash_file(const std::string& filepath, const bool& cancel)
+    {
+        // nobody can help us
+        if (m_workers.size() < 2) return file2atp(m_read_flags)(filepath, cancel);
 
-                if (ec)
-                    break;
+        std::pair<add_transfer_params, error_code> res_pair;
+        add_transfer_params& atp = res_pair.first;
+        error_code& ec = res_pair.second;
+        atp.file_path = filepath;
+        atp.file_size = 0;
 
-                atp.piece_hashses[i] = piece_hash.final();
-            }
+        {
+            file f(filepath, file::read_only, ec);
+            if (!ec) atp.file_size = f.get_size(ec);
+        }
 
-            if (!ec)
-            {
-                if (pieces_count*libed2k::PIECE_SIZE == atp.file_size)
-                {
-                    atp.piece_hashses.push_back(libed2k::md4_hash::terminal);
-                }
-                // calculate full file hash
-                if (atp.piece_hashses.size() > 1)
-                {
-                    atp.file_hash = hasher(reinterpret_cast<const char*>(&atp.piece_hashses[0]), atp.piece_hashses.size()*MD4_DIGEST_LENGTH).final();
-                }
-                else
-                {
-                    atp.file_hash = atp.piece_hashses[0];
-                }
+        if (!ec && atp.file_size == 0) ec = errors::filesize_is_zero;
+
+        if (ec)
+        {
+            DBG("hash_file{" << convert_to_native(filepath) << "} res: {" << ec.message() << "}");
+            return res_pair;
+        }
+
+        int pieces_count = div_ceil(atp.file_size, PIECE_SIZE);
+        // short ranges keep all threads busy on last pieces, but not too short to keep reads sequential
+        // and to fill all multi_hasher lanes
+        int range_size = std::min(div_ceil(pieces_count, static_cast<int>(m_workers.size())),
+            std::max(multi_hasher::lanes(), 8));
+        DBG("hash file: {" << convert_to_native(filepath) << ", pieces: " << pieces_count << ", range: " << range_size << "}");
+
+        boost::shared_ptr<hashing_job> job(new hashing_job(filepath, atp.file_size, pieces_count, cancel));
+        if (m_read_flags & file2atp::hash_aich) job->m_aich.resize(aich_hashset::total_blocks(atp.file_size));
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        for (int first = 0; first < pieces_count; first += range_size)
+        {
+            piece_range range;
+            range.m_job = job;
+            range.m_first = first;
+            range.m_last = std::min(first + range_size, pieces_count);
+            m_ranges.push_back(range);
+            ++job->m_pending;
+        }
+
+        m_condition.notify_all();
+
+        // hash own ranges which weren't taken by other threads and wait the rest
+        while(job->m_pending > 0)
+        {
+            std::deque<piece_range>::iterator itr = m_ranges.begin();
+            while(itr != m_ranges.end() && itr->m_job != job) ++itr;
 
-                atp.seed_mode   = true;
+            if (itr == m_ranges.end())
+            {
+                m_condition.wait(lock);
+                continue;
             }
 
+            piece_range range = *itr;
+            m_ranges.erase(itr);
+            lock.unlock();
+            hash_range(range);
+            lock.lock();
         }
-        else
+
+        ec = job->m_ec;
+        lock.unlock();
+
+        if (!ec)
         {
-            // when is not error - file size is zero
-            if (!ec)
-                ec = errors::filesize_is_zero;
+            atp.piece_hashses.swap(job->m_hashes);
+            atp.aich_hashes.swap(job->m_aich);
+            file2atp::complete(atp);
         }
 
-        DBG("file2atp{" << convert_to_native(filepath) << "} res: {" << ec.message() << "}");
+        DBG("hash_file{" << convert_to_native(filepath) << "} res: {" << ec.message() << "}");
         return res_pair;
     }
 
-    void transfer_params_maker::process_item()
+    std::pair<add_transfer_params, error_code> transfer_params_maker::make_params(const std::string& filepath, const bool& cancel)
     {
         error_code ec;
         file_status fs;
-        stat_file(m_current_filepath, &fs, ec);
+        stat_file(filepath, &fs, ec);
         add_transfer_params atp;
-        atp.file_path = m_current_filepath;
+        atp.file_path = filepath;
 
         if (!ec)
         {
-            atp = m_kfc.extract_transfer_params(fs.mtime, m_current_filepath);
+            atp = m_kfs.is_open() ?
+                m_kfs.extract_transfer_params(fs.mtime, fs.file_size, filepath) :
+                m_kfc.extract_transfer_params(fs.mtime, fs.file_size, filepath);
 
             if (!atp.file_hash.defined() || (atp.file_size == 0)) // avoid some fails on zero lengths
             {
-                file2atp fatp;
-                std::pair<add_transfer_params, error_code> rp = fatp(m_current_filepath, m_abort_current);
-                atp = rp.first;
-                ec =  rp.second;
+                return hash_file(filepath, cancel);
             }
         }
 
-        if (!m_am.post_alert(transfer_params_alert(atp, ec)))
+        return std::make_pair(atp, ec);
+    }
+
+    void transfer_params_maker::process_item(const std::string& filepath, const bool& cancel)
+    {
+        std::pair<add_transfer_params, error_code> rp = make_params(filepath, cancel);
+
+        if (!m_am.post_alert(transfer_params_alert(rp.first, rp.second)))
         {
-            ERR("add transfer parameters for {" << atp.file_path << "} waren't added because order overflow!");
+            ERR("add transfer parameters for {" << rp.first.file_path << "} waren't added because order overflow!");
         }
     }
 
@@ -134,7 +134,9 @@ namespace libed2k
             if ((((e.mode & file::rw_mask) != file::read_write)
                 && ((m & file::rw_mask) == file::read_write))
                 || (e.mode & file::no_buffer) != (m & file::no_buffer)
-                || (e.mode & file::random_access) != (m & file::random_access))
+                || (e.mode & file::random_access) != (m & file::random_access)
+                || ((m & file::rw_mask) == file::read_write
+                    && (e.mode & file::dsync) != (m & file::dsync)))
             {
                 // close the file before we open it with
                 // the new read/write privilages
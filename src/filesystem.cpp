@@ -80,6 +80,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <errno.h>
 #include <dirent.h>
+#include <sys/mman.h> // for mmap
 
 #ifdef LIBED2K_LINUX
 // linux specifics
@@ -207,6 +208,12 @@ namespace libed2k
         s->atime = ret.st_atime;
         s->mtime = ret.st_mtime;
         s->ctime = ret.st_ctime;
+#ifdef LIBED2K_WINDOWS
+        s->inode = 0;
+#else
+        s->inode = ret.st_ino;
+#endif
+        s->device = ret.st_dev;
         s->mode = ret.st_mode;
     }
 
@@ -934,7 +941,8 @@ namespace libed2k
         DWORD flags
             = ((mode & random_access) ? 0 : FILE_FLAG_SEQUENTIAL_SCAN)
             | (a ? a : FILE_ATTRIBUTE_NORMAL)
-            | ((mode & no_buffer) ? FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING : 0);
+            | ((mode & no_buffer) ? FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING : 0)
+            | ((mode & dsync) ? FILE_FLAG_WRITE_THROUGH : 0);
 
         m_file_handle = CreateFile_(m_path.c_str(), m.rw_mode
             , (mode & lock_file) ? 0 : share_array[mode & rw_mask]
@@ -1172,6 +1180,63 @@ namespace libed2k
     // defined in storage.cpp
     int bufs_size(file::iovec_t const* bufs, int num_bufs);
 
+// pwritev2 appeared in glibc 2.26, RWF_DSYNC needs linux 4.7
+#if LIBED2K_USE_PREADV && defined RWF_DSYNC && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 26)
+#define LIBED2K_USE_PWRITEV2 1
+#else
+#define LIBED2K_USE_PWRITEV2 0
+#endif
+
+    namespace
+    {
+        LIBED2K_THREAD_LOCAL boost::uint32_t thread_io_calls = 0;
+
+#ifndef LIBED2K_WINDOWS
+        // vectored write at offset, or at the current position
+        // when there is no pwritev. With RWF_DSYNC the data is
+        // on disk when it returns, otherwise synced is cleared
+        int write_bufs(int fd, file::iovec_t const* bufs, int num_bufs
+            , size_type offset, bool dsync, bool& synced)
+        {
+            ++thread_io_calls;
+#if LIBED2K_USE_PWRITEV2
+            if (dsync)
+            {
+                int ret = ::pwritev2(fd, bufs, num_bufs, offset, RWF_DSYNC);
+                // older kernels don't know the flag
+                if (ret >= 0 || (errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL))
+                    return ret;
+                ++thread_io_calls;
+            }
+#endif
+            synced = false;
+#if LIBED2K_USE_PREADV
+            return ::pwritev(fd, bufs, num_bufs, offset);
+#else
+            return ::writev(fd, bufs, num_bufs);
+#endif
+        }
+
+        // flushes data of the file, not its metadata when possible
+        bool sync_data(int fd, error_code& ec)
+        {
+            ++thread_io_calls;
+#ifdef LIBED2K_LINUX
+            if (fdatasync(fd) == 0) return true;
+#else
+            if (fsync(fd) == 0) return true;
+#endif
+            ec.assign(errno, get_posix_category());
+            return false;
+        }
+#endif
+    }
+
+    boost::uint32_t file::io_calls()
+    {
+        return thread_io_calls;
+    }
+
 #if defined LIBED2K_WINDOWS || defined LIBED2K_LINUX || defined LIBED2K_DEBUG
 
     int file::m_page_size = 0;
@@ -1199,6 +1264,13 @@ namespace libed2k
 #endif
     }
 
+    void file::drop_cache(size_type file_offset, size_type len)
+    {
+#if defined POSIX_FADV_DONTNEED
+        posix_fadvise(m_fd, file_offset, len, POSIX_FADV_DONTNEED);
+#endif
+    }
+
     size_type file::readv(size_type file_offset, iovec_t const* bufs, int num_bufs, error_code& ec)
     {
         LIBED2K_ASSERT((m_open_mode & rw_mask) == read_only || (m_open_mode & rw_mask) == read_write);
@@ -1259,6 +1331,7 @@ namespace libed2k
 
             LARGE_INTEGER offs;
             offs.QuadPart = file_offset;
+            ++thread_io_calls;
             if (SetFilePointerEx(m_file_handle, offs, &offs, FILE_BEGIN) == FALSE)
             {
                 ec.assign(GetLastError(), get_system_category());
@@ -1268,6 +1341,7 @@ namespace libed2k
             for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
             {
                 DWORD intermediate = 0;
+                ++thread_io_calls;
                 if (ReadFile(m_file_handle, (char*)i->iov_base
                     , (DWORD)i->iov_len, &intermediate, 0) == FALSE)
                 {
@@ -1306,6 +1380,7 @@ namespace libed2k
 
         ret += size;
         size = num_pages * m_page_size;
+        ++thread_io_calls;
         if (ReadFileScatter(m_file_handle, segment_array, size, 0, &ol) == 0)
         {
             DWORD last_error = GetLastError();
@@ -1332,12 +1407,17 @@ namespace libed2k
 
 #else // LIBED2K_WINDOWS
 
+#if !LIBED2K_USE_PREADV || !LIBED2K_USE_READV
+        ++thread_io_calls;
         size_type ret = lseek(m_fd, file_offset, SEEK_SET);
         if (ret < 0)
         {
             ec.assign(errno, get_posix_category());
             return -1;
         }
+#else
+        size_type ret = 0;
+#endif
 #if LIBED2K_USE_READV
 
         ret = 0;
@@ -1358,7 +1438,12 @@ namespace libed2k
             if (aligned)
 #endif // LIBED2K_LINUX
             {
+                ++thread_io_calls;
+#if LIBED2K_USE_PREADV
+                tmp_ret = ::preadv(m_fd, bufs, nbufs, file_offset);
+#else
                 tmp_ret = ::readv(m_fd, bufs, nbufs);
+#endif
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1373,7 +1458,12 @@ namespace libed2k
                 memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * nbufs);
                 iovec_t& last = temp_bufs[nbufs-1];
                 last.iov_len = (last.iov_len & ~(size_alignment()-1)) + m_page_size;
+                ++thread_io_calls;
+#if LIBED2K_USE_PREADV
+                tmp_ret = ::preadv(m_fd, temp_bufs, nbufs, file_offset);
+#else
                 tmp_ret = ::readv(m_fd, temp_bufs, nbufs);
+#endif
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1383,6 +1473,7 @@ namespace libed2k
             }
 #endif // LIBED2K_LINUX
 
+            file_offset += tmp_ret;
             num_bufs -= nbufs;
             bufs += nbufs;
         }
@@ -1394,6 +1485,7 @@ namespace libed2k
         ret = 0;
         for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
         {
+            ++thread_io_calls;
             int tmp = read(m_fd, i->iov_base, i->iov_len);
             if (tmp < 0)
             {
@@ -1461,6 +1553,7 @@ namespace libed2k
 
             LARGE_INTEGER offs;
             offs.QuadPart = file_offset;
+            ++thread_io_calls;
             if (SetFilePointerEx(m_file_handle, offs, &offs, FILE_BEGIN) == FALSE)
             {
                 ec.assign(GetLastError(), get_system_category());
@@ -1470,6 +1563,7 @@ namespace libed2k
             for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
             {
                 DWORD intermediate = 0;
+                ++thread_io_calls;
                 if (WriteFile(m_file_handle, (char const*)i->iov_base
                     , (DWORD)i->iov_len, &intermediate, 0) == FALSE)
                 {
@@ -1518,6 +1612,7 @@ namespace libed2k
             size = num_pages * m_page_size;
         }
 
+        ++thread_io_calls;
         if (WriteFileGather(m_file_handle, segment_array, size, 0, &ol) == 0)
         {
             if (GetLastError() != ERROR_IO_PENDING)
@@ -1540,12 +1635,19 @@ namespace libed2k
         if (file_size > 0) set_size(file_size, ec);
         return ret;
 #else
+#if !LIBED2K_USE_PREADV || !LIBED2K_USE_WRITEV
+        ++thread_io_calls;
         size_type ret = lseek(m_fd, file_offset, SEEK_SET);
         if (ret < 0)
         {
             ec.assign(errno, get_posix_category());
             return -1;
         }
+#else
+        size_type ret = 0;
+#endif
+        bool const dsync_write = (m_open_mode & dsync) != 0;
+        bool synced = true;
 
 #if LIBED2K_USE_WRITEV
 
@@ -1567,7 +1669,7 @@ namespace libed2k
             if (aligned)
 #endif
             {
-                tmp_ret = ::writev(m_fd, bufs, nbufs);
+                tmp_ret = write_bufs(m_fd, bufs, nbufs, file_offset, dsync_write, synced);
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1582,12 +1684,13 @@ namespace libed2k
                 memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * nbufs);
                 iovec_t& last = temp_bufs[nbufs-1];
                 last.iov_len = (last.iov_len & ~(size_alignment()-1)) + size_alignment();
-                tmp_ret = ::writev(m_fd, temp_bufs, nbufs);
+                tmp_ret = write_bufs(m_fd, temp_bufs, nbufs, file_offset, dsync_write, synced);
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
                     return -1;
                 }
+                ++thread_io_calls;
                 if (ftruncate(m_fd, file_offset + size) < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1597,10 +1700,12 @@ namespace libed2k
             }
 #endif // LIBED2K_LINUX
 
+            file_offset += tmp_ret;
             num_bufs -= nbufs;
             bufs += nbufs;
         }
 
+        if (dsync_write && !synced && !sync_data(m_fd, ec)) return -1;
         return ret;
 
 #else // LIBED2K_USE_WRITEV
@@ -1608,6 +1713,7 @@ namespace libed2k
         ret = 0;
         for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
         {
+            ++thread_io_calls;
             int tmp = write(m_fd, i->iov_base, i->iov_len);
             if (tmp < 0)
             {
@@ -1617,6 +1723,7 @@ namespace libed2k
             ret += tmp;
             if (tmp < i->iov_len) break;
         }
+        if (dsync_write && !sync_data(m_fd, ec)) return -1;
         return ret;
 
 #endif // LIBED2K_USE_WRITEV
@@ -1987,14 +2094,96 @@ typedef struct _FILE_ALLOCATED_RANGE_BUFFER {
         return buffer.FileOffset.QuadPart;
 
 #elif defined SEEK_DATA
-        // this is supported on solaris
+        // this is supported on linux and solaris. ENXIO means
+        // there is no data after start up to the end of the file
         size_type ret = lseek(m_fd, start, SEEK_DATA);
-        if (ret < 0) return start;
-        return start;
+        if (ret >= 0) return ret;
+        if (errno != ENXIO) return start;
+
+        error_code ec;
+        size_type file_size = get_size(ec);
+        if (ec) return start;
+        return (std::max)(start, file_size);
 #else
         return start;
 #endif
     }
 
-}
+    file_view::file_view() : m_base(0), m_base_size(0), m_data(0), m_size(0)
+    {}
+
+    file_view::~file_view()
+    {
+        unmap();
+    }
+
+    bool file_view::map(file const& f, size_type offset, size_type len, error_code& ec)
+    {
+        LIBED2K_ASSERT(f.is_open());
+        LIBED2K_ASSERT(len > 0);
+        unmap();
+
+#ifdef LIBED2K_WINDOWS
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        // view offset must be aligned to the allocation granularity
+        size_type base = offset - offset % si.dwAllocationGranularity;
+        size_type base_size = len + (offset - base);
 
+        HANDLE mapping = CreateFileMapping(f.native_handle(), 0, PAGE_READONLY, 0, 0, 0);
+        if (mapping == NULL)
+        {
+            ec.assign(GetLastError(), get_system_category());
+            return false;
+        }
+
+        m_base = MapViewOfFile(mapping, FILE_MAP_READ, DWORD(base >> 32), DWORD(base & 0xffffffff), SIZE_T(base_size));
+        // the view keeps the mapping object alive
+        CloseHandle(mapping);
+
+        if (m_base == NULL)
+        {
+            ec.assign(GetLastError(), get_system_category());
+            m_base = 0;
+            return false;
+        }
+#else
+        size_type page = page_size();
+        size_type base = offset - offset % page;
+        size_type base_size = len + (offset - base);
+
+        m_base = mmap(0, base_size, PROT_READ, MAP_SHARED, f.native_handle(), base);
+
+        if (m_base == MAP_FAILED)
+        {
+            ec.assign(errno, get_posix_category());
+            m_base = 0;
+            return false;
+        }
+
+#ifdef MADV_SEQUENTIAL
+        // read-ahead aggressively and free pages behind
+        madvise(m_base, base_size, MADV_SEQUENTIAL);
+#endif
+#endif
+
+        m_base_size = base_size;
+        m_data = static_cast<char const*>(m_base) + (offset - base);
+        m_size = len;
+        return true;
+    }
+
+    void file_view::unmap()
+    {
+        if (m_base == 0) return;
+#ifdef LIBED2K_WINDOWS
+        UnmapViewOfFile(m_base);
+#else
+        munmap(m_base, m_base_size);
+#endif
+        m_base = 0;
+        m_base_size = 0;
+        m_data = 0;
+        m_size = 0;
+    }
+}
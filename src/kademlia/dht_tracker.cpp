@@ -466,14 +466,11 @@ namespace libed2k { namespace dht
             LIBED2K_LOG(dht_tracker) << " incoming data: " << to_hex(cincoming);
         }
 #endif
-        // TODO - need total fix for serialization
         const char* incoming = NULL;
         if (!container.empty()) incoming = (const char*)&container[0];
 
-        typedef boost::iostreams::basic_array_source<char> Device;
-        boost::iostreams::stream_buffer<Device> buffer(incoming, container.size());
-        std::istream in_array_stream(&buffer);
-        archive::ed2k_iarchive ia(in_array_stream);
+        // decode directly from socket buffer
+        archive::ed2k_iarchive ia(incoming, container.size());
 
 #ifdef LIBED2K_DHT_VERBOSE_LOGGING
         LIBED2K_LOG(dht_tracker) << kad2string(uh.m_type) << " <== " << ep.address();
@@ -0,0 +1,411 @@
+/*
+ * Multi-buffer MD4 - hashes independent streams in SIMD lanes.
+ *
+ * Every lane runs the same MD4 rounds as body() in md4.cpp over its own
+ * 64-byte blocks. Input words of 4 lanes are transposed with SSE2 into
+ * lane-major order, so a wide kernel sees one register per message word.
+ */
+
+#include "libed2k/hasher.hpp"
+#include "libed2k/log.hpp"
+#include "libed2k/mpsc_queue.hpp"
+#include <string.h>
+#include <algorithm>
+
+#if !defined LIBED2K_USE_OPENSSL && !defined LIBED2K_USE_GCRYPT \
+    && !defined LIBED2K_DISABLE_MD4_SIMD && defined __GNUC__ && defined __x86_64__
+#define LIBED2K_MD4_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace libed2k
+{
+namespace
+{
+    // state is [a, b, c, d] each of lanes words, data contains lanes pointers
+    typedef void (*md4_blocks_fun)(boost::uint32_t* state, const unsigned char* const* data, size_t blocks);
+
+    struct md4_kernel
+    {
+        int lanes;
+        md4_blocks_fun blocks;
+    };
+
+#ifdef LIBED2K_MD4_SIMD
+
+/*
+ * The basic MD4 functions on vectors.
+ */
+#define MB_F(x, y, z)   V_XOR((z), V_AND((x), V_XOR((y), (z))))
+#define MB_G(x, y, z)   V_OR(V_AND((x), (y)), V_AND((z), V_OR((x), (y))))
+#define MB_H(x, y, z)   V_XOR(V_XOR((x), (y)), (z))
+
+#define MB_STEP(f, a, b, c, d, x, s) \
+    (a) = V_ADD((a), V_ADD(f((b), (c), (d)), (x))); \
+    (a) = V_ROTL((a), (s))
+
+#define MB_W(n)     V_LOAD(w + (n) * LANES)
+#define MB_W2(n)    V_ADD(MB_W(n), k2)
+#define MB_W3(n)    V_ADD(MB_W(n), k3)
+
+/*
+ * Kernel body for LANES lanes, expects V_* operations on VEC type.
+ */
+#define MD4_MB_KERNEL \
+    boost::uint32_t w[16 * LANES]; \
+    VEC a = V_LOAD(state); \
+    VEC b = V_LOAD(state + LANES); \
+    VEC c = V_LOAD(state + 2 * LANES); \
+    VEC d = V_LOAD(state + 3 * LANES); \
+    const VEC k2 = V_SET1(0x5A827999); \
+    const VEC k3 = V_SET1(0x6ED9EBA1); \
+    for (size_t blk = 0; blk < blocks; ++blk) \
+    { \
+        for (int g = 0; g < LANES; g += 4) \
+            transpose4(data, g, blk * 64, w, LANES); \
+        VEC saved_a = a; \
+        VEC saved_b = b; \
+        VEC saved_c = c; \
+        VEC saved_d = d; \
+        MB_STEP(MB_F, a, b, c, d, MB_W( 0),  3); \
+        MB_STEP(MB_F, d, a, b, c, MB_W( 1),  7); \
+        MB_STEP(MB_F, c, d, a, b, MB_W( 2), 11); \
+        MB_STEP(MB_F, b, c, d, a, MB_W( 3), 19); \
+        MB_STEP(MB_F, a, b, c, d, MB_W( 4),  3); \
+        MB_STEP(MB_F, d, a, b, c, MB_W( 5),  7); \
+        MB_STEP(MB_F, c, d, a, b, MB_W( 6), 11); \
+        MB_STEP(MB_F, b, c, d, a, MB_W( 7), 19); \
+        MB_STEP(MB_F, a, b, c, d, MB_W( 8),  3); \
+        MB_STEP(MB_F, d, a, b, c, MB_W( 9),  7); \
+        MB_STEP(MB_F, c, d, a, b, MB_W(10), 11); \
+        MB_STEP(MB_F, b, c, d, a, MB_W(11), 19); \
+        MB_STEP(MB_F, a, b, c, d, MB_W(12),  3); \
+        MB_STEP(MB_F, d, a, b, c, MB_W(13),  7); \
+        MB_STEP(MB_F, c, d, a, b, MB_W(14), 11); \
+        MB_STEP(MB_F, b, c, d, a, MB_W(15), 19); \
+        MB_STEP(MB_G, a, b, c, d, MB_W2( 0),  3); \
+        MB_STEP(MB_G, d, a, b, c, MB_W2( 4),  5); \
+        MB_STEP(MB_G, c, d, a, b, MB_W2( 8),  9); \
+        MB_STEP(MB_G, b, c, d, a, MB_W2(12), 13); \
+        MB_STEP(MB_G, a, b, c, d, MB_W2( 1),  3); \
+        MB_STEP(MB_G, d, a, b, c, MB_W2( 5),  5); \
+        MB_STEP(MB_G, c, d, a, b, MB_W2( 9),  9); \
+        MB_STEP(MB_G, b, c, d, a, MB_W2(13), 13); \
+        MB_STEP(MB_G, a, b, c, d, MB_W2( 2),  3); \
+        MB_STEP(MB_G, d, a, b, c, MB_W2( 6),  5); \
+        MB_STEP(MB_G, c, d, a, b, MB_W2(10),  9); \
+        MB_STEP(MB_G, b, c, d, a, MB_W2(14), 13); \
+        MB_STEP(MB_G, a, b, c, d, MB_W2( 3),  3); \
+        MB_STEP(MB_G, d, a, b, c, MB_W2( 7),  5); \
+        MB_STEP(MB_G, c, d, a, b, MB_W2(11),  9); \
+        MB_STEP(MB_G, b, c, d, a, MB_W2(15), 13); \
+        MB_STEP(MB_H, a, b, c, d, MB_W3( 0),  3); \
+        MB_STEP(MB_H, d, a, b, c, MB_W3( 8),  9); \
+        MB_STEP(MB_H, c, d, a, b, MB_W3( 4), 11); \
+        MB_STEP(MB_H, b, c, d, a, MB_W3(12), 15); \
+        MB_STEP(MB_H, a, b, c, d, MB_W3( 2),  3); \
+        MB_STEP(MB_H, d, a, b, c, MB_W3(10),  9); \
+        MB_STEP(MB_H, c, d, a, b, MB_W3( 6), 11); \
+        MB_STEP(MB_H, b, c, d, a, MB_W3(14), 15); \
+        MB_STEP(MB_H, a, b, c, d, MB_W3( 1),  3); \
+        MB_STEP(MB_H, d, a, b, c, MB_W3( 9),  9); \
+        MB_STEP(MB_H, c, d, a, b, MB_W3( 5), 11); \
+        MB_STEP(MB_H, b, c, d, a, MB_W3(13), 15); \
+        MB_STEP(MB_H, a, b, c, d, MB_W3( 3),  3); \
+        MB_STEP(MB_H, d, a, b, c, MB_W3(11),  9); \
+        MB_STEP(MB_H, c, d, a, b, MB_W3( 7), 11); \
+        MB_STEP(MB_H, b, c, d, a, MB_W3(15), 15); \
+        a = V_ADD(a, saved_a); \
+        b = V_ADD(b, saved_b); \
+        c = V_ADD(c, saved_c); \
+        d = V_ADD(d, saved_d); \
+    } \
+    V_STORE(state, a); \
+    V_STORE(state + LANES, b); \
+    V_STORE(state + 2 * LANES, c); \
+    V_STORE(state + 3 * LANES, d)
+
+    /**
+      * transpose 64 bytes block at offset of lanes [g, g + 4) into w[word * lanes + lane]
+     */
+    inline void transpose4(const unsigned char* const* data, int g, size_t offset, boost::uint32_t* w, int lanes)
+    {
+        for (int q = 0; q < 4; ++q)
+        {
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(data[g] + offset + q * 16));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(data[g + 1] + offset + q * 16));
+            __m128i r2 = _mm_loadu_si128((const __m128i*)(data[g + 2] + offset + q * 16));
+            __m128i r3 = _mm_loadu_si128((const __m128i*)(data[g + 3] + offset + q * 16));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+            _mm_storeu_si128((__m128i*)(w + (q * 4 + 0) * lanes + g), _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(w + (q * 4 + 1) * lanes + g), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(w + (q * 4 + 2) * lanes + g), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i*)(w + (q * 4 + 3) * lanes + g), _mm_unpackhi_epi64(t2, t3));
+        }
+    }
+
+#define LANES           4
+#define VEC             __m128i
+#define V_LOAD(p)       _mm_loadu_si128((const __m128i*)(p))
+#define V_STORE(p, v)   _mm_storeu_si128((__m128i*)(p), (v))
+#define V_SET1(x)       _mm_set1_epi32(x)
+#define V_ADD(x, y)     _mm_add_epi32((x), (y))
+#define V_AND(x, y)     _mm_and_si128((x), (y))
+#define V_OR(x, y)      _mm_or_si128((x), (y))
+#define V_XOR(x, y)     _mm_xor_si128((x), (y))
+#define V_ROTL(x, s)    _mm_or_si128(_mm_slli_epi32((x), (s)), _mm_srli_epi32((x), 32 - (s)))
+
+    void md4_blocks_sse2(boost::uint32_t* state, const unsigned char* const* data, size_t blocks)
+    {
+        MD4_MB_KERNEL;
+    }
+
+#undef LANES
+#undef VEC
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROTL
+
+#define LANES           8
+#define VEC             __m256i
+#define V_LOAD(p)       _mm256_loadu_si256((const __m256i*)(p))
+#define V_STORE(p, v)   _mm256_storeu_si256((__m256i*)(p), (v))
+#define V_SET1(x)       _mm256_set1_epi32(x)
+#define V_ADD(x, y)     _mm256_add_epi32((x), (y))
+#define V_AND(x, y)     _mm256_and_si256((x), (y))
+#define V_OR(x, y)      _mm256_or_si256((x), (y))
+#define V_XOR(x, y)     _mm256_xor_si256((x), (y))
+#define V_ROTL(x, s)    _mm256_or_si256(_mm256_slli_epi32((x), (s)), _mm256_srli_epi32((x), 32 - (s)))
+
+    __attribute__((target("avx2")))
+    void md4_blocks_avx2(boost::uint32_t* state, const unsigned char* const* data, size_t blocks)
+    {
+        MD4_MB_KERNEL;
+    }
+
+#undef LANES
+#undef VEC
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROTL
+
+#define LANES           16
+#define VEC             __m512i
+#define V_LOAD(p)       _mm512_loadu_si512((const void*)(p))
+#define V_STORE(p, v)   _mm512_storeu_si512((void*)(p), (v))
+#define V_SET1(x)       _mm512_set1_epi32(x)
+#define V_ADD(x, y)     _mm512_add_epi32((x), (y))
+#define V_AND(x, y)     _mm512_and_si512((x), (y))
+#define V_OR(x, y)      _mm512_or_si512((x), (y))
+#define V_XOR(x, y)     _mm512_xor_si512((x), (y))
+#define V_ROTL(x, s)    _mm512_rol_epi32((x), (s))
+
+    __attribute__((target("avx512f")))
+    void md4_blocks_avx512(boost::uint32_t* state, const unsigned char* const* data, size_t blocks)
+    {
+        MD4_MB_KERNEL;
+    }
+
+#undef LANES
+#undef VEC
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROTL
+
+#undef MD4_MB_KERNEL
+#undef MB_W
+#undef MB_W2
+#undef MB_W3
+#undef MB_STEP
+#undef MB_F
+#undef MB_G
+#undef MB_H
+
+    // from the widest to the narrowest
+    const md4_kernel md4_kernels[] =
+    {
+        { 16, md4_blocks_avx512 },
+        { 8, md4_blocks_avx2 },
+        { 4, md4_blocks_sse2 }
+    };
+
+    bool kernel_supported(int lanes)
+    {
+        switch(lanes)
+        {
+            case 16: return __builtin_cpu_supports("avx512f");
+            case 8: return __builtin_cpu_supports("avx2");
+            case 4: return true; // x86_64 always has SSE2
+            default: break;
+        }
+
+        return false;
+    }
+
+    int best_lanes()
+    {
+        __builtin_cpu_init();
+
+        for (size_t n = 0; n < sizeof(md4_kernels)/sizeof(md4_kernels[0]); ++n)
+        {
+            if (kernel_supported(md4_kernels[n].lanes))
+                return md4_kernels[n].lanes;
+        }
+
+        return 1;
+    }
+#else
+    const md4_kernel md4_kernels[] = { { 1, 0 } };
+    bool kernel_supported(int lanes) { return false; }
+    int best_lanes() { return 1; }
+#endif
+
+    // changed by set_lanes() while hashing threads read it
+    volatile long& active_lanes()
+    {
+        static volatile long lanes = best_lanes();
+        return lanes;
+    }
+
+    /**
+      * the widest kernel which isn't wider than limit and doesn't exceed active lanes
+     */
+    const md4_kernel* find_kernel(int limit)
+    {
+        for (size_t n = 0; n < sizeof(md4_kernels)/sizeof(md4_kernels[0]); ++n)
+        {
+            if (md4_kernels[n].blocks && md4_kernels[n].lanes <= limit && md4_kernels[n].lanes <= atomics::load(&active_lanes())
+                && kernel_supported(md4_kernels[n].lanes))
+                return &md4_kernels[n];
+        }
+
+        return 0;
+    }
+}
+
+    multi_hasher::multi_hasher(int streams) : m_contexts(streams)
+    {
+        LIBED2K_ASSERT(streams > 0);
+
+        for (size_t n = 0; n < m_contexts.size(); ++n)
+        {
+            MD4_Init(&m_contexts[n]);
+        }
+    }
+
+    void multi_hasher::update(const char* const* data, int len)
+    {
+        LIBED2K_ASSERT(len >= 0);
+        int count = streams();
+        int n = 0;
+#ifdef LIBED2K_MD4_SIMD
+        size_t blocks = len / 64;
+        bool aligned = true;
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (m_contexts[i].lo & 0x3f) aligned = false;
+        }
+
+        // kernels process whole blocks only, so stream buffers must be empty
+        while (aligned && blocks > 0 && n < count)
+        {
+            const md4_kernel* k = find_kernel(count - n);
+            if (!k) break;
+
+            boost::uint32_t state[4 * max_lanes];
+            const unsigned char* ptrs[max_lanes];
+
+            for (int l = 0; l < k->lanes; ++l)
+            {
+                MD4_CTX& ctx = m_contexts[n + l];
+                state[l] = ctx.a;
+                state[k->lanes + l] = ctx.b;
+                state[2 * k->lanes + l] = ctx.c;
+                state[3 * k->lanes + l] = ctx.d;
+                ptrs[l] = reinterpret_cast<const unsigned char*>(data[n + l]);
+            }
+
+            k->blocks(state, ptrs, blocks);
+
+            boost::uint32_t size = static_cast<boost::uint32_t>(blocks * 64);
+
+            for (int l = 0; l < k->lanes; ++l)
+            {
+                MD4_CTX& ctx = m_contexts[n + l];
+                ctx.a = state[l];
+                ctx.b = state[k->lanes + l];
+                ctx.c = state[2 * k->lanes + l];
+                ctx.d = state[3 * k->lanes + l];
+
+                // the same counters update as MD4_Update does
+                boost::uint32_t saved_lo = ctx.lo;
+                if ((ctx.lo = (saved_lo + size) & 0x1fffffff) < saved_lo)
+                    ctx.hi++;
+                ctx.hi += size >> 29;
+
+                if (len > static_cast<int>(size))
+                    MD4_Update(&ctx, reinterpret_cast<const boost::uint8_t*>(data[n + l]) + size, len - size);
+            }
+
+            n += k->lanes;
+        }
+#endif
+
+        for (; n < count; ++n)
+        {
+            MD4_Update(&m_contexts[n], reinterpret_cast<const boost::uint8_t*>(data[n]), len);
+        }
+    }
+
+    md4_hash multi_hasher::final(int stream)
+    {
+        LIBED2K_ASSERT(stream >= 0 && stream < streams());
+        md4_hash digest;
+        MD4_Final(digest.getContainer(), &m_contexts[stream]);
+        return digest;
+    }
+
+    /*static*/
+    int multi_hasher::lanes()
+    {
+        return static_cast<int>(atomics::load(&active_lanes()));
+    }
+
+    /*static*/
+    int multi_hasher::set_lanes(int lanes)
+    {
+        int res = 1;
+
+        for (size_t n = 0; n < sizeof(md4_kernels)/sizeof(md4_kernels[0]); ++n)
+        {
+            if (md4_kernels[n].lanes <= lanes && kernel_supported(md4_kernels[n].lanes))
+            {
+                res = md4_kernels[n].lanes;
+                break;
+            }
+        }
+
+        atomics::exchange(&active_lanes(), res);
+        DBG("multi_hasher {lanes: " << res << "}");
+        return res;
+    }
+}
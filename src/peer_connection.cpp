@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -92,7 +94,7 @@ size_t block_size(const piece_block& b, size_type s)
 }
 
 pending_block::pending_block(const piece_block& b, size_type fsize):
-    skipped(0), not_wanted(false), timed_out(false), busy(false), block(b),
+    skipped(0), not_wanted(false), timed_out(false), busy(false), time_critical(false), block(b),
     data_size(block_size(b, fsize)), data_left(block_range(b.piece_index, b.block_index, fsize)),
     buffer(NULL), create_time(time_now())
 {
@@ -139,11 +141,15 @@ void peer_connection::reset()
     m_last_receive = time_now();
     m_last_sent = time_now();
     m_timeout = seconds(m_ses.settings().peer_timeout);
+    m_last_minute_payload = 0;
+    m_minute_base = 0;
+    m_minute_ticks = 0;
     m_z_recv_buffer = NULL;
 
     m_connection_ticket = -1;
     m_fast_reconnect = false;
     m_failed = false;
+    m_upload_requested = false;
     m_quota[upload_channel] = 0;
     m_quota[download_channel] = 0;
     m_priority = 1;
@@ -167,6 +173,10 @@ void peer_connection::reset()
     add_handler(/*OP_FILESTATUS*/get_proto_pair<client_file_status>(), boost::bind(&peer_connection::on_file_status, this, _1));
     add_handler(/*OP_HASHSETREQUEST*/get_proto_pair<client_hashset_request>(), boost::bind(&peer_connection::on_hashset_request, this, _1));
     add_handler(/*OP_HASHSETANSWER*/get_proto_pair<client_hashset_answer>(), boost::bind(&peer_connection::on_hashset_answer, this, _1));
+    add_handler(/*OP_AICHFILEHASHREQ*/get_proto_pair<client_aich_hash_request>(), boost::bind(&peer_connection::on_aich_hash_request, this, _1));
+    add_handler(/*OP_AICHFILEHASHANS*/get_proto_pair<client_aich_hash_answer>(), boost::bind(&peer_connection::on_aich_hash_answer, this, _1));
+    add_handler(/*OP_AICHREQUEST*/get_proto_pair<client_aich_request>(), boost::bind(&peer_connection::on_aich_request, this, _1));
+    add_handler(/*OP_AICHANSWER*/get_proto_pair<client_aich_answer>(), boost::bind(&peer_connection::on_aich_answer, this, _1));
     add_handler(/*OP_STARTUPLOADREQ*/get_proto_pair<client_start_upload>(), boost::bind(&peer_connection::on_start_upload, this, _1));
     add_handler(/*OP_QUEUERANKING*/get_proto_pair<client_queue_ranking>(), boost::bind(&peer_connection::on_queue_ranking, this, _1));
     add_handler(std::make_pair(OP_ACCEPTUPLOADREQ, OP_EDONKEYPROT), boost::bind(&peer_connection::on_accept_upload, this, _1));
@@ -411,6 +421,65 @@ void peer_connection::second_tick(int tick_interval_ms)
         fill_send_buffer();
 
     m_statistics.second_tick(tick_interval_ms);
+
+    if (++m_minute_ticks >= 60)
+    {
+        size_type total = m_statistics.total_payload_upload() + m_statistics.total_payload_download();
+        m_last_minute_payload = total - m_minute_base;
+        m_minute_base = total;
+        m_minute_ticks = 0;
+    }
+}
+
+size_type peer_connection::minute_payload() const
+{
+    size_type total = m_statistics.total_payload_upload() + m_statistics.total_payload_download();
+    return (std::max)(m_last_minute_payload, total - m_minute_base);
+}
+
+bool peer_connection::is_busy() const
+{
+    return !m_requests.empty() || !m_download_queue.empty() || !m_request_queue.empty() ||
+        (m_upload_requested && m_ses.m_upload_queue.has_slot(upload_client()));
+}
+
+disconnect_rank peer_connection::get_disconnect_rank() const
+{
+    disconnect_rank r;
+    r.minute_payload = minute_payload();
+    r.busy = is_busy();
+
+    // peer with pieces helps when we download, seed doesn't when we seed
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    r.useful = t && (t->is_finished() ? !is_seed() : m_remote_pieces.count() > 0);
+    r.last_receive = m_last_receive;
+    return r;
+}
+
+bool libed2k::disconnect_before(const disconnect_rank& l, const disconnect_rank& r)
+{
+    if (l.minute_payload != r.minute_payload) return l.minute_payload < r.minute_payload;
+    if (l.busy != r.busy) return r.busy;
+    if (l.useful != r.useful) return r.useful;
+    return l.last_receive < r.last_receive;
+}
+
+static bool ranked_before(const ranked_connection& l, const ranked_connection& r)
+{
+    return disconnect_before(l.first, r.first);
+}
+
+static bool ranked_busy(const ranked_connection& c)
+{
+    return !c.first.idle();
+}
+
+int libed2k::select_disconnects(std::vector<ranked_connection>& peers, int num, bool idle_only)
+{
+    if (idle_only) peers.erase(std::remove_if(peers.begin(), peers.end(), ranked_busy), peers.end());
+    num = (std::min)(num, int(peers.size()));
+    std::partial_sort(peers.begin(), peers.begin() + num, peers.end(), ranked_before);
+    return num;
 }
 
 bool peer_connection::attach_to_transfer(const md4_hash& hash)
@@ -691,11 +760,13 @@ bool peer_connection::add_request(const piece_block& block, int flags)
     else if (speed == medium) state = piece_picker::medium;
     else state = piece_picker::slow;
 
-    if ((flags & req_busy) && num_requesting_busy_blocks() >= m_max_busy_blocks)
+    if ((flags & req_busy) && !(flags & req_time_critical)
+        && num_requesting_busy_blocks() >= m_max_busy_blocks)
     {
         // this block is busy (i.e. it has been requested
         // from another peer already). Only allow m_max_busy_blocks busy
-        // requests in the pipeline at the time
+        // requests in the pipeline at the time. Time critical
+        // duplicates are limited by the transfer instead
 
         return false;
     }
@@ -704,7 +775,22 @@ bool peer_connection::add_request(const piece_block& block, int flags)
         return false;
 
     pending_block pb(block, t->size());
-    m_request_queue.push_back(pb);
+    pb.busy = (flags & req_busy) != 0;
+    pb.time_critical = (flags & req_time_critical) != 0;
+
+    if (pb.time_critical)
+    {
+        // time critical blocks go behind the other
+        // time critical ones, ahead of regular requests
+        std::vector<pending_block>::iterator i = m_request_queue.begin();
+        while (i != m_request_queue.end() && i->time_critical) ++i;
+        m_request_queue.insert(i, pb);
+    }
+    else
+    {
+        m_request_queue.push_back(pb);
+    }
+
     return true;
 }
 
@@ -722,13 +808,20 @@ void peer_connection::send_block_requests()
         t->state() == transfer_status::allocating)
         return;
 
-    // send in 3 requests at a time
-    if (m_download_queue.size() + 2 >= m_desired_queue_size || t->upload_mode()) return;
+    if (t->upload_mode()) return;
+
+    // send in 3 requests at a time, time critical requests don't wait
+    // for the queue to drain and may take a few slots over its size
+    bool time_critical = !m_request_queue.empty() && m_request_queue.front().time_critical;
+    if (m_download_queue.size() + 2 >= m_desired_queue_size && !time_critical) return;
 
     client_request_parts_64 rp;
     rp.m_hFile = t->hash();
 
-    while (!m_request_queue.empty() && m_download_queue.size() < m_desired_queue_size)
+    while (!m_request_queue.empty() &&
+           (m_download_queue.size() < m_desired_queue_size ||
+            (m_request_queue.front().time_critical
+             && m_download_queue.size() < m_desired_queue_size + time_critical_queue_slots)))
     {
         pending_block block = m_request_queue.front();
         m_request_queue.erase(m_request_queue.begin());
@@ -866,6 +959,25 @@ size_t peer_connection::num_requesting_busy_blocks() const
     return res;
 }
 
+time_duration peer_connection::download_queue_time(int extra_bytes) const
+{
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    size_type bytes = outstanding_bytes() + extra_bytes;
+
+    if (t)
+    {
+        for (std::vector<pending_block>::const_iterator i = m_request_queue.begin(),
+                 end(m_request_queue.end()); i != end; ++i)
+        {
+            bytes += block_size(i->block, t->size());
+        }
+    }
+
+    size_type rate = std::max(int(m_statistics.download_payload_rate()), 1);
+    return milliseconds(int(std::min(bytes * 1000 / rate,
+                                     size_type(std::numeric_limits<int>::max()))));
+}
+
 int peer_connection::outstanding_bytes() const
 {
     int res = 0;
@@ -991,6 +1103,7 @@ void peer_connection::on_sent(const error_code& error, std::size_t bytes_transfe
 
     LIBED2K_ASSERT(amount_payload <= (int)bytes_transferred);
     m_statistics.sent_bytes(amount_payload, bytes_transferred - amount_payload);
+    if (amount_payload > 0) m_ses.m_upload_queue.uploaded(upload_client(), amount_payload);
 }
 
 void peer_connection::disconnect(error_code const& ec, int error)
@@ -1006,6 +1119,13 @@ void peer_connection::disconnect(error_code const& ec, int error)
         m_connection_ticket = -1;
     }
 
+    if (m_upload_requested)
+    {
+        // client may have asked for upload on another connection too
+        m_upload_requested = false;
+        if (!m_ses.find_upload_client(upload_client())) m_ses.m_upload_queue.disconnected(upload_client());
+    }
+
     boost::shared_ptr<transfer> t = m_transfer.lock();
 
     if (t)
@@ -1174,6 +1294,34 @@ const std::vector<pending_block>& peer_connection::request_queue() const
     return m_request_queue;
 }
 
+void peer_connection::grant_upload_slot()
+{
+    write_accept_upload();
+    fill_send_buffer();
+}
+
+void peer_connection::revoke_upload_slot()
+{
+    // requests in flight are dropped, client asks for upload again later
+    m_requests.clear();
+    write_out_parts();
+}
+
+void peer_connection::send_queue_rank(int rank)
+{
+    write_queue_ranking((std::min)(rank, 0xffff));
+}
+
+upload_queue::client_id peer_connection::upload_client() const
+{
+    return std::make_pair(m_hClient, m_remote.address());
+}
+
+bool peer_connection::is_upload_client(const upload_queue::client_id& client) const
+{
+    return m_upload_requested && upload_client() == client;
+}
+
 bool peer_connection::has_network_point(const net_identifier& np) const
 {
     return address2int(m_remote.address()) == np.m_nIP && user_port() == np.m_nPort;
@@ -1256,10 +1404,10 @@ void peer_connection::fill_send_buffer()
 
     if (m_handshake_complete) { send_deferred(); }
 
-    if (!m_requests.empty() && m_send_buffer.size() < m_ses.settings().send_buffer_watermark)
+    if (!m_requests.empty() && m_send_buffer.size() < m_ses.settings().send_buffer_watermark &&
+        m_upload_requested && m_ses.m_upload_queue.has_slot(upload_client()))
     {
         const peer_request& req = m_requests.front();
-        write_part(req);
         send_data(req);
         m_requests.erase(m_requests.begin());
     }
@@ -1310,6 +1458,23 @@ void peer_connection::on_disk_read_complete(
         t->handle_disk_error(j, this);
         return;
     }
+    if (!t) return;
+
+    if (m_misc_options.m_nDataCompVer > 0)
+    {
+        // buffer holder frees disk buffer when block was compressed
+        block_compressor::block z = m_ses.m_block_compressor.compress_block(
+            t->hash(), mk_range(r).first, buffer.get(), r.length);
+
+        if (z)
+        {
+            write_compressed_part(r, *z);
+            send_data(left);
+            return;
+        }
+    }
+
+    write_part(r);
     append_send_buffer(buffer.get(), r.length,
                        boost::bind(&aux::session_impl::free_disk_buffer, boost::ref(m_ses), _1));
     buffer.release();
@@ -1396,6 +1561,7 @@ void peer_connection::on_receive_data(const error_code& error, std::size_t bytes
     LIBED2K_ASSERT(int(bytes_transferred) <= m_quota[download_channel]);
     m_quota[download_channel] -= bytes_transferred;
     m_statistics.received_bytes(bytes_transferred, 0);
+    m_ses.m_upload_queue.downloaded(upload_client(), bytes_transferred);
 
     m_recv_pos += bytes_transferred;
     LIBED2K_ASSERT(int(bytes_transferred) <= m_recv_req.length);
@@ -1540,8 +1706,9 @@ void peer_connection::on_disk_write_complete(
 void peer_connection::append_misc_info(tag_list<boost::uint32_t>& t)
 {
     misc_options mo(0);
+    mo.m_nAICHVersion = 1;
     mo.m_nUnicodeSupport = 1;
-    mo.m_nDataCompVer = 0;  // support data compression
+    mo.m_nDataCompVer = (m_ses.settings().upload_compression_level > 0) ? 1 : 0;  // support data compression
     mo.m_nNoViewSharedFiles = !m_ses.settings().m_show_shared_files;
     mo.m_nSourceExchange1Ver = SOURCE_EXCHG_LEVEL;
 
@@ -1758,6 +1925,51 @@ void peer_connection::write_hashset_answer(
     write_struct(ha);
 }
 
+void peer_connection::write_aich_hash_request(const md4_hash& file_hash)
+{
+    DBG("request AICH root for " << file_hash << " ==> " << m_remote);
+    client_aich_hash_request hr;
+    hr.m_hFile = file_hash;
+    write_struct(hr);
+}
+
+void peer_connection::write_aich_hash_answer(const md4_hash& file_hash, const sha1_hash& root)
+{
+    DBG("AICH root {file: " << file_hash << ", root: " << root << "} ==> " << m_remote);
+    client_aich_hash_answer ha;
+    ha.m_hFile = file_hash;
+    ha.m_hRoot = root;
+    write_struct(ha);
+}
+
+void peer_connection::write_aich_request(const md4_hash& file_hash, int part, const sha1_hash& root)
+{
+    DBG("request AICH recovery {file: " << file_hash << ", part: " << part << "} ==> " << m_remote);
+    client_aich_request ar;
+    ar.m_hFile = file_hash;
+    ar.m_nPart = static_cast<boost::uint16_t>(part);
+    ar.m_hRoot = root;
+    write_struct(ar);
+}
+
+void peer_connection::write_aich_answer(
+    const md4_hash& file_hash, int part, const sha1_hash& root, const aich_recovery& rd)
+{
+    DBG("AICH recovery {file: " << file_hash << ", part: " << part <<
+        ", hashes: " << rd.size() << "} ==> " << m_remote);
+    client_aich_answer aa;
+    aa.m_hFile = file_hash;
+    aa.m_bHasData = !rd.empty();
+    aa.m_nPart = static_cast<boost::uint16_t>(part);
+    aa.m_hRoot = root;
+    aa.m_hashes = rd;
+
+    if (boost::shared_ptr<transfer> t = m_transfer.lock())
+        aa.m_bLarge = t->size() > OLD_MAX_FILE_SIZE;
+
+    write_struct(aa);
+}
+
 void peer_connection::write_start_upload(const md4_hash& file_hash)
 {
     DBG("start upload " << file_hash << " ==> " << m_remote);
@@ -1781,6 +1993,13 @@ void peer_connection::write_accept_upload()
     write_struct(au);
 }
 
+void peer_connection::write_out_parts()
+{
+    DBG("out of parts ==> " << m_remote);
+    client_out_parts op;
+    write_struct(op);
+}
+
 void peer_connection::write_cancel_transfer()
 {
     DBG("cancel ==> " << m_remote);
@@ -1814,6 +2033,36 @@ void peer_connection::write_part(const peer_request& r)
         << " ==> " << m_remote);
 }
 
+void peer_connection::write_compressed_part(const peer_request& r, const std::string& data)
+{
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    if (!t) return;
+
+    client_compressed_part_64 cp;
+    cp.m_hFile = t->hash();
+    cp.m_begin_offset = mk_range(r).first;
+    cp.m_compressed_size = data.size();
+
+    // compressed block is split into several packets with the same header
+    libed2k_header header = serialize_message(cp, m_write_body);
+    size_t body_size = header.m_size;
+
+    for (size_t pos = 0; pos < data.size(); pos += COMPRESSED_PART_SIZE)
+    {
+        int size = int(std::min(data.size() - pos, COMPRESSED_PART_SIZE));
+        header.m_size = body_size + size;
+        copy_send_buffer(reinterpret_cast<const char*>(&header), header_size);
+        copy_send_buffer(m_write_body.c_str(), m_write_body.size());
+        copy_send_buffer(data.c_str() + pos, size);
+        m_payloads.push_back(range(m_send_buffer.size() - size, size));
+    }
+
+    do_write();
+
+    DBG("compressed part " << cp.m_hFile << " [" << cp.m_begin_offset << ", " << r.length
+        << " -> " << cp.m_compressed_size << "] ==> " << m_remote);
+}
+
 void peer_connection::on_hello(const error_code& error)
 {
     if (!error)
@@ -2005,6 +2254,10 @@ void peer_connection::on_file_status(const error_code& error)
         {
             m_remote_pieces = fs.m_status;
             t->picker().inc_refcount(fs.m_status);
+
+            if (supports_aich() && t->aich_root().is_all_zeros())
+                write_aich_hash_request(fs.m_hFile);
+
             if (t->size() < PIECE_SIZE)
                 write_start_upload(fs.m_hFile);
             else if (fs.m_status.count() > 0)
@@ -2077,6 +2330,83 @@ void peer_connection::on_hashset_answer(const error_code& error)
     }
 }
 
+void peer_connection::on_aich_hash_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_hash_request, hr);
+        DBG("AICH root request " << hr.m_hFile << " <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t) return;
+
+        // unknown root isn't answered, like eMule does
+        if (t->hash() == hr.m_hFile && !t->aich_root().is_all_zeros())
+            write_aich_hash_answer(t->hash(), t->aich_root());
+    }
+    else
+    {
+        ERR("AICH root request error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_hash_answer(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_hash_answer, ha);
+        DBG("AICH root answer {file: " << ha.m_hFile << ", root: " << ha.m_hRoot << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (t && t->hash() == ha.m_hFile) t->aich_root_received(ha.m_hRoot, this);
+    }
+    else
+    {
+        ERR("AICH root answer error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_request, ar);
+        DBG("AICH recovery request {file: " << ar.m_hFile << ", part: " << ar.m_nPart << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != ar.m_hFile) return;
+
+        aich_recovery rd;
+        if (t->aich().complete() && t->aich_root() == ar.m_hRoot)
+            t->aich().recovery_data(ar.m_nPart, rd);
+
+        write_aich_answer(ar.m_hFile, ar.m_nPart, ar.m_hRoot, rd);
+    }
+    else
+    {
+        ERR("AICH recovery request error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_answer(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_answer, aa);
+        DBG("AICH recovery answer {file: " << aa.m_hFile << ", part: " << aa.m_nPart <<
+            ", hashes: " << aa.m_hashes.size() << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != aa.m_hFile) return;
+
+        t->aich_recovery_received(aa.m_bHasData ? aa.m_nPart : -1, aa.m_hRoot, aa.m_hashes, this);
+    }
+    else
+    {
+        ERR("AICH recovery answer error " << error.message() << " <== " << m_remote);
+    }
+}
+
 void peer_connection::on_start_upload(const error_code& error)
 {
     if (!error)
@@ -2089,7 +2419,22 @@ void peer_connection::on_start_upload(const error_code& error)
 
         // do not check a hash, due to mldonkey's weirdness
         // mldonkey sends zero hash here
-        write_accept_upload();
+        int rank = 0;
+
+        switch (m_ses.m_upload_queue.request(upload_client(), t->hash(), time_now(), rank))
+        {
+        case upload_queue::granted:
+            m_upload_requested = true;
+            write_accept_upload();
+            break;
+        case upload_queue::queued:
+            m_upload_requested = true;
+            write_queue_ranking(rank);
+            break;
+        case upload_queue::queue_full:
+            write_queue_ranking((std::min)(m_ses.settings().upload_queue_size + 1, 0xffff));
+            break;
+        }
     }
     else
     {
@@ -2161,7 +2506,8 @@ void peer_connection::on_cancel_transfer(const error_code& error)
     if (!error)
     {
         DBG("cancel transfer <== " << m_remote);
-        // TODO: handle it.
+        if (m_upload_requested) m_ses.m_upload_queue.release(upload_client());
+        m_upload_requested = false;
         disconnect(errors::transfer_aborted);
     }
     else
@@ -2176,6 +2522,9 @@ void peer_connection::on_end_download(const error_code& error)
     {
         DECODE_PACKET(client_end_download, ed);
         DBG("end download " << ed.m_hFile << " <== " << m_remote);
+        if (m_upload_requested) m_ses.m_upload_queue.release(upload_client());
+        m_upload_requested = false;
+        m_requests.clear();
     }
     else
     {
@@ -2537,6 +2886,13 @@ void peer_connection::on_request_parts(const error_code& error)
             << "[" << rp.m_begin_offset[1] << ", " << rp.m_end_offset[1] << "]"
             << "[" << rp.m_begin_offset[2] << ", " << rp.m_end_offset[2] << "]"
             << " <== " << m_remote);
+
+        if (!m_upload_requested || !m_ses.m_upload_queue.has_slot(upload_client()))
+        {
+            DBG("requested parts without upload slot: {remote: " << m_remote << "}");
+            return;
+        }
+
         for (size_t i = 0; i < 3; ++i)
         {
             std::vector<peer_request> reqs = mk_peer_requests(rp.m_begin_offset[i], rp.m_end_offset[i], t->size());
@@ -929,6 +929,11 @@ namespace libed2k
 		if (prev_priority >= 0) update(prev_priority, p.index);
 	}
 
+	// bitfields with fewer pieces than this share of all pieces are
+	// moved between the priority buckets one by one, more of them
+	// make a rebuild of the buckets on the next pick cheaper
+	enum { incremental_refcount_factor = 8 };
+
 	void piece_picker::inc_refcount(bitfield const& bitmask)
 	{
 #ifdef LIBED2K_EXPENSIVE_INVARIANT_CHECKS
@@ -936,19 +941,35 @@ namespace libed2k
 #endif
 		LIBED2K_ASSERT(bitmask.size() == m_piece_map.size());
 
-		int index = 0;
-		bool updated = false;
-		for (bitfield::const_iterator i = bitmask.begin()
-			, end(bitmask.end()); i != end; ++i, ++index)
+		int num_pieces = bitmask.count();
+		if (num_pieces == 0) return;
+
+		// a complete source counts as a seed, the order of
+		// the pieces doesn't change
+		if (num_pieces == int(m_piece_map.size()))
+		{
+			inc_refcount_all();
+			return;
+		}
+
+		bool incremental = !m_dirty
+			&& num_pieces <= int(m_piece_map.size()) / incremental_refcount_factor;
+
+		// whole bytes without pieces are skipped
+		unsigned char const* bytes = (unsigned char const*)bitmask.bytes();
+		int num_bytes = (int(bitmask.size()) + 7) / 8;
+		for (int byte = 0; byte < num_bytes; ++byte)
 		{
-			if (*i)
+			if (bytes[byte] == 0) continue;
+			for (int bit = 0, index = byte * 8; bit < 8; ++bit, ++index)
 			{
-				++m_piece_map[index].peer_count;
-				updated = true;
+				if ((bytes[byte] & (0x80 >> bit)) == 0) continue;
+				if (incremental) inc_refcount(index);
+				else ++m_piece_map[index].peer_count;
 			}
 		}
 
-		if (updated) m_dirty = true;
+		if (!incremental) m_dirty = true;
 	}
 
 	void piece_picker::dec_refcount(bitfield const& bitmask)
@@ -958,19 +979,37 @@ namespace libed2k
 #endif
 		LIBED2K_ASSERT(bitmask.size() == m_piece_map.size());
 
-		int index = 0;
-		bool updated = false;
-		for (bitfield::const_iterator i = bitmask.begin()
-			, end(bitmask.end()); i != end; ++i, ++index)
+		int num_pieces = bitmask.count();
+		if (num_pieces == 0) return;
+
+		if (num_pieces == int(m_piece_map.size()))
+		{
+			dec_refcount_all();
+			return;
+		}
+
+		bool incremental = !m_dirty
+			&& num_pieces <= int(m_piece_map.size()) / incremental_refcount_factor;
+
+		unsigned char const* bytes = (unsigned char const*)bitmask.bytes();
+		int num_bytes = (int(bitmask.size()) + 7) / 8;
+		for (int byte = 0; byte < num_bytes; ++byte)
 		{
-			if (*i)
+			if (bytes[byte] == 0) continue;
+			for (int bit = 0, index = byte * 8; bit < 8; ++bit, ++index)
 			{
+				if ((bytes[byte] & (0x80 >> bit)) == 0) continue;
+				if (incremental)
+				{
+					dec_refcount(index);
+					continue;
+				}
+				LIBED2K_ASSERT(m_piece_map[index].peer_count > 0);
 				--m_piece_map[index].peer_count;
-				updated = true;
 			}
 		}
 
-		if (updated) m_dirty = true;
+		if (!incremental) m_dirty = true;
 	}
 
 	void piece_picker::update_pieces() const
@@ -1437,6 +1476,11 @@ namespace libed2k
 			if (num_blocks <= 0) return;
 		}
 
+		// suggested pieces are picked first, the passes
+		// below skip them looking them up in sorted order
+		std::vector<int> ignore(suggested_pieces);
+		std::sort(ignore.begin(), ignore.end());
+
 		if (!suggested_pieces.empty())
 		{
 			for (std::vector<int>::const_iterator i = suggested_pieces.begin();
@@ -1462,7 +1506,7 @@ namespace libed2k
 					num_blocks = add_blocks(i, pieces
 						, interesting_blocks, backup_blocks
 						, backup_blocks2, num_blocks
-						, prefer_whole_pieces, peer, suggested_pieces
+						, prefer_whole_pieces, peer, ignore
 						, speed, options);
 					if (num_blocks <= 0) return;
 				}
@@ -1475,7 +1519,7 @@ namespace libed2k
 					num_blocks = add_blocks(i, pieces
 						, interesting_blocks, backup_blocks
 						, backup_blocks2, num_blocks
-						, prefer_whole_pieces, peer, suggested_pieces
+						, prefer_whole_pieces, peer, ignore
 						, speed, options);
 					if (num_blocks <= 0) return;
 				}
@@ -1511,7 +1555,7 @@ namespace libed2k
 						num_blocks = add_blocks(m_pieces[p], pieces
 							, interesting_blocks, backup_blocks
 							, backup_blocks2, num_blocks
-							, prefer_whole_pieces, peer, suggested_pieces
+							, prefer_whole_pieces, peer, ignore
 							, speed, options);
 						if (num_blocks <= 0) return;
 					}
@@ -1527,7 +1571,7 @@ namespace libed2k
 					num_blocks = add_blocks(*i, pieces
 						, interesting_blocks, backup_blocks
 						, backup_blocks2, num_blocks
-						, prefer_whole_pieces, peer, suggested_pieces
+						, prefer_whole_pieces, peer, ignore
 						, speed, options);
 					if (num_blocks <= 0) return;
 				}
@@ -1547,9 +1591,7 @@ namespace libed2k
 				// skip pieces we can't pick, and suggested pieces
 				// since we've already picked those
 				while (!can_pick(piece, pieces)
-					|| std::find(suggested_pieces.begin()
-					, suggested_pieces.end(), piece)
-					!= suggested_pieces.end())
+					|| std::binary_search(ignore.begin(), ignore.end(), piece))
 				{
 					++piece;
 					if (piece == int(m_piece_map.size())) piece = 0;
@@ -1804,7 +1846,8 @@ namespace libed2k
 //		std::cout << "  num_blocks " << num_blocks << std::endl;
 
 		// ignore pieces found in the ignore list
-		if (std::find(ignore.begin(), ignore.end(), piece) != ignore.end()) return num_blocks;
+		if (!ignore.empty() && std::binary_search(ignore.begin(), ignore.end(), piece))
+			return num_blocks;
 
 		LIBED2K_ASSERT(m_piece_map[piece].priority(this) >= 0);
 		if (m_piece_map[piece].downloading)
@@ -2178,6 +2221,34 @@ namespace libed2k
 			*j = i->peer_count + m_seeds;
 	}
 
+	void piece_picker::set_piece_deadline(int index, ptime deadline, int flags)
+	{
+		LIBED2K_ASSERT(index >= 0);
+		LIBED2K_ASSERT(index < int(m_piece_map.size()) || m_piece_map.empty());
+
+		reset_piece_deadline(index);
+
+		time_critical_piece p;
+		p.deadline = deadline;
+		p.piece = index;
+		p.flags = flags;
+		m_time_critical_pieces.insert(std::upper_bound(m_time_critical_pieces.begin()
+			, m_time_critical_pieces.end(), p), p);
+	}
+
+	bool piece_picker::reset_piece_deadline(int index, int* flags)
+	{
+		for (std::deque<time_critical_piece>::iterator i = m_time_critical_pieces.begin()
+			, end(m_time_critical_pieces.end()); i != end; ++i)
+		{
+			if (i->piece != index) continue;
+			if (flags) *flags = i->flags;
+			m_time_critical_pieces.erase(i);
+			return true;
+		}
+		return false;
+	}
+
 	bool piece_picker::mark_as_writing(piece_block block, void* peer)
 	{
 #ifdef LIBED2K_EXPENSIVE_INVARIANT_CHECKS
@@ -17,7 +17,7 @@ struct match_peer_endpoint
     {}
 
     bool operator()(const peer* p) const
-    { return p->endpoint == m_ep; }
+    { return p->port == m_ep.port() && p->address() == m_ep.address(); }
 
     tcp::endpoint const& m_ep;
 };
@@ -91,14 +91,12 @@ peer* policy::add_peer(const tcp::endpoint& ep, int source, char flags)
         // we don't have any info about this peer.
         // add a new entry
 
-        p = (peer*)ses.m_ipv4_peer_pool.malloc();
+        p = allocate_peer(ep, true, source);
         if (p == 0) return NULL;
-        ses.m_ipv4_peer_pool.set_next_size(500);
-        new (p) peer(ep, true, source);
 
         if (!insert_peer(p, iter, flags))
         {
-            m_transfer->session().m_ipv4_peer_pool.destroy(p);
+            free_peer(p);
             return 0;
         }
     }
@@ -208,10 +206,8 @@ bool policy::new_connection(peer_connection& c, int session_time)
             return false;
         }
 
-        peer* p = (peer*)ses.m_ipv4_peer_pool.malloc();
+        peer* p = allocate_peer(c.remote(), false, 0);
         if (p == 0) return false;
-        ses.m_ipv4_peer_pool.set_next_size(500);
-        new (p) peer(c.remote(), false, 0);
 
         iter = m_peers.insert(iter, p);
         if (m_round_robin >= iter - m_peers.begin()) ++m_round_robin;
@@ -482,7 +478,7 @@ void policy::ip_filter_updated()
 void policy::erase_peer(peer* p)
 {
     std::pair<peers_t::iterator, peers_t::iterator> range = find_peers(p->address());
-    peers_t::iterator iter = std::find_if(range.first, range.second, match_peer_endpoint(p->endpoint));
+    peers_t::iterator iter = std::find_if(range.first, range.second, match_peer_endpoint(p->ip()));
     if (iter == range.second) return;
     erase_peer(iter);
 }
@@ -505,27 +501,44 @@ void policy::erase_peer(peers_t::iterator i)
     if (m_round_robin > i - m_peers.begin()) --m_round_robin;
     if (m_round_robin >= int(m_peers.size())) m_round_robin = 0;
 
+    free_peer(*i);
+    m_peers.erase(i);
+}
+
+peer* policy::allocate_peer(const tcp::endpoint& ep, bool conn, int src)
+{
+    aux::session_impl& ses = m_transfer->session();
+
 #if LIBED2K_USE_IPV6
-    if ((*i)->is_v6_addr)
+    if (ep.address().is_v6())
     {
-        LIBED2K_ASSERT(m_transfer->session().m_ipv6_peer_pool.is_from(static_cast<ipv6_peer*>(*i)));
-        m_transfer->session().m_ipv6_peer_pool.destroy(static_cast<ipv6_peer*>(*i));
+        void* mem = ses.m_ipv6_peer_pool.malloc();
+        return mem ? new (mem) ipv6_peer(ep, conn, src) : NULL;
     }
-    else
+#else
+    if (!ep.address().is_v4()) return NULL;
 #endif
-#if LIBED2K_USE_I2P
-        if ((*i)->is_i2p_addr)
-        {
-            LIBED2K_ASSERT(m_transfer->session().m_i2p_peer_pool.is_from(static_cast<i2p_peer*>(*i)));
-            m_transfer->session().m_i2p_peer_pool.destroy(static_cast<i2p_peer*>(*i));
-        }
-        else
+
+    void* mem = ses.m_ipv4_peer_pool.malloc();
+    return mem ? new (mem) ipv4_peer(ep, conn, src) : NULL;
+}
+
+void policy::free_peer(peer* p)
+{
+    aux::session_impl& ses = m_transfer->session();
+
+    // records are trivially destructible, so memory goes back to pool without destructor call
+#if LIBED2K_USE_IPV6
+    if (p->is_v6_addr)
+    {
+        LIBED2K_ASSERT(ses.m_ipv6_peer_pool.is_from(p));
+        ses.m_ipv6_peer_pool.free(p);
+        return;
+    }
 #endif
-        {
-            LIBED2K_ASSERT(m_transfer->session().m_ipv4_peer_pool.is_from(*i));
-            m_transfer->session().m_ipv4_peer_pool.destroy(*i);
-        }
-    m_peers.erase(i);
+
+    LIBED2K_ASSERT(ses.m_ipv4_peer_pool.is_from(p));
+    ses.m_ipv4_peer_pool.free(p);
 }
 
 void policy::set_connection(peer* p, peer_connection* c)
@@ -683,7 +696,7 @@ policy::peers_t::iterator policy::find_connect_candidate(int session_time)
         // advertise support)
         if (!pinged && !pe.added_to_dht)
         {
-            udp::endpoint node(pe.address(), pe.port());
+            udp::endpoint node(pe.address(), pe.port);
             //m_transfer->session().add_dht_node(node);
             pe.added_to_dht = true;
             pinged = true;
@@ -764,7 +777,7 @@ bool policy::is_connect_candidate(peer const& p, bool finished) const
         return false;
 
     // is there connection to this peer
-    boost::intrusive_ptr<peer_connection> c = ses.find_peer_connection(p.endpoint);
+    boost::intrusive_ptr<peer_connection> c = ses.find_peer_connection(p.ip());
     if (c) return false;
 
     //if (ses.m_port_filter.access(p.port) & port_filter::blocked)
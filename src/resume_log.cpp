@@ -0,0 +1,561 @@
+#include <cstdio>
+#include <iterator>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#include "libed2k/resume_log.hpp"
+#include "libed2k/lazy_entry.hpp"
+#include "libed2k/bencode.hpp"
+#include "libed2k/filesystem.hpp"
+#include "libed2k/escape_string.hpp"
+#include "libed2k/io.hpp"
+#include "libed2k/log.hpp"
+
+namespace libed2k
+{
+    // resume log file header: magic, uint32 version
+    const char RESUME_LOG_MAGIC[] = { 'e', 'd', '2', 'k', 'R', 'L', 'O', 'G' };
+    const int RESUME_LOG_HEADER_SIZE = sizeof(RESUME_LOG_MAGIC) + 4;
+    const int RESUME_LOG_RECORD_HEADER_SIZE = 4 + 1 + md4_hash::size;
+
+    static void append_string(std::string& out, const std::string& s)
+    {
+        char len[24];
+        snprintf(len, sizeof(len), "%d:", int(s.size()));
+        out += len;
+        out += s;
+    }
+
+    // makes rename of the file durable, the new directory entry reaches
+    // the disk when the directory is synced. Not available on windows
+    static void sync_parent_directory(const std::string& path)
+    {
+#ifndef LIBED2K_WINDOWS
+        std::string dir = has_parent_path(path) ? parent_path(path) : std::string(".");
+        int fd = ::open(convert_to_native(dir).c_str(), O_RDONLY);
+
+        if (fd == -1 || ::fsync(fd) != 0)
+        {
+            ERR("resume_log: unable to sync directory {" << convert_to_native(dir) << "}");
+        }
+
+        if (fd != -1) ::close(fd);
+#endif
+    }
+
+    resume_log::resume_log() : m_compact_ratio(4), m_writing(false), m_abort(false)
+    {
+    }
+
+    resume_log::~resume_log()
+    {
+        close();
+    }
+
+    bool resume_log::open(const std::string& filepath, int compact_ratio, error_code& ec)
+    {
+        LIBED2K_ASSERT(!is_open());
+        m_filepath = filepath;
+        m_compact_ratio = (std::max)(compact_ratio, 2);
+        m_states.clear();
+        m_status = resume_log_status();
+        m_abort = false;
+
+        size_type file_size = 0;
+        size_type valid_size = 0;
+
+        {
+            std::ifstream in(convert_to_native(m_filepath).c_str(), std::ios_base::binary | std::ios_base::in);
+
+            if (in)
+            {
+                in.seekg(0, std::ios_base::end);
+                file_size = in.tellg();
+                in.seekg(0, std::ios_base::beg);
+
+                if (!replay(in, file_size, valid_size))
+                {
+                    ERR("resume_log: unrecognized log {" << convert_to_native(m_filepath) << "}");
+                    ec = errors::invalid_file_tag;
+                    return false;
+                }
+            }
+        }
+
+        if (valid_size != file_size || file_size == 0)
+        {
+            // records torn by crash are dropped, new log starts with header
+            if (file_size > 0)
+            {
+                ERR("resume_log: drop " << (file_size - valid_size) << " bytes of incomplete records");
+            }
+
+            if (!compact(ec)) return false;
+        }
+        else
+        {
+            if (!m_log.open(m_filepath, file::write_only | file::dsync, ec)) return false;
+
+            m_status.log_size = file_size;
+            m_status.live_size = RESUME_LOG_HEADER_SIZE;
+
+            for (state_map::const_iterator i = m_states.begin(); i != m_states.end(); ++i)
+            {
+                m_status.live_size += RESUME_LOG_RECORD_HEADER_SIZE + full_payload(i->second).size();
+            }
+        }
+
+        m_status.transfers = m_states.size();
+        m_writer.reset(new boost::thread(boost::bind(&resume_log::writer, this)));
+        return true;
+    }
+
+    void resume_log::close()
+    {
+        if (!is_open()) return;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_abort = true;
+            m_condition.notify_all();
+        }
+
+        m_writer->join();
+        m_writer.reset();
+        m_log.close();
+    }
+
+    bool resume_log::resume_data(const md4_hash& hash, std::vector<char>& buf) const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        state_map::const_iterator i = m_states.find(hash);
+        if (i == m_states.end()) return false;
+
+        std::string payload = full_payload(i->second);
+        buf.assign(payload.begin(), payload.end());
+        return true;
+    }
+
+    void resume_log::post(checkpoint& cp)
+    {
+        if (cp.empty()) return;
+
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_batches.push_back(checkpoint());
+        m_batches.back().swap(cp);
+        m_condition.notify_all();
+    }
+
+    void resume_log::erase(const md4_hash& hash)
+    {
+        checkpoint cp(1);
+        cp[0].hash = hash;
+        post(cp);
+    }
+
+    void resume_log::flush()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        while (is_open() && (!m_batches.empty() || m_writing))
+        {
+            m_condition.wait(lock);
+        }
+    }
+
+    resume_log_status resume_log::status() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_status;
+    }
+
+    void resume_log::writer()
+    {
+        for (;;)
+        {
+            checkpoint cp;
+
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                while (m_batches.empty() && !m_abort)
+                {
+                    m_condition.wait(lock);
+                }
+
+                // pending checkpoints are written before exit
+                if (m_batches.empty()) return;
+
+                cp.swap(m_batches.front());
+                m_batches.pop_front();
+                m_writing = true;
+            }
+
+            write_batch(cp);
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_writing = false;
+            m_condition.notify_all();
+        }
+    }
+
+    void resume_log::write_batch(checkpoint& cp)
+    {
+        std::vector<char> out;
+        int records = 0;
+
+        for (checkpoint::iterator i = cp.begin(); i != cp.end(); ++i)
+        {
+            if (encode(*i, out)) ++records;
+        }
+
+        if (out.empty()) return;
+
+        // whole batch goes to disk in one synced write, log size
+        // is changed by writer thread only, so it is read without lock.
+        // A torn append is overwritten by the next one
+        file::iovec_t b = { &out[0], out.size() };
+        error_code ec;
+
+        if (m_log.writev(m_status.log_size, &b, 1, ec) != size_type(out.size()) || ec)
+        {
+            ERR("resume_log: unable to append to {" << convert_to_native(m_filepath) << "} " << ec.message());
+            return;
+        }
+
+        bool need_compact = false;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_status.logged_bytes += out.size();
+            m_status.log_size += out.size();
+            m_status.records += records;
+            need_compact = m_status.log_size > min_compact_size &&
+                m_status.log_size > m_status.live_size * m_compact_ratio;
+        }
+
+        if (need_compact && compact(ec))
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_status.compacted_bytes += m_status.log_size;
+            ++m_status.compactions;
+        }
+    }
+
+    bool resume_log::encode(checkpoint_entry& ce, std::vector<char>& out)
+    {
+        // m_states is changed by writer thread only, so it is read here without lock
+        state_map::iterator s = m_states.find(ce.hash);
+
+        if (!ce.resume_data)
+        {
+            if (s == m_states.end()) return false;
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_status.live_size -= RESUME_LOG_RECORD_HEADER_SIZE + full_payload(s->second).size();
+            m_states.erase(s);
+            m_status.transfers = m_states.size();
+            lock.unlock();
+
+            append_record(record_erase, ce.hash, std::string(), out);
+            return true;
+        }
+
+        entry& rd = *ce.resume_data;
+
+        transfer_state ts;
+
+        for (entry::dictionary_type::const_iterator i = rd.dict().begin(); i != rd.dict().end(); ++i)
+        {
+            if (i->first == "pieces" && i->second.type() == entry::string_t)
+            {
+                ts.pieces = i->second.string();
+                continue;
+            }
+
+            std::string& value = ts.values[i->first];
+            bencode(std::back_inserter(value), i->second);
+        }
+
+        std::string full = full_payload(ts);
+        std::string payload;
+        record_type type = record_delta;
+        size_type changed = 0;
+
+        if (s != m_states.end() && s->second.pieces.size() == ts.pieces.size())
+        {
+            const transfer_state& old = s->second;
+            std::string set;
+            std::string unset;
+            std::string pieces;
+
+            for (value_map::const_iterator i = ts.values.begin(); i != ts.values.end(); ++i)
+            {
+                value_map::const_iterator o = old.values.find(i->first);
+                if (o != old.values.end() && o->second == i->second) continue;
+                append_string(set, i->first);
+                set += i->second;
+                changed += i->first.size() + i->second.size();
+            }
+
+            for (value_map::const_iterator o = old.values.begin(); o != old.values.end(); ++o)
+            {
+                if (ts.values.count(o->first)) continue;
+                append_string(unset, o->first);
+                changed += o->first.size();
+            }
+
+            for (size_t n = 0; n < ts.pieces.size(); ++n)
+            {
+                if (ts.pieces[n] == old.pieces[n]) continue;
+                std::back_insert_iterator<std::string> ptr(pieces);
+                detail::write_uint32(n, ptr);
+                detail::write_uint8(ts.pieces[n], ptr);
+                ++changed;
+            }
+
+            // keys are written in sorted order
+            if (!pieces.empty()) { payload += "6:pieces"; append_string(payload, pieces); }
+            if (!set.empty()) payload += "3:setd" + set + "e";
+            if (!unset.empty()) payload += "5:unsetl" + unset + "e";
+
+            if (!payload.empty()) payload = "d" + payload + "e";
+        }
+        else
+        {
+            type = record_full;
+            changed = full.size();
+        }
+
+        if (type == record_delta && payload.size() >= full.size())
+        {
+            type = record_full;
+        }
+
+        if (type == record_full) payload = full;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_status.logical_bytes += full.size();
+            m_status.changed_bytes += changed;
+
+            if (payload.empty()) return false;
+
+            if (s != m_states.end())
+                m_status.live_size -= RESUME_LOG_RECORD_HEADER_SIZE + full_payload(s->second).size();
+            m_status.live_size += RESUME_LOG_RECORD_HEADER_SIZE + full.size();
+            m_states[ce.hash] = ts;
+            m_status.transfers = m_states.size();
+        }
+
+        append_record(type, ce.hash, payload, out);
+        return true;
+    }
+
+    bool resume_log::compact(error_code& ec)
+    {
+        std::vector<char> out(RESUME_LOG_HEADER_SIZE);
+        char* ptr = &out[0];
+        ptr = std::copy(RESUME_LOG_MAGIC, RESUME_LOG_MAGIC + sizeof(RESUME_LOG_MAGIC), ptr);
+        detail::write_uint32(version, ptr);
+
+        for (state_map::const_iterator i = m_states.begin(); i != m_states.end(); ++i)
+        {
+            append_record(record_full, i->first, full_payload(i->second), out);
+        }
+
+        std::string tmp_filepath = m_filepath + ".tmp";
+
+        {
+            // new log is on disk before it replaces the old one, leftover
+            // of a failed compaction is removed so nothing trails it
+            file tmp;
+            file::iovec_t b = { &out[0], out.size() };
+            remove(tmp_filepath, ec);
+            ec.clear();
+
+            if (tmp.open(tmp_filepath, file::write_only | file::dsync, ec)
+                && tmp.writev(0, &b, 1, ec) != size_type(out.size()) && !ec)
+            {
+                ec.assign(EIO, get_posix_category());
+            }
+
+            if (ec)
+            {
+                ERR("resume_log: unable to write {" << convert_to_native(tmp_filepath) << "} " << ec.message());
+                return false;
+            }
+        }
+
+        m_log.close();
+        rename(tmp_filepath, m_filepath, ec);
+
+        if (ec)
+        {
+            ERR("resume_log: unable to replace log {" << ec.message() << "}");
+        }
+        else
+        {
+            sync_parent_directory(m_filepath);
+        }
+
+        // on rename failure old log is appended further
+        error_code open_ec;
+        m_log.open(m_filepath, file::write_only | file::dsync, open_ec);
+        if (!ec) ec = open_ec;
+        if (ec) return false;
+
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_status.log_size = out.size();
+        m_status.live_size = out.size();
+        return true;
+    }
+
+    bool resume_log::replay(std::ifstream& in, size_type file_size, size_type& valid_size)
+    {
+        char header[RESUME_LOG_HEADER_SIZE];
+        valid_size = 0;
+
+        // empty or torn header - log is created again
+        if (!in.read(header, sizeof(header))) return true;
+        if (!std::equal(RESUME_LOG_MAGIC, RESUME_LOG_MAGIC + sizeof(RESUME_LOG_MAGIC), header)) return false;
+
+        const char* ptr = header + sizeof(RESUME_LOG_MAGIC);
+        if (detail::read_uint32(ptr) != version) return false;
+        valid_size = RESUME_LOG_HEADER_SIZE;
+
+        std::vector<char> payload;
+
+        for (;;)
+        {
+            char rec[RESUME_LOG_RECORD_HEADER_SIZE];
+            if (!in.read(rec, sizeof(rec))) break;
+
+            ptr = rec;
+            boost::uint32_t size = detail::read_uint32(ptr);
+            record_type type = static_cast<record_type>(detail::read_uint8(ptr));
+            md4_hash hash(ptr);
+
+            // garbage length, the rest of log is dropped like a torn record
+            if (size > max_record_size || size > file_size - valid_size - RESUME_LOG_RECORD_HEADER_SIZE) break;
+
+            payload.resize(size);
+            if (size > 0 && !in.read(&payload[0], size)) break;
+            if (!apply(type, hash, size ? &payload[0] : 0, size)) break;
+
+            valid_size += RESUME_LOG_RECORD_HEADER_SIZE + size;
+        }
+
+        return true;
+    }
+
+    bool resume_log::apply(record_type type, const md4_hash& hash, const char* payload, int size)
+    {
+        if (type == record_erase)
+        {
+            m_states.erase(hash);
+            return true;
+        }
+
+        lazy_entry e;
+        error_code ec;
+        if (lazy_bdecode(payload, payload + size, e, ec) != 0 || e.type() != lazy_entry::dict_t) return false;
+
+        if (type == record_full)
+        {
+            transfer_state& ts = m_states[hash];
+            ts = transfer_state();
+
+            for (int i = 0; i < e.dict_size(); ++i)
+            {
+                std::pair<std::string, lazy_entry const*> item = e.dict_at(i);
+
+                if (item.first == "pieces" && item.second->type() == lazy_entry::string_t)
+                {
+                    ts.pieces = item.second->string_value();
+                    continue;
+                }
+
+                std::pair<char const*, int> data = item.second->data_section();
+                ts.values[item.first].assign(data.first, data.second);
+            }
+
+            return true;
+        }
+
+        if (type != record_delta) return false;
+
+        state_map::iterator s = m_states.find(hash);
+        if (s == m_states.end()) return false;
+        transfer_state& ts = s->second;
+
+        if (lazy_entry const* set = e.dict_find_dict("set"))
+        {
+            for (int i = 0; i < set->dict_size(); ++i)
+            {
+                std::pair<std::string, lazy_entry const*> item = set->dict_at(i);
+                std::pair<char const*, int> data = item.second->data_section();
+                ts.values[item.first].assign(data.first, data.second);
+            }
+        }
+
+        if (lazy_entry const* unset = e.dict_find_list("unset"))
+        {
+            for (int i = 0; i < unset->list_size(); ++i)
+            {
+                ts.values.erase(unset->list_string_value_at(i));
+            }
+        }
+
+        std::string pieces = e.dict_find_string_value("pieces");
+        if (pieces.size() % 5 != 0) return false;
+
+        for (const char* ptr = pieces.data(); ptr != pieces.data() + pieces.size();)
+        {
+            boost::uint32_t index = detail::read_uint32(ptr);
+            boost::uint8_t value = detail::read_uint8(ptr);
+            if (index >= ts.pieces.size()) return false;
+            ts.pieces[index] = value;
+        }
+
+        return true;
+    }
+
+    void resume_log::append_record(record_type type, const md4_hash& hash, const std::string& payload,
+        std::vector<char>& out)
+    {
+        std::back_insert_iterator<std::vector<char> > ptr(out);
+        detail::write_uint32(payload.size(), ptr);
+        detail::write_uint8(type, ptr);
+        std::copy(hash.begin(), hash.end(), ptr);
+        out.insert(out.end(), payload.begin(), payload.end());
+    }
+
+    std::string resume_log::full_payload(const transfer_state& ts)
+    {
+        std::string out = "d";
+        bool pieces = ts.pieces.empty();
+
+        for (value_map::const_iterator i = ts.values.begin(); i != ts.values.end(); ++i)
+        {
+            if (!pieces && i->first > "pieces")
+            {
+                out += "6:pieces";
+                append_string(out, ts.pieces);
+                pieces = true;
+            }
+
+            append_string(out, i->first);
+            out += i->second;
+        }
+
+        if (!pieces)
+        {
+            out += "6:pieces";
+            append_string(out, ts.pieces);
+        }
+
+        out += "e";
+        return out;
+    }
+}
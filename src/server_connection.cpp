@@ -466,8 +466,6 @@ namespace libed2k
     {
         CHECK_ABORTED();
 
-        typedef boost::iostreams::basic_array_source<char> Device;
-
         if (!error)
         {
             //DBG("server_connection::handle_read_packet(" << error.message() << ", " << nSize << ", " << packetToString(m_in_header.m_type));
@@ -493,9 +491,7 @@ namespace libed2k
             }
 
 
-            boost::iostreams::stream_buffer<Device> buffer(&m_in_container[0], m_in_container.size());
-            std::istream in_array_stream(&buffer);
-            archive::ed2k_iarchive ia(in_array_stream);
+            archive::ed2k_iarchive ia(m_in_container.empty() ? NULL : &m_in_container[0], m_in_container.size());
 
             try
             {
@@ -230,6 +230,23 @@ namespace libed2k
     {
         m_impl->m_tpm.cancel_transfer_params(filepath);
     }
+
+    void session::share_directory(const std::string& dirpath)
+    {
+        m_impl->m_tpm.share_directory(dirpath);
+    }
+
+    void session::checkpoint_resume_data()
+    {
+        boost::mutex::scoped_lock l(m_impl->m_mutex);
+        m_impl->checkpoint_resume_data();
+    }
+
+    resume_log_status session::resume_status() const
+    {
+        boost::mutex::scoped_lock l(m_impl->m_mutex);
+        return m_impl->resume_status();
+    }
     
     void session::start_natpmp() {
         m_impl->m_io_service.post(boost::bind(&aux::session_impl::start_natpmp, m_impl));
@@ -32,7 +32,10 @@ session_impl_base::session_impl_base(const session_settings& settings) :
     m_transfers(),
     m_active_transfers(),
     m_alerts(m_io_service),
-    m_tpm(m_alerts, settings.m_known_file)
+    m_tpm(m_alerts, settings.m_known_file, settings.m_share_cache_file, settings.hashing_threads,
+        (settings.hashing_mapped_reads ? file2atp::read_mapped : 0) | (settings.hashing_drop_cache ? file2atp::drop_cache : 0) |
+        (settings.hashing_aich ? file2atp::hash_aich : 0),
+        settings.m_known_store_file)
 {
 }
 
@@ -115,12 +118,19 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
                            const session_settings& settings):
     session_impl_base(settings),
     m_host_resolver(m_io_service),
-    m_peer_pool(500),
+    m_ipv4_peer_pool(sizeof(ipv4_peer), 500),
+#if LIBED2K_USE_IPV6
+    m_ipv6_peer_pool(sizeof(ipv6_peer), 500),
+#endif
     m_send_buffers(send_buffer_size),
     m_z_buffers(BLOCK_SIZE),
+    m_block_compressor(m_settings),
+    m_upload_queue(m_settings),
+    m_checkpoint_jobs(0),
     m_skip_buffer(4096),
     m_filepool(40),
-    m_disk_thread(m_io_service, boost::bind(&session_impl::on_disk_queue, this), m_filepool, BLOCK_SIZE),
+    m_disk_thread(m_io_service, boost::bind(&session_impl::on_disk_queue, this), m_filepool, BLOCK_SIZE,
+                  m_settings.disk_io_threads, m_settings.disk_hash_threads),
     m_half_open(m_io_service),
     m_download_rate(peer_connection::download_channel),
     m_upload_rate(peer_connection::upload_channel),
@@ -128,6 +138,8 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
     m_next_connect_transfer(m_active_transfers),
     m_paused(false),
     m_created(time_now_hires()),
+    m_last_checkpoint(m_created),
+    m_last_turnover(m_created),
     m_second_timer(seconds(1)),
     m_timer(m_io_service),
     m_last_tick(m_created),
@@ -257,6 +269,13 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
     update_rate_settings();
     update_connections_limit();
 
+    if (!m_settings.m_resume_log_file.empty() &&
+        !m_resume_log.open(m_settings.m_resume_log_file, m_settings.resume_log_compact_ratio, ec))
+    {
+        ERR("session_impl: unable to open resume log {" << ec.message() << "}");
+        ec.clear();
+    }
+
     m_io_service.post(boost::bind(&session_impl::on_tick, this, ec));
 
     m_tcp_mapping[0] = -1;
@@ -387,6 +406,7 @@ void session_impl::operator()()
     }
 
     boost::mutex::scoped_lock l(m_mutex);
+    m_resume_log.close();
     m_transfers.clear();
     m_active_transfers.clear();
 }
@@ -798,6 +818,14 @@ boost::intrusive_ptr<peer_connection> session_impl::find_peer_connection(const m
     return boost::intrusive_ptr<peer_connection>();
 }
 
+boost::intrusive_ptr<peer_connection> session_impl::find_upload_client(const upload_queue::client_id& client) const
+{
+    connection_map::const_iterator itr = std::find_if(
+        m_connections.begin(), m_connections.end(), boost::bind(&peer_connection::is_upload_client, _1, client));
+    if (itr != m_connections.end())  {  return *itr; }
+    return boost::intrusive_ptr<peer_connection>();
+}
+
 transfer_handle session_impl::find_transfer_handle(const md4_hash& hash)
 {
     return transfer_handle(find_transfer(hash));
@@ -919,7 +947,20 @@ transfer_handle session_impl::add_transfer(add_transfer_params const& params, er
         return transfer_handle();
     }
 
-    transfer_ptr.reset(new transfer(*this, m_listen_interface, ++m_queue_pos, params));
+    // transfer resumes from session log unless it has own resume data
+    std::vector<char> resume_data;
+    if ((!params.resume_data || params.resume_data->empty()) &&
+        m_resume_log.is_open() && m_resume_log.resume_data(params.file_hash, resume_data))
+    {
+        add_transfer_params p = params;
+        p.resume_data = &resume_data;
+        transfer_ptr.reset(new transfer(*this, m_listen_interface, ++m_queue_pos, p));
+    }
+    else
+    {
+        transfer_ptr.reset(new transfer(*this, m_listen_interface, ++m_queue_pos, params));
+    }
+
     transfer_ptr->start();
 
     m_transfers.insert(std::make_pair(params.file_hash, transfer_ptr));
@@ -949,6 +990,14 @@ void session_impl::remove_transfer(const transfer_handle& h, int options)
 
         //t.set_queue_position(-1);
         m_transfers.erase(i);
+        m_block_compressor.remove_file(hash);
+        if (m_resume_log.is_open()) m_resume_log.erase(hash);
+
+        for (resume_log::checkpoint::iterator c = m_checkpoint.begin(); c != m_checkpoint.end();)
+        {
+            if (c->hash == hash) c = m_checkpoint.erase(c);
+            else ++c;
+        }
 
         m_alerts.post_alert_should(deleted_transfer_alert(hash));
     }
@@ -1080,6 +1129,9 @@ session_status session_impl::status() const
     session_status s;
 
     s.num_peers = (int)m_connections.size();
+    s.num_unchoked = m_upload_queue.slots();
+    s.allowed_upload_slots = m_upload_queue.target_slots();
+    s.upload_queue_length = m_upload_queue.waiting();
 
     //s.total_redundant_bytes = m_total_redundant_bytes;
     //s.total_failed_bytes = m_total_failed_bytes;
@@ -1148,6 +1200,10 @@ void session_impl::abort()
     stop_dht();
 #endif
 
+    // last checkpoint is taken before transfers release their storages,
+    // log is closed when the disk thread answered and the main loop exits
+    checkpoint_resume_data();
+
     DBG("aborting all transfers (" << m_transfers.size() << ")");
     // abort all transfers
     for (transfer_map::iterator i = m_transfers.begin(),
@@ -1271,6 +1327,14 @@ void session_impl::on_tick(error_code const& e)
     // TODO: should it be implemented?
 
     m_server_connection->second_tick(tick_interval_ms);
+    m_block_compressor.second_tick();
+    update_upload_slots(now);
+
+    if (m_resume_log.is_open() &&
+        now - m_last_checkpoint >= seconds(m_settings.resume_checkpoint_interval))
+    {
+        checkpoint_resume_data();
+    }
     update_active_transfers();
 
     // --------------------------------------------------------------
@@ -1314,7 +1378,81 @@ void session_impl::on_tick(error_code const& e)
     // --------------------------------------------------------------
     // disconnect peers when we have too many
     // --------------------------------------------------------------
-    // TODO: should it be implemented?
+    if (num_connections() > max_connections())
+    {
+        evict_connections(num_connections() - max_connections(), false,
+            error_code(errors::too_many_connections, get_libed2k_category()));
+    }
+    else if (now - m_last_turnover >= seconds(m_settings.peer_turnover_interval))
+    {
+        m_last_turnover = now;
+
+        if (num_connections() > boost::int64_t(max_connections()) * m_settings.peer_turnover_cutoff / 100)
+        {
+            evict_connections((std::max)(num_connections() * m_settings.peer_turnover / 100, 1), true,
+                error_code(errors::too_many_connections, get_libed2k_category()));
+        }
+    }
+}
+
+int session_impl::evict_connections(int num, bool idle_only, const error_code& ec)
+{
+    std::vector<ranked_connection> peers;
+    peers.reserve(m_connections.size());
+
+    for (connection_map::const_iterator i = m_connections.begin(); i != m_connections.end(); ++i)
+    {
+        if ((*i)->is_disconnecting()) continue;
+        peers.push_back(std::make_pair((*i)->get_disconnect_rank(), *i));
+    }
+
+    num = select_disconnects(peers, num, idle_only);
+
+    for (int n = 0; n < num; ++n)
+    {
+        DBG("evict connection " << peers[n].second->remote() << " {payload: " << peers[n].first.minute_payload << "}");
+        peers[n].second->disconnect(ec);
+    }
+
+    return num;
+}
+
+void session_impl::checkpoint_resume_data()
+{
+    m_last_checkpoint = time_now_hires();
+    if (!m_resume_log.is_open()) return;
+
+    // one batch for all changed transfers, their storages write
+    // resume data on disk thread
+    for (transfer_map::iterator i = m_transfers.begin(), end(m_transfers.end()); i != end; ++i)
+    {
+        if (i->second->resume_checkpoint()) ++m_checkpoint_jobs;
+    }
+}
+
+void session_impl::add_resume_checkpoint(boost::shared_ptr<transfer> const& t
+    , boost::shared_ptr<entry> const& rd)
+{
+    LIBED2K_ASSERT(m_checkpoint_jobs > 0);
+    --m_checkpoint_jobs;
+
+    // removed transfer is already erased from log
+    transfer_map::iterator i = m_transfers.find(t->hash());
+
+    if (rd && i != m_transfers.end() && i->second == t)
+    {
+        resume_log::checkpoint_entry ce;
+        ce.hash = t->hash();
+        ce.resume_data = rd;
+        m_checkpoint.push_back(ce);
+    }
+
+    if (m_checkpoint_jobs == 0) m_resume_log.post(m_checkpoint);
+}
+
+resume_log_status session_impl::resume_status() const
+{
+    return m_resume_log.status();
 }
 
 void session_impl::connect_new_peers()
@@ -1560,6 +1698,31 @@ void session_impl::update_active_transfers()
     }
 }
 
+void session_impl::update_upload_slots(ptime now)
+{
+    upload_queue::tick_result res;
+    m_upload_queue.second_tick(now, res);
+
+    for (std::vector<upload_queue::client_id>::const_iterator i = res.revoked.begin(); i != res.revoked.end(); ++i)
+    {
+        if (boost::intrusive_ptr<peer_connection> pc = find_upload_client(*i)) pc->revoke_upload_slot();
+    }
+
+    for (std::vector<upload_queue::client_id>::const_iterator i = res.granted.begin(); i != res.granted.end(); ++i)
+    {
+        if (boost::intrusive_ptr<peer_connection> pc = find_upload_client(*i))
+            pc->grant_upload_slot();
+        else
+            m_upload_queue.disconnected(*i);
+    }
+
+    for (std::vector<std::pair<upload_queue::client_id, int> >::const_iterator i = res.ranks.begin();
+         i != res.ranks.end(); ++i)
+    {
+        if (boost::intrusive_ptr<peer_connection> pc = find_upload_client(i->first)) pc->send_queue_rank(i->second);
+    }
+}
+
 void session_impl::start_natpmp()
 {
     if (m_natpmp) return;
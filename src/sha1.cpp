@@ -0,0 +1,140 @@
+/*
+ * SHA-1 (FIPS 180-1) message digest.
+ * Straightforward implementation processing one 64-byte block at a time,
+ * words are read in big-endian byte order on every architecture.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "libed2k/sha1.hpp"
+#include "libed2k/assert.hpp"
+
+namespace
+{
+    inline boost::uint32_t rol(boost::uint32_t v, int bits)
+    {
+        return (v << bits) | (v >> (32 - bits));
+    }
+
+    void transform(boost::uint32_t state[5], const unsigned char* block)
+    {
+        boost::uint32_t w[80];
+
+        for (int i = 0; i < 16; ++i)
+        {
+            w[i] = (boost::uint32_t(block[i * 4]) << 24) |
+                (boost::uint32_t(block[i * 4 + 1]) << 16) |
+                (boost::uint32_t(block[i * 4 + 2]) << 8) |
+                boost::uint32_t(block[i * 4 + 3]);
+        }
+
+        for (int i = 16; i < 80; ++i)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        boost::uint32_t a = state[0];
+        boost::uint32_t b = state[1];
+        boost::uint32_t c = state[2];
+        boost::uint32_t d = state[3];
+        boost::uint32_t e = state[4];
+
+        for (int i = 0; i < 80; ++i)
+        {
+            boost::uint32_t f, k;
+
+            if (i < 20)
+            {
+                f = d ^ (b & (c ^ d));
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (d & (b | c));
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            boost::uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+namespace libed2k
+{
+    void sha1_hasher::reset()
+    {
+        m_state[0] = 0x67452301;
+        m_state[1] = 0xEFCDAB89;
+        m_state[2] = 0x98BADCFE;
+        m_state[3] = 0x10325476;
+        m_state[4] = 0xC3D2E1F0;
+        m_count = 0;
+    }
+
+    sha1_hasher& sha1_hasher::update(const char* data, int len)
+    {
+        LIBED2K_ASSERT(len >= 0);
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        int used = int(m_count % 64);
+        m_count += len;
+
+        if (used > 0)
+        {
+            int n = (std::min)(64 - used, len);
+            memcpy(m_buffer + used, p, n);
+            p += n;
+            len -= n;
+            if (used + n < 64) return *this;
+            transform(m_state, m_buffer);
+        }
+
+        for (; len >= 64; p += 64, len -= 64)
+            transform(m_state, p);
+
+        if (len > 0) memcpy(m_buffer, p, len);
+        return *this;
+    }
+
+    sha1_hash sha1_hasher::final()
+    {
+        boost::uint64_t bits = m_count * 8;
+        unsigned char tail[72];
+        int used = int(m_count % 64);
+        int pad = (used < 56) ? 56 - used : 120 - used;
+
+        memset(tail, 0, sizeof(tail));
+        tail[0] = 0x80;
+        for (int i = 0; i < 8; ++i)
+            tail[pad + i] = (unsigned char)(bits >> (56 - i * 8));
+
+        update(reinterpret_cast<const char*>(tail), pad + 8);
+        LIBED2K_ASSERT(m_count % 64 == 0);
+
+        sha1_hash digest;
+        for (int i = 0; i < 20; ++i)
+            digest[i] = (unsigned char)(m_state[i / 4] >> (24 - (i % 4) * 8));
+
+        reset();
+        return digest;
+    }
+}
@@ -0,0 +1,470 @@
+#include <fstream>
+#include <cerrno>
+#include <boost/bind.hpp>
+
+#include "libed2k/share_scanner.hpp"
+#include "libed2k/log.hpp"
+#include "libed2k/escape_string.hpp"
+#include "libed2k/mpsc_queue.hpp"
+
+#ifdef LIBED2K_LINUX
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace libed2k
+{
+    // fingerprint cache file header
+    const boost::uint8_t SHARE_CACHE_VERSION = 0x01;
+
+    static bool is_directory_mode(const file_status& fs)
+    {
+        return (fs.mode & S_IFMT) == file_status::directory;
+    }
+
+    static bool is_regular_mode(const file_status& fs)
+    {
+        return (fs.mode & S_IFMT) == file_status::regular_file;
+    }
+
+    share_cache_entry::share_cache_entry(const file_status& fs, const add_transfer_params& atp) :
+        m_inode(fs.inode), m_size(fs.file_size), m_mtime(fs.mtime), m_ctime(fs.ctime),
+        m_hash(atp.file_hash), m_hashset(atp.piece_hashses)
+    {
+    }
+
+    bool share_cache_entry::match(const file_status& fs) const
+    {
+        return m_inode == fs.inode && m_size == static_cast<boost::uint64_t>(fs.file_size) &&
+            m_mtime == static_cast<boost::uint64_t>(fs.mtime) && m_ctime == static_cast<boost::uint64_t>(fs.ctime);
+    }
+
+    add_transfer_params share_cache_entry::params(const std::string& filepath) const
+    {
+        add_transfer_params atp(filepath);
+        atp.file_hash = m_hash;
+        atp.file_size = m_size;
+        atp.piece_hashses = m_hashset.m_collection;
+        atp.seed_mode = true;
+        return atp;
+    }
+
+    share_scanner::share_scanner(alert_manager& am, const std::string& known_filepath, const std::string& cache_filepath,
+        int hashing_threads, int read_flags, const std::string& known_store_filepath) :
+            transfer_params_maker(am, known_filepath, hashing_threads, read_flags, known_store_filepath),
+            m_cache_filepath(cache_filepath),
+            m_cache_loaded(false),
+            m_hashed(0),
+            m_running(false),
+            m_inotify(-1),
+            m_watch_abort(0)
+    {
+    }
+
+    share_scanner::~share_scanner()
+    {
+        stop();
+    }
+
+    bool share_scanner::start()
+    {
+        std::vector<std::string> roots;
+        m_running = true;
+
+        {
+            boost::mutex::scoped_lock lock(m_cache_mutex);
+            roots.assign(m_roots.begin(), m_roots.end());
+            m_hashed = 0;
+#ifdef LIBED2K_LINUX
+            LIBED2K_ASSERT(m_inotify < 0);
+            atomics::exchange(&m_watch_abort, 0);
+            m_inotify = inotify_init();
+
+            if (m_inotify < 0)
+            {
+                ERR("share_scanner: unable to init inotify, changes won't be watched {" << errno << "}");
+            }
+            else
+            {
+                m_watcher.reset(new boost::thread(boost::bind(&share_scanner::watcher, this)));
+            }
+#endif
+        }
+
+        if (!transfer_params_maker::start()) return false;
+
+        // order was cleared on stop - scan again, unchanged files will be taken from cache
+        for (size_t n = 0; n < roots.size(); ++n)
+        {
+            make_transfer_params(roots[n]);
+        }
+
+        return true;
+    }
+
+    void share_scanner::stop()
+    {
+        // destructor stops again, results are flushed and cache saved once
+        if (!m_running) return;
+        m_running = false;
+        atomics::exchange(&m_watch_abort, 1);
+
+        if (m_watcher)
+        {
+            m_watcher->join();
+            m_watcher.reset();
+        }
+
+        transfer_params_maker::stop();
+
+#ifdef LIBED2K_LINUX
+        {
+            boost::mutex::scoped_lock lock(m_cache_mutex);
+            if (m_inotify >= 0) close(m_inotify);
+            m_inotify = -1;
+            m_watches.clear();
+        }
+#endif
+
+        flush(true);
+        save_cache();
+    }
+
+    void share_scanner::share_directory(const std::string& dirpath)
+    {
+        std::string path = dirpath;
+
+        // drop trailing separator to compare paths by prefix
+        while (path.size() > 1 && (path[path.size() - 1] == '/' || path[path.size() - 1] == '\\'))
+        {
+            path.resize(path.size() - 1);
+        }
+
+        {
+            boost::mutex::scoped_lock lock(m_cache_mutex);
+            m_roots.insert(path);
+        }
+
+        make_transfer_params(path);
+    }
+
+    bool share_scanner::save_cache()
+    {
+        boost::mutex::scoped_lock lock(m_cache_mutex);
+
+        // never overwrite cache which wasn't read
+        if (m_cache_filepath.empty() || !m_cache_loaded) return false;
+
+        std::string tmp_filepath = m_cache_filepath + ".tmp";
+
+        {
+            std::ofstream fstream(convert_to_native(tmp_filepath).c_str(), std::ios_base::binary | std::ios_base::out);
+
+            if (!fstream)
+            {
+                ERR("share_scanner: unable to write {" << convert_to_native(tmp_filepath) << "}");
+                return false;
+            }
+
+            archive::ed2k_oarchive oa(fstream);
+            boost::uint8_t version = SHARE_CACHE_VERSION;
+            boost::uint32_t count = static_cast<boost::uint32_t>(m_cache.size());
+            oa << version;
+            oa << count;
+
+            for (cache_map::iterator itr = m_cache.begin(); itr != m_cache.end(); ++itr)
+            {
+                container_holder<boost::uint16_t, std::string> filepath(itr->first);
+                oa << filepath;
+                oa << itr->second;
+            }
+        }
+
+        error_code ec;
+        rename(tmp_filepath, m_cache_filepath, ec);
+
+        if (ec)
+        {
+            ERR("share_scanner: unable to replace cache {" << ec.message() << "}");
+            return false;
+        }
+
+        DBG("share_scanner: " << m_cache.size() << " entries saved");
+        return true;
+    }
+
+    size_t share_scanner::hashed_files()
+    {
+        boost::mutex::scoped_lock lock(m_cache_mutex);
+        return m_hashed;
+    }
+
+    void share_scanner::process_item(const std::string& filepath, const bool& cancel)
+    {
+        if (!shared(filepath))
+        {
+            transfer_params_maker::process_item(filepath, cancel);
+            return;
+        }
+
+        load_cache();
+
+        error_code ec;
+        file_status fs;
+        stat_file(filepath, &fs, ec, dont_follow_links);
+
+        if (ec)
+        {
+            // file or directory was removed - forget it and everything below it
+            boost::mutex::scoped_lock lock(m_cache_mutex);
+            m_cache.erase(filepath);
+            cache_map::iterator itr = m_cache.lower_bound(filepath + "/");
+
+            while (itr != m_cache.end() && itr->first.compare(0, filepath.size() + 1, filepath + "/") == 0)
+            {
+                m_cache.erase(itr++);
+            }
+
+            lock.unlock();
+            post_result(filepath, add_transfer_params(filepath), ec);
+        }
+        else if (is_directory_mode(fs))
+        {
+            scan_directory(filepath);
+        }
+        else if (is_regular_mode(fs))
+        {
+            boost::mutex::scoped_lock lock(m_cache_mutex);
+            cache_map::const_iterator itr = m_cache.find(filepath);
+
+            if (itr != m_cache.end() && itr->second.match(fs))
+            {
+                add_transfer_params atp = itr->second.params(filepath);
+                lock.unlock();
+                post_result(filepath, atp, ec);
+            }
+            else
+            {
+                lock.unlock();
+                std::pair<add_transfer_params, error_code> rp = make_params(filepath, cancel);
+
+                if (!rp.second)
+                {
+                    lock.lock();
+                    m_cache[filepath] = share_cache_entry(fs, rp.first);
+                    ++m_hashed;
+                    lock.unlock();
+                }
+
+                post_result(filepath, rp.first, rp.second);
+            }
+        }
+
+        flush(order_size() == 0);
+    }
+
+    bool share_scanner::shared(const std::string& filepath)
+    {
+        boost::mutex::scoped_lock lock(m_cache_mutex);
+
+        for (std::set<std::string>::const_iterator itr = m_roots.begin(); itr != m_roots.end(); ++itr)
+        {
+            if (filepath.compare(0, itr->size(), *itr) != 0) continue;
+            if (filepath.size() == itr->size()) return true;
+            if (filepath[itr->size()] == '/' || filepath[itr->size()] == '\\') return true;
+        }
+
+        return false;
+    }
+
+    void share_scanner::scan_directory(const std::string& dirpath)
+    {
+        add_watch(dirpath);
+
+        error_code ec;
+
+        for (directory i(dirpath, ec); !i.done(); i.next(ec))
+        {
+            if (ec) break;
+            std::string name = i.file();
+            if (name == "." || name == "..") continue;
+
+            std::string filepath = combine_path(dirpath, name);
+            file_status fs;
+            error_code fec;
+            stat_file(filepath, &fs, fec, dont_follow_links);
+
+            if (fec) continue;
+
+            if (is_directory_mode(fs))
+            {
+                // let idle threads help with subdirectories
+                make_transfer_params(filepath);
+            }
+            else if (is_regular_mode(fs))
+            {
+                // unchanged files are reported immediately, others go to hashing threads
+                boost::mutex::scoped_lock lock(m_cache_mutex);
+                cache_map::const_iterator itr = m_cache.find(filepath);
+
+                if (itr != m_cache.end() && itr->second.match(fs))
+                {
+                    m_batch.push_back(std::make_pair(itr->second.params(filepath), error_code()));
+                }
+                else
+                {
+                    lock.unlock();
+                    make_transfer_params(filepath);
+                }
+            }
+
+            flush(false);
+        }
+
+        if (ec)
+        {
+            post_result(dirpath, add_transfer_params(dirpath), ec);
+        }
+    }
+
+    void share_scanner::load_cache()
+    {
+        boost::mutex::scoped_lock lock(m_cache_mutex);
+        if (m_cache_loaded) return;
+        m_cache_loaded = true;
+
+        if (m_cache_filepath.empty()) return;
+
+        std::ifstream fstream(convert_to_native(m_cache_filepath).c_str(), std::ios_base::binary | std::ios_base::in);
+        if (!fstream) return;
+
+        archive::ed2k_iarchive ia(fstream);
+
+        try
+        {
+            boost::uint8_t version = 0;
+            boost::uint32_t count = 0;
+            ia >> version;
+
+            if (version != SHARE_CACHE_VERSION)
+            {
+                ERR("share_scanner: unknown cache version " << int(version));
+                return;
+            }
+
+            ia >> count;
+
+            for (boost::uint32_t n = 0; n < count; ++n)
+            {
+                container_holder<boost::uint16_t, std::string> filepath;
+                share_cache_entry entry;
+                ia >> filepath;
+                ia >> entry;
+                m_cache.insert(m_cache.end(), std::make_pair(filepath.m_collection, entry));
+            }
+        }
+        catch(libed2k_exception&)
+        {
+            ERR("share_scanner: cache {" << convert_to_native(m_cache_filepath) << "} is corrupted");
+            m_cache.clear();
+        }
+
+        DBG("share_scanner: " << m_cache.size() << " entries loaded");
+    }
+
+    void share_scanner::post_result(const std::string& filepath, const add_transfer_params& atp, const error_code& ec)
+    {
+        boost::mutex::scoped_lock lock(m_cache_mutex);
+        m_batch.push_back(std::make_pair(atp, ec));
+        m_batch.back().first.file_path = filepath;
+    }
+
+    void share_scanner::flush(bool force)
+    {
+        transfer_params_batch_alert::params_list batch;
+
+        {
+            boost::mutex::scoped_lock lock(m_cache_mutex);
+            if (m_batch.empty() || (!force && m_batch.size() < batch_size)) return;
+            batch.swap(m_batch);
+        }
+
+        if (!m_am.post_alert(transfer_params_batch_alert(batch)))
+        {
+            ERR("transfer parameters batch of " << batch.size() << " files wasn't added because order overflow!");
+        }
+    }
+
+    void share_scanner::add_watch(const std::string& dirpath)
+    {
+#ifdef LIBED2K_LINUX
+        boost::mutex::scoped_lock lock(m_cache_mutex);
+        if (m_inotify < 0) return;
+
+        // files are reported when they were written completely, new directories immediately
+        int wd = inotify_add_watch(m_inotify, convert_to_native(dirpath).c_str(),
+            IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+
+        if (wd < 0)
+        {
+            ERR("share_scanner: unable to watch {" << convert_to_native(dirpath) << "} " << errno);
+            return;
+        }
+
+        m_watches[wd] = dirpath;
+#endif
+    }
+
+    void share_scanner::watcher()
+    {
+#ifdef LIBED2K_LINUX
+        std::vector<char> buffer(64 * 1024);
+
+        while (!atomics::load(&m_watch_abort))
+        {
+            pollfd pfd;
+            pfd.fd = m_inotify;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            // wake up periodically to check abort flag
+            if (poll(&pfd, 1, 200) <= 0) continue;
+
+            ssize_t len = read(m_inotify, &buffer[0], buffer.size());
+            if (len <= 0) continue;
+
+            std::vector<std::string> changed;
+
+            {
+                boost::mutex::scoped_lock lock(m_cache_mutex);
+
+                for (ssize_t pos = 0; pos < len; )
+                {
+                    const inotify_event* ev = reinterpret_cast<const inotify_event*>(&buffer[pos]);
+                    pos += sizeof(inotify_event) + ev->len;
+
+                    std::map<int, std::string>::iterator itr = m_watches.find(ev->wd);
+                    if (itr == m_watches.end()) continue;
+
+                    if (ev->mask & IN_IGNORED)
+                    {
+                        m_watches.erase(itr);
+                        continue;
+                    }
+
+                    // created file will be reported on close
+                    if (ev->len == 0 || ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR))) continue;
+                    changed.push_back(combine_path(itr->second, convert_from_native(ev->name)));
+                }
+            }
+
+            for (size_t n = 0; n < changed.size(); ++n)
+            {
+                DBG("share_scanner: changed {" << convert_to_native(changed[n]) << "}");
+                make_transfer_params(changed[n]);
+            }
+        }
+#endif
+    }
+}
@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cstring>
+
+#include <boost/thread/tss.hpp>
+
+#include "libed2k/slab_arena.hpp"
+#include "libed2k/mpsc_queue.hpp"
+#include "libed2k/allocator.hpp"
+#include "libed2k/assert.hpp"
+
+#ifdef LIBED2K_LINUX
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace libed2k
+{
+    /**
+      * plain data to live in thread local storage
+     */
+    struct slab_arena::thread_cache
+    {
+        long arena;     //!< id of arena the buffers belong to, 0 for none
+        long epoch;     //!< flush epoch of arena when cache was taken
+        unsigned long last_use;
+        int count;
+        char* buffers[thread_cache_size];
+    };
+
+    struct slab_arena::thread_caches
+    {
+        thread_cache slots[thread_cache_slots];
+        unsigned long uses;
+    };
+
+    namespace
+    {
+        volatile long last_arena_id = 0;
+
+        // live arenas by id, thread caches return buffers
+        // of other arena only when it still exists
+        mutex& arenas_mutex()
+        {
+            static mutex m;
+            return m;
+        }
+
+        std::map<long, slab_arena*>& arenas()
+        {
+            static std::map<long, slab_arena*> a;
+            return a;
+        }
+
+        // destroyed with thread local storage of the thread
+        struct thread_exit_drain
+        {
+            ~thread_exit_drain();
+        };
+
+        boost::thread_specific_ptr<thread_exit_drain>& exit_drain()
+        {
+            static boost::thread_specific_ptr<thread_exit_drain> p;
+            return p;
+        }
+
+        char* map_memory(std::size_t size, bool hugepages, int numa_node, bool& huge)
+        {
+            huge = false;
+#ifdef LIBED2K_LINUX
+            void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            if (hugepages)
+            {
+                p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                huge = (p != MAP_FAILED);
+            }
+#endif
+            if (p == MAP_FAILED)
+            {
+                // no reserved hugepages, align the memory on hugepage
+                // boundary so transparent hugepages can back it
+                const std::size_t align = slab_arena::hugepage_size;
+                char* raw = (char*)mmap(0, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (raw == (char*)MAP_FAILED) return 0;
+                char* aligned = (char*)((std::size_t(raw) + align - 1) & ~(align - 1));
+                if (aligned != raw) munmap(raw, aligned - raw);
+                std::size_t tail = raw + align - aligned;
+                if (tail > 0) munmap(aligned + size, tail);
+                p = aligned;
+#ifdef MADV_HUGEPAGE
+                if (hugepages) madvise(p, size, MADV_HUGEPAGE);
+#endif
+            }
+
+#ifdef SYS_mbind
+            // preferred policy falls back to other nodes when the node is out of memory
+            const int mpol_preferred = 1;
+            if (numa_node >= 0 && numa_node < int(sizeof(unsigned long) * 8))
+            {
+                unsigned long mask = 1UL << numa_node;
+                // the kernel reads maxnode - 1 bits of mask
+                syscall(SYS_mbind, p, size, mpol_preferred, &mask, sizeof(mask) * 8 + 1, 0);
+            }
+#endif
+            return (char*)p;
+#else
+            return page_aligned_allocator::malloc(size);
+#endif
+        }
+
+        void unmap_memory(char* p, std::size_t size)
+        {
+#ifdef LIBED2K_LINUX
+            munmap(p, size);
+#else
+            page_aligned_allocator::free(p);
+#endif
+        }
+    }
+
+    slab_arena::slab_arena(int buffer_size) :
+        m_buffer_size(buffer_size), m_id(atomics::fetch_add(&last_arena_id, 1) + 1),
+        m_min_buffers(1), m_hugepages(true), m_numa_node(-1), m_max_slabs(0),
+        m_in_use(0), m_peak_in_use(0), m_flush_epoch(0)
+    {
+        mutex::scoped_lock l(arenas_mutex());
+        arenas()[m_id] = this;
+    }
+
+    slab_arena::~slab_arena()
+    {
+        {
+            mutex::scoped_lock l(arenas_mutex());
+            arenas().erase(m_id);
+        }
+
+        for (std::map<char*, slab>::iterator i = m_slabs.begin(); i != m_slabs.end(); ++i)
+            unmap_memory(i->first, i->second.size);
+    }
+
+    void slab_arena::set_policy(int min_buffers, bool hugepages, int numa_node)
+    {
+        mutex::scoped_lock l(m_mutex);
+        m_min_buffers = std::max(min_buffers, 1);
+        m_hugepages = hugepages;
+        m_numa_node = numa_node;
+    }
+
+    void slab_arena::set_limit(int max_slabs)
+    {
+        mutex::scoped_lock l(m_mutex);
+        m_max_slabs = std::max(max_slabs, 0);
+    }
+
+    char* slab_arena::allocate()
+    {
+        thread_cache& c = local_cache();
+        if (c.count == 0) refill(c);
+        if (c.count == 0) return 0;
+
+        long n = atomics::fetch_add(&m_in_use, 1) + 1;
+        long peak = atomics::load(&m_peak_in_use);
+        while (n > peak && !atomics::compare_exchange(&m_peak_in_use, peak, n))
+            peak = atomics::load(&m_peak_in_use);
+
+        return c.buffers[--c.count];
+    }
+
+    void slab_arena::free(char* buf)
+    {
+        LIBED2K_ASSERT(owns(buf));
+        thread_cache& c = local_cache();
+        if (c.count == thread_cache_size) flush(c, thread_cache_size / 2);
+        c.buffers[c.count++] = buf;
+        atomics::fetch_add(&m_in_use, -1);
+    }
+
+    bool slab_arena::owns(char const* buf) const
+    {
+        mutex::scoped_lock l(m_mutex);
+        return const_cast<slab_arena*>(this)->find_slab(buf) != m_slabs.end();
+    }
+
+    void slab_arena::release_memory()
+    {
+        atomics::fetch_add(&m_flush_epoch, 1);
+        thread_cache& c = local_cache();
+        flush(c, c.count);
+
+        mutex::scoped_lock l(m_mutex);
+        for (std::map<char*, slab>::iterator i = m_slabs.begin(); i != m_slabs.end();)
+        {
+            if (i->second.used > 0)
+            {
+                ++i;
+                continue;
+            }
+
+            m_available.erase(i->first);
+            unmap_memory(i->first, i->second.size);
+            m_slabs.erase(i++);
+        }
+    }
+
+    slab_arena::stats_t slab_arena::stats() const
+    {
+        stats_t ret;
+        int used = 0;
+
+        mutex::scoped_lock l(m_mutex);
+        for (std::map<char*, slab>::const_iterator i = m_slabs.begin(); i != m_slabs.end(); ++i)
+        {
+            const slab& s = i->second;
+            ret.reserved += s.buffers;
+            used += s.used;
+            if (s.hugepages) ++ret.hugepage_slabs;
+            if (s.used > 0) ret.fragmented += s.buffers - s.used;
+        }
+        ret.slabs = m_slabs.size();
+        l.unlock();
+
+        ret.in_use = atomics::load(&m_in_use);
+        ret.peak_in_use = atomics::load(&m_peak_in_use);
+        // counters of threads change meanwhile
+        ret.cached = std::max(used - ret.in_use, 0);
+        return ret;
+    }
+
+    slab_arena::thread_cache& slab_arena::local_cache()
+    {
+        thread_caches*& tc = caches();
+        if (tc == 0)
+        {
+            tc = new thread_caches();
+            if (exit_drain().get() == 0) exit_drain().reset(new thread_exit_drain);
+        }
+
+        const long epoch = atomics::load(&m_flush_epoch);
+        thread_cache* victim = &tc->slots[0];
+        ++tc->uses;
+
+        for (int n = 0; n < thread_cache_slots; ++n)
+        {
+            thread_cache& c = tc->slots[n];
+
+            if (c.arena == m_id)
+            {
+                // release_memory was called by other thread meanwhile
+                if (c.epoch != epoch)
+                {
+                    flush(c, c.count);
+                    c.epoch = epoch;
+                }
+
+                c.last_use = tc->uses;
+                return c;
+            }
+
+            if (victim->arena != 0 && (c.arena == 0 || c.last_use < victim->last_use)) victim = &c;
+        }
+
+        drop(*victim);
+        victim->arena = m_id;
+        victim->epoch = epoch;
+        victim->last_use = tc->uses;
+        return *victim;
+    }
+
+    void slab_arena::drop(thread_cache& c)
+    {
+        // buffers of an arena which is gone are dropped since its slabs are unmapped
+        if (c.count > 0)
+        {
+            mutex::scoped_lock l(arenas_mutex());
+            std::map<long, slab_arena*>::iterator i = arenas().find(c.arena);
+            if (i != arenas().end()) i->second->flush(c, c.count);
+        }
+
+        c.arena = 0;
+        c.count = 0;
+    }
+
+    slab_arena::thread_caches*& slab_arena::caches()
+    {
+        // tls variables of class type aren't portable, caches are allocated on first use
+        static LIBED2K_THREAD_LOCAL thread_caches* tc = 0;
+        return tc;
+    }
+
+    void slab_arena::drain_thread()
+    {
+        thread_caches*& tc = caches();
+        if (tc == 0) return;
+        for (int n = 0; n < thread_cache_slots; ++n) drop(tc->slots[n]);
+        delete tc;
+        tc = 0;
+    }
+
+    namespace
+    {
+        thread_exit_drain::~thread_exit_drain()
+        {
+            slab_arena::drain_thread();
+        }
+    }
+
+    void slab_arena::refill(thread_cache& c)
+    {
+        mutex::scoped_lock l(m_mutex);
+        while (c.count < thread_cache_size / 2)
+        {
+            char* buf = take(l);
+            if (buf == 0) break;
+            c.buffers[c.count++] = buf;
+        }
+    }
+
+    void slab_arena::flush(thread_cache& c, int count)
+    {
+        count = std::min(count, c.count);
+        if (count == 0) return;
+
+        // the oldest buffers go back, recently freed ones are likely in CPU cache
+        mutex::scoped_lock l(m_mutex);
+        for (int n = 0; n < count; ++n) put(c.buffers[n], l);
+        std::memmove(c.buffers, c.buffers + count, (c.count - count) * sizeof(char*));
+        c.count -= count;
+    }
+
+    char* slab_arena::take(mutex::scoped_lock& l)
+    {
+        if (m_available.empty() && !map_slab(l)) return 0;
+
+        std::map<char*, slab>::iterator i = m_slabs.find(*m_available.begin());
+        LIBED2K_ASSERT(i != m_slabs.end());
+        slab& s = i->second;
+        char* ret;
+
+        if (s.free_list)
+        {
+            ret = s.free_list;
+            s.free_list = *(char**)ret;
+        }
+        else
+        {
+            LIBED2K_ASSERT(s.carved < s.buffers);
+            ret = i->first + std::size_t(s.carved++) * m_buffer_size;
+        }
+
+        if (++s.used == s.buffers) m_available.erase(i->first);
+        return ret;
+    }
+
+    void slab_arena::put(char* buf, mutex::scoped_lock& l)
+    {
+        std::map<char*, slab>::iterator i = find_slab(buf);
+        LIBED2K_ASSERT(i != m_slabs.end());
+        slab& s = i->second;
+        LIBED2K_ASSERT(s.used > 0);
+
+        *(char**)buf = s.free_list;
+        s.free_list = buf;
+        --s.used;
+        m_available.insert(i->first);
+    }
+
+    bool slab_arena::map_slab(mutex::scoped_lock& l)
+    {
+        if (m_max_slabs > 0 && int(m_slabs.size()) >= m_max_slabs) return false;
+
+        slab s;
+        s.size = std::size_t(m_min_buffers) * m_buffer_size;
+        s.size = std::max((s.size + hugepage_size - 1) / hugepage_size, std::size_t(1)) * hugepage_size;
+        s.buffers = int(s.size / m_buffer_size);
+        s.free_list = 0;
+        s.carved = 0;
+        s.used = 0;
+
+        char* base = map_memory(s.size, m_hugepages, m_numa_node, s.hugepages);
+        if (base == 0) return false;
+
+        m_slabs[base] = s;
+        m_available.insert(base);
+        return true;
+    }
+
+    std::map<char*, slab_arena::slab>::iterator slab_arena::find_slab(char const* buf)
+    {
+        std::map<char*, slab>::iterator i = m_slabs.upper_bound(const_cast<char*>(buf));
+        if (i == m_slabs.begin()) return m_slabs.end();
+        --i;
+        if (buf >= i->first + i->second.size) return m_slabs.end();
+        return i;
+    }
+}
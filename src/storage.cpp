@@ -63,6 +63,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libed2k/alloca.hpp"
 #include "libed2k/allocator.hpp" // page_size
 #include "libed2k/lazy_entry.hpp"
+#include "libed2k/aich.hpp"
 
 #include <cstdio>
 
@@ -342,16 +343,16 @@ namespace libed2k
                 {
                     if (small_hash && small_piece_size <= block_size)
                     {
-                        ph.h.update((char const*)bufs[i].iov_base, small_piece_size);
+                        ph.update((char const*)bufs[i].iov_base, small_piece_size);
                         *small_hash = hasher(ph.h).final();
                         small_hash = 0; // avoid this case again
                         if (int(bufs[i].iov_len) > small_piece_size)
-                            ph.h.update((char const*)bufs[i].iov_base + small_piece_size
+                            ph.update((char const*)bufs[i].iov_base + small_piece_size
                                 , bufs[i].iov_len - small_piece_size);
                     }
                     else
                     {
-                        ph.h.update((char const*)bufs[i].iov_base, bufs[i].iov_len);
+                        ph.update((char const*)bufs[i].iov_base, bufs[i].iov_len);
                         small_piece_size -= bufs[i].iov_len;
                     }
                     ph.offset += bufs[i].iov_len;
@@ -373,16 +374,16 @@ namespace libed2k
 
                     if (small_hash && small_piece_size <= block_size)
                     {
-                        if (small_piece_size > 0) ph.h.update((char const*)buf.iov_base, small_piece_size);
+                        if (small_piece_size > 0) ph.update((char const*)buf.iov_base, small_piece_size);
                         *small_hash = hasher(ph.h).final();
                         small_hash = 0; // avoid this case again
                         if (int(buf.iov_len) > small_piece_size)
-                            ph.h.update((char const*)buf.iov_base + small_piece_size
+                            ph.update((char const*)buf.iov_base + small_piece_size
                                 , buf.iov_len - small_piece_size);
                     }
                     else
                     {
-                        ph.h.update((char const*)buf.iov_base, buf.iov_len);
+                        ph.update((char const*)buf.iov_base, buf.iov_len);
                         small_piece_size -= buf.iov_len;
                     }
 
@@ -628,7 +629,16 @@ namespace libed2k
         if (!file_handle || ec) return slot;
 
         size_type data_start = file_handle->sparse_end(file_offset);
-        return int((data_start + m_files.piece_length() - 1) / m_files.piece_length());
+        if (data_start >= file_iter->size)
+        {
+            // no data up to the end of the file, the slot
+            // where the next file starts may have some
+            if (file_iter + 1 == files().end()) return m_files.num_pieces();
+            data_start = file_iter->size;
+        }
+
+        // the slot holding the first byte of data has content
+        return int((file_iter->offset + data_start) / m_files.piece_length());
     }
 
     bool default_storage::verify_resume_data(lazy_entry const& rd, error_code& error)
@@ -1378,6 +1388,8 @@ ret:
         if (lock_files) mode |= file::lock_file;
         if (!m_allocate_files) mode |= file::sparse;
         if (m_settings && settings().no_atime_storage) mode |= file::no_atime;
+        if (m_settings && settings().dsync_writes && (mode & file::rw_mask) == file::read_write)
+            mode |= file::dsync;
 
         return m_pool.open_file(const_cast<default_storage*>(this), m_save_path, fe, files(), mode, ec);
     }
@@ -1476,6 +1488,7 @@ ret:
 
     piece_manager::~piece_manager()
     {
+        m_io_thread.forget_ghosts(m_info->info_hash());
     }
 
     void piece_manager::async_finalize_file(int file)
@@ -1669,17 +1682,29 @@ ret:
         m_io_thread.add_job(j, handler);
     }
 
+    void piece_manager::async_aich_hash(int piece
+        , boost::function<void(int, disk_io_job const&)> const& handler)
+    {
+        disk_io_job j;
+        j.storage = this;
+        j.action = disk_io_job::aich_hash;
+        j.piece = piece;
+
+        m_io_thread.add_job(j, handler);
+    }
+
     std::string piece_manager::save_path() const
     {
         mutex::scoped_lock l(m_mutex);
         return m_save_path;
     }
 
-    md4_hash piece_manager::hash_for_piece_impl(int piece, int* readback)
+    md4_hash piece_manager::hash_for_piece_impl(int piece, int* readback
+        , std::vector<sha1_hash>* aich_blocks)
     {
         LIBED2K_ASSERT(!m_storage->error());
 
-        partial_hash ph;
+        partial_hash ph = start_hash();
 
         std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece);
         if (i != m_piece_hasher.end())
@@ -1693,9 +1718,89 @@ ret:
         int read = hash_for_slot(slot, ph, m_files.piece_size(piece));
         if (readback) *readback = read;
         if (m_storage->error()) return md4_hash();
+        if (aich_blocks && ph.aich) *aich_blocks = ph.aich->final();
         return ph.h.final();
     }
 
+    int piece_manager::read_piece_for_hash(int piece, partial_hash& ph, std::vector<file::iovec_t>& bufs)
+    {
+        LIBED2K_ASSERT(!m_storage->error());
+        LIBED2K_ASSERT(bufs.empty());
+
+        std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece);
+        if (i != m_piece_hasher.end())
+        {
+            ph = i->second;
+            m_piece_hasher.erase(i);
+        }
+        else
+        {
+            ph = start_hash();
+        }
+
+        int size = m_files.piece_size(piece) - ph.offset;
+        if (size <= 0) return 0;
+
+        int block_size = m_io_thread.block_size();
+        int num_blocks = (size + block_size - 1) / block_size;
+        bufs.reserve(num_blocks);
+
+        for (int i = 0; i < num_blocks; ++i)
+        {
+            file::iovec_t b;
+            b.iov_base = m_io_thread.allocate_buffer("hash temp");
+            b.iov_len = (std::min)(block_size, size);
+
+            if (b.iov_base == 0)
+            {
+                // give the partial hash back, the piece will be hashed in place
+                for (std::vector<file::iovec_t>::iterator j = bufs.begin(); j != bufs.end(); ++j)
+                    m_io_thread.free_buffer((char*)j->iov_base);
+                bufs.clear();
+                if (ph.offset > 0) m_piece_hasher[piece] = ph;
+                ph = partial_hash();
+                return no_hash_buffers;
+            }
+
+            size -= b.iov_len;
+            bufs.push_back(b);
+        }
+
+        int slot = slot_for(piece);
+        LIBED2K_ASSERT(slot != has_no_slot);
+        return m_storage->readv(&bufs[0], slot, ph.offset, num_blocks);
+    }
+
+    int piece_manager::aich_hash_impl(int piece, std::vector<sha1_hash>& blocks)
+    {
+        LIBED2K_ASSERT(!m_storage->error());
+
+        int slot = slot_for(piece);
+        LIBED2K_ASSERT(slot != has_no_slot);
+
+        int size = m_files.piece_size(piece);
+        int block_size = m_io_thread.block_size();
+        disk_buffer_holder holder(m_io_thread, m_io_thread.allocate_buffer("aich hash temp"));
+        if (!holder.get()) return -1;
+
+        aich_piece_hasher h;
+        file::iovec_t buf;
+        buf.iov_base = holder.get();
+        int num_read = 0;
+
+        for (int offset = 0; offset < size; offset += block_size)
+        {
+            buf.iov_len = (std::min)(block_size, size - offset);
+            int ret = m_storage->readv(&buf, slot, offset, 1);
+            if (ret < int(buf.iov_len) || error()) return num_read;
+            num_read += ret;
+            h.update((char const*)buf.iov_base, buf.iov_len);
+        }
+
+        blocks = h.final();
+        return num_read;
+    }
+
     int piece_manager::move_storage_impl(std::string const& save_path)
     {
         if (m_storage->move_storage(save_path))
@@ -1787,96 +1892,75 @@ ret:
         LIBED2K_ASSERT(num_bufs > 0);
         LIBED2K_ASSERT(piece_index >= 0 && piece_index < m_files.num_pieces());
 
-        int size = bufs_size(bufs, num_bufs);
-
-        file::iovec_t* iov = LIBED2K_ALLOCA(file::iovec_t, num_bufs);
-        std::copy(bufs, bufs + num_bufs, iov);
         m_last_piece = piece_index;
         int slot = allocate_slot_for_piece(piece_index);
-        int ret = m_storage->writev(bufs, slot, offset, num_bufs);
-        // only save the partial hash if the write succeeds
-        if (ret != size) return ret;
+        return m_storage->writev(bufs, slot, offset, num_bufs);
+    }
+
+    bool piece_manager::hash_blocks(int piece_index, int offset
+        , file::iovec_t const* bufs, int num_bufs)
+    {
+        LIBED2K_ASSERT(offset >= 0);
+        LIBED2K_ASSERT(piece_index >= 0 && piece_index < m_files.num_pieces());
 
-        if (m_storage->settings().disable_hash_checks) return ret;
+        if (m_storage->settings().disable_hash_checks) return true;
 
 #if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
         std::ofstream out("partial_hash.log", std::ios::app);
 #endif
 
-        if (offset == 0)
-        {
-            partial_hash& ph = m_piece_hasher[piece_index];
-            LIBED2K_ASSERT(ph.offset == 0);
-            ph.offset = size;
-
-            for (file::iovec_t* i = iov, *end(iov + num_bufs); i < end; ++i)
-                ph.h.update((char const*)i->iov_base, i->iov_len);
+        std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece_index);
+        int hash_offset = (i == m_piece_hasher.end()) ? 0 : i->second.offset;
 
+        // only the block right after the hashed part can extend the hash,
+        // the caller keeps later blocks until the gap is filled
+        if (offset != hash_offset)
+        {
 #if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
-            out << time_now_string() << " NEW ["
+            out << time_now_string() << " SKIPPING (out of order) ["
                 " s: " << this
                 << " p: " << piece_index
                 << " off: " << offset
-                << " size: " << size
+                << " hashed: " << hash_offset
                 << " entries: " << m_piece_hasher.size()
                 << " ]" << std::endl;
 #endif
+            return false;
         }
-        else
+
+        if (i == m_piece_hasher.end())
+            i = m_piece_hasher.insert(std::make_pair(piece_index, start_hash())).first;
+
+        for (file::iovec_t const* b = bufs, *end(bufs + num_bufs); b < end; ++b)
         {
-            std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece_index);
-            if (i != m_piece_hasher.end())
-            {
-#ifdef LIBED2K_DEBUG
-                LIBED2K_ASSERT(i->second.offset > 0);
-                int hash_offset = i->second.offset;
-                LIBED2K_ASSERT(offset >= hash_offset);
-#endif
-                if (offset == i->second.offset)
-                {
-#ifdef LIBED2K_PARTIAL_HASH_LOG
-                    out << time_now_string() << " UPDATING ["
-                        " s: " << this
-                        << " p: " << piece_index
-                        << " off: " << offset
-                        << " size: " << size
-                        << " entries: " << m_piece_hasher.size()
-                        << " ]" << std::endl;
-#endif
-                    for (file::iovec_t* b = iov, *end(iov + num_bufs); b < end; ++b)
-                    {
-                        i->second.h.update((char const*)b->iov_base, b->iov_len);
-                        i->second.offset += b->iov_len;
-                    }
-                }
-#ifdef LIBED2K_PARTIAL_HASH_LOG
-                else
-                {
-                    out << time_now_string() << " SKIPPING (out of order) ["
-                        " s: " << this
-                        << " p: " << piece_index
-                        << " off: " << offset
-                        << " size: " << size
-                        << " entries: " << m_piece_hasher.size()
-                        << " ]" << std::endl;
-                }
-#endif
-            }
-#ifdef LIBED2K_PARTIAL_HASH_LOG
-            else
-            {
-                out << time_now_string() << " SKIPPING (no entry) ["
-                    " s: " << this
-                    << " p: " << piece_index
-                    << " off: " << offset
-                    << " size: " << size
-                    << " entries: " << m_piece_hasher.size()
-                    << " ]" << std::endl;
-            }
-#endif
+            i->second.update((char const*)b->iov_base, b->iov_len);
+            i->second.offset += b->iov_len;
         }
 
-        return ret;
+#if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
+        out << time_now_string() << " UPDATING ["
+            " s: " << this
+            << " p: " << piece_index
+            << " off: " << offset
+            << " hashed: " << i->second.offset
+            << " entries: " << m_piece_hasher.size()
+            << " ]" << std::endl;
+#endif
+        return true;
+    }
+
+    int piece_manager::hashed_bytes(int piece_index) const
+    {
+        std::map<int, partial_hash>::const_iterator i = m_piece_hasher.find(piece_index);
+        return i == m_piece_hasher.end() ? 0 : i->second.offset;
+    }
+
+    partial_hash piece_manager::start_hash() const
+    {
+        partial_hash ph;
+        if (m_storage->settings().hashing_aich && aich_hashset::recoverable(m_files.total_size()))
+            ph.aich.reset(new aich_piece_hasher);
+        return ph;
     }
 
     size_type piece_manager::physical_offset(
@@ -2460,6 +2544,70 @@ ret:
         return need_full_check;
     }
 
+    bool piece_manager::can_check_fast() const
+    {
+        return m_state == state_full_check
+            && m_storage_mode != internal_storage_mode_compact_deprecated;
+    }
+
+    int piece_manager::check_next_slot(int& slot, std::vector<file::iovec_t>& bufs, error_code& error)
+    {
+        LIBED2K_ASSERT(can_check_fast());
+        LIBED2K_ASSERT(bufs.empty());
+        slot = -1;
+
+        // slots in sparse regions were never written, they are missing
+        while (m_current_slot < m_files.num_pieces())
+        {
+            int next_slot = (std::min)(m_storage->sparse_end(m_current_slot), m_files.num_pieces());
+            if (next_slot <= m_current_slot) break;
+            m_current_slot = next_slot;
+        }
+
+        if (m_current_slot >= m_files.num_pieces())
+        {
+            std::multimap<md4_hash, int>().swap(m_hash_to_piece);
+            std::vector<int>().swap(m_piece_to_slot);
+            std::vector<int>().swap(m_slot_to_piece);
+            return check_init_storage(error);
+        }
+
+        partial_hash ph;
+        int num_read = read_piece_for_hash(m_current_slot, ph, bufs);
+
+        // no buffers for the piece now, it is read again later
+        if (num_read == no_hash_buffers) return need_full_check;
+
+        if (num_read != m_files.piece_size(m_current_slot))
+        {
+            for (std::vector<file::iovec_t>::iterator i = bufs.begin(); i != bufs.end(); ++i)
+                m_io_thread.free_buffer((char*)i->iov_base);
+            bufs.clear();
+
+            if (m_storage->error()
+#ifdef LIBED2K_WINDOWS
+                && m_storage->error() != error_code(ERROR_PATH_NOT_FOUND, get_system_category())
+                && m_storage->error() != error_code(ERROR_FILE_NOT_FOUND, get_system_category())
+                && m_storage->error() != error_code(ERROR_HANDLE_EOF, get_system_category())
+                && m_storage->error() != error_code(ERROR_INVALID_HANDLE, get_system_category()))
+#else
+                && m_storage->error() != error_code(ENOENT, get_posix_category()))
+#endif
+            {
+                error = m_storage->error();
+                return fatal_disk_error;
+            }
+
+            // if the file is incomplete, skip the rest of it
+            clear_error();
+            m_current_slot += skip_file();
+            return need_full_check;
+        }
+
+        slot = m_current_slot++;
+        return need_full_check;
+    }
+
     int piece_manager::skip_file() const
     {
         size_type file_offset = 0;
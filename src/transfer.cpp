@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include "libed2k/version.hpp"
 #include "libed2k/session.hpp"
 #include "libed2k/session_impl.hpp"
@@ -57,9 +59,13 @@ namespace libed2k
         m_total_redundant_bytes(0),
         m_minute_timer(minutes(1), min_time()),
         m_need_save_resume_data(true),
-        m_last_active(0)
+        m_need_resume_checkpoint(true),
+        m_last_active(0),
+        m_aich(p.file_size),
+        m_aich_root(p.aich_root)
     {
         if (p.resume_data) m_resume_data.swap(*p.resume_data);
+        if (m_aich.assign(p.aich_hashes)) aich_part_added();
     }
 
     transfer::~transfer()
@@ -101,6 +107,8 @@ namespace libed2k
         res.requested = m_requested;
         res.transferred = m_transferred;
         res.priority = m_priority;
+        res.aich_root = m_aich_root;
+        res.aich_hashes = m_aich.blocks();
         return res;
     }
 
@@ -220,7 +228,7 @@ namespace libed2k
         peerinfo->last_connected = m_ses.session_time();
         peerinfo->next_connect = 0;
 
-        tcp::endpoint ep(peerinfo->endpoint);
+        tcp::endpoint ep(peerinfo->ip());
         LIBED2K_ASSERT((m_ses.m_ip_filter.access(peerinfo->address()) & ip_filter::blocked) == 0);
 
         boost::shared_ptr<tcp::socket> sock(new tcp::socket(m_ses.m_io_service));
@@ -369,8 +377,23 @@ namespace libed2k
 
     int transfer::disconnect_peers(int num, error_code const& ec)
     {
-        // FIXME - implement method
-        return 0;
+        std::vector<ranked_connection> peers;
+        peers.reserve(m_connections.size());
+
+        for (std::set<peer_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); ++i)
+        {
+            if (!(*i)->is_disconnecting())
+                peers.push_back(std::make_pair((*i)->get_disconnect_rank(), boost::intrusive_ptr<peer_connection>(*i)));
+        }
+
+        num = select_disconnects(peers, num, false);
+
+        for (int n = 0; n < num; ++n)
+        {
+            peers[n].second->disconnect(ec);
+        }
+
+        return num;
     }
 
     bool transfer::try_connect_peer()
@@ -382,8 +405,24 @@ namespace libed2k
     void transfer::piece_passed(int index)
     {
         bool was_finished = (num_have() == num_pieces());
+
+        // the deadline is taken before the picker may go away with the last piece
+        int deadline_flags = 0;
+        bool had_deadline = has_picker() && m_picker->reset_piece_deadline(index, &deadline_flags);
+
         we_have(index);
-        m_need_save_resume_data = true;
+        set_need_save_resume();
+
+        if (had_deadline && (deadline_flags & transfer_handle::alert_when_available))
+            read_piece(index);
+
+        // AICH hashes of verified part let us serve recovery data later,
+        // they're usually hashed with the piece already
+        if (m_ses.settings().hashing_aich && aich_hashset::recoverable(size()) && !m_aich.has_part(index))
+        {
+            m_storage->async_aich_hash(
+                index, boost::bind(&transfer::on_aich_part_hashed, shared_from_this(), _1, _2));
+        }
 
         if (!was_finished && is_finished())
         {
@@ -532,7 +571,7 @@ namespace libed2k
         m_paused = true;
 
         // we need to save this new state
-        m_need_save_resume_data = true;
+        set_need_save_resume();
 
         if (!m_ses.is_paused())
             do_pause();
@@ -577,7 +616,7 @@ namespace libed2k
         m_paused = false;
 
         // we need to save this new state
-        m_need_save_resume_data = true;
+        set_need_save_resume();
 
         do_resume();
     }
@@ -691,7 +730,7 @@ namespace libed2k
         if (index < 0 || index >= int(num_pieces())) return;
 
         if (m_picker->set_piece_priority(index, priority))
-            m_need_save_resume_data = true;
+            set_need_save_resume();
     }
 
     int transfer::piece_priority(int index) const
@@ -732,6 +771,187 @@ namespace libed2k
 
     void transfer::set_sequential_download(bool sd) { m_sequential_download = sd; }
 
+    void transfer::set_piece_deadline(int piece, int deadline_ms, int flags)
+    {
+        LIBED2K_ASSERT(piece >= 0);
+        LIBED2K_ASSERT(piece < int(num_pieces()));
+        if (piece < 0 || piece >= int(num_pieces())) return;
+
+        add_time_critical_piece(piece, deadline_ms, flags);
+        request_time_critical_pieces();
+    }
+
+    void transfer::set_range_deadline(size_type offset, size_type length, int deadline_ms, int flags)
+    {
+        if (offset < 0 || length <= 0 || offset >= size()) return;
+
+        int first = int(offset / PIECE_SIZE);
+        int last = int((std::min(offset + length, size()) - 1) / PIECE_SIZE);
+        for (int piece = first; piece <= last; ++piece)
+            add_time_critical_piece(piece, deadline_ms, flags);
+
+        request_time_critical_pieces();
+    }
+
+    void transfer::reset_piece_deadline(int piece)
+    {
+        if (has_picker()) m_picker->reset_piece_deadline(piece);
+    }
+
+    void transfer::clear_piece_deadlines()
+    {
+        if (has_picker()) m_picker->clear_piece_deadlines();
+    }
+
+    void transfer::add_time_critical_piece(int piece, int deadline_ms, int flags)
+    {
+        // the piece is already here, nothing to request
+        if (have_piece(piece))
+        {
+            if (flags & transfer_handle::alert_when_available) read_piece(piece);
+            return;
+        }
+
+        if (!has_picker()) return;
+        m_picker->set_piece_deadline(piece, time_now() + milliseconds(deadline_ms), flags);
+    }
+
+    void transfer::request_time_critical_pieces()
+    {
+        if (!has_picker() || m_picker->time_critical_pieces().empty()) return;
+        if (is_paused() || upload_mode()) return;
+
+        std::vector<peer_connection*> peers;
+        for (std::set<peer_connection*>::const_iterator i = m_connections.begin();
+             i != m_connections.end(); ++i)
+        {
+            if ((*i)->can_request()) peers.push_back(*i);
+        }
+
+        if (peers.empty()) return;
+
+        std::vector<bool> requested_from(peers.size(), false);
+        ptime now = time_now();
+
+        std::deque<piece_picker::time_critical_piece> const& pieces = m_picker->time_critical_pieces();
+        for (std::deque<piece_picker::time_critical_piece>::const_iterator i = pieces.begin();
+             i != pieces.end(); ++i)
+        {
+            const int piece = i->piece;
+            if (m_picker->have_piece(piece)) continue;
+
+            for (int b = 0, end(m_picker->blocks_in_piece(piece)); b != end; ++b)
+            {
+                piece_block block(piece, b);
+                if (m_picker->is_finished(block) || m_picker->is_downloaded(block)) continue;
+
+                // a block already requested from a peer is requested from
+                // one more when that peer isn't expected to deliver it in time
+                bool busy = m_picker->is_requested(block);
+                if (busy)
+                {
+                    if (m_picker->num_peers(block) > 1) continue;
+                    peer* p = static_cast<peer*>(m_picker->get_downloader(block));
+                    if (p && p->connection && now + p->connection->download_queue_time() < i->deadline)
+                        continue;
+                }
+
+                // the peer expected to deliver the block first gets it.
+                // Peers we asked for something already take it only in time
+                int best = -1;
+                time_duration best_time;
+                for (int k = 0; k < int(peers.size()); ++k)
+                {
+                    peer_connection* c = peers[k];
+                    if (!c->remote_pieces().get_bit(piece)) continue;
+                    if (busy && c->requesting(block)) continue;
+
+                    time_duration t = c->download_queue_time(BLOCK_SIZE);
+                    if ((busy || requested_from[k]) && now + t >= i->deadline) continue;
+                    if (best == -1 || t < best_time)
+                    {
+                        best = k;
+                        best_time = t;
+                    }
+                }
+
+                if (best == -1) continue;
+
+                int flags = peer_connection::req_time_critical;
+                if (busy) flags |= peer_connection::req_busy;
+                if (peers[best]->add_request(block, flags)) requested_from[best] = true;
+            }
+        }
+
+        for (int k = 0; k < int(peers.size()); ++k)
+            if (requested_from[k]) peers[k]->send_block_requests();
+    }
+
+    void transfer::read_piece(int piece)
+    {
+        if (piece < 0 || piece >= int(num_pieces()) || !have_piece(piece) || !m_storage)
+        {
+            m_ses.m_alerts.post_alert_should(
+                read_piece_alert(handle(), piece, errors::invalid_piece_index));
+            return;
+        }
+
+        const int piece_size = m_info->piece_size(piece);
+        const int blocks_in_piece = int((piece_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+        boost::shared_ptr<read_piece_struct> rp(new read_piece_struct);
+        rp->piece_data.reset(new (std::nothrow) char[piece_size]);
+        rp->blocks_left = 0;
+        rp->fail = false;
+
+        if (!rp->piece_data)
+        {
+            m_ses.m_alerts.post_alert_should(
+                read_piece_alert(handle(), piece, error_code(boost::asio::error::no_memory)));
+            return;
+        }
+
+        for (int b = 0; b < blocks_in_piece; ++b)
+        {
+            peer_request r(piece, b * BLOCK_SIZE, std::min(piece_size - b * int(BLOCK_SIZE), int(BLOCK_SIZE)));
+            ++rp->blocks_left;
+            m_storage->async_read(r, boost::bind(&transfer::on_disk_read_complete,
+                                                 shared_from_this(), _1, _2, r, rp));
+        }
+    }
+
+    void transfer::on_disk_read_complete(int ret, disk_io_job const& j,
+                                         peer_request r, boost::shared_ptr<read_piece_struct> rp)
+    {
+        boost::mutex::scoped_lock l(m_ses.m_mutex);
+
+        disk_buffer_holder buffer(m_ses.m_disk_thread, j.buffer);
+
+        --rp->blocks_left;
+        if (ret != r.length)
+        {
+            rp->fail = true;
+            rp->error = j.error;
+            handle_disk_error(j);
+        }
+        else
+        {
+            std::memcpy(rp->piece_data.get() + r.start, buffer.get(), r.length);
+        }
+
+        if (rp->blocks_left > 0) return;
+
+        if (rp->fail)
+        {
+            m_ses.m_alerts.post_alert_should(read_piece_alert(handle(), r.piece, rp->error));
+        }
+        else
+        {
+            m_ses.m_alerts.post_alert_should(
+                read_piece_alert(handle(), r.piece, rp->piece_data, m_info->piece_size(r.piece)));
+        }
+    }
+
     void transfer::piece_failed(int index)
     {
         LIBED2K_ASSERT(m_storage);
@@ -740,11 +960,18 @@ namespace libed2k
         LIBED2K_ASSERT(index >= 0);
         LIBED2K_ASSERT(index < int(num_pieces()));
 
+        // a late block completed the piece waiting for recovery data again
+        if (m_aich_recovering.count(index)) return;
+
         m_ses.m_alerts.post_alert_should(hash_failed_alert(handle(), index));
 
         // increase the total amount of failed bytes
         add_failed_bytes(PIECE_SIZE);
 
+        // the piece stays finished until AICH recovery data comes,
+        // then only its corrupted blocks are downloaded again
+        if (request_aich_recovery(index)) return;
+
         // TODO:
         // decrease the trust point of all peers that sent
         // parts of this piece.
@@ -792,6 +1019,177 @@ namespace libed2k
         }
     }
 
+    void transfer::aich_root_received(const sha1_hash& root, peer_connection* c)
+    {
+        if (!m_aich_root.is_all_zeros() || root.is_all_zeros()) return;
+
+        std::set<address>& votes = m_aich_votes[root];
+        votes.insert(c->remote().address());
+
+        // conflicting roots are never trusted
+        if (m_aich_votes.size() == 1 && int(votes.size()) >= m_ses.settings().aich_trust_sources)
+        {
+            DBG("AICH root hash is trusted: {transfer: " << hash() << ", root: " << root <<
+                ", sources: " << votes.size() << "}");
+            m_aich_root = root;
+            m_aich_votes.clear();
+            set_need_save_resume();
+        }
+    }
+
+    void transfer::aich_recovery_received(int part, const sha1_hash& root,
+        const aich_recovery& rd, peer_connection* c)
+    {
+        // answer without data doesn't tell its part
+        std::map<int, aich_recovery_state>::iterator itr = m_aich_recovering.begin();
+        if (part >= 0) itr = m_aich_recovering.find(part);
+        else while (itr != m_aich_recovering.end() && itr->second.peer != c->remote()) ++itr;
+
+        if (itr == m_aich_recovering.end() || itr->second.peer != c->remote()) return;
+        part = itr->first;
+
+        std::vector<sha1_hash> blocks;
+        if (root != m_aich_root || !aich_hashset::verify(m_aich_root, size(), part, rd, blocks))
+        {
+            DBG("AICH recovery data rejected: {transfer: " << hash() << ", piece: " << part <<
+                ", hashes: " << rd.size() << ", peer: " << c->remote() << "}");
+            if (!request_aich_recovery(part)) aich_recovery_failed(part);
+            return;
+        }
+
+        // hashes are verified by the trusted root
+        if (!m_aich.has_part(part))
+        {
+            m_aich.set_part(part, blocks);
+            aich_part_added();
+        }
+
+        itr->second.peer = tcp::endpoint();
+        m_storage->async_aich_hash(part, boost::bind(&transfer::on_aich_recovery_hashed,
+            shared_from_this(), _1, _2, blocks));
+    }
+
+    bool transfer::request_aich_recovery(int index)
+    {
+        if (m_aich_root.is_all_zeros() || !aich_hashset::recoverable(size()) || !has_picker())
+            return false;
+
+        aich_recovery_state& st = m_aich_recovering[index];
+
+        for (std::set<peer_connection*>::const_iterator i = m_connections.begin();
+             i != m_connections.end(); ++i)
+        {
+            peer_connection* p = *i;
+            const bitfield& pieces = p->remote_pieces();
+            if (!p->supports_aich() || st.asked.count(p->remote()) ||
+                int(pieces.size()) <= index || !pieces[index])
+                continue;
+
+            st.asked.insert(p->remote());
+            st.peer = p->remote();
+            st.deadline = time_now() + seconds(m_ses.settings().aich_recovery_timeout);
+            p->write_aich_request(hash(), index, m_aich_root);
+            return true;
+        }
+
+        m_aich_recovering.erase(index);
+        return false;
+    }
+
+    void transfer::aich_recovery_failed(int index)
+    {
+        m_aich_recovering.erase(index);
+        if (!has_picker() || m_picker->have_piece(index)) return;
+
+        DBG("AICH recovery failed, download whole piece: {transfer: " << hash() << ", piece: " << index << "}");
+        m_picker->restore_piece(index);
+        restore_piece_state(index);
+    }
+
+    void transfer::on_aich_recovery_hashed(int ret, disk_io_job const& j, std::vector<sha1_hash> const& trusted)
+    {
+        boost::mutex::scoped_lock l(m_ses.m_mutex);
+
+        const int index = j.piece;
+        if (!m_aich_recovering.count(index)) return;
+
+        if (ret < 0 || !j.aich_blocks || j.aich_blocks->size() != trusted.size())
+        {
+            if (ret < 0) handle_disk_error(j);
+            aich_recovery_failed(index);
+            return;
+        }
+
+        m_aich_recovering.erase(index);
+        if (!has_picker() || m_picker->have_piece(index)) return;
+
+        // picker block is kept when all AICH blocks it overlaps are good
+        const std::vector<sha1_hash>& stored = *j.aich_blocks;
+        const size_type piece_size = m_info->piece_size(index);
+        const int blocks_in_piece = m_picker->blocks_in_piece(index);
+        std::vector<int> good;
+
+        for (int b = 0; b < blocks_in_piece; ++b)
+        {
+            size_type begin = b * BLOCK_SIZE;
+            size_type end = std::min(begin + BLOCK_SIZE, piece_size);
+            bool ok = true;
+
+            for (int k = int(begin / AICH_BLOCK_SIZE); ok && k <= int((end - 1) / AICH_BLOCK_SIZE); ++k)
+                ok = stored[k] == trusted[k];
+
+            if (ok) good.push_back(b);
+        }
+
+        m_picker->restore_piece(index);
+
+        // data matches AICH hashes but not MD4 hash, nothing can be kept
+        if (int(good.size()) == blocks_in_piece) good.clear();
+
+        for (std::vector<int>::const_iterator i = good.begin(); i != good.end(); ++i)
+            m_picker->mark_as_finished(piece_block(index, *i), 0);
+
+        restore_piece_state(index);
+        set_need_save_resume();
+
+        DBG("AICH recovered piece: {transfer: " << hash() << ", piece: " << index <<
+            ", kept blocks: " << good.size() << " of " << blocks_in_piece << "}");
+    }
+
+    void transfer::on_aich_part_hashed(int ret, disk_io_job const& j)
+    {
+        boost::mutex::scoped_lock l(m_ses.m_mutex);
+
+        if (ret < 0)
+        {
+            handle_disk_error(j);
+            return;
+        }
+
+        if (!j.aich_blocks || m_aich.has_part(j.piece)) return;
+        m_aich.set_part(j.piece, *j.aich_blocks);
+        aich_part_added();
+    }
+
+    void transfer::aich_part_added()
+    {
+        set_need_save_resume();
+        if (!m_aich.complete()) return;
+
+        // hash set of verified data is the final word on root hash
+        sha1_hash root = m_aich.root();
+        if (root == m_aich_root) return;
+
+        if (!m_aich_root.is_all_zeros())
+        {
+            ERR("AICH root hash doesn't match verified data: {transfer: " << hash() <<
+                ", root: " << m_aich_root << ", data: " << root << "}");
+        }
+
+        m_aich_root = root;
+        m_aich_votes.clear();
+    }
+
     int transfer::num_peers() const
     {
         return (int)std::count_if(
@@ -1253,6 +1651,15 @@ namespace libed2k
 
     void transfer::second_tick(stat& accumulator, int tick_interval_ms, const ptime& now)
     {
+        for (std::map<int, aich_recovery_state>::iterator i = m_aich_recovering.begin();
+             i != m_aich_recovering.end(); )
+        {
+            int index = i->first;
+            bool expired = i->second.peer != tcp::endpoint() && now >= i->second.deadline;
+            ++i;
+            if (expired && !request_aich_recovery(index)) aich_recovery_failed(index);
+        }
+
         if (m_minute_timer.expired(now) && m_connections.size() == 0 && !is_paused() && !is_aborted())
             request_peers();
 
@@ -1276,6 +1683,8 @@ namespace libed2k
         if (active()) m_last_active = 0;
         else m_last_active += div_ceil(tick_interval_ms, 1000);
 
+        request_time_critical_pieces();
+
         for (std::set<peer_connection*>::iterator i = m_connections.begin();
              i != m_connections.end();)
         {
@@ -1338,6 +1747,14 @@ namespace libed2k
         state_updated();
 
         if (ret == -1) handle_disk_error(j);
+
+        // AICH blocks hashed with the piece, piece_passed reads them back otherwise
+        if (ret == 0 && j.aich_blocks && !m_aich.has_part(j.piece))
+        {
+            m_aich.set_part(j.piece, *j.aich_blocks);
+            if (m_aich.has_part(j.piece)) aich_part_added();
+        }
+
         f(ret);
     }
 
@@ -1508,6 +1925,32 @@ namespace libed2k
         }
     }
 
+    bool transfer::resume_checkpoint()
+    {
+        // files aren't checked yet, resume data is taken later
+        if (!m_need_resume_checkpoint || !m_owning_storage.get()
+            || m_state == transfer_status::queued_for_checking
+            || m_state == transfer_status::checking_files
+            || m_state == transfer_status::checking_resume_data)
+            return false;
+
+        m_need_resume_checkpoint = false;
+        m_storage->async_save_resume_data(
+            boost::bind(&transfer::on_resume_checkpoint, shared_from_this(), _1, _2));
+        return true;
+    }
+
+    void transfer::on_resume_checkpoint(int ret, disk_io_job const& j)
+    {
+        boost::mutex::scoped_lock l(m_ses.m_mutex);
+
+        // taken by the next checkpoint
+        if (!j.resume_data) m_need_resume_checkpoint = true;
+        else write_resume_data(*j.resume_data);
+
+        m_ses.add_resume_checkpoint(shared_from_this(), j.resume_data);
+    }
+
     bool transfer::should_check_file() const
     {
         return
@@ -1730,6 +2173,24 @@ namespace libed2k
             hv.push_back(piece_hashses.at(n).toString());
         }
 
+        // AICH hash set, hashes of blocks of each part are stored in one string
+        if (!m_aich_root.is_all_zeros()) ret["aich-root"] = m_aich_root.to_string();
+        ret["aich-parts"] = entry::list_type();
+        entry::list_type& ap = ret["aich-parts"].list();
+
+        for (int n = 0; n < m_aich.num_parts(); ++n)
+        {
+            std::string part;
+            if (m_aich.has_part(n))
+            {
+                const std::vector<sha1_hash>& blocks = m_aich.part(n);
+                part.reserve(blocks.size() * sha1_hash::size);
+                for (size_t k = 0; k < blocks.size(); ++k)
+                    part += blocks[k].to_string();
+            }
+            ap.push_back(part);
+        }
+
         ret["upload_rate_limit"] = upload_limit();
         ret["download_rate_limit"] = download_limit();
         // TODO - add real values
@@ -1767,6 +2228,26 @@ namespace libed2k
 
         int paused_ = rd.dict_find_int_value("paused", -1);
         if (paused_ != -1) m_paused = paused_;
+
+        std::string aich_root = rd.dict_find_string_value("aich-root");
+        if (aich_root.size() == sha1_hash::size) m_aich_root.assign(aich_root);
+
+        if (lazy_entry const* ap = rd.dict_find_list("aich-parts"))
+        {
+            for (int n = 0; n < std::min(ap->list_size(), m_aich.num_parts()); ++n)
+            {
+                std::string part = ap->list_string_value_at(n);
+                if (int(part.size()) != aich_hashset::blocks_in_part(size(), n) * sha1_hash::size)
+                    continue;
+
+                std::vector<sha1_hash> blocks;
+                for (size_t k = 0; k < part.size(); k += sha1_hash::size)
+                    blocks.push_back(sha1_hash(part.c_str() + k));
+                m_aich.set_part(n, blocks);
+            }
+
+            aich_part_added();
+        }
     }
 
     void transfer::handle_disk_write(const disk_io_job& j, peer_connection* c)
@@ -1778,7 +2259,7 @@ namespace libed2k
 
         piece_block block_finished(j.piece, j.offset/BLOCK_SIZE);
         m_picker->mark_as_finished(block_finished, c->get_peer());
-        m_need_save_resume_data = true;
+        set_need_save_resume();
     }
 
     void transfer::handle_disk_error(disk_io_job const& j, peer_connection* c)
@@ -159,6 +159,31 @@ namespace libed2k
         LIBED2K_FORWARD(set_sequential_download(sd));
     }
 
+    void transfer_handle::set_piece_deadline(int index, int deadline, int flags) const
+    {
+        LIBED2K_FORWARD(set_piece_deadline(index, deadline, flags));
+    }
+
+    void transfer_handle::set_range_deadline(size_type offset, size_type length, int deadline, int flags) const
+    {
+        LIBED2K_FORWARD(set_range_deadline(offset, length, deadline, flags));
+    }
+
+    void transfer_handle::reset_piece_deadline(int index) const
+    {
+        LIBED2K_FORWARD(reset_piece_deadline(index));
+    }
+
+    void transfer_handle::clear_piece_deadlines() const
+    {
+        LIBED2K_FORWARD(clear_piece_deadlines());
+    }
+
+    void transfer_handle::read_piece(int index) const
+    {
+        LIBED2K_FORWARD(read_piece(index));
+    }
+
     void transfer_handle::set_upload_limit(int limit) const
     {
         LIBED2K_FORWARD(set_upload_limit(limit));
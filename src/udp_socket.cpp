@@ -51,6 +51,20 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libed2k/debug.hpp"
 #endif
 
+#if LIBED2K_USE_MMSG
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#include <string.h>
+
+// UDP segmentation offload appeared in linux 4.18, older
+// headers don't have it and older kernels reject it at runtime
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#endif
+
 using namespace libed2k;
 
 udp_socket::udp_socket(asio::io_service& ios
@@ -83,6 +97,9 @@ udp_socket::udp_socket(asio::io_service& ios
     , m_force_proxy(false)
     , m_abort(false)
     , m_outstanding_ops(0)
+    , m_batch_size(max_batch_size)
+    , m_cork(0)
+    , m_gso(true)
 {
 #if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
     m_magic = 0x1337;
@@ -220,14 +237,247 @@ void udp_socket::send(udp::endpoint const& ep, char const* p, int len, error_cod
 
     if (m_force_proxy) return;
 
-#if LIBED2K_USE_IPV6
-    if (ep.address().is_v4() && m_ipv4_sock.is_open())
+#if LIBED2K_USE_MMSG
+    if (m_cork > 0 && m_batch_size > 1)
+    {
+        batched_packet bp;
+        bp.ep = ep;
+        bp.offset = m_send_batch_buf.size();
+        bp.size = len;
+        m_send_batch_buf.insert(m_send_batch_buf.end(), p, p + len);
+        m_send_batch.push_back(bp);
+        ec.clear();
+        if (int(m_send_batch.size()) >= m_batch_size) flush_sends();
+        return;
+    }
 #endif
-        m_ipv4_sock.send_to(asio::buffer(p, len), ep, 0, ec);
+
+    send_now(ep, p, len, ec);
+}
+
+udp::socket& udp_socket::socket_for(udp::endpoint const& ep)
+{
 #if LIBED2K_USE_IPV6
-    else
-        m_ipv6_sock.send_to(asio::buffer(p, len), ep, 0, ec);
+    if (!ep.address().is_v4() || !m_ipv4_sock.is_open()) return m_ipv6_sock;
 #endif
+    return m_ipv4_sock;
+}
+
+void udp_socket::send_now(udp::endpoint const& ep, char const* p, int len, error_code& ec)
+{
+    socket_for(ep).send_to(asio::buffer(p, len), ep, 0, ec);
+}
+
+void udp_socket::uncork()
+{
+    LIBED2K_ASSERT(m_cork > 0);
+    if (--m_cork > 0) return;
+    if (!m_send_batch.empty()) flush_sends();
+}
+
+void udp_socket::set_batch_size(int s)
+{
+    m_batch_size = (std::max)(1, (std::min)(s, int(max_batch_size)));
+    if (m_batch_size == 1 && !m_send_batch.empty()) flush_sends();
+}
+
+int udp_socket::split_batch(std::vector<batched_packet> const& batch
+    , int begin, int end, bool gso, int* first)
+{
+    int msg = 0;
+    int j = begin;
+    while (j < end)
+    {
+        batched_packet const& bp = batch[j];
+        first[msg++] = j;
+        int bytes = bp.size;
+        ++j;
+
+        while (gso && j < end)
+        {
+            batched_packet const& next = batch[j];
+            if (next.ep != bp.ep || next.size > bp.size
+                || batch[j - 1].size != bp.size
+                || bytes + next.size > 0xffff - 100) break;
+            bytes += next.size;
+            ++j;
+        }
+    }
+    first[msg] = end;
+    return msg;
+}
+
+#if LIBED2K_USE_MMSG
+void udp_socket::flush_sends()
+{
+    LIBED2K_ASSERT(is_single_thread());
+
+    mmsghdr msgs[max_batch_size];
+    iovec iov[max_batch_size];
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(boost::uint16_t))];
+        cmsghdr align;
+    } control[max_batch_size];
+    // index of the first packet of every message
+    int first[max_batch_size + 1];
+
+    int const count = m_send_batch.size();
+    int i = 0;
+
+    while (i < count)
+    {
+        // a system call sends the packets going out
+        // through the socket of the first one
+        udp::socket& sock = socket_for(m_send_batch[i].ep);
+        int end = i + 1;
+        while (end < count && end - i < max_batch_size
+            && &socket_for(m_send_batch[end].ep) == &sock) ++end;
+
+        int const msg = split_batch(m_send_batch, i, end, m_gso, first);
+        for (int n = 0; n < msg; ++n)
+        {
+            int const j = first[n];
+            int const segments = first[n + 1] - j;
+            batched_packet const& bp = m_send_batch[j];
+
+            for (int k = 0; k < segments; ++k)
+            {
+                iov[j - i + k].iov_base = &m_send_batch_buf[m_send_batch[j + k].offset];
+                iov[j - i + k].iov_len = m_send_batch[j + k].size;
+            }
+
+            msghdr& h = msgs[n].msg_hdr;
+            memset(&h, 0, sizeof(h));
+            h.msg_name = const_cast<udp::endpoint&>(bp.ep).data();
+            h.msg_namelen = bp.ep.size();
+            h.msg_iov = &iov[j - i];
+            h.msg_iovlen = segments;
+
+            if (segments > 1)
+            {
+                h.msg_control = control[n].buf;
+                h.msg_controllen = sizeof(control[n].buf);
+                cmsghdr* cm = CMSG_FIRSTHDR(&h);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(boost::uint16_t));
+                boost::uint16_t segment_size = bp.size;
+                memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+            }
+        }
+
+        int sent = sendmmsg(sock.native_handle(), msgs, msg, 0);
+        // a partial send reports the error of the message
+        // which didn't go out on the next call
+        int const err = sent < 0 ? errno : 0;
+        if (sent < 0) sent = 0;
+
+        if (sent < msg)
+        {
+            // the first message which didn't go out is sent packet by packet,
+            // the rest of the batch is tried again
+            if (msgs[sent].msg_hdr.msg_iovlen > 1
+                && (err == EIO || err == EINVAL || err == ENOPROTOOPT || err == EOPNOTSUPP))
+                m_gso = false;
+
+            for (int k = first[sent]; k < first[sent + 1]; ++k)
+            {
+                error_code ec;
+                batched_packet const& bp = m_send_batch[k];
+                send_now(bp.ep, &m_send_batch_buf[bp.offset], bp.size, ec);
+            }
+            ++sent;
+        }
+
+        i = first[sent];
+    }
+
+    m_send_batch.clear();
+    m_send_batch_buf.clear();
+}
+
+void udp_socket::read_batch(udp::socket* s)
+{
+    if (m_batch_size <= 1) return;
+
+    int const buf_size = (std::max)(m_v4_buf_size, 2000);
+    int const count = m_batch_size;
+    m_read_batch_buf.resize(count * buf_size);
+
+    mmsghdr msgs[max_batch_size];
+    iovec iov[max_batch_size];
+    sockaddr_storage from[max_batch_size];
+
+    // a few batches per wakeup, the rest waits for the next
+    // one so other handlers get their turn
+    for (int round = 0; round < 4 && !m_abort; ++round)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            iov[i].iov_base = &m_read_batch_buf[i * buf_size];
+            iov[i].iov_len = buf_size;
+            msghdr& h = msgs[i].msg_hdr;
+            memset(&h, 0, sizeof(h));
+            h.msg_name = &from[i];
+            h.msg_namelen = sizeof(from[i]);
+            h.msg_iov = &iov[i];
+            h.msg_iovlen = 1;
+        }
+
+        // errors are picked up by the next asynchronous read
+        int received = recvmmsg(s->native_handle(), msgs, count, MSG_DONTWAIT, 0);
+        if (received <= 0) break;
+
+        for (int i = 0; i < received && !m_abort; ++i)
+        {
+            msghdr const& h = msgs[i].msg_hdr;
+            // truncated datagrams are dropped the way message_size errors are
+            if (h.msg_flags & MSG_TRUNC) continue;
+
+            udp::endpoint ep;
+            if (h.msg_namelen > ep.capacity()) continue;
+            memcpy(ep.data(), &from[i], h.msg_namelen);
+            ep.resize(h.msg_namelen);
+            dispatch(ep, &m_read_batch_buf[i * buf_size], msgs[i].msg_len);
+        }
+
+        if (received < count) break;
+    }
+}
+#else
+void udp_socket::flush_sends()
+{
+    for (std::vector<batched_packet>::const_iterator i = m_send_batch.begin();
+        i != m_send_batch.end(); ++i)
+    {
+        error_code ec;
+        send_now(i->ep, &m_send_batch_buf[i->offset], i->size, ec);
+    }
+
+    m_send_batch.clear();
+    m_send_batch_buf.clear();
+}
+
+void udp_socket::read_batch(udp::socket*) {}
+#endif
+
+void udp_socket::dispatch(udp::endpoint const& ep, char const* buf, int size)
+{
+    LIBED2K_TRY {
+
+        if (m_tunnel_packets)
+        {
+            // if the source IP doesn't match the proxy's, ignore the packet
+            if (ep == m_udp_proxy_addr)
+                unwrap(error_code(), buf, size);
+        }
+        else
+        {
+            m_callback(error_code(), ep, buf, size);
+        }
+
+    } LIBED2K_CATCH (std::exception&) {}
 }
 
 void udp_socket::maybe_realloc_buffers(int which)
@@ -371,20 +621,10 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 #if LIBED2K_USE_IPV6
     if (s == &m_ipv6_sock)
     {
-        LIBED2K_TRY {
-
-            if (m_tunnel_packets)
-            {
-                // if the source IP doesn't match the proxy's, ignore the packet
-                if (m_v6_ep == m_udp_proxy_addr)
-                    unwrap(e, m_v6_buf, bytes_transferred);
-            }
-            else
-            {
-                m_callback(e, m_v6_ep, m_v6_buf, bytes_transferred);
-            }
-
-        } LIBED2K_CATCH (std::exception&) {}
+        cork();
+        dispatch(m_v6_ep, m_v6_buf, bytes_transferred);
+        if (!m_abort) read_batch(s);
+        uncork();
 
         if (m_abort) return;
 
@@ -405,20 +645,10 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 #endif // LIBED2K_USE_IPV6
     {
 
-        LIBED2K_TRY {
-
-            if (m_tunnel_packets)
-            {
-                // if the source IP doesn't match the proxy's, ignore the packet
-                if (m_v4_ep == m_udp_proxy_addr)
-                    unwrap(e, m_v4_buf, bytes_transferred);
-            }
-            else
-            {
-                m_callback(e, m_v4_ep, m_v4_buf, bytes_transferred);
-            }
-
-        } LIBED2K_CATCH (std::exception&) {}
+        cork();
+        dispatch(m_v4_ep, m_v4_buf, bytes_transferred);
+        if (!m_abort) read_batch(s);
+        uncork();
 
         if (m_abort) return;
 
@@ -551,6 +781,9 @@ void udp_socket::close()
     LIBED2K_ASSERT(is_single_thread());
     LIBED2K_ASSERT(m_magic == 0x1337);
 
+    // packets sent while corked still go out
+    if (!m_send_batch.empty()) flush_sends();
+
     error_code ec;
     // if we close the socket here, we can't shut down
     // utp connections or NAT-PMP. We need to cancel the
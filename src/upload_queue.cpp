@@ -0,0 +1,344 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "libed2k/upload_queue.hpp"
+#include "libed2k/session_settings.hpp"
+
+namespace libed2k
+{
+    template<typename Ranked>
+    static bool better(const Ranked& l, const Ranked& r)
+    {
+        return l.first > r.first;
+    }
+
+    upload_queue::upload_queue(const session_settings& settings) :
+        m_settings(settings), m_target((std::max)(settings.upload_slots_min, 1)), m_ticks(0),
+        m_period_bytes(0), m_last_rate(0), m_change_slot_rate(0), m_stable(0), m_added(false)
+    {
+    }
+
+    upload_queue::request_result upload_queue::request(
+        const client_id& client, const md4_hash& file, ptime now, int& rank)
+    {
+        rank = 0;
+        if (!client.first.defined()) return queue_full;
+        if (m_slots.count(client)) return granted;
+
+        waiting_map::iterator w = m_waiting.find(client);
+
+        if (w == m_waiting.end())
+        {
+            if (int(m_waiting.size()) >= m_settings.upload_queue_size) return queue_full;
+
+            waiting_client wc;
+            wc.enqueued = now;
+            wc.last_rank_sent = now;
+            wc.last_rank = 0;
+            w = m_waiting.insert(std::make_pair(client, wc)).first;
+        }
+
+        w->second.file = file;
+        w->second.last_ask = now;
+        w->second.connected = true;
+
+        if (int(m_slots.size()) < m_target)
+        {
+            // free slot goes to the best connected client, the others get it on second tick
+            double s = score(*w, now);
+            bool best = true;
+
+            for (waiting_map::const_iterator i = m_waiting.begin(); i != m_waiting.end(); ++i)
+            {
+                if (i != w && i->second.connected && score(*i, now) > s)
+                {
+                    best = false;
+                    break;
+                }
+            }
+
+            if (best)
+            {
+                grant(w, now);
+                return granted;
+            }
+        }
+
+        rank = upload_queue::rank(client, now);
+        w->second.last_rank = rank;
+        w->second.last_rank_sent = now;
+        return queued;
+    }
+
+    void upload_queue::disconnected(const client_id& client)
+    {
+        m_slots.erase(client);
+        waiting_map::iterator w = m_waiting.find(client);
+        if (w != m_waiting.end()) w->second.connected = false;
+    }
+
+    void upload_queue::release(const client_id& client)
+    {
+        m_slots.erase(client);
+        m_waiting.erase(client);
+    }
+
+    void upload_queue::uploaded(const client_id& client, int bytes)
+    {
+        m_period_bytes += bytes;
+        if (!client.first.defined()) return;
+
+        slot_map::iterator s = m_slots.find(client);
+
+        if (s != m_slots.end())
+        {
+            s->second.bytes += bytes;
+            s->second.period_bytes += bytes;
+        }
+
+        credit& c = m_credits[client];
+        c.uploaded += bytes;
+        c.last_seen = time_now();
+    }
+
+    void upload_queue::downloaded(const client_id& client, int bytes)
+    {
+        if (!client.first.defined()) return;
+
+        credit& c = m_credits[client];
+        c.downloaded += bytes;
+        c.last_seen = time_now();
+    }
+
+    void upload_queue::second_tick(ptime now, tick_result& res)
+    {
+        for (slot_map::iterator i = m_slots.begin(); i != m_slots.end(); ++i)
+        {
+            if (i->second.bytes == i->second.tick_bytes) continue;
+            i->second.tick_bytes = i->second.bytes;
+            i->second.last_upload = now;
+        }
+
+        // slots which uploaded enough or went idle are given to waiting clients
+        if (demand())
+        {
+            for (slot_map::iterator i = m_slots.begin(); i != m_slots.end();)
+            {
+                const slot& s = i->second;
+
+                if (s.bytes >= m_settings.upload_slot_bytes ||
+                    now - s.start >= seconds(m_settings.upload_slot_time) ||
+                    now - s.last_upload >= seconds(slot_idle_time))
+                {
+                    requeue(i++, now, res);
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+        }
+
+        if (++m_ticks >= adjust_interval)
+        {
+            adjust_slots(int(m_period_bytes / m_ticks));
+            m_ticks = 0;
+            m_period_bytes = 0;
+
+            // the slowest slots go when there are too many
+            while (int(m_slots.size()) > m_target)
+            {
+                slot_map::iterator slowest = m_slots.begin();
+
+                for (slot_map::iterator i = m_slots.begin(); i != m_slots.end(); ++i)
+                {
+                    if (i->second.period_bytes < slowest->second.period_bytes) slowest = i;
+                }
+
+                requeue(slowest, now, res);
+            }
+
+            for (slot_map::iterator i = m_slots.begin(); i != m_slots.end(); ++i)
+            {
+                i->second.period_bytes = 0;
+            }
+
+            for (waiting_map::iterator i = m_waiting.begin(); i != m_waiting.end();)
+            {
+                if (!i->second.connected &&
+                    now - i->second.last_ask >= seconds(m_settings.upload_queue_reask_timeout))
+                    m_waiting.erase(i++);
+                else
+                    ++i;
+            }
+
+            for (credit_map::iterator i = m_credits.begin(); i != m_credits.end();)
+            {
+                if (now - i->second.last_seen >= seconds(credit_expiry))
+                    m_credits.erase(i++);
+                else
+                    ++i;
+            }
+        }
+
+        if (m_waiting.empty()) return;
+
+        ranking r;
+        rank_clients(now, r);
+
+        for (ranking::iterator i = r.begin(); i != r.end(); ++i)
+        {
+            if (int(m_slots.size()) >= m_target) break;
+            if (!i->second->second.connected) continue;
+
+            res.granted.push_back(i->second->first);
+            grant(i->second, now);
+            i->second = m_waiting.end();
+        }
+
+        int position = 0;
+
+        for (ranking::iterator i = r.begin(); i != r.end(); ++i)
+        {
+            if (i->second == m_waiting.end()) continue;
+            ++position;
+
+            waiting_client& wc = i->second->second;
+            if (!wc.connected || wc.last_rank == position ||
+                now - wc.last_rank_sent < seconds(rank_interval)) continue;
+
+            wc.last_rank = position;
+            wc.last_rank_sent = now;
+            res.ranks.push_back(std::make_pair(i->second->first, position));
+        }
+    }
+
+    int upload_queue::rank(const client_id& client, ptime now) const
+    {
+        waiting_map::const_iterator w = m_waiting.find(client);
+        if (w == m_waiting.end()) return 0;
+
+        double s = score(*w, now);
+        int ret = 1;
+
+        for (waiting_map::const_iterator i = m_waiting.begin(); i != m_waiting.end(); ++i)
+        {
+            if (i != w && score(*i, now) > s) ++ret;
+        }
+
+        return ret;
+    }
+
+    float upload_queue::credit_modifier(const client_id& client) const
+    {
+        credit_map::const_iterator i = m_credits.find(client);
+        if (i == m_credits.end() || i->second.downloaded < 1024 * 1024) return 1.f;
+
+        const credit& c = i->second;
+        float by_ratio = c.uploaded == 0 ? 10.f : float(c.downloaded) * 2 / c.uploaded;
+        float by_amount = std::sqrt(float(c.downloaded) / (1024 * 1024) + 2);
+        return (std::max)(1.f, (std::min)((std::min)(by_ratio, by_amount), 10.f));
+    }
+
+    double upload_queue::score(const waiting_map::value_type& w, ptime now) const
+    {
+        // one second more, so clients which came in the same second are ordered by credits
+        return (total_seconds(now - w.second.enqueued) + 1) * double(credit_modifier(w.first));
+    }
+
+    void upload_queue::rank_clients(ptime now, ranking& r)
+    {
+        r.clear();
+        r.reserve(m_waiting.size());
+
+        for (waiting_map::iterator i = m_waiting.begin(); i != m_waiting.end(); ++i)
+        {
+            r.push_back(std::make_pair(score(*i, now), i));
+        }
+
+        std::stable_sort(r.begin(), r.end(), better<ranking::value_type>);
+    }
+
+    void upload_queue::grant(waiting_map::iterator w, ptime now)
+    {
+        slot s;
+        s.file = w->second.file;
+        s.start = now;
+        s.last_upload = now;
+        s.bytes = 0;
+        s.tick_bytes = 0;
+        s.period_bytes = 0;
+        m_slots[w->first] = s;
+        m_waiting.erase(w);
+    }
+
+    void upload_queue::requeue(slot_map::iterator s, ptime now, tick_result& res)
+    {
+        waiting_client wc;
+        wc.file = s->second.file;
+        wc.enqueued = now;
+        wc.last_ask = now;
+        wc.last_rank_sent = now;
+        wc.last_rank = 0;
+        wc.connected = true;
+
+        res.revoked.push_back(s->first);
+        m_waiting[s->first] = wc;
+        m_slots.erase(s);
+    }
+
+    void upload_queue::adjust_slots(int rate)
+    {
+        int min_slots = (std::max)(m_settings.upload_slots_min, 1);
+        int max_slots = m_settings.unchoke_slots_limit < 0 ? (std::numeric_limits<int>::max)() :
+            (std::max)(m_settings.unchoke_slots_limit, min_slots);
+        int used = m_slots.size();
+        int per_slot = used > 0 ? rate / used : 0;
+
+        bool rising = rate > m_last_rate + m_last_rate / 20;
+        bool collapsed = used > 0 &&
+            (per_slot < m_settings.upload_slot_min_rate || per_slot < m_change_slot_rate / 2);
+        int target = m_target;
+
+        if (m_added && m_stable == 0 && !rising)
+        {
+            // the slot added last time didn't raise total rate
+            --target;
+        }
+        else if (collapsed && !rising)
+        {
+            --target;
+        }
+        else if (demand() && used >= m_target && (rising || m_stable >= probe_interval))
+        {
+            ++target;
+        }
+
+        target = (std::min)((std::max)(target, min_slots), max_slots);
+
+        if (target != m_target)
+        {
+            m_added = target > m_target;
+            m_target = target;
+            m_change_slot_rate = per_slot;
+            m_stable = 0;
+        }
+        else
+        {
+            ++m_stable;
+        }
+
+        m_last_rate = rate;
+    }
+
+    bool upload_queue::demand() const
+    {
+        for (waiting_map::const_iterator i = m_waiting.begin(); i != m_waiting.end(); ++i)
+        {
+            if (i->second.connected) return true;
+        }
+
+        return false;
+    }
+}
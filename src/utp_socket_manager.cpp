@@ -53,7 +53,15 @@ namespace libed2k
         , m_last_route_update(min_time())
         , m_last_if_update(min_time())
         , m_sock_buf_size(0)
-    {}
+        , m_small_packets(small_packet_size)
+        , m_mtu_packets(mtu_packet_size)
+        , m_heap_packets(0)
+        , m_pool_fallbacks(0)
+        , m_pool_fallbacks_in_use(0)
+    {
+        m_small_packets.set_policy(1, false, -1);
+        m_mtu_packets.set_policy(1, false, -1);
+    }
 
     utp_socket_manager::~utp_socket_manager()
     {
@@ -85,10 +93,71 @@ namespace libed2k
                 case 5: ++s.num_close_wait; break;
             }
         }
+
+        slab_arena::stats_t small = m_small_packets.stats();
+        slab_arena::stats_t mtu = m_mtu_packets.stats();
+        s.packet_buffers_in_use = small.in_use + mtu.in_use;
+        s.packet_buffers_reserved = small.reserved + mtu.reserved;
+        s.small_packet_buffers_peak = small.peak_in_use;
+        s.mtu_packet_buffers_peak = mtu.peak_in_use;
+        s.heap_packets = m_heap_packets;
+        s.packet_pool_fallbacks = m_pool_fallbacks;
+    }
+
+    char* utp_socket_manager::allocate_packet(int size)
+    {
+        if (size > mtu_packet_size)
+        {
+            ++m_heap_packets;
+            return (char*)malloc(size);
+        }
+
+        slab_arena& pool = size <= small_packet_size ? m_small_packets : m_mtu_packets;
+        char* ret = pool.allocate();
+        if (ret) return ret;
+
+        // no memory for a new slab. Allocate the full class size,
+        // release_packet() tells these from pooled ones by the address
+        ret = (char*)malloc(pool.buffer_size());
+        if (ret == 0) return 0;
+        ++m_pool_fallbacks;
+        ++m_pool_fallbacks_in_use;
+        return ret;
+    }
+
+    void utp_socket_manager::release_packet(char* p, int size)
+    {
+        if (p == 0) return;
+
+        if (size > mtu_packet_size)
+        {
+            ::free(p);
+            return;
+        }
+
+        slab_arena& pool = size <= small_packet_size ? m_small_packets : m_mtu_packets;
+
+        // looking the buffer up locks the pool, only do it while
+        // heap allocated packets are around
+        if (m_pool_fallbacks_in_use > 0 && !pool.owns(p))
+        {
+            --m_pool_fallbacks_in_use;
+            ::free(p);
+            return;
+        }
+
+        pool.free(p);
+    }
+
+    void utp_socket_manager::set_packet_pool_limit(int slabs)
+    {
+        m_small_packets.set_limit(slabs);
+        m_mtu_packets.set_limit(slabs);
     }
 
     void utp_socket_manager::tick(ptime now)
     {
+        bool removed = false;
         for (socket_map_t::iterator i = m_utp_sockets.begin()
             , end(m_utp_sockets.end()); i != end;)
         {
@@ -97,11 +166,19 @@ namespace libed2k
                 delete_utp_impl(i->second);
                 if (m_last_socket == i->second) m_last_socket = 0;
                 m_utp_sockets.erase(i++);
+                removed = true;
                 continue;
             }
             tick_utp_impl(i->second, now);
             ++i;
         }
+
+        // slabs are given back once the last socket is gone
+        if (removed && m_utp_sockets.empty())
+        {
+            m_small_packets.release_memory();
+            m_mtu_packets.release_memory();
+        }
     }
 
     void utp_socket_manager::mtu_for_dest(address const& addr, int& link_mtu, int& utp_mtu)
@@ -210,7 +210,7 @@ struct packet
 
 // when we receive data into m_receive_buffer (i.e. the buffer
 // used when there's no user provided one) is stored as a
-// number of heap allocated packets. This is just because it's
+// number of pooled packets. This is just because it's
 // simple to reuse the data structured and it provides all the
 // functionality needed for this buffer.
 
@@ -295,6 +295,11 @@ struct utp_socket_impl
     void send_syn();
     void send_fin();
 
+    // packet buffers come from the pools of the socket manager,
+    // size is the payload size and is stored in the packet
+    packet* allocate_packet(int size);
+    void release_packet(packet* p);
+
     bool send_pkt(bool ack);
     bool resend_packet(packet* p, bool fast_resend = false);
     void send_reset(utp_header* ph);
@@ -944,7 +949,7 @@ size_t utp_stream::read_some(bool clear_buffers)
         // Consumed entire packet
         if (p->header_size == p->size)
         {
-            free(p);
+            m_impl->release_packet(p);
             ++pop_packets;
             *i = 0;
             ++i;
@@ -1032,24 +1037,35 @@ utp_socket_impl::~utp_socket_impl()
         + m_inbuf.capacity()) & ACK_MASK);
         i != end; i = (i + 1) & ACK_MASK)
     {
-        void* p = m_inbuf.remove(i);
-        free(p);
+        release_packet((packet*)m_inbuf.remove(i));
     }
     for (boost::uint16_t i = m_outbuf.cursor(), end((m_outbuf.cursor()
         + m_outbuf.capacity()) & ACK_MASK);
         i != end; i = (i + 1) & ACK_MASK)
     {
-        void* p = m_outbuf.remove(i);
-        free(p);
+        release_packet((packet*)m_outbuf.remove(i));
     }
 
     for (std::vector<packet*>::iterator i = m_receive_buffer.begin()
         , end = m_receive_buffer.end(); i != end; ++i)
     {
-        free(*i);
+        release_packet(*i);
     }
 }
 
+packet* utp_socket_impl::allocate_packet(int size)
+{
+    packet* p = (packet*)m_sm->allocate_packet(sizeof(packet) + size);
+    p->size = size;
+    return p;
+}
+
+void utp_socket_impl::release_packet(packet* p)
+{
+    if (p == 0) return;
+    m_sm->release_packet((char*)p, sizeof(packet) + p->size);
+}
+
 bool utp_socket_impl::should_delete() const
 {
     // if the socket state is not attached anymore we're free
@@ -1152,8 +1168,7 @@ void utp_socket_impl::send_syn()
     m_ack_nr = 0;
     m_fast_resend_seq_nr = m_seq_nr;
 
-    packet* p = (packet*)malloc(sizeof(packet) + sizeof(utp_header));
-    p->size = sizeof(utp_header);
+    packet* p = allocate_packet(sizeof(utp_header));
     p->header_size = sizeof(utp_header);
     p->num_transmissions = 1;
     p->need_resend = false;
@@ -1186,7 +1201,7 @@ void utp_socket_impl::send_syn()
 
     if (ec)
     {
-        free(p);
+        release_packet(p);
         m_error = ec;
         m_state = UTP_STATE_ERROR_WAIT;
         test_socket_state();
@@ -1211,9 +1226,8 @@ void utp_socket_impl::send_fin()
 
     // we need a heap allocated packet in order to stick it
     // in the send buffer, so that we can resend it
-    packet* p = (packet*)malloc(sizeof(packet) + sizeof(utp_header));
+    packet* p = allocate_packet(sizeof(utp_header));
 
-    p->size = sizeof(utp_header);
     p->header_size = sizeof(utp_header);
     p->num_transmissions = 1;
     p->need_resend = false;
@@ -1248,7 +1262,7 @@ void utp_socket_impl::send_fin()
         m_error = ec;
         m_state = UTP_STATE_ERROR_WAIT;
         test_socket_state();
-        free(p);
+        release_packet(p);
         return;
     }
 
@@ -1263,7 +1277,7 @@ void utp_socket_impl::send_fin()
     if (old)
     {
         if (!old->need_resend) m_bytes_in_flight -= old->size - old->header_size;
-        free(old);
+        release_packet(old);
     }
     m_seq_nr = (m_seq_nr + 1) & ACK_MASK;
     m_fast_resend_seq_nr = m_seq_nr;
@@ -1584,9 +1598,9 @@ bool utp_socket_impl::send_pkt(bool ack)
     }
 
     packet* p;
-    // we only need a heap allocation if we have payload and
+    // we only need a pooled buffer if we have payload and
     // need to keep the packet around (in the outbuf)
-    if (payload_size) p = (packet*)malloc(sizeof(packet) + packet_size);
+    if (payload_size) p = allocate_packet(packet_size);
     else
     {
         // this alloca() statement won't necessarily produce
@@ -1669,7 +1683,7 @@ bool utp_socket_impl::send_pkt(bool ack)
         m_error = ec;
         m_state = UTP_STATE_ERROR_WAIT;
         test_socket_state();
-        if (payload_size) free(p);
+        if (payload_size) release_packet(p);
         return false;
     }
 
@@ -1692,7 +1706,7 @@ bool utp_socket_impl::send_pkt(bool ack)
         if (old)
         {
             if (!old->need_resend) m_bytes_in_flight -= old->size - old->header_size;
-            free(old);
+            release_packet(old);
         }
         m_seq_nr = (m_seq_nr + 1) & ACK_MASK;
         LIBED2K_ASSERT(payload_size >= 0);
@@ -1893,7 +1907,7 @@ void utp_socket_impl::ack_packet(packet* p, ptime const& receive_time
 
     m_rtt.add_sample(rtt / 1000);
     if (rtt < min_rtt) min_rtt = rtt;
-    free(p);
+    release_packet(p);
 }
 
 void utp_socket_impl::incoming(char const* buf, int size, packet* p, ptime now)
@@ -1932,7 +1946,7 @@ void utp_socket_impl::incoming(char const* buf, int size, packet* p, ptime now)
         if (size == 0)
         {
             LIBED2K_ASSERT(p == 0 || p->header_size == p->size);
-            free(p);
+            release_packet(p);
             maybe_trigger_receive_callback(now);
             return;
         }
@@ -1943,8 +1957,7 @@ void utp_socket_impl::incoming(char const* buf, int size, packet* p, ptime now)
     if (!p)
     {
         LIBED2K_ASSERT(buf);
-        p = (packet*)malloc(sizeof(packet) + size);
-        p->size = size;
+        p = allocate_packet(size);
         p->header_size = 0;
         memcpy(p->buf, buf, size);
     }
@@ -2048,8 +2061,7 @@ bool utp_socket_impl::consume_incoming_data(
         }
 
         // we don't need to save the packet header, just the payload
-        packet* p = (packet*)malloc(sizeof(packet) + payload_size);
-        p->size = payload_size;
+        packet* p = allocate_packet(payload_size);
         p->header_size = 0;
         p->num_transmissions = 0;
         p->need_resend = false;
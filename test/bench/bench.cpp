@@ -0,0 +1,54 @@
+#include <cstdlib>
+#include <cstring>
+#include "bench.hpp"
+
+namespace
+{
+    struct benchmark
+    {
+        const char* name;
+        int (*run)(int iterations);
+        int iterations;
+    };
+
+    const benchmark benchmarks[] =
+    {
+        { "serializer", &bench::serializer, 200000 },
+        { "completion", &bench::completion, 100000 },
+        { "picker", &bench::picker, 20000 },
+        { "udp", &bench::udp, 200000 },
+        { "peer_list", &bench::peer_list, 1000000 }
+    };
+
+    const size_t benchmarks_count = sizeof(benchmarks)/sizeof(benchmarks[0]);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: bench <name|all> [iterations]" << std::endl << "benchmarks:";
+        for (size_t n = 0; n < benchmarks_count; ++n) std::cerr << " " << benchmarks[n].name;
+        std::cerr << std::endl;
+        return 1;
+    }
+
+    int res = 0;
+    bool found = false;
+
+    for (size_t n = 0; n < benchmarks_count; ++n)
+    {
+        if (std::strcmp(argv[1], "all") != 0 && std::strcmp(argv[1], benchmarks[n].name) != 0) continue;
+        found = true;
+        std::cout << "== " << benchmarks[n].name << std::endl;
+        res |= benchmarks[n].run(argc > 2 ? std::atoi(argv[2]) : benchmarks[n].iterations);
+    }
+
+    if (!found)
+    {
+        std::cerr << "unknown benchmark " << argv[1] << std::endl;
+        return 1;
+    }
+
+    return res;
+}
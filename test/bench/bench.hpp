@@ -0,0 +1,29 @@
+#ifndef __LIBED2K_BENCH__
+#define __LIBED2K_BENCH__
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include "libed2k/time.hpp"
+
+namespace bench
+{
+    /**
+      * print operations per second of measured loop
+     */
+    inline void report(const std::string& name, size_t operations, libed2k::ptime start)
+    {
+        boost::int64_t us = libed2k::total_microseconds(libed2k::time_now_hires() - start);
+        if (us <= 0) us = 1;
+        std::cout << std::left << std::setw(48) << name << std::right << std::setw(14)
+            << static_cast<boost::int64_t>(operations * 1000000.0 / us) << " ops/s" << std::endl;
+    }
+
+    int serializer(int iterations);
+    int completion(int iterations);
+    int picker(int iterations);
+    int udp(int iterations);
+    int peer_list(int peers);
+}
+
+#endif
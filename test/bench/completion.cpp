@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "bench.hpp"
+#include "libed2k/disk_io_thread.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/storage.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/thread.hpp"
+
+namespace
+{
+    const int producers = 2;
+    const int outstanding = 10000;
+    const int read_size = 4 * 1024;
+    const int file_size = 4 * 1024 * 1024;
+
+    // how completions went before: a list under a mutex
+    // which the disk thread swapped out every 30 jobs
+    struct locked_list
+    {
+        typedef std::list<std::pair<libed2k::disk_io_job, int> > jobs_t;
+
+        locked_list(libed2k::io_service& ios) : m_ios(ios) {}
+
+        static void dispatch(jobs_t* jobs)
+        {
+            boost::shared_ptr<jobs_t> holder(jobs);
+            for (jobs_t::iterator i = jobs->begin(); i != jobs->end(); ++i)
+                i->first.callback(i->second, i->first);
+        }
+
+        void post(libed2k::disk_io_job const& j, int ret)
+        {
+            libed2k::mutex::scoped_lock l(m_mutex);
+            m_jobs.push_back(std::make_pair(j, ret));
+            if (m_jobs.size() >= 30) flush(l);
+        }
+
+        // the disk thread flushed the rest when it ran out of jobs
+        void flush()
+        {
+            libed2k::mutex::scoped_lock l(m_mutex);
+            flush(l);
+        }
+
+        void flush(libed2k::mutex::scoped_lock& l)
+        {
+            if (m_jobs.empty()) return;
+            jobs_t* q = new jobs_t;
+            q->swap(m_jobs);
+            m_ios.post(boost::bind(&locked_list::dispatch, q));
+        }
+
+        libed2k::io_service& m_ios;
+        libed2k::mutex m_mutex;
+        jobs_t m_jobs;
+    };
+
+    struct counter
+    {
+        counter() : done(0) {}
+        void on_job(int, libed2k::disk_io_job const&) { ++done; }
+        int done;
+    };
+
+    void flush(locked_list& q) { q.flush(); }
+    void flush(libed2k::completion_queue&) {}
+
+    template<typename Queue>
+    void push_jobs(Queue* q, libed2k::disk_io_job const* j, int count)
+    {
+        for (int n = 0; n < count; ++n) q->post(*j, n);
+        flush(*q);
+    }
+
+    template<typename Queue>
+    void run_queue(const char* name, Queue& q, libed2k::io_service& ios, int iterations)
+    {
+        counter c;
+        libed2k::disk_io_job j;
+        j.callback = boost::bind(&counter::on_job, &c, _1, _2);
+        int count = iterations / producers;
+
+        libed2k::io_service::work work(ios);
+        libed2k::ptime start = libed2k::time_now_hires();
+        std::vector<boost::shared_ptr<libed2k::thread> > threads;
+        for (int n = 0; n < producers; ++n)
+            threads.push_back(boost::shared_ptr<libed2k::thread>(new libed2k::thread(
+                boost::bind(&push_jobs<Queue>, &q, &j, count))));
+
+        while (c.done < count * producers) ios.run_one();
+        bench::report(name, c.done, start);
+        for (int n = 0; n < producers; ++n) threads[n]->join();
+    }
+
+    struct read_log
+    {
+        read_log(libed2k::disk_io_thread& d) : dio(d), done(0) {}
+
+        void on_read(int ret, libed2k::disk_io_job const& j)
+        {
+            latency.push_back(libed2k::total_microseconds(libed2k::time_now_hires() - j.start_time));
+            if (j.buffer) dio.free_buffer(j.buffer);
+            ++done;
+        }
+
+        libed2k::disk_io_thread& dio;
+        std::vector<boost::int64_t> latency;
+        int done;
+    };
+
+    boost::int64_t percentile(const std::vector<boost::int64_t>& sorted, int p)
+    {
+        return sorted[std::min(sorted.size() - 1, sorted.size() * p / 100)];
+    }
+
+    // reads of a cached file in rounds of outstanding requests,
+    // all completions of a round go through the completion path at once
+    void run_reads(int iterations)
+    {
+        const char* filename = "bench_completion.bin";
+        {
+            std::vector<char> data(file_size, 'x');
+            FILE* f = std::fopen(filename, "wb");
+            if (!f) return;
+            std::fwrite(&data[0], 1, data.size(), f);
+            std::fclose(f);
+        }
+
+        libed2k::io_service ios;
+        libed2k::file_pool fp(4);
+        libed2k::disk_io_thread dio(ios, boost::function<void()>(), fp, read_size);
+        read_log log(dio);
+
+        libed2k::session_settings* settings = new libed2k::session_settings;
+        settings->cache_size = file_size / read_size * 2 + outstanding;
+        libed2k::disk_io_job j;
+        j.action = libed2k::disk_io_job::update_settings;
+        j.buffer = (char*)settings;
+        dio.add_job(j);
+
+        boost::intrusive_ptr<libed2k::transfer_info> ti(
+            new libed2k::transfer_info(libed2k::md4_hash::emule, filename, file_size));
+        boost::intrusive_ptr<libed2k::piece_manager> storage(new libed2k::piece_manager(
+            boost::shared_ptr<void>(), ti, ".", fp, dio, libed2k::default_storage_constructor,
+            libed2k::storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+        libed2k::ptime start = libed2k::time_now_hires();
+        int issued = 0;
+        std::srand(1);
+
+        while (issued < iterations)
+        {
+            int round = std::min(outstanding, iterations - issued);
+            for (int n = 0; n < round; ++n)
+            {
+                libed2k::peer_request r;
+                r.piece = 0;
+                r.start = (std::rand() % (file_size / read_size)) * read_size;
+                r.length = read_size;
+                storage->async_read(r, boost::bind(&read_log::on_read, &log, _1, _2));
+            }
+            issued += round;
+            while (log.done < issued) ios.run_one();
+        }
+
+        bench::report("disk reads", log.done, start);
+
+        std::sort(log.latency.begin(), log.latency.end());
+        std::cout << "latency us p50 " << percentile(log.latency, 50)
+            << " p90 " << percentile(log.latency, 90)
+            << " p99 " << percentile(log.latency, 99)
+            << " max " << log.latency.back() << std::endl;
+        std::cout << "completions per dispatch "
+            << double(dio.completions().completions()) / std::max(dio.completions().dispatches(), boost::int64_t(1))
+            << std::endl;
+
+        dio.abort();
+        dio.join();
+        ios.run();
+        std::remove(filename);
+    }
+}
+
+namespace bench
+{
+    int completion(int iterations)
+    {
+        {
+            libed2k::io_service ios;
+            locked_list q(ios);
+            run_queue("mutex list", q, ios, iterations);
+        }
+
+        {
+            libed2k::io_service ios;
+            boost::shared_ptr<libed2k::completion_queue> q(new libed2k::completion_queue(ios));
+            run_queue("completion queue", *q, ios, iterations);
+        }
+
+        run_reads(iterations);
+        return 0;
+    }
+}
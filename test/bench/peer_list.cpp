@@ -0,0 +1,120 @@
+#include <cstdlib>
+#include <cstdio>
+#include <sstream>
+#include <deque>
+#include <algorithm>
+
+#include <boost/pool/pool.hpp>
+
+#include "bench.hpp"
+#include "libed2k/peer.hpp"
+
+namespace
+{
+    // peer record layout before ipv4_peer, with full endpoint and plain fields
+    struct legacy_peer
+    {
+        libed2k::tcp::endpoint endpoint;
+        libed2k::peer_connection* connection;
+        boost::uint16_t last_connected;
+        boost::uint16_t next_connect;
+        bool connectable;
+        bool seed;
+        unsigned failcount;
+        unsigned fast_reconnects;
+        signed trust_points;
+        unsigned source;
+        bool added_to_dht;
+    };
+
+    struct peer_address_compare
+    {
+        bool operator()(const libed2k::peer* lhs, const libed2k::ip::address& rhs) const
+        { return lhs->address() < rhs; }
+
+        bool operator()(const libed2k::ip::address& lhs, const libed2k::peer* rhs) const
+        { return lhs < rhs->address(); }
+
+        bool operator()(const libed2k::peer* lhs, const libed2k::peer* rhs) const
+        { return lhs->address() < rhs->address(); }
+    };
+
+    libed2k::tcp::endpoint random_endpoint()
+    {
+        boost::uint32_t ip = (boost::uint32_t(std::rand()) << 16) ^ std::rand();
+        return libed2k::tcp::endpoint(libed2k::ip::address_v4(ip), 4662 + std::rand() % 1000);
+    }
+
+    // resident memory in bytes, 0 where it can't be read
+    size_t resident_memory()
+    {
+        size_t ret = 0;
+#ifdef __linux__
+        FILE* f = std::fopen("/proc/self/statm", "r");
+        if (!f) return 0;
+        unsigned long size = 0;
+        unsigned long resident = 0;
+        if (std::fscanf(f, "%lu %lu", &size, &resident) == 2) ret = resident * 4096;
+        std::fclose(f);
+#endif
+        return ret;
+    }
+
+    std::string title(const char* what, int peers)
+    {
+        std::ostringstream ret;
+        ret << what << " " << peers << " peers";
+        return ret.str();
+    }
+}
+
+namespace bench
+{
+    /**
+      * peer list of one transfer the way policy keeps it: pooled records
+      * in a deque sorted by address, looked up with equal_range
+     */
+    int peer_list(int peers)
+    {
+        std::cout << "record " << sizeof(libed2k::ipv4_peer) << " bytes, legacy record "
+            << sizeof(legacy_peer) << " bytes" << std::endl;
+
+        size_t base = resident_memory();
+        boost::pool<> pool(sizeof(libed2k::ipv4_peer), 500);
+        std::deque<libed2k::peer*> list;
+
+        libed2k::ptime start = libed2k::time_now_hires();
+        for (int n = 0; n < peers; ++n)
+        {
+            list.push_back(new (pool.malloc()) libed2k::ipv4_peer(random_endpoint(), true, 0));
+        }
+        std::sort(list.begin(), list.end(), peer_address_compare());
+        bench::report(title("add", peers), peers, start);
+
+        size_t used = resident_memory() - base;
+        if (base > 0)
+            std::cout << "resident " << used / (1024 * 1024) << " MB, "
+                << used / peers << " bytes per peer" << std::endl;
+
+        int found = 0;
+        start = libed2k::time_now_hires();
+        for (int n = 0; n < peers; ++n)
+        {
+            libed2k::ip::address a = list[std::rand() % list.size()]->address();
+            std::pair<std::deque<libed2k::peer*>::iterator, std::deque<libed2k::peer*>::iterator> range =
+                std::equal_range(list.begin(), list.end(), a, peer_address_compare());
+            found += range.first != range.second;
+        }
+        bench::report(title("find_peers", peers), peers, start);
+
+        start = libed2k::time_now_hires();
+        for (std::deque<libed2k::peer*>::iterator i = list.begin(); i != list.end(); ++i)
+        {
+            pool.free(*i);
+        }
+        list.clear();
+        bench::report(title("erase", peers), peers, start);
+
+        return found == peers ? 0 : 1;
+    }
+}
@@ -0,0 +1,97 @@
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+#include "bench.hpp"
+#include "libed2k/piece_picker.hpp"
+#include "libed2k/bitfield.hpp"
+
+namespace
+{
+    enum source_kind { complete, partial, few };
+
+    // sources which have all pieces, a random share of them or a few ones
+    libed2k::bitfield source_pieces(int pieces, source_kind kind)
+    {
+        libed2k::bitfield ret(pieces, kind == complete);
+        if (kind == complete) return ret;
+        int share = kind == partial ? 1 + std::rand() % 99 : 1;
+        for (int n = 0; n < pieces; ++n)
+            if (std::rand() % 100 < share) ret.set_bit(n);
+        return ret;
+    }
+
+    std::string title(const char* what, int pieces, int sources)
+    {
+        std::ostringstream ret;
+        ret << what << " " << pieces << " pieces " << sources << " sources";
+        return ret.str();
+    }
+
+    // half of the sources are complete, the way big files are spread.
+    // Sources join, each one requests blocks in turn the way peer
+    // connections ask the picker when their request queue drains,
+    // then sources leave and others join between picks
+    void run_picks(int pieces, int sources, int iterations)
+    {
+        libed2k::piece_picker p;
+        p.init(37, 37, pieces);
+
+        std::vector<libed2k::bitfield> bits;
+        for (int n = 0; n < sources; ++n)
+            bits.push_back(source_pieces(pieces, n % 2 ? partial : complete));
+
+        libed2k::ptime start = libed2k::time_now_hires();
+        for (int n = 0; n < sources; ++n) p.inc_refcount(bits[n]);
+        bench::report(title("join", pieces, sources), sources, start);
+
+        std::vector<libed2k::piece_block> blocks;
+        const std::vector<int> suggested;
+        start = libed2k::time_now_hires();
+        for (int n = 0; n < iterations; ++n)
+        {
+            blocks.clear();
+            p.pick_pieces(bits[n % sources], blocks, 4, 0, 0, libed2k::piece_picker::fast,
+                libed2k::piece_picker::rarest_first, suggested, sources);
+        }
+        bench::report(title("pick", pieces, sources), iterations, start);
+
+        const source_kind kinds[] = { complete, few, partial };
+        const char* names[] = { "complete source churn", "few pieces source churn", "partial source churn" };
+        for (int k = 0; k < 3; ++k)
+        {
+            int count = std::max(iterations / 100, 1);
+            std::vector<libed2k::bitfield> joining;
+            for (int n = 0; n < count; ++n) joining.push_back(source_pieces(pieces, kinds[k]));
+
+            start = libed2k::time_now_hires();
+            for (int n = 0; n < count; ++n)
+            {
+                int source = n % sources;
+                p.dec_refcount(bits[source]);
+                bits[source] = joining[n];
+                p.inc_refcount(bits[source]);
+
+                blocks.clear();
+                p.pick_pieces(bits[(n + 1) % sources], blocks, 4, 0, 0, libed2k::piece_picker::fast,
+                    libed2k::piece_picker::rarest_first, suggested, sources);
+            }
+            bench::report(title(names[k], pieces, sources), count, start);
+        }
+    }
+}
+
+namespace bench
+{
+    int picker(int iterations)
+    {
+        const int pieces[] = { 1000, 10000, 100000 };
+        const int sources[] = { 10, 100, 1000 };
+
+        std::srand(1);
+        for (size_t i = 0; i < sizeof(pieces)/sizeof(pieces[0]); ++i)
+            for (size_t j = 0; j < sizeof(sources)/sizeof(sources[0]); ++j)
+                run_picks(pieces[i], sources[j], iterations);
+        return 0;
+    }
+}
@@ -0,0 +1,77 @@
+#include "bench.hpp"
+#include "libed2k/packet_struct.hpp"
+#include "libed2k/ctag.hpp"
+
+namespace
+{
+    // serialization how make_message did it through iostreams
+    template<typename T>
+    libed2k::message make_stream_message(const T& t)
+    {
+        libed2k::message msg;
+        msg.first.m_protocol = libed2k::packet_type<T>::protocol;
+        boost::iostreams::back_insert_device<std::string> inserter(msg.second);
+        boost::iostreams::stream<boost::iostreams::back_insert_device<std::string> > s(inserter);
+        libed2k::archive::ed2k_oarchive oa(s);
+        oa << const_cast<T&>(t);
+        s.flush();
+        msg.first.m_size = libed2k::body_size(t, msg.second) + 1;
+        msg.first.m_type = libed2k::packet_type<T>::value;
+        return msg;
+    }
+
+    template<typename T>
+    size_t run(const std::string& name, const T& t, int iterations)
+    {
+        size_t bytes = 0;
+
+        libed2k::ptime start = libed2k::time_now_hires();
+        for (int n = 0; n < iterations; ++n) bytes += make_stream_message(t).second.size();
+        bench::report(name + " iostream", iterations, start);
+
+        start = libed2k::time_now_hires();
+        for (int n = 0; n < iterations; ++n) bytes += libed2k::make_message(t).second.size();
+        bench::report(name + " make_message", iterations, start);
+
+        // how connections write packets - one buffer for all messages
+        std::string body;
+        start = libed2k::time_now_hires();
+        for (int n = 0; n < iterations; ++n) bytes += libed2k::serialize_message(t, body).m_size;
+        bench::report(name + " reused buffer", iterations, start);
+
+        return bytes;
+    }
+}
+
+namespace bench
+{
+    int serializer(int iterations)
+    {
+        libed2k::client_hello hello(libed2k::md4_hash::emule, libed2k::net_identifier(0x0100007f, 4662),
+            libed2k::net_identifier(0x0200007f, 4661), "libed2k benchmark", "libed2k", 0x3c);
+
+        libed2k::client_request_parts_64 rp;
+        rp.m_hFile = libed2k::md4_hash::libed2k;
+        rp.append(std::make_pair(0ULL, 180ULL*1024));
+        rp.append(std::make_pair(180ULL*1024, 360ULL*1024));
+        rp.append(std::make_pair(360ULL*1024, 540ULL*1024));
+
+        // typical answer on shared files request
+        libed2k::shared_files_list sfl;
+
+        for (boost::uint32_t n = 0; n < 100; ++n)
+        {
+            libed2k::shared_file_entry sfe(libed2k::md4_hash::emule, n, 4662);
+            sfe.m_list.add_tag(libed2k::make_string_tag("shared file name of usual length.avi", libed2k::FT_FILENAME, true));
+            sfe.m_list.add_tag(libed2k::make_typed_tag(boost::uint32_t(700*1024*1024), libed2k::FT_FILESIZE, true));
+            sfe.m_list.add_tag(libed2k::make_string_tag("Video", libed2k::FT_FILETYPE, true));
+            sfl.m_collection.push_back(sfe);
+        }
+
+        size_t bytes = 0;
+        bytes += run("client_hello", hello, iterations);
+        bytes += run("client_request_parts_64", rp, iterations);
+        bytes += run("shared_files_list(100)", sfl, std::max(iterations / 50, 1));
+        return bytes > 0 ? 0 : 1;
+    }
+}
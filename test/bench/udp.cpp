@@ -0,0 +1,97 @@
+#include <sstream>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include "bench.hpp"
+#include "libed2k/udp_socket.hpp"
+#include "libed2k/connection_queue.hpp"
+#include "libed2k/io_service.hpp"
+
+namespace
+{
+    // a KAD request is some tens of bytes, uTP data packets are MTU sized
+    const int sizes[] = { 64, 1400 };
+    const int burst = 64;
+
+    struct counter
+    {
+        counter() : packets(0) {}
+        void on_receive(libed2k::error_code const& ec, libed2k::udp::endpoint const&, char const*, int)
+        {
+            if (!ec) ++packets;
+        }
+        void on_receive_hostname(libed2k::error_code const&, char const*, char const*, int) {}
+        int packets;
+    };
+
+    std::string title(const char* what, int batch, int size)
+    {
+        std::ostringstream ret;
+        ret << what << " batch " << batch << " " << size << " bytes";
+        return ret.str();
+    }
+
+    // bursts of packets from one socket to another over loopback, the way
+    // replies to a read batch go out, each burst is received before the next one
+    int run_loopback(int packets, int batch, int size)
+    {
+        libed2k::io_service ios;
+        libed2k::connection_queue cc(ios);
+        counter c;
+        libed2k::udp_socket receiver(ios, boost::bind(&counter::on_receive, &c, _1, _2, _3, _4),
+            boost::bind(&counter::on_receive_hostname, &c, _1, _2, _3, _4), cc);
+        libed2k::udp_socket sender(ios, boost::bind(&counter::on_receive, &c, _1, _2, _3, _4),
+            boost::bind(&counter::on_receive_hostname, &c, _1, _2, _3, _4), cc);
+
+        libed2k::error_code ec;
+        receiver.bind(libed2k::udp::endpoint(libed2k::ip::address_v4::loopback(), 0), ec);
+        if (!ec) sender.bind(libed2k::udp::endpoint(libed2k::ip::address_v4::loopback(), 0), ec);
+        if (ec)
+        {
+            std::cerr << "bind failed: " << ec.message() << std::endl;
+            return 1;
+        }
+
+        receiver.set_option(libed2k::udp::socket::receive_buffer_size(4 * 1024 * 1024), ec);
+        receiver.set_batch_size(batch);
+        sender.set_batch_size(batch);
+        libed2k::udp::endpoint target(libed2k::ip::address_v4::loopback(), receiver.local_endpoint(ec).port());
+        std::vector<char> packet(size, 'x');
+
+        int sent = 0;
+        libed2k::ptime start = libed2k::time_now_hires();
+        while (sent < packets)
+        {
+            sender.cork();
+            for (int n = 0; n < burst && sent < packets; ++n, ++sent)
+                sender.send(target, &packet[0], size, ec);
+            sender.uncork();
+
+            libed2k::ptime deadline = libed2k::time_now_hires() + libed2k::milliseconds(100);
+            while (c.packets < sent && libed2k::time_now_hires() < deadline)
+                ios.poll_one();
+        }
+        bench::report(title("loopback", batch, size), c.packets, start);
+        if (c.packets < sent) std::cout << "  lost " << sent - c.packets << " of " << sent << std::endl;
+
+        sender.close();
+        receiver.close();
+        ios.run();
+        return 0;
+    }
+}
+
+namespace bench
+{
+    int udp(int iterations)
+    {
+        int res = 0;
+        for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+        {
+            res |= run_loopback(iterations, 1, sizes[s]);
+            res |= run_loopback(iterations, libed2k::udp_socket::max_batch_size, sizes[s]);
+        }
+        return res;
+    }
+}
@@ -0,0 +1,240 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/constants.hpp"
+#include "libed2k/escape_string.hpp"
+#include "libed2k/sha1.hpp"
+#include "libed2k/aich.hpp"
+#include "libed2k/file.hpp"
+#include "libed2k/packet_struct.hpp"
+#include "common.hpp"
+
+namespace
+{
+    std::string hex(const libed2k::sha1_hash& h)
+    {
+        char out[41];
+        libed2k::to_hex((const char*)h.begin(), libed2k::sha1_hash::size, out);
+        return std::string(out);
+    }
+
+    libed2k::sha1_hash sha1(const std::string& s)
+    {
+        return libed2k::sha1_hasher(s.c_str(), s.size()).final();
+    }
+
+    libed2k::sha1_hash combine(const libed2k::sha1_hash& l, const libed2k::sha1_hash& r)
+    {
+        return sha1(l.to_string() + r.to_string());
+    }
+
+    // distinct fake hashes of blocks
+    libed2k::aich_hashset make_hashset(libed2k::size_type file_size)
+    {
+        libed2k::aich_hashset hs(file_size);
+        for (int part = 0; part < hs.num_parts(); ++part)
+        {
+            std::vector<libed2k::sha1_hash> blocks;
+            for (int b = 0; b < libed2k::aich_hashset::blocks_in_part(file_size, part); ++b)
+            {
+                std::ostringstream s;
+                s << part << ":" << b;
+                blocks.push_back(sha1(s.str()));
+            }
+            hs.set_part(part, blocks);
+        }
+        return hs;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_aich)
+
+BOOST_AUTO_TEST_CASE(test_sha1_vectors)
+{
+    BOOST_CHECK_EQUAL(hex(sha1("")), "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+    BOOST_CHECK_EQUAL(hex(sha1("abc")), "a9993e364706816aba3e25717850c26c9cd0d89d");
+    BOOST_CHECK_EQUAL(hex(sha1("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")),
+        "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+    // unaligned updates
+    std::string chunk(997, 'a');
+    libed2k::sha1_hasher h;
+    int left = 1000000;
+    while (left > 0)
+    {
+        int n = std::min(left, int(chunk.size()));
+        h.update(chunk.c_str(), n);
+        left -= n;
+    }
+    BOOST_CHECK_EQUAL(hex(h.final()), "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+}
+
+BOOST_AUTO_TEST_CASE(test_piece_hasher)
+{
+    std::string data(libed2k::AICH_BLOCK_SIZE * 2 + 5, 'x');
+    data[libed2k::AICH_BLOCK_SIZE + 1] = 'y';
+
+    libed2k::aich_piece_hasher h;
+    for (size_t pos = 0; pos < data.size(); pos += 7000)
+        h.update(data.c_str() + pos, std::min(data.size() - pos, size_t(7000)));
+
+    const std::vector<libed2k::sha1_hash>& blocks = h.final();
+    BOOST_REQUIRE_EQUAL(blocks.size(), 3U);
+    BOOST_CHECK(blocks[0] == sha1(data.substr(0, libed2k::AICH_BLOCK_SIZE)));
+    BOOST_CHECK(blocks[1] == sha1(data.substr(libed2k::AICH_BLOCK_SIZE, libed2k::AICH_BLOCK_SIZE)));
+    BOOST_CHECK(blocks[2] == sha1(data.substr(libed2k::AICH_BLOCK_SIZE * 2)));
+}
+
+BOOST_AUTO_TEST_CASE(test_tree_layout)
+{
+    using libed2k::AICH_BLOCK_SIZE;
+    using libed2k::PIECE_SIZE;
+
+    // left branch gets the bigger half
+    libed2k::aich_hashset three = make_hashset(AICH_BLOCK_SIZE * 2 + 10);
+    const std::vector<libed2k::sha1_hash>& b = three.part(0);
+    BOOST_CHECK(three.root() == combine(combine(b[0], b[1]), b[2]));
+
+    // parts are split before blocks and right branch gets the bigger half on its left side
+    libed2k::aich_hashset parts = make_hashset(PIECE_SIZE * 2 + 10);
+    BOOST_CHECK_EQUAL(parts.num_parts(), 3);
+    BOOST_CHECK_EQUAL(libed2k::aich_hashset::blocks_in_part(parts.file_size(), 0), 53);
+    BOOST_CHECK_EQUAL(libed2k::aich_hashset::blocks_in_part(parts.file_size(), 2), 1);
+    BOOST_CHECK_EQUAL(libed2k::aich_hashset::total_blocks(parts.file_size()), 107);
+
+    libed2k::aich_recovery rd;
+    BOOST_REQUIRE(parts.recovery_data(1, rd));
+    // uncle of the second part is the last part, then the first part and 53 blocks
+    BOOST_REQUIRE_EQUAL(rd.size(), 55U);
+    BOOST_CHECK_EQUAL(rd[0].first, 2U);
+    BOOST_CHECK(rd[0].second == parts.part(2)[0]);
+    BOOST_CHECK_EQUAL(rd[1].first, 7U);
+    BOOST_CHECK_EQUAL(rd[2].first >> 6, 6U);
+
+    // small file isn't recoverable
+    libed2k::aich_hashset one = make_hashset(100);
+    BOOST_CHECK(one.root() == one.part(0)[0]);
+    BOOST_CHECK(!one.recovery_data(0, rd));
+}
+
+BOOST_AUTO_TEST_CASE(test_recovery_data)
+{
+    using libed2k::PIECE_SIZE;
+    const libed2k::size_type sizes[] = { PIECE_SIZE - 1000, PIECE_SIZE, PIECE_SIZE * 5 + 300000, PIECE_SIZE * 8 };
+
+    for (size_t n = 0; n < sizeof(sizes)/sizeof(sizes[0]); ++n)
+    {
+        libed2k::aich_hashset hs = make_hashset(sizes[n]);
+        BOOST_REQUIRE(hs.complete());
+        libed2k::sha1_hash root = hs.root();
+
+        libed2k::aich_hashset copy(sizes[n]);
+        BOOST_CHECK(copy.assign(hs.blocks()));
+        BOOST_CHECK(copy.root() == root);
+
+        for (int part = 0; part < hs.num_parts(); ++part)
+        {
+            libed2k::aich_recovery rd;
+            std::vector<libed2k::sha1_hash> blocks;
+            BOOST_REQUIRE(hs.recovery_data(part, rd));
+            BOOST_CHECK(libed2k::aich_hashset::verify(root, sizes[n], part, rd, blocks));
+            BOOST_CHECK(blocks == hs.part(part));
+
+            // data of other part or changed hash are rejected
+            if (hs.num_parts() > 1)
+            {
+                BOOST_CHECK(!libed2k::aich_hashset::verify(
+                    root, sizes[n], (part + 1) % hs.num_parts(), rd, blocks));
+            }
+
+            rd.back().second = libed2k::sha1_hash();
+            BOOST_CHECK(!libed2k::aich_hashset::verify(root, sizes[n], part, rd, blocks));
+            BOOST_CHECK(blocks.empty());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_answer_packet)
+{
+    libed2k::aich_hashset hs = make_hashset(libed2k::PIECE_SIZE * 3);
+
+    for (int large = 0; large < 2; ++large)
+    {
+        libed2k::client_aich_answer out;
+        out.m_hFile = libed2k::md4_hash::emule;
+        out.m_nPart = 2;
+        out.m_hRoot = hs.root();
+        out.m_bHasData = true;
+        out.m_bLarge = large;
+        BOOST_REQUIRE(hs.recovery_data(2, out.m_hashes));
+
+        std::string buffer;
+        libed2k::archive::ed2k_oarchive oa(buffer);
+        oa << out;
+        BOOST_CHECK_EQUAL(buffer.size(), 16U + 2 + 20 + 4 + out.m_hashes.size() * (20 + (large ? 4 : 2)));
+
+        libed2k::client_aich_answer in;
+        libed2k::archive::ed2k_iarchive ia(buffer.c_str(), buffer.size());
+        ia >> in;
+        BOOST_CHECK(in.m_bHasData);
+        BOOST_CHECK_EQUAL(in.m_nPart, 2);
+        BOOST_CHECK(in.m_hRoot == out.m_hRoot);
+        BOOST_CHECK(in.m_hashes == out.m_hashes);
+    }
+
+    libed2k::client_aich_answer none;
+    none.m_hFile = libed2k::md4_hash::emule;
+    std::string buffer;
+    libed2k::archive::ed2k_oarchive oa(buffer);
+    oa << none;
+    BOOST_CHECK_EQUAL(buffer.size(), 16U);
+
+    libed2k::client_aich_answer in;
+    libed2k::archive::ed2k_iarchive ia(buffer.c_str(), buffer.size());
+    ia >> in;
+    BOOST_CHECK(!in.m_bHasData);
+}
+
+BOOST_AUTO_TEST_CASE(test_file2atp_aich)
+{
+    test_files_holder tfh;
+    const char* filename = "test_aich_file";
+    const libed2k::size_type size = libed2k::PIECE_SIZE * 2 + 5000;
+    BOOST_REQUIRE(generate_test_file(size, filename));
+    tfh.hold(filename);
+
+    // test file is filled by 'X'
+    libed2k::aich_hashset expected(size);
+    for (int part = 0; part < expected.num_parts(); ++part)
+    {
+        std::vector<libed2k::sha1_hash> blocks;
+        libed2k::size_type part_size = std::min(libed2k::PIECE_SIZE, size - part * libed2k::PIECE_SIZE);
+        for (libed2k::size_type offset = 0; offset < part_size; offset += libed2k::AICH_BLOCK_SIZE)
+            blocks.push_back(sha1(std::string(std::min(libed2k::AICH_BLOCK_SIZE, part_size - offset), 'X')));
+        expected.set_part(part, blocks);
+    }
+
+    const int flags[] = { libed2k::file2atp::hash_aich, libed2k::file2atp::hash_aich | libed2k::file2atp::read_mapped };
+    bool cancel = false;
+
+    for (size_t n = 0; n < sizeof(flags)/sizeof(flags[0]); ++n)
+    {
+        libed2k::add_transfer_params atp = libed2k::file2atp(flags[n])(filename, cancel).first;
+        BOOST_CHECK(atp.aich_hashes == expected.blocks());
+        BOOST_CHECK(atp.aich_root == expected.root());
+    }
+
+    BOOST_CHECK(libed2k::file2atp()(filename, cancel).first.aich_hashes.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -703,6 +703,81 @@ BOOST_AUTO_TEST_CASE(test_packets)
     BOOST_CHECK(flist.m_collection[2].m_network_point.m_nPort == 5);
 }
 
+BOOST_AUTO_TEST_CASE(test_buffer_archive)
+{
+    libed2k::shared_files_list flist;
+    flist.m_collection.push_back(libed2k::shared_file_entry(libed2k::md4_hash::terminal, 1,2));
+    flist.m_collection.push_back(libed2k::shared_file_entry(libed2k::md4_hash::emule, 3,4));
+    flist.m_collection[1].m_list.add_tag(libed2k::make_string_tag("file name", libed2k::FT_FILENAME, true));
+
+    std::stringstream sstream_out(std::ios::out | std::ios::in | std::ios::binary);
+    libed2k::archive::ed2k_oarchive out_stream_archive(sstream_out);
+    out_stream_archive << flist;
+
+    // buffer backend gives the same bytes
+    std::string buffer;
+    libed2k::archive::ed2k_oarchive out_buffer_archive(buffer);
+    out_buffer_archive << flist;
+    BOOST_CHECK(buffer == sstream_out.str());
+
+    // message serialized into reused buffer is equal to make_message result
+    libed2k::message msg = libed2k::make_message(flist);
+    libed2k::libed2k_header header = libed2k::serialize_message(flist, buffer);
+    BOOST_CHECK(buffer == msg.second);
+    BOOST_CHECK_EQUAL(header.m_size, msg.first.m_size);
+    BOOST_CHECK_EQUAL(header.m_size, buffer.size() + 1);
+    BOOST_CHECK_EQUAL(header.m_type, msg.first.m_type);
+    BOOST_CHECK_EQUAL(header.m_protocol, msg.first.m_protocol);
+}
+
+BOOST_AUTO_TEST_CASE(test_span_archive)
+{
+    libed2k::shared_files_list flist;
+    flist.m_collection.push_back(libed2k::shared_file_entry(libed2k::md4_hash::terminal, 1,2));
+    flist.m_collection.push_back(libed2k::shared_file_entry(libed2k::md4_hash::emule, 3,4));
+    flist.m_collection[1].m_list.add_tag(libed2k::make_string_tag("file name", libed2k::FT_FILENAME, true));
+    flist.m_collection[1].m_list.add_tag(libed2k::make_blob_tag(std::vector<char>(100, 'x'), libed2k::FT_AICH_HASH, true));
+
+    std::string buffer;
+    libed2k::archive::ed2k_oarchive out_buffer_archive(buffer);
+    out_buffer_archive << flist;
+
+    libed2k::archive::ed2k_iarchive ia(buffer.c_str(), buffer.size());
+    libed2k::shared_files_list flist_dst;
+    ia >> flist_dst;
+    BOOST_CHECK_EQUAL(ia.bytes_left(), 0U);
+    BOOST_REQUIRE_EQUAL(flist_dst.m_collection.size(), 2U);
+    BOOST_CHECK_EQUAL(flist_dst.m_collection[0].m_hFile, libed2k::md4_hash::terminal);
+    BOOST_CHECK_EQUAL(flist_dst.m_collection[1].m_hFile, libed2k::md4_hash::emule);
+    BOOST_CHECK_EQUAL(flist_dst.m_collection[1].m_network_point.m_nPort, 4);
+    BOOST_CHECK_EQUAL(flist_dst.m_collection[1].m_list.getStringTagByNameId(libed2k::FT_FILENAME), "file name");
+    BOOST_REQUIRE_EQUAL(flist_dst.m_collection[1].m_list.size(), 2U);
+    BOOST_CHECK(flist_dst.m_collection[1].m_list[1]->asBlob() == std::vector<char>(100, 'x'));
+
+    // every truncated buffer is rejected
+    for (size_t n = 0; n < buffer.size(); ++n)
+    {
+        libed2k::archive::ed2k_iarchive ia_short(buffer.c_str(), n);
+        BOOST_CHECK_THROW(ia_short >> flist_dst, libed2k::libed2k_exception);
+    }
+
+    // bool array and huge blob are checked by buffer bounds
+    char chTags[] = {'\x02', '\x00', '\x00', '\x00',
+        '\x86', '\x01', '\x10', '\x00', '\x01', '\x02', '\x03',                    // bool array 16 bits + 1 byte
+        '\x87', '\x01', '\xFF', '\xFF', '\xFF', '\x7F', '\x00'};                  // huge blob
+    libed2k::tag_list<boost::uint32_t> tlist;
+    libed2k::archive::ed2k_iarchive ia_tags(&chTags[0], sizeof(chTags));
+    BOOST_CHECK_THROW(ia_tags >> tlist, libed2k::libed2k_exception);
+    BOOST_CHECK_EQUAL(ia_tags.bytes_left(), 1U);
+
+    libed2k::archive::ed2k_iarchive ia_skip(&chTags[0], sizeof(chTags));
+    boost::uint32_t nCount;
+    ia_skip >> nCount;
+    BOOST_CHECK_THROW(ia_skip.skip(sizeof(chTags)), libed2k::libed2k_exception);
+    ia_skip.skip(ia_skip.bytes_left());
+    BOOST_CHECK_EQUAL(ia_skip.bytes_left(), 0U);
+}
+
 BOOST_AUTO_TEST_CASE(test_emule_collection)
 {
 #ifdef WIN32
@@ -0,0 +1,660 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <set>
+#include <fstream>
+#include <iterator>
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+
+#include "libed2k/constants.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/disk_io_thread.hpp"
+#include "libed2k/storage.hpp"
+#include "libed2k/lazy_entry.hpp"
+#include "common.hpp"
+
+namespace
+{
+    struct job_log
+    {
+        job_log() : done(0) {}
+
+        void on_job(int storage, int ret, libed2k::disk_io_job const& j)
+        {
+            actions[storage].push_back(j.action);
+            results[storage].push_back(ret);
+            if (j.aich_blocks) aich_blocks = *j.aich_blocks;
+            ++done;
+        }
+
+        std::vector<int> actions[2];
+        std::vector<int> results[2];
+        std::vector<libed2k::sha1_hash> aich_blocks;
+        int done;
+    };
+
+    void write_and_hash(int io_threads, int hash_threads)
+    {
+        using namespace libed2k;
+
+        io_service ios;
+        file_pool fp(4);
+        disk_io_thread dio(ios, boost::function<void()>(), fp, BLOCK_SIZE, io_threads, hash_threads);
+        test_files_holder files;
+        job_log log;
+
+        const int size = BLOCK_SIZE * 2 + 100;
+        std::vector<boost::intrusive_ptr<piece_manager> > storages;
+
+        for (int n = 0; n < 2; ++n)
+        {
+            std::string data(size, char('a' + n));
+            std::string filename = std::string("disk_io_test") + char('0' + n) + ".bin";
+            files.hold("./" + filename);
+
+            // the second storage expects other data, its piece fails
+            md4_hash hash = n == 0 ? hasher(data.c_str(), data.size()).final() : md4_hash::emule;
+            boost::intrusive_ptr<transfer_info> ti(new transfer_info(hash, filename, size));
+            storages.push_back(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+                default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+            for (int offset = 0; offset < size; offset += BLOCK_SIZE)
+            {
+                peer_request r;
+                r.piece = 0;
+                r.start = offset;
+                r.length = std::min(size - offset, int(BLOCK_SIZE));
+                disk_buffer_holder buffer(dio, dio.allocate_buffer("receive buffer"));
+                std::memcpy(buffer.get(), data.c_str() + offset, r.length);
+                storages.back()->async_write(r, buffer, boost::bind(&job_log::on_job, &log, n, _1, _2));
+            }
+
+            storages.back()->async_hash(0, boost::bind(&job_log::on_job, &log, n, _1, _2));
+        }
+
+        while (log.done < 8) ios.run_one();
+
+        dio.abort();
+        dio.join();
+        ios.run();
+
+        for (int n = 0; n < 2; ++n)
+        {
+            // completions of a storage come in order of its jobs
+            BOOST_REQUIRE_EQUAL(log.actions[n].size(), 4U);
+            BOOST_CHECK_EQUAL(log.actions[n][0], disk_io_job::write);
+            BOOST_CHECK_EQUAL(log.actions[n][1], disk_io_job::write);
+            BOOST_CHECK_EQUAL(log.actions[n][2], disk_io_job::write);
+            BOOST_CHECK_EQUAL(log.actions[n][3], disk_io_job::hash);
+        }
+
+        BOOST_CHECK_EQUAL(log.results[0].back(), 0);
+        BOOST_CHECK_EQUAL(log.results[1].back(), -2);
+    }
+
+    struct read_log
+    {
+        read_log(libed2k::disk_io_thread& d) : dio(d), done(false) {}
+
+        void on_read(int ret, libed2k::disk_io_job const& j)
+        {
+            BOOST_CHECK_EQUAL(ret, j.buffer_size);
+            if (j.buffer) dio.free_buffer(j.buffer);
+            done = true;
+        }
+
+        libed2k::disk_io_thread& dio;
+        bool done;
+    };
+
+    // reads the first piece of a file hot twice, then scans four
+    // other files through the cache and reads the hot file again.
+    // Returns read cache hits of the hot file
+    int scan_read_cache(bool adaptive)
+    {
+        using namespace libed2k;
+
+        io_service ios;
+        file_pool fp(8);
+        disk_io_thread dio(ios, boost::function<void()>(), fp);
+        test_files_holder files;
+        read_log log(dio);
+
+        // room for three pieces of two blocks and a send buffer
+        session_settings* settings = new session_settings;
+        settings->cache_size = 7;
+        settings->adaptive_read_cache = adaptive;
+        disk_io_job j;
+        j.action = disk_io_job::update_settings;
+        j.buffer = (char*)settings;
+        dio.add_job(j);
+
+        const int size = BLOCK_SIZE * 2;
+        std::vector<boost::intrusive_ptr<piece_manager> > storages;
+        for (int n = 0; n < 5; ++n)
+        {
+            std::string filename = std::string("cache_test") + char('0' + n) + ".bin";
+            BOOST_REQUIRE(generate_test_file(size, filename));
+            files.hold(filename);
+            boost::intrusive_ptr<transfer_info> ti(
+                new transfer_info(hasher(filename.c_str(), filename.size()).final(), filename, size));
+            storages.push_back(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+                default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+        }
+
+        const int reads[][2] = { {0, 0}, {0, 0}, {1, 0}, {1, 1}, {2, 0}, {2, 1},
+            {3, 0}, {3, 1}, {4, 0}, {4, 1}, {0, 0} };
+
+        for (size_t n = 0; n < sizeof(reads)/sizeof(reads[0]); ++n)
+        {
+            peer_request r;
+            r.piece = 0;
+            r.start = reads[n][1] * BLOCK_SIZE;
+            r.length = BLOCK_SIZE;
+            log.done = false;
+            storages[reads[n][0]]->async_read(r, boost::bind(&read_log::on_read, &log, _1, _2));
+            while (!log.done) ios.run_one();
+        }
+
+        cache_status st = dio.status();
+        BOOST_CHECK_EQUAL(st.read_cache_frequent_pieces, adaptive ? 1 : 0);
+        BOOST_CHECK_EQUAL(st.transfers[storages[0]->info()->info_hash()].blocks_read, 3);
+
+        dio.abort();
+        dio.join();
+        ios.run();
+
+        return int(st.transfers[storages[0]->info()->info_hash()].blocks_read_hit);
+    }
+
+    // writes one piece block by block in order, returns the
+    // write cache status and checks data on disk
+    libed2k::cache_status write_piece(bool whole_pieces)
+    {
+        using namespace libed2k;
+
+        io_service ios;
+        file_pool fp(4);
+        disk_io_thread dio(ios, boost::function<void()>(), fp);
+        test_files_holder files;
+        files.hold("./disk_io_flush.bin");
+        job_log log;
+
+        session_settings* settings = new session_settings;
+        settings->flush_whole_pieces = whole_pieces;
+        disk_io_job j;
+        j.action = disk_io_job::update_settings;
+        j.buffer = (char*)settings;
+        dio.add_job(j);
+
+        const int size = BLOCK_SIZE * 5 + 100;
+        std::string data(size, 'f');
+        for (int n = 0; n < size; n += 1000) data[n] = char('a' + n % 26);
+
+        boost::intrusive_ptr<transfer_info> ti(new transfer_info(md4_hash::emule, "disk_io_flush.bin", size));
+        boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+            default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+        for (int offset = 0; offset < size; offset += BLOCK_SIZE)
+        {
+            peer_request r;
+            r.piece = 0;
+            r.start = offset;
+            r.length = std::min(size - offset, int(BLOCK_SIZE));
+            disk_buffer_holder buffer(dio, dio.allocate_buffer("receive buffer"));
+            std::memcpy(buffer.get(), data.c_str() + offset, r.length);
+            storage->async_write(r, buffer, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+        }
+
+        while (log.done < 6) ios.run_one();
+        cache_status st = dio.status();
+
+        dio.abort();
+        dio.join();
+        ios.run();
+
+        std::ifstream in("disk_io_flush.bin", std::ios_base::binary);
+        std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        BOOST_CHECK(written == data);
+        return st;
+    }
+
+    struct check_log
+    {
+        check_log() : ret(0), done(0) {}
+
+        void on_resume(int r, libed2k::disk_io_job const&)
+        {
+            ret = r;
+            ++done;
+        }
+
+        // like transfer::on_piece_checked the last call reports a piece too
+        void on_check(int r, libed2k::disk_io_job const& j)
+        {
+            if (j.offset >= 0) pieces.insert(j.offset);
+            ret = r;
+            ++done;
+        }
+
+        std::set<int> pieces;
+        int ret;
+        int done;
+    };
+
+    // checks a file without resume data where the first piece was
+    // never written, returns the pieces found
+    std::set<int> check_sparse_file(bool fast, int hash_threads)
+    {
+        using namespace libed2k;
+
+        io_service ios;
+        file_pool fp(4);
+        disk_io_thread dio(ios, boost::function<void()>(), fp, BLOCK_SIZE, 1, hash_threads);
+        test_files_holder files;
+        files.hold("./disk_io_check.bin");
+        check_log log;
+
+        session_settings* settings = new session_settings;
+        settings->fast_recheck = fast;
+        disk_io_job j;
+        j.action = disk_io_job::update_settings;
+        j.buffer = (char*)settings;
+        dio.add_job(j);
+
+        std::string piece(PIECE_SIZE, 'p');
+        std::string tail(100, 't');
+        {
+            std::ofstream out("disk_io_check.bin", std::ios_base::binary);
+            out.seekp(PIECE_SIZE);
+            out.write(piece.c_str(), piece.size());
+            out.write(tail.c_str(), tail.size());
+        }
+
+        std::vector<md4_hash> hashes;
+        hashes.push_back(md4_hash::emule);
+        hashes.push_back(hasher(piece.c_str(), piece.size()).final());
+        hashes.push_back(hasher(tail.c_str(), tail.size()).final());
+        boost::intrusive_ptr<transfer_info> ti(new transfer_info(
+            md4_hash::emule, "disk_io_check.bin", PIECE_SIZE * 2 + 100, hashes));
+        boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+            default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+        // no resume data, the file is there and needs a check
+        lazy_entry rd;
+        storage->async_check_fastresume(&rd, boost::bind(&check_log::on_resume, &log, _1, _2));
+        while (log.done < 1) ios.run_one();
+        BOOST_CHECK_EQUAL(log.ret, int(piece_manager::need_full_check));
+
+        storage->async_check_files(boost::bind(&check_log::on_check, &log, _1, _2));
+        do ios.run_one(); while (log.ret == piece_manager::need_full_check);
+
+        dio.abort();
+        dio.join();
+        ios.run();
+
+        BOOST_CHECK_EQUAL(log.ret, int(piece_manager::no_error));
+        return log.pieces;
+    }
+
+    struct completion_log
+    {
+        completion_log() : done(0), ordered(true) { std::fill(last, last + 4, -1); }
+
+        void on_job(int producer, int ret, libed2k::disk_io_job const&)
+        {
+            if (ret != last[producer] + 1) ordered = false;
+            last[producer] = ret;
+            ++done;
+        }
+
+        int last[4];
+        int done;
+        bool ordered;
+    };
+
+    void push_completions(libed2k::completion_queue* q, completion_log* log, int producer, int count)
+    {
+        libed2k::disk_io_job j;
+        j.callback = boost::bind(&completion_log::on_job, log, producer, _1, _2);
+        for (int n = 0; n < count; ++n) q->post(j, n);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_disk_io)
+
+BOOST_AUTO_TEST_CASE(test_hash_in_io_thread)
+{
+    write_and_hash(1, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_io_workers_and_hash_threads)
+{
+    write_and_hash(2, 1);
+    write_and_hash(3, 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_completion_queue)
+{
+    using namespace libed2k;
+
+    io_service ios;
+    // keeps run_one() waiting for producers
+    boost::optional<io_service::work> work((io_service::work(ios)));
+    boost::shared_ptr<completion_queue> q(new completion_queue(ios));
+    completion_log log;
+    const int count = 20000;
+
+    std::vector<boost::shared_ptr<thread> > producers;
+    for (int n = 0; n < 4; ++n)
+        producers.push_back(boost::shared_ptr<thread>(
+            new thread(boost::bind(&push_completions, q.get(), &log, n, count))));
+
+    while (log.done < 4 * count) ios.run_one();
+    for (int n = 0; n < 4; ++n) producers[n]->join();
+    work.reset();
+    ios.run();
+
+    // jobs of a producer are called back in order, in batches
+    BOOST_CHECK(log.ordered);
+    BOOST_CHECK_EQUAL(log.done, 4 * count);
+    BOOST_CHECK_EQUAL(q->completions(), 4 * count);
+    BOOST_CHECK(q->dispatches() <= q->completions());
+}
+
+BOOST_AUTO_TEST_CASE(test_read_cache_scan_resistance)
+{
+    // scanning evicts the hot piece from a plain LRU, but not from
+    // the frequent list of the adaptive cache
+    BOOST_CHECK_EQUAL(scan_read_cache(false), 1);
+    BOOST_CHECK_EQUAL(scan_read_cache(true), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_cache_promote_after_hash)
+{
+    using namespace libed2k;
+
+    io_service ios;
+    file_pool fp(4);
+    disk_io_thread dio(ios, boost::function<void()>(), fp);
+    test_files_holder files;
+    read_log log(dio);
+
+    session_settings* settings = new session_settings;
+    settings->adaptive_read_cache = true;
+    settings->disable_hash_checks = true;
+    disk_io_job j;
+    j.action = disk_io_job::update_settings;
+    j.buffer = (char*)settings;
+    dio.add_job(j);
+
+    const int size = BLOCK_SIZE * 2;
+    BOOST_REQUIRE(generate_test_file(size, "cache_hash.bin"));
+    files.hold("cache_hash.bin");
+    boost::intrusive_ptr<transfer_info> ti(new transfer_info(md4_hash::emule, "cache_hash.bin", size));
+    boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+        default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+    peer_request r;
+    r.piece = 0;
+    r.start = 0;
+    r.length = BLOCK_SIZE;
+    storage->async_read_and_hash(r, boost::bind(&read_log::on_read, &log, _1, _2));
+    while (!log.done) ios.run_one();
+    BOOST_CHECK_EQUAL(dio.status().read_cache_frequent_pieces, 0);
+
+    // the piece was cached reading the first block, a second
+    // reader of it is a repeated access
+    log.done = false;
+    storage->async_read(r, boost::bind(&read_log::on_read, &log, _1, _2));
+    while (!log.done) ios.run_one();
+    BOOST_CHECK_EQUAL(dio.status().read_cache_frequent_pieces, 1);
+
+    dio.abort();
+    dio.join();
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_flush_whole_pieces)
+{
+    libed2k::cache_status lines = write_piece(false);
+    libed2k::cache_status whole = write_piece(true);
+
+    BOOST_CHECK_EQUAL(lines.blocks_written, 6);
+    BOOST_CHECK(lines.flushes > 1);
+    BOOST_CHECK_EQUAL(whole.blocks_written, 6);
+    BOOST_CHECK_EQUAL(whole.flushes, 1);
+    BOOST_CHECK_EQUAL(whole.writes, 1);
+#if LIBED2K_USE_PREADV
+    // a single pwritev, no seek
+    BOOST_CHECK_EQUAL(whole.write_syscalls, 1);
+#endif
+    BOOST_CHECK(whole.write_syscalls < lines.write_syscalls);
+}
+
+BOOST_AUTO_TEST_CASE(test_hash_out_of_order_blocks)
+{
+    using namespace libed2k;
+
+    io_service ios;
+    file_pool fp(4);
+    disk_io_thread dio(ios, boost::function<void()>(), fp);
+    test_files_holder files;
+    files.hold("./disk_io_reorder.bin");
+    job_log log;
+
+    const int size = BLOCK_SIZE * 5 + 100;
+    std::string data(size, 'r');
+    for (int n = 0; n < size; n += 1000) data[n] = char('a' + n % 26);
+
+    boost::intrusive_ptr<transfer_info> ti(new transfer_info(
+        hasher(data.c_str(), data.size()).final(), "disk_io_reorder.bin", size));
+    boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+        default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+    // the last block comes first, the first one last
+    for (int offset = BLOCK_SIZE * 5; offset >= 0; offset -= BLOCK_SIZE)
+    {
+        peer_request r;
+        r.piece = 0;
+        r.start = offset;
+        r.length = std::min(size - offset, int(BLOCK_SIZE));
+        disk_buffer_holder buffer(dio, dio.allocate_buffer("receive buffer"));
+        std::memcpy(buffer.get(), data.c_str() + offset, r.length);
+        storage->async_write(r, buffer, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+    }
+
+    storage->async_hash(0, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+    while (log.done < 7) ios.run_one();
+    cache_status st = dio.status();
+
+    dio.abort();
+    dio.join();
+    ios.run();
+
+    // blocks waited in the write cache for the first one
+    // and the piece was hashed from memory
+    BOOST_CHECK_EQUAL(log.results[0].back(), 0);
+    BOOST_CHECK_EQUAL(st.pieces_hashed, 1);
+    BOOST_CHECK_EQUAL(st.pieces_read_back, 0);
+    BOOST_CHECK_EQUAL(st.total_read_back, 0);
+    BOOST_CHECK_EQUAL(st.blocks_written, 6);
+}
+
+BOOST_AUTO_TEST_CASE(test_avoid_readback_full_cache)
+{
+    using namespace libed2k;
+
+    io_service ios;
+    file_pool fp(4);
+    disk_io_thread dio(ios, boost::function<void()>(), fp);
+    test_files_holder files;
+    files.hold("./disk_io_full_cache.bin");
+    job_log log;
+
+    session_settings* settings = new session_settings;
+    settings->disk_cache_algorithm = session_settings::avoid_readback;
+    settings->cache_size = 3;
+    disk_io_job j;
+    j.action = disk_io_job::update_settings;
+    j.buffer = (char*)settings;
+    dio.add_job(j);
+
+    const int size = BLOCK_SIZE * 5 + 100;
+    std::string data(size, 'f');
+    for (int n = 0; n < size; n += 1000) data[n] = char('a' + n % 26);
+
+    boost::intrusive_ptr<transfer_info> ti(new transfer_info(
+        hasher(data.c_str(), data.size()).final(), "disk_io_full_cache.bin", size));
+    boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+        default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+    // blocks after the gap don't fit in the cache, they go to
+    // the disk unhashed and the piece is read back
+    for (int offset = BLOCK_SIZE * 5; offset >= 0; offset -= BLOCK_SIZE)
+    {
+        peer_request r;
+        r.piece = 0;
+        r.start = offset;
+        r.length = std::min(size - offset, int(BLOCK_SIZE));
+        disk_buffer_holder buffer(dio, dio.allocate_buffer("receive buffer"));
+        std::memcpy(buffer.get(), data.c_str() + offset, r.length);
+        storage->async_write(r, buffer, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+    }
+
+    storage->async_hash(0, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+    while (log.done < 7) ios.run_one();
+    cache_status st = dio.status();
+
+    dio.abort();
+    dio.join();
+    ios.run();
+
+    BOOST_CHECK_EQUAL(log.results[0].back(), 0);
+    BOOST_CHECK_EQUAL(st.pieces_hashed, 1);
+    BOOST_CHECK_EQUAL(st.pieces_read_back, 1);
+    BOOST_CHECK_EQUAL(st.blocks_written, 6);
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_hash_job)
+{
+    using namespace libed2k;
+
+    io_service ios;
+    file_pool fp(4);
+    disk_io_thread dio(ios, boost::function<void()>(), fp);
+    test_files_holder files;
+    files.hold("./disk_io_aich.bin");
+    job_log log;
+
+    const int size = AICH_BLOCK_SIZE * 3 + 100;
+    std::string data(size, 'z');
+    data[AICH_BLOCK_SIZE + 1] = 'q';
+
+    boost::intrusive_ptr<transfer_info> ti(new transfer_info(md4_hash::emule, "disk_io_aich.bin", size));
+    boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+        default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+    for (int offset = 0; offset < size; offset += BLOCK_SIZE)
+    {
+        peer_request r;
+        r.piece = 0;
+        r.start = offset;
+        r.length = std::min(size - offset, int(BLOCK_SIZE));
+        disk_buffer_holder buffer(dio, dio.allocate_buffer("receive buffer"));
+        std::memcpy(buffer.get(), data.c_str() + offset, r.length);
+        storage->async_write(r, buffer, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+    }
+
+    // blocks cached by writes are flushed before the piece is read
+    storage->async_aich_hash(0, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+
+    while (log.done < 4) ios.run_one();
+
+    dio.abort();
+    dio.join();
+    ios.run();
+
+    aich_piece_hasher h;
+    h.update(data.c_str(), data.size());
+
+    BOOST_CHECK_EQUAL(log.results[0].back(), 0);
+    BOOST_CHECK(log.aich_blocks == h.final());
+    BOOST_CHECK_EQUAL(log.aich_blocks.size(), 4U);
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_with_piece_hash)
+{
+    using namespace libed2k;
+
+    const int size = AICH_BLOCK_SIZE * 3 + 100;
+    std::string data(size, 'y');
+    data[AICH_BLOCK_SIZE * 2 + 7] = 'w';
+
+    aich_piece_hasher expected;
+    expected.update(data.c_str(), data.size());
+
+    // verified pieces carry AICH blocks hashed in the same pass, with
+    // and without hash threads
+    for (int hash_threads = 0; hash_threads < 2; ++hash_threads)
+    {
+        io_service ios;
+        file_pool fp(4);
+        disk_io_thread dio(ios, boost::function<void()>(), fp, BLOCK_SIZE, 1, hash_threads);
+        test_files_holder files;
+        files.hold("./disk_io_aich_md4.bin");
+        job_log log;
+
+        boost::intrusive_ptr<transfer_info> ti(new transfer_info(
+            hasher(data.c_str(), data.size()).final(), "disk_io_aich_md4.bin", size));
+        boost::intrusive_ptr<piece_manager> storage(new piece_manager(boost::shared_ptr<void>(), ti, ".", fp, dio,
+            default_storage_constructor, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+        int jobs = 0;
+        for (int offset = 0; offset < size; offset += BLOCK_SIZE, ++jobs)
+        {
+            peer_request r;
+            r.piece = 0;
+            r.start = offset;
+            r.length = std::min(size - offset, int(BLOCK_SIZE));
+            disk_buffer_holder buffer(dio, dio.allocate_buffer("receive buffer"));
+            std::memcpy(buffer.get(), data.c_str() + offset, r.length);
+            storage->async_write(r, buffer, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+        }
+
+        storage->async_hash(0, boost::bind(&job_log::on_job, &log, 0, _1, _2));
+        while (log.done < jobs + 1) ios.run_one();
+
+        dio.abort();
+        dio.join();
+        ios.run();
+
+        BOOST_CHECK_EQUAL(log.actions[0].back(), int(disk_io_job::hash));
+        BOOST_CHECK_EQUAL(log.results[0].back(), 0);
+        BOOST_CHECK(log.aich_blocks == expected.final());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_fast_check_sparse_file)
+{
+    std::set<int> expected;
+    expected.insert(1);
+    expected.insert(2);
+
+    // the hole at the first piece is skipped, pieces with
+    // data are found in their own slots either way
+    BOOST_CHECK(check_sparse_file(false, 0) == expected);
+    BOOST_CHECK(check_sparse_file(true, 0) == expected);
+    BOOST_CHECK(check_sparse_file(true, 2) == expected);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
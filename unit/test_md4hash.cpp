@@ -121,4 +121,51 @@ BOOST_AUTO_TEST_CASE(test_partial_hashing_and_hashset)
     }
 }
 
+BOOST_AUTO_TEST_CASE(test_multi_hasher)
+{
+    const int streams = 21;
+    const int chunks[] = { 4096, 100, 64, 28, 8192, 1 };
+    int total = 0;
+    for (size_t c = 0; c < sizeof(chunks)/sizeof(chunks[0]); ++c) total += chunks[c];
+
+    std::vector<std::vector<char> > data(streams, std::vector<char>(total));
+    for (int n = 0; n < streams; ++n)
+        for (int i = 0; i < total; ++i)
+            data[n][i] = static_cast<char>((i * 31 + n * 7 + (i >> 8)) & 0xff);
+
+    std::vector<libed2k::md4_hash> expected(streams);
+    for (int n = 0; n < streams; ++n)
+        expected[n] = libed2k::hasher(&data[n][0], total).final();
+
+    int lanes[] = { 16, 8, 4, 1 };
+    int best = libed2k::multi_hasher::lanes();
+
+    for (size_t l = 0; l < sizeof(lanes)/sizeof(lanes[0]); ++l)
+    {
+        int active = libed2k::multi_hasher::set_lanes(lanes[l]);
+        BOOST_CHECK(active <= lanes[l]);
+
+        // every streams count checks full and partial lane groups
+        for (int count = 1; count <= streams; ++count)
+        {
+            libed2k::multi_hasher mh(count);
+            std::vector<const char*> ptrs(count);
+            int offset = 0;
+
+            for (size_t c = 0; c < sizeof(chunks)/sizeof(chunks[0]); ++c)
+            {
+                for (int n = 0; n < count; ++n) ptrs[n] = &data[n][offset];
+                mh.update(&ptrs[0], chunks[c]);
+                offset += chunks[c];
+            }
+
+            for (int n = 0; n < count; ++n)
+                BOOST_CHECK_MESSAGE(mh.final(n) == expected[n], "lanes: " << active << " streams: " << count << " stream: " << n);
+        }
+    }
+
+    libed2k::multi_hasher::set_lanes(best);
+    BOOST_CHECK_EQUAL(libed2k::multi_hasher::lanes(), best);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
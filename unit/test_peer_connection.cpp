@@ -0,0 +1,78 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/peer_connection.hpp"
+
+namespace
+{
+    libed2k::ranked_connection peer(libed2k::size_type payload, bool busy, bool useful, int silent)
+    {
+        libed2k::disconnect_rank r;
+        r.minute_payload = payload;
+        r.busy = busy;
+        r.useful = useful;
+        r.last_receive = libed2k::time_now_hires() - libed2k::seconds(silent);
+        return std::make_pair(r, boost::intrusive_ptr<libed2k::peer_connection>());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_peer_connection)
+
+BOOST_AUTO_TEST_CASE(test_disconnect_rank)
+{
+    using libed2k::disconnect_before;
+    libed2k::disconnect_rank quiet = peer(0, false, false, 10).first;
+
+    // payload of the last minute goes first, then busy, usefulness and silence
+    BOOST_CHECK(disconnect_before(quiet, peer(1, false, false, 100).first));
+    BOOST_CHECK(!disconnect_before(peer(1, false, false, 100).first, quiet));
+    BOOST_CHECK(disconnect_before(quiet, peer(0, true, false, 100).first));
+    BOOST_CHECK(disconnect_before(quiet, peer(0, false, true, 100).first));
+    BOOST_CHECK(disconnect_before(peer(0, true, false, 100).first, peer(0, true, true, 10).first));
+    BOOST_CHECK(disconnect_before(peer(0, false, false, 100).first, quiet));
+    BOOST_CHECK(!disconnect_before(quiet, quiet));
+}
+
+BOOST_AUTO_TEST_CASE(test_select_disconnects)
+{
+    std::vector<libed2k::ranked_connection> peers;
+    peers.push_back(peer(5000, false, true, 1));
+    peers.push_back(peer(0, true, true, 50));
+    peers.push_back(peer(0, false, true, 40));
+    peers.push_back(peer(0, false, false, 20));
+    peers.push_back(peer(0, false, false, 30));
+    peers.push_back(peer(100, false, false, 60));
+
+    std::vector<libed2k::ranked_connection> all(peers);
+    BOOST_REQUIRE_EQUAL(libed2k::select_disconnects(all, 4, false), 4);
+    BOOST_CHECK(!all[0].first.useful && all[0].first.last_receive < all[1].first.last_receive);
+    BOOST_CHECK(!all[1].first.useful);
+    BOOST_CHECK(all[2].first.useful && !all[2].first.busy);
+    BOOST_CHECK(all[3].first.busy);
+
+    // more than there are
+    all = peers;
+    BOOST_CHECK_EQUAL(libed2k::select_disconnects(all, 10, false), 6);
+    BOOST_CHECK_EQUAL(all.back().first.minute_payload, 5000);
+
+    // turnover closes only connections without payload and requests
+    std::vector<libed2k::ranked_connection> idle(peers);
+    BOOST_REQUIRE_EQUAL(libed2k::select_disconnects(idle, 10, true), 3);
+
+    for (int n = 0; n < 3; ++n)
+    {
+        BOOST_CHECK(idle[n].first.idle());
+    }
+
+    BOOST_CHECK(idle[2].first.useful);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <deque>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/piece_picker.hpp"
+#include "libed2k/bitfield.hpp"
+
+namespace
+{
+    const int num_pieces = 64;
+
+    libed2k::bitfield make_bitfield(const int* pieces, int count)
+    {
+        libed2k::bitfield ret(num_pieces, false);
+        for (int n = 0; n < count; ++n) ret.set_bit(pieces[n]);
+        return ret;
+    }
+
+    std::vector<int> pick(libed2k::piece_picker const& p, libed2k::bitfield const& mask, int count)
+    {
+        std::vector<libed2k::piece_block> blocks;
+        p.pick_pieces(mask, blocks, count, 0, 0, libed2k::piece_picker::fast,
+            libed2k::piece_picker::rarest_first, std::vector<int>(), 10);
+
+        std::vector<int> ret;
+        for (size_t n = 0; n < blocks.size(); ++n) ret.push_back(blocks[n].piece_index);
+        return ret;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_piece_picker)
+
+BOOST_AUTO_TEST_CASE(test_rarest_first_refcounts)
+{
+    libed2k::piece_picker p;
+    p.init(1, 1, num_pieces);
+
+    // a source with all but the first piece rebuilds the buckets,
+    // the small ones move their pieces between buckets
+    libed2k::bitfield most(num_pieces, true);
+    most.clear_bit(0);
+    const int some[] = { 3, 5 };
+    const int few[] = { 5 };
+    p.inc_refcount(most);
+    pick(p, most, 1);
+    p.inc_refcount(make_bitfield(some, 2));
+    p.inc_refcount(make_bitfield(few, 1));
+
+    const int wanted[] = { 3, 5, 7 };
+    libed2k::bitfield mask = make_bitfield(wanted, 3);
+    std::vector<int> picked = pick(p, mask, 3);
+    BOOST_REQUIRE_EQUAL(picked.size(), 3U);
+    BOOST_CHECK_EQUAL(picked[0], 7);
+    BOOST_CHECK_EQUAL(picked[1], 3);
+    BOOST_CHECK_EQUAL(picked[2], 5);
+
+    p.dec_refcount(make_bitfield(some, 2));
+    picked = pick(p, mask, 3);
+    BOOST_REQUIRE_EQUAL(picked.size(), 3U);
+    BOOST_CHECK_EQUAL(picked[2], 5);
+
+    std::vector<int> avail;
+    p.get_availability(avail);
+    BOOST_CHECK_EQUAL(avail[0], 0);
+    BOOST_CHECK_EQUAL(avail[3], 1);
+    BOOST_CHECK_EQUAL(avail[5], 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_complete_sources_are_seeds)
+{
+    libed2k::piece_picker p;
+    p.init(1, 1, num_pieces);
+
+    const int some[] = { 10 };
+    p.inc_refcount(make_bitfield(some, 1));
+    libed2k::bitfield all(num_pieces, true);
+    p.inc_refcount(all);
+    p.inc_refcount(all);
+
+    BOOST_CHECK_EQUAL(p.m_seeds, 2);
+    BOOST_CHECK_EQUAL(p.piece_stats(10).peer_count, 1U);
+    BOOST_CHECK_EQUAL(p.distributed_copies().first, 2);
+
+    // pieces without other sources are pickable from seeds,
+    // the piece with one more source is picked last
+    std::vector<int> picked = pick(p, all, num_pieces);
+    BOOST_REQUIRE_EQUAL(picked.size(), size_t(num_pieces));
+    BOOST_CHECK_EQUAL(picked.back(), 10);
+
+    p.dec_refcount(all);
+    p.dec_refcount(all);
+    BOOST_CHECK_EQUAL(p.m_seeds, 0);
+
+    std::vector<int> avail;
+    p.get_availability(avail);
+    BOOST_CHECK_EQUAL(avail[10], 1);
+    BOOST_CHECK_EQUAL(avail[11], 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_piece_deadlines)
+{
+    libed2k::piece_picker p;
+    p.init(1, 1, num_pieces);
+    libed2k::ptime now = libed2k::time_now_hires();
+
+    // kept in deadline order, equal deadlines in order they were set
+    p.set_piece_deadline(10, now + libed2k::milliseconds(300), 0);
+    p.set_piece_deadline(11, now + libed2k::milliseconds(100), 1);
+    p.set_piece_deadline(12, now + libed2k::milliseconds(200), 0);
+    p.set_piece_deadline(13, now + libed2k::milliseconds(100), 0);
+
+    const int expected[] = { 11, 13, 12, 10 };
+    std::deque<libed2k::piece_picker::time_critical_piece> const& tc = p.time_critical_pieces();
+    BOOST_REQUIRE_EQUAL(tc.size(), 4U);
+    for (int n = 0; n < 4; ++n) BOOST_CHECK_EQUAL(tc[n].piece, expected[n]);
+
+    // a new deadline replaces the previous one
+    p.set_piece_deadline(10, now, 1);
+    BOOST_REQUIRE_EQUAL(tc.size(), 4U);
+    BOOST_CHECK_EQUAL(tc[0].piece, 10);
+    BOOST_CHECK_EQUAL(tc[0].flags, 1);
+    BOOST_CHECK_EQUAL(tc[3].piece, 12);
+
+    int flags = 0;
+    BOOST_CHECK(p.reset_piece_deadline(11, &flags));
+    BOOST_CHECK_EQUAL(flags, 1);
+    BOOST_CHECK(!p.reset_piece_deadline(11, &flags));
+    BOOST_CHECK_EQUAL(tc.size(), 3U);
+    BOOST_CHECK_EQUAL(tc[1].piece, 13);
+
+    p.clear_piece_deadlines();
+    BOOST_CHECK(tc.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,9 @@
 #include <fstream>
 #include <boost/test/unit_test.hpp>
 #include "libed2k/packet_struct.hpp"
+#include "libed2k/block_compressor.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/puff.hpp"
 #include "common.hpp"
 
 
@@ -48,4 +51,61 @@ BOOST_AUTO_TEST_CASE(test_extract_message){
 
 }
 
+BOOST_AUTO_TEST_CASE(test_block_compressor){
+    libed2k::session_settings settings;
+    settings.upload_compression_level = 6;
+    settings.upload_compression_budget = -1;
+    libed2k::block_compressor bc(settings);
+
+    std::string text;
+    while (text.size() < 100000) text += "some highly compressible log line\n";
+    libed2k::block_compressor::block z = bc.compress_block(libed2k::md4_hash::terminal, 0, text.c_str(), text.size());
+    BOOST_REQUIRE(z);
+    BOOST_CHECK(z->size() < text.size() / 10);
+
+    // zlib stream is raw deflate data after two bytes header
+    std::vector<unsigned char> out(text.size());
+    boost::uint32_t out_len = out.size();
+    boost::uint32_t in_len = z->size() - 2;
+    BOOST_CHECK_EQUAL(puff(&out[0], &out_len, (unsigned char*)z->c_str() + 2, &in_len), 0);
+    BOOST_CHECK_EQUAL(std::string((const char*)&out[0], out_len), text);
+
+    // repeated request is taken from cache
+    BOOST_CHECK(bc.compress_block(libed2k::md4_hash::terminal, 0, text.c_str(), text.size()) == z);
+    BOOST_CHECK_EQUAL(bc.cache_hits(), 1U);
+    BOOST_CHECK_EQUAL(bc.cached_blocks(), 1U);
+
+    // random blocks aren't compressed and stop file probing
+    std::string noise(10000, '\0');
+    for (size_t i = 0; i < noise.size(); ++i) noise[i] = char(rand());
+
+    for (int i = 0; i < libed2k::block_compressor::probe_blocks; ++i)
+    {
+        BOOST_CHECK(!bc.incompressible(libed2k::md4_hash::emule));
+        BOOST_CHECK(!bc.compress_block(libed2k::md4_hash::emule, i * noise.size(), noise.c_str(), noise.size()));
+    }
+
+    BOOST_CHECK(bc.incompressible(libed2k::md4_hash::emule));
+    BOOST_CHECK(!bc.compress_block(libed2k::md4_hash::emule, 1000000, text.c_str(), text.size()));
+    BOOST_CHECK_EQUAL(bc.cached_blocks(), 1U + libed2k::block_compressor::probe_blocks);
+
+    bc.remove_file(libed2k::md4_hash::emule);
+    BOOST_CHECK(!bc.incompressible(libed2k::md4_hash::emule));
+    BOOST_CHECK_EQUAL(bc.cached_blocks(), 1U);
+
+    // spent budget and disabled compression send blocks as is
+    settings.upload_compression_budget = 0;
+    BOOST_CHECK(!bc.compress_block(libed2k::md4_hash::libed2k, 0, text.c_str(), text.size()));
+    settings.upload_compression_budget = -1;
+    settings.upload_compression_level = 0;
+    BOOST_CHECK(!bc.compress_block(libed2k::md4_hash::libed2k, 0, text.c_str(), text.size()));
+    settings.upload_compression_level = 6;
+    BOOST_CHECK(bc.compress_block(libed2k::md4_hash::libed2k, 0, text.c_str(), text.size()));
+
+    // cache is limited by its size
+    settings.compressed_cache_size = 0;
+    bc.compress_block(libed2k::md4_hash::libed2k, 100000, text.c_str(), text.size());
+    BOOST_CHECK_EQUAL(bc.cached_blocks(), 2U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
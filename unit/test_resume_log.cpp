@@ -0,0 +1,166 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <vector>
+#include <iterator>
+#include <fstream>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/resume_log.hpp"
+#include "libed2k/bencode.hpp"
+#include "common.hpp"
+
+namespace
+{
+    const char log_filename[] = "./resume_test.log";
+
+    boost::shared_ptr<libed2k::entry> make_resume_data(int pieces, int have, int uploaded)
+    {
+        boost::shared_ptr<libed2k::entry> rd(new libed2k::entry(libed2k::entry::dictionary_t));
+        (*rd)["file-format"] = "libed2k resume file";
+        (*rd)["total_uploaded"] = uploaded;
+        std::string& bitmap = (*rd)["pieces"].string();
+        bitmap.assign(pieces, 0);
+        for (int n = 0; n < have; ++n) bitmap[n] = 1;
+        return rd;
+    }
+
+    void post_resume_data(libed2k::resume_log& log, const libed2k::md4_hash& hash,
+        boost::shared_ptr<libed2k::entry> rd)
+    {
+        libed2k::resume_log::checkpoint cp(1);
+        cp[0].hash = hash;
+        cp[0].resume_data = rd;
+        log.post(cp);
+        BOOST_CHECK(cp.empty());
+    }
+
+    std::string bencoded(const libed2k::entry& e)
+    {
+        std::string out;
+        libed2k::bencode(std::back_inserter(out), e);
+        return out;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_resume_log)
+
+BOOST_AUTO_TEST_CASE(test_resume_log_deltas)
+{
+    using namespace libed2k;
+    test_files_holder files;
+    files.hold(log_filename);
+    error_code ec;
+    remove(log_filename, ec);
+
+    md4_hash first = md4_hash::emule;
+    md4_hash second = md4_hash::terminal;
+    boost::shared_ptr<entry> last = make_resume_data(10000, 101, 200);
+
+    {
+        resume_log log;
+        BOOST_REQUIRE(log.open(log_filename, 4, ec));
+
+        post_resume_data(log, first, make_resume_data(10000, 100, 100));
+        post_resume_data(log, second, make_resume_data(10, 10, 0));
+        log.flush();
+        resume_log_status full = log.status();
+        BOOST_CHECK_EQUAL(full.records, 2);
+        BOOST_CHECK_EQUAL(full.transfers, 2);
+
+        // one piece and one value changed, unchanged transfer isn't written
+        post_resume_data(log, first, last);
+        post_resume_data(log, second, make_resume_data(10, 10, 0));
+        log.flush();
+        resume_log_status delta = log.status();
+        BOOST_CHECK_EQUAL(delta.records, 3);
+        BOOST_CHECK(delta.logged_bytes - full.logged_bytes < 100);
+        BOOST_CHECK(delta.logical_bytes - full.logical_bytes > 10000);
+
+        log.erase(second);
+        log.close();
+    }
+
+    // log is replayed on open
+    resume_log log;
+    BOOST_REQUIRE(log.open(log_filename, 4, ec));
+    BOOST_CHECK_EQUAL(log.status().transfers, 1);
+
+    std::vector<char> buf;
+    BOOST_REQUIRE(log.resume_data(first, buf));
+    BOOST_CHECK(std::string(buf.begin(), buf.end()) == bencoded(*last));
+    BOOST_CHECK(!log.resume_data(second, buf));
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_log_compaction)
+{
+    using namespace libed2k;
+    test_files_holder files;
+    files.hold(log_filename);
+    error_code ec;
+    remove(log_filename, ec);
+
+    resume_log log;
+    BOOST_REQUIRE(log.open(log_filename, 2, ec));
+
+    // every checkpoint rewrites the whole transfer
+    const int pieces = 64 * 1024;
+    for (int n = 0; n < 40; ++n)
+    {
+        boost::shared_ptr<entry> rd = make_resume_data(pieces, n % 2 ? pieces : 0, n);
+        post_resume_data(log, md4_hash::emule, rd);
+    }
+
+    log.flush();
+    resume_log_status st = log.status();
+    BOOST_CHECK(st.compactions > 0);
+    BOOST_CHECK(st.log_size <= std::max<size_type>(resume_log::min_compact_size, st.live_size * 2));
+    BOOST_CHECK(st.write_amplification() > 1.);
+    log.close();
+
+    BOOST_REQUIRE(log.open(log_filename, 2, ec));
+    std::vector<char> buf;
+    BOOST_REQUIRE(log.resume_data(md4_hash::emule, buf));
+    BOOST_CHECK(std::string(buf.begin(), buf.end()) == bencoded(*make_resume_data(pieces, pieces, 39)));
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_log_garbage_length)
+{
+    using namespace libed2k;
+    test_files_holder files;
+    files.hold(log_filename);
+    error_code ec;
+    remove(log_filename, ec);
+
+    {
+        resume_log log;
+        BOOST_REQUIRE(log.open(log_filename, 4, ec));
+        post_resume_data(log, md4_hash::emule, make_resume_data(10, 5, 1));
+        log.close();
+    }
+
+    size_type valid_size = file_size(log_filename);
+
+    // record header claiming 4 GB of payload
+    {
+        std::ofstream out(log_filename, std::ios_base::binary | std::ios_base::app);
+        char rec[4 + 1 + md4_hash::size] = { '\xff', '\xff', '\xff', '\xf0', resume_log::record_full };
+        out.write(rec, sizeof(rec));
+        out.write("d1:a1:be", 8);
+    }
+
+    resume_log log;
+    BOOST_REQUIRE(log.open(log_filename, 4, ec));
+    BOOST_CHECK_EQUAL(log.status().transfers, 1);
+    BOOST_CHECK_EQUAL(log.status().log_size, valid_size);
+    log.close();
+    BOOST_CHECK_EQUAL(file_size(log_filename), valid_size);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #endif
 
 #include <sstream>
+#include <algorithm>
 #include <locale.h>
 #include <boost/test/unit_test.hpp>
 
@@ -14,6 +15,10 @@
 #include "libed2k/log.hpp"
 #include "libed2k/alert.hpp"
 #include "libed2k/session_impl.hpp"
+#include "libed2k/session.hpp"
+#include "libed2k/alert_types.hpp"
+#include "libed2k/file.hpp"
+#include "common.hpp"
 
 namespace libed2k{
 
@@ -30,6 +35,22 @@ namespace libed2k{
     };
 }
 
+namespace
+{
+    libed2k::read_piece_alert* wait_read_piece(libed2k::session& ses, std::auto_ptr<libed2k::alert>& a, int ms)
+    {
+        libed2k::ptime end = libed2k::time_now_hires() + libed2k::milliseconds(ms);
+
+        while (libed2k::time_now_hires() < end && ses.wait_for_alert(end - libed2k::time_now_hires()))
+        {
+            a = ses.pop_alert();
+            if (libed2k::read_piece_alert* rp = dynamic_cast<libed2k::read_piece_alert*>(a.get())) return rp;
+        }
+
+        return 0;
+    }
+}
+
 BOOST_AUTO_TEST_SUITE(test_session)
 
 BOOST_AUTO_TEST_CASE(test_lowid_logic)
@@ -45,4 +66,57 @@ BOOST_AUTO_TEST_CASE(test_lowid_logic)
     BOOST_CHECK_EQUAL(ses.callbacked_lowid(101), libed2k::md4_hash::terminal);
 }
 
+BOOST_AUTO_TEST_CASE(test_read_piece_alert)
+{
+    const std::string filename = "test_read_piece.dat";
+    test_files_holder files;
+    files.hold(filename);
+    const libed2k::size_type file_size = libed2k::PIECE_SIZE + 1000;
+    BOOST_REQUIRE(generate_test_file(file_size, filename));
+
+    bool cancel = false;
+    libed2k::add_transfer_params atp = libed2k::file2atp()(filename, cancel).first;
+    atp.seed_mode = true;
+
+    libed2k::session_settings settings;
+    settings.listen_port = 0;
+    libed2k::session ses(libed2k::fingerprint(), "127.0.0.1", settings);
+    ses.set_alert_mask(libed2k::alert::storage_notification | libed2k::alert::error_notification);
+    std::auto_ptr<libed2k::alert> a;
+
+    {
+        libed2k::transfer_handle h = ses.add_transfer(atp);
+        BOOST_REQUIRE(h.is_valid());
+
+        // posted when the piece was read
+        h.read_piece(1);
+        libed2k::read_piece_alert* rp = wait_read_piece(ses, a, 5000);
+        BOOST_REQUIRE(rp);
+        BOOST_CHECK(!rp->ec);
+        BOOST_CHECK_EQUAL(rp->piece, 1);
+        BOOST_REQUIRE_EQUAL(rp->size, 1000);
+        BOOST_CHECK(std::count(rp->buffer.get(), rp->buffer.get() + rp->size, 'X') == 1000);
+
+        // deadline of a piece we have reads it right away when asked to
+        h.set_piece_deadline(0, 1000, libed2k::transfer_handle::alert_when_available);
+        rp = wait_read_piece(ses, a, 5000);
+        BOOST_REQUIRE(rp);
+        BOOST_CHECK(!rp->ec);
+        BOOST_CHECK_EQUAL(rp->piece, 0);
+        BOOST_CHECK_EQUAL(rp->size, int(libed2k::PIECE_SIZE));
+
+        // and not posted otherwise
+        h.set_piece_deadline(0, 1000);
+        BOOST_CHECK(!wait_read_piece(ses, a, 500));
+
+        // piece out of range is answered with an error
+        h.read_piece(2);
+        rp = wait_read_piece(ses, a, 5000);
+        BOOST_REQUIRE(rp);
+        BOOST_CHECK_EQUAL(rp->piece, 2);
+        BOOST_CHECK(rp->ec == libed2k::errors::make_error_code(libed2k::errors::invalid_piece_index));
+        BOOST_CHECK(!rp->buffer);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #endif
 
 #include <sstream>
+#include <map>
 #include <locale.h>
 #include <boost/test/unit_test.hpp>
 
@@ -17,6 +18,7 @@
 #include "libed2k/deadline_timer.hpp"
 #include "libed2k/alert.hpp"
 #include "libed2k/session_impl.hpp"
+#include "libed2k/share_scanner.hpp"
 #include "common.hpp"
 
 namespace libed2k
@@ -35,7 +37,7 @@ namespace libed2k
 
         test_transfer_params_maker(alert_manager& am, const std::string& known_file);
     protected:
-        void process_item();
+        void process_item(const std::string& filepath, const bool& cancel);
     private:
         int m_index;
     };
@@ -48,7 +50,7 @@ namespace libed2k
     public:
         cancel_transfer_params_maker_progress(alert_manager& am, const std::string& known_file);
     protected:
-        void process_item();
+        void process_item(const std::string& filepath, const bool& cancel);
     };
 
     template<class Maker>
@@ -71,11 +73,11 @@ namespace libed2k
 
     test_transfer_params_maker::test_transfer_params_maker(alert_manager& am, const std::string& known_file) : transfer_params_maker(am, known_file), m_index(0) {}
 
-    void test_transfer_params_maker::process_item()
+    void test_transfer_params_maker::process_item(const std::string& filepath, const bool& cancel)
     {
         DBG("process item " << m_index);
         add_transfer_params atp;
-        atp.file_path = m_current_filepath;
+        atp.file_path = filepath;
         m_am.post_alert_should(transfer_params_alert(atp, m_errors[m_index]));
         ++m_index;
         m_index = m_index % TCOUNT;
@@ -83,13 +85,13 @@ namespace libed2k
 
     cancel_transfer_params_maker_progress::cancel_transfer_params_maker_progress(alert_manager& am, const std::string& known_file): transfer_params_maker(am, known_file){}
 
-    void cancel_transfer_params_maker_progress::process_item()
+    void cancel_transfer_params_maker_progress::process_item(const std::string& filepath, const bool& cancel)
     {
         try
         {
             while(1)
             {
-                if (m_abort_current || m_abort)
+                if (cancel || m_abort)
                 {
                     throw libed2k_exception(errors::file_params_making_was_cancelled);
                 }
@@ -98,13 +100,35 @@ namespace libed2k
         }
         catch(libed2k_exception& e)
         {
-            m_am.post_alert_should(transfer_params_alert(add_transfer_params(m_current_filepath), e.error()));
+            m_am.post_alert_should(transfer_params_alert(add_transfer_params(filepath), e.error()));
         }
     }
 }
 
 #define WAIT_TPM(x) while(x.order_size() || !x.current_filepath().empty()) {}
 
+// collect batched parameters until count files reported or timeout
+static std::map<std::string, libed2k::add_transfer_params> wait_batches(libed2k::alert_manager& am, size_t count)
+{
+    std::map<std::string, libed2k::add_transfer_params> res;
+
+    for (int n = 0; n < 100 && res.size() < count; ++n)
+    {
+        if (!am.wait_for_alert(libed2k::milliseconds(100))) continue;
+        std::auto_ptr<libed2k::alert> aptr = am.get();
+        libed2k::transfer_params_batch_alert* a = dynamic_cast<libed2k::transfer_params_batch_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+
+        for (size_t i = 0; i < a->m_params.size(); ++i)
+        {
+            BOOST_CHECK(!a->m_params[i].second);
+            res[a->m_params[i].first.file_path] = a->m_params[i].first;
+        }
+    }
+
+    return res;
+}
+
 BOOST_AUTO_TEST_SUITE(test_share_files)
 
 const char chRussianDirectory[] = {'\xEF', '\xBB', '\xBF', '\xD1', '\x80', '\xD1', '\x83', '\xD1', '\x81', '\xD1', '\x81', '\xD0', '\xBA', '\xD0', '\xB0', '\xD1', '\x8F', '\x20', '\xD0', '\xB4', '\xD0', '\xB8', '\xD1', '\x80', '\xD0', '\xB5', '\xD0', '\xBA', '\xD1', '\x82', '\xD0', '\xBE', '\xD1', '\x80', '\xD0', '\xB8', '\xD1', '\x8F', '\x00' };
@@ -317,6 +341,305 @@ BOOST_AUTO_TEST_CASE(test_add_transfer_params_maker)
     DBG("test_add_transfer_params_maker {completed}");
 }
 
+BOOST_AUTO_TEST_CASE(test_parallel_transfer_params_maker)
+{
+    libed2k::session_impl_test<libed2k::test_transfer_params_maker> sit(libed2k::ss);
+    sit.m_alerts.set_alert_mask(libed2k::alert::all_categories);
+    libed2k::transfer_params_maker tpm(sit.m_alerts, "", 4);
+
+    test_files_holder tfh;
+    const size_t sz = 4;
+    const char* filename = "test_parallel_filename";
+    libed2k::size_type sizes[sz] = { 100, libed2k::PIECE_SIZE, libed2k::PIECE_SIZE*4, libed2k::PIECE_SIZE*5 + 4566 };
+    std::map<std::string, libed2k::add_transfer_params> expected;
+
+    bool cancel = false;
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(sizes[n], s.str()));
+        tfh.hold(s.str());
+        expected[s.str()] = libed2k::file2atp()(s.str(), cancel).first;
+    }
+
+    tpm.start();
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        tpm.make_transfer_params(s.str());
+    }
+
+    WAIT_TPM(tpm);
+    tpm.stop();
+
+    // files are processed concurrently and alerts order is undefined
+    for (size_t n = 0; n < sz; ++n)
+    {
+        BOOST_REQUIRE(sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
+        std::auto_ptr<libed2k::alert> aptr = sit.m_alerts.get();
+        libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+        BOOST_CHECK(!a->m_ec);
+        BOOST_REQUIRE(expected.count(a->m_atp.file_path));
+        const libed2k::add_transfer_params& atp = expected[a->m_atp.file_path];
+        BOOST_CHECK_EQUAL(a->m_atp.file_hash, atp.file_hash);
+        BOOST_CHECK_EQUAL(a->m_atp.file_size, atp.file_size);
+        BOOST_CHECK(a->m_atp.piece_hashses == atp.piece_hashses);
+        expected.erase(a->m_atp.file_path);
+    }
+
+    BOOST_CHECK(expected.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_file2atp)
+{
+    test_files_holder tfh;
+    const size_t sz = 4;
+    const char* filename = "test_mapped_filename";
+    libed2k::size_type sizes[sz] = { 100, libed2k::PIECE_SIZE, libed2k::PIECE_SIZE*2, libed2k::PIECE_SIZE*3 + 4566 };
+
+    bool cancel = false;
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(sizes[n], s.str()));
+        tfh.hold(s.str());
+        std::pair<libed2k::add_transfer_params, libed2k::error_code> expected = libed2k::file2atp()(s.str(), cancel);
+        std::pair<libed2k::add_transfer_params, libed2k::error_code> mapped =
+            libed2k::file2atp(libed2k::file2atp::read_mapped | libed2k::file2atp::drop_cache)(s.str(), cancel);
+        BOOST_CHECK(!expected.second);
+        BOOST_CHECK(!mapped.second);
+        BOOST_CHECK_EQUAL(mapped.first.file_hash, expected.first.file_hash);
+        BOOST_CHECK_EQUAL(mapped.first.file_size, expected.first.file_size);
+        BOOST_CHECK(mapped.first.piece_hashses == expected.first.piece_hashses);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_collection_index)
+{
+    test_files_holder tfh;
+    const size_t sz = 3;
+    const char* filename = "test_known_filename";
+    libed2k::known_file_collection kfc;
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(100 + n, s.str()));
+        tfh.hold(s.str());
+        std::vector<libed2k::md4_hash> hashes(n + 1, libed2k::md4_hash::emule);
+        libed2k::known_file_entry entry(libed2k::md4_hash::libed2k, hashes, s.str(), 100 + n, 0, 0, 0, 0);
+        entry.m_nLastChanged = 1000 + n;
+        kfc.m_known_file_list.m_collection.push_back(entry);
+    }
+
+    kfc.build_index();
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        libed2k::add_transfer_params atp = kfc.extract_transfer_params(1000 + n, 100 + n, s.str());
+        BOOST_CHECK_EQUAL(atp.file_hash, libed2k::md4_hash::libed2k);
+        BOOST_CHECK_EQUAL(atp.file_size, 100 + n);
+        BOOST_CHECK_EQUAL(atp.piece_hashses.size(), n + 1);
+        BOOST_CHECK(atp.seed_mode);
+
+        // any changed key part misses
+        BOOST_CHECK(!kfc.extract_transfer_params(1001 + n, 100 + n, s.str()).file_hash.defined());
+        BOOST_CHECK(!kfc.extract_transfer_params(1000 + n, 101 + n, s.str()).file_hash.defined());
+        BOOST_CHECK(!kfc.extract_transfer_params(1000 + n, 100 + n, s.str() + "x").file_hash.defined());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_store)
+{
+    libed2k::session_impl_test<libed2k::test_transfer_params_maker> sit(libed2k::ss);
+    sit.m_alerts.set_alert_mask(libed2k::alert::all_categories);
+
+    test_files_holder tfh;
+    const size_t sz = 3;
+    const char* filename = "test_store_filename";
+    const char* known_filepath = "test_store_known.met";
+    const char* store_filepath = "test_store.kfs";
+    tfh.hold(known_filepath);
+    tfh.hold(store_filepath);
+    libed2k::known_file_collection kfc;
+    libed2k::file_status fs[sz];
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(100 + n, s.str()));
+        tfh.hold(s.str());
+        libed2k::error_code ec;
+        libed2k::stat_file(s.str(), &fs[n], ec);
+        BOOST_REQUIRE(!ec);
+        std::vector<libed2k::md4_hash> hashes(n, libed2k::md4_hash::emule);
+        libed2k::known_file_entry entry(libed2k::md4_hash::libed2k, hashes, s.str(), 100 + n, n, n + 1, 0x100000000ULL + n, n);
+        entry.m_nLastChanged = fs[n].mtime;
+        kfc.m_known_file_list.m_collection.push_back(entry);
+    }
+
+    kfc.build_index();
+
+    libed2k::error_code ec;
+    BOOST_REQUIRE(libed2k::known_file_store::write(store_filepath, kfc, ec));
+    libed2k::known_file_store kfs;
+    BOOST_REQUIRE(kfs.open(store_filepath, ec));
+    BOOST_CHECK_EQUAL(kfs.size(), sz);
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        libed2k::add_transfer_params atp = kfs.extract_transfer_params(fs[n].mtime, fs[n].file_size, s.str());
+        BOOST_CHECK(atp == kfc.extract_transfer_params(fs[n].mtime, fs[n].file_size, s.str()));
+        BOOST_CHECK_EQUAL(atp.transferred, 0x100000000ULL + n);
+        BOOST_CHECK(!kfs.extract_transfer_params(fs[n].mtime, fs[n].file_size + 1, s.str()).file_hash.defined());
+    }
+
+    // export gives the same entries
+    libed2k::known_file_collection exported;
+    kfs.export_collection(exported);
+    exported.build_index();
+    BOOST_REQUIRE_EQUAL(exported.m_known_file_list.m_collection.size(), sz);
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_CHECK(exported.extract_transfer_params(fs[n].mtime, fs[n].file_size, s.str()) ==
+            kfc.extract_transfer_params(fs[n].mtime, fs[n].file_size, s.str()));
+    }
+
+    kfs.close();
+
+    // first hash index which wraps around with hashes count is rejected
+    {
+        std::fstream fstream(store_filepath, std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+        fstream.seekp(32 + 72 + 40);
+        const char wrap[8] = { '\xff', '\xff', '\xff', '\xff', '\xff', '\xff', '\xff', '\xff' };
+        fstream.write(wrap, sizeof(wrap));
+    }
+
+    BOOST_CHECK(!kfs.open(store_filepath, ec));
+    BOOST_CHECK(ec == libed2k::errors::make_error_code(libed2k::errors::known_store_corrupted));
+    BOOST_CHECK(!kfs.is_open());
+
+    // maker imports known.met into store and takes parameters from it
+    {
+        std::ofstream fstream(known_filepath, std::ios_base::binary | std::ios_base::out);
+        libed2k::archive::ed2k_oarchive oa(fstream);
+        oa << kfc;
+    }
+
+    libed2k::remove(store_filepath, ec);
+    libed2k::transfer_params_maker tpm(sit.m_alerts, known_filepath, 1, 0, store_filepath);
+    tpm.start();
+    tpm.make_transfer_params(std::string(filename) + "1");
+    WAIT_TPM(tpm);
+    tpm.stop();
+
+    BOOST_CHECK(libed2k::exists(store_filepath));
+    BOOST_REQUIRE(sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
+    std::auto_ptr<libed2k::alert> aptr = sit.m_alerts.get();
+    libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+    BOOST_REQUIRE(a);
+    BOOST_CHECK(!a->m_ec);
+    BOOST_CHECK_EQUAL(a->m_atp.file_hash, libed2k::md4_hash::libed2k);
+    BOOST_CHECK_EQUAL(a->m_atp.requested, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(test_share_scanner)
+{
+    libed2k::session_impl_test<libed2k::test_transfer_params_maker> sit(libed2k::ss);
+    sit.m_alerts.set_alert_mask(libed2k::alert::all_categories);
+
+    const std::string dirpath = "test_share_scanner_dir";
+    const std::string cache_filepath = "test_share_scanner.cache";
+    libed2k::error_code ec;
+    libed2k::remove_all(dirpath, ec);
+    libed2k::remove(cache_filepath, ec);
+    libed2k::create_directories(libed2k::combine_path(dirpath, "sub"), ec);
+    BOOST_REQUIRE(!ec);
+
+    const size_t sz = 4;
+    const char* names[sz] = { "a", "b", "c", "sub/d" };
+    libed2k::size_type sizes[sz] = { 100, 200, libed2k::PIECE_SIZE + 5, 300 };
+    std::map<std::string, libed2k::add_transfer_params> expected;
+    bool cancel = false;
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::string filepath = libed2k::combine_path(dirpath, names[n]);
+        BOOST_REQUIRE(generate_test_file(sizes[n], filepath));
+        expected[filepath] = libed2k::file2atp()(filepath, cancel).first;
+    }
+
+    {
+        libed2k::share_scanner scanner(sit.m_alerts, "", cache_filepath, 2);
+        scanner.start();
+        scanner.share_directory(dirpath);
+        std::map<std::string, libed2k::add_transfer_params> res = wait_batches(sit.m_alerts, sz);
+        BOOST_REQUIRE_EQUAL(res.size(), sz);
+
+        for (std::map<std::string, libed2k::add_transfer_params>::iterator itr = expected.begin(); itr != expected.end(); ++itr)
+        {
+            BOOST_CHECK_EQUAL(res[itr->first].file_hash, itr->second.file_hash);
+            BOOST_CHECK_EQUAL(res[itr->first].file_size, itr->second.file_size);
+        }
+
+        BOOST_CHECK_EQUAL(scanner.hashed_files(), sz);
+        scanner.stop();
+
+        // destructor doesn't save cache again
+        BOOST_REQUIRE(libed2k::exists(cache_filepath));
+        libed2k::rename(cache_filepath, cache_filepath + ".saved", ec);
+        BOOST_REQUIRE(!ec);
+    }
+
+    BOOST_CHECK(!libed2k::exists(cache_filepath));
+    libed2k::rename(cache_filepath + ".saved", cache_filepath, ec);
+    BOOST_REQUIRE(!ec);
+
+    // restart takes all files from cache
+    libed2k::share_scanner scanner(sit.m_alerts, "", cache_filepath, 2);
+    scanner.start();
+    scanner.share_directory(dirpath);
+    std::map<std::string, libed2k::add_transfer_params> res = wait_batches(sit.m_alerts, sz);
+    BOOST_REQUIRE_EQUAL(res.size(), sz);
+
+    for (std::map<std::string, libed2k::add_transfer_params>::iterator itr = expected.begin(); itr != expected.end(); ++itr)
+    {
+        BOOST_CHECK_EQUAL(res[itr->first].file_hash, itr->second.file_hash);
+        BOOST_CHECK(res[itr->first].piece_hashses == itr->second.piece_hashses);
+    }
+
+    BOOST_CHECK_EQUAL(scanner.hashed_files(), 0U);
+
+#ifdef LIBED2K_LINUX
+    // new file is reported by watcher
+    std::string filepath = libed2k::combine_path(libed2k::combine_path(dirpath, "sub"), "e");
+    BOOST_REQUIRE(generate_test_file(400, filepath));
+    res = wait_batches(sit.m_alerts, 1);
+    BOOST_REQUIRE_EQUAL(res.size(), 1U);
+    BOOST_CHECK_EQUAL(res.begin()->first, filepath);
+    BOOST_CHECK_EQUAL(res.begin()->second.file_hash, libed2k::file2atp()(filepath, cancel).first.file_hash);
+    BOOST_CHECK_EQUAL(scanner.hashed_files(), 1U);
+#endif
+
+    scanner.stop();
+    libed2k::remove_all(dirpath, ec);
+    libed2k::remove(cache_filepath, ec);
+}
+
 BOOST_AUTO_TEST_CASE(test_cancel_filename_in_progress)
 {
     const char* filepath = "it is simple test name";
@@ -0,0 +1,178 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <set>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "libed2k/slab_arena.hpp"
+#include "libed2k/thread.hpp"
+
+namespace
+{
+    const int buffer_size = 16 * 1024;
+    const int per_slab = libed2k::slab_arena::hugepage_size / buffer_size;
+
+    void churn(libed2k::slab_arena* arena, int seed, bool* ok)
+    {
+        std::vector<char*> bufs;
+        for (int round = 0; round < 2000; ++round)
+        {
+            int n = (round * 7 + seed) % 13;
+            while (int(bufs.size()) < n)
+            {
+                char* buf = arena->allocate();
+                if (!buf) { *ok = false; return; }
+                buf[0] = char(seed);
+                buf[buffer_size - 1] = char(seed);
+                bufs.push_back(buf);
+            }
+
+            while (int(bufs.size()) > n / 2)
+            {
+                char* buf = bufs.back();
+                if (buf[0] != char(seed) || buf[buffer_size - 1] != char(seed)) *ok = false;
+                arena->free(buf);
+                bufs.pop_back();
+            }
+        }
+
+        for (size_t i = 0; i < bufs.size(); ++i) arena->free(bufs[i]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_slab_arena)
+
+BOOST_AUTO_TEST_CASE(test_slabs)
+{
+    libed2k::slab_arena arena(buffer_size);
+    std::vector<char*> bufs;
+    std::set<char*> unique;
+
+    for (int n = 0; n < per_slab * 2; ++n)
+    {
+        char* buf = arena.allocate();
+        BOOST_REQUIRE(buf);
+        BOOST_CHECK_EQUAL((std::size_t(buf) % 4096), 0U);
+        BOOST_CHECK(arena.owns(buf));
+        bufs.push_back(buf);
+        unique.insert(buf);
+    }
+
+    BOOST_CHECK_EQUAL(unique.size(), bufs.size());
+    BOOST_CHECK(!arena.owns((char*)&bufs));
+
+    libed2k::slab_arena::stats_t st = arena.stats();
+    BOOST_CHECK_EQUAL(st.in_use, per_slab * 2);
+    BOOST_CHECK_EQUAL(st.peak_in_use, per_slab * 2);
+    BOOST_CHECK_EQUAL(st.slabs, 2);
+    BOOST_CHECK_EQUAL(st.reserved, per_slab * 2);
+    BOOST_CHECK_EQUAL(st.cached, 0);
+    BOOST_CHECK_EQUAL(st.fragmented, 0);
+
+    // every other buffer of the first slab and the whole second one are freed
+    for (int n = 0; n < per_slab * 2; ++n)
+        if (n >= per_slab || n % 2) arena.free(bufs[n]);
+
+    arena.release_memory();
+    st = arena.stats();
+    BOOST_CHECK_EQUAL(st.in_use, per_slab / 2);
+    BOOST_CHECK_EQUAL(st.peak_in_use, per_slab * 2);
+    BOOST_CHECK_EQUAL(st.cached, 0);
+    BOOST_CHECK_EQUAL(st.slabs, 1);
+    BOOST_CHECK_EQUAL(st.fragmented, per_slab / 2);
+
+    // freed buffers are reused before a new slab is mapped
+    for (int n = 0; n < per_slab / 2; ++n) BOOST_CHECK(arena.owns(arena.allocate()));
+    st = arena.stats();
+    BOOST_CHECK_EQUAL(st.slabs, 1);
+    BOOST_CHECK_EQUAL(st.fragmented, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_threads)
+{
+    libed2k::slab_arena arena(buffer_size);
+    std::vector<boost::shared_ptr<libed2k::thread> > threads;
+    bool ok[4] = { true, true, true, true };
+
+    for (int n = 0; n < 4; ++n)
+        threads.push_back(boost::shared_ptr<libed2k::thread>(
+            new libed2k::thread(boost::bind(&churn, &arena, n + 1, &ok[n]))));
+    for (int n = 0; n < 4; ++n) threads[n]->join();
+
+    for (int n = 0; n < 4; ++n) BOOST_CHECK(ok[n]);
+    libed2k::slab_arena::stats_t st = arena.stats();
+    BOOST_CHECK_EQUAL(st.in_use, 0);
+    BOOST_CHECK(st.peak_in_use <= 4 * 12);
+    // finished threads returned their caches
+    BOOST_CHECK_EQUAL(st.cached, 0);
+    arena.release_memory();
+    BOOST_CHECK_EQUAL(arena.stats().slabs, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_switches_arena)
+{
+    libed2k::slab_arena a(buffer_size);
+    char* buf = a.allocate();
+    BOOST_CHECK(a.stats().cached > 0);
+
+    {
+        libed2k::slab_arena b(buffer_size);
+        b.free(b.allocate());
+        // each arena has its own cache in the thread
+        BOOST_CHECK(a.stats().cached > 0);
+        BOOST_CHECK(b.stats().cached > 0);
+    }
+
+    // cache of the destroyed arena is dropped
+    a.free(buf);
+    a.release_memory();
+    BOOST_CHECK_EQUAL(a.stats().in_use, 0);
+    BOOST_CHECK_EQUAL(a.stats().slabs, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_least_recently_used_cache_flushed)
+{
+    const int count = libed2k::slab_arena::thread_cache_slots + 1;
+    std::vector<boost::shared_ptr<libed2k::slab_arena> > arenas;
+
+    for (int n = 0; n < count; ++n)
+    {
+        arenas.push_back(boost::shared_ptr<libed2k::slab_arena>(new libed2k::slab_arena(buffer_size)));
+        arenas[n]->free(arenas[n]->allocate());
+    }
+
+    // the first arena was used least recently, its cache made room for the last one
+    BOOST_CHECK_EQUAL(arenas[0]->stats().cached, 0);
+    for (int n = 1; n < count; ++n) BOOST_CHECK(arenas[n]->stats().cached > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_release_memory_of_other_thread)
+{
+    libed2k::slab_arena arena(buffer_size);
+
+    // the cache of this thread keeps a slab mapped
+    char* buf = arena.allocate();
+    BOOST_CHECK(arena.stats().cached > 0);
+
+    libed2k::thread t(boost::bind(&libed2k::slab_arena::release_memory, &arena));
+    t.join();
+    BOOST_CHECK_EQUAL(arena.stats().slabs, 1);
+
+    // this thread flushes its cache on next call
+    arena.free(buf);
+    BOOST_CHECK_EQUAL(arena.stats().cached, 1);
+    libed2k::slab_arena::drain_thread();
+    BOOST_CHECK_EQUAL(arena.stats().cached, 0);
+    arena.release_memory();
+    BOOST_CHECK_EQUAL(arena.stats().slabs, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <string>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/io_service.hpp"
+#include "libed2k/address.hpp"
+#include "libed2k/connection_queue.hpp"
+#include "libed2k/udp_socket.hpp"
+
+namespace
+{
+    typedef libed2k::udp_socket::batched_packet packet;
+
+    packet make_packet(int port, int size)
+    {
+        packet p;
+        p.ep = libed2k::udp::endpoint(libed2k::address_v4::loopback(), port);
+        p.offset = 0;
+        p.size = size;
+        return p;
+    }
+
+    // sends packets of given sizes corked through a socket bound
+    // to loopback and checks they arrive one by one, in order
+    void send_corked(int const* sizes, int count, bool no_checksums)
+    {
+        using namespace libed2k;
+
+        io_service ios;
+        connection_queue cq(ios);
+        udp_socket sock(ios, udp_socket::callback_t(), udp_socket::callback2_t(), cq);
+        error_code ec;
+        sock.bind(udp::endpoint(address_v4::loopback(), 0), ec);
+        BOOST_REQUIRE(!ec);
+
+#if LIBED2K_USE_MMSG && defined SO_NO_CHECK
+        // the kernel refuses segmentation offload
+        // on sockets without UDP checksums
+        if (no_checksums)
+        {
+            sock.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_NO_CHECK>(true), ec);
+            BOOST_REQUIRE(!ec);
+        }
+#endif
+
+        udp::socket peer(ios);
+        peer.open(udp::v4(), ec);
+        peer.bind(udp::endpoint(address_v4::loopback(), 0), ec);
+        BOOST_REQUIRE(!ec);
+        udp::endpoint const to = peer.local_endpoint(ec);
+
+        sock.cork();
+        for (int n = 0; n < count; ++n)
+        {
+            std::string data(sizes[n], char('a' + n));
+            ec = asio::error::would_block;
+            sock.send(to, data.c_str(), int(data.size()), ec);
+            BOOST_CHECK(!ec);
+        }
+        sock.uncork();
+
+#if LIBED2K_USE_MMSG && defined SO_NO_CHECK
+        if (no_checksums) BOOST_CHECK(!sock.segmentation_offload());
+#endif
+
+        std::vector<char> buf(0x10000);
+        for (int n = 0; n < count; ++n)
+        {
+            udp::endpoint from;
+            std::size_t len = peer.receive_from(asio::buffer(&buf[0], buf.size()), from, 0, ec);
+            BOOST_REQUIRE(!ec);
+            BOOST_CHECK_EQUAL(int(len), sizes[n]);
+            BOOST_CHECK(std::string(&buf[0], len) == std::string(sizes[n], char('a' + n)));
+        }
+
+        sock.close();
+        ios.run();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_udp_socket)
+
+BOOST_AUTO_TEST_CASE(test_split_batch)
+{
+    std::vector<packet> batch;
+    batch.push_back(make_packet(1000, 100));
+    batch.push_back(make_packet(1000, 100));
+    batch.push_back(make_packet(1000, 60));
+    batch.push_back(make_packet(1000, 100));
+    batch.push_back(make_packet(1001, 100));
+    batch.push_back(make_packet(1001, 100));
+    batch.push_back(make_packet(1001, 50));
+    batch.push_back(make_packet(1001, 100));
+
+    int first[libed2k::udp_socket::max_batch_size + 1];
+
+    // runs to one endpoint end after a shorter packet
+    // or when the endpoint changes
+    BOOST_REQUIRE_EQUAL(libed2k::udp_socket::split_batch(batch, 0, 8, true, first), 4);
+    BOOST_CHECK_EQUAL(first[0], 0);
+    BOOST_CHECK_EQUAL(first[1], 3);
+    BOOST_CHECK_EQUAL(first[2], 4);
+    BOOST_CHECK_EQUAL(first[3], 7);
+    BOOST_CHECK_EQUAL(first[4], 8);
+
+    // a part of the batch
+    BOOST_REQUIRE_EQUAL(libed2k::udp_socket::split_batch(batch, 3, 6, true, first), 2);
+    BOOST_CHECK_EQUAL(first[0], 3);
+    BOOST_CHECK_EQUAL(first[1], 4);
+    BOOST_CHECK_EQUAL(first[2], 6);
+
+    // without segmentation offload every packet is a message
+    BOOST_REQUIRE_EQUAL(libed2k::udp_socket::split_batch(batch, 0, 8, false, first), 8);
+    for (int n = 0; n <= 8; ++n) BOOST_CHECK_EQUAL(first[n], n);
+
+    // a message stays below the datagram size limit
+    batch.clear();
+    for (int n = 0; n < 3; ++n) batch.push_back(make_packet(1000, 30000));
+    BOOST_REQUIRE_EQUAL(libed2k::udp_socket::split_batch(batch, 0, 3, true, first), 2);
+    BOOST_CHECK_EQUAL(first[1], 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_corked_send)
+{
+    const int sizes[] = { 1200, 1200, 1200, 700, 1200, 300 };
+    send_corked(sizes, 6, false);
+}
+
+BOOST_AUTO_TEST_CASE(test_corked_send_without_offload)
+{
+    const int sizes[] = { 1200, 1200, 1200, 1200, 500 };
+    send_corked(sizes, 5, true);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,247 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/upload_queue.hpp"
+#include "libed2k/session_settings.hpp"
+
+namespace
+{
+    libed2k::upload_queue::client_id client(int n, const char* ip = "10.0.0.1")
+    {
+        libed2k::md4_hash h;
+        h[0] = n + 1;
+        return std::make_pair(h, libed2k::address::from_string(ip));
+    }
+
+    libed2k::session_settings queue_settings(int min_slots, int max_slots)
+    {
+        libed2k::session_settings s;
+        s.upload_slots_min = min_slots;
+        s.unchoke_slots_limit = max_slots;
+        s.upload_slot_bytes = 1ll << 40;
+        s.upload_slot_time = 24 * 3600;
+        return s;
+    }
+
+    // every slot uploads up to slot_rate, together they can't go over link_rate
+    void run(libed2k::upload_queue& q, int clients, libed2k::ptime& now, int seconds, int slot_rate, int link_rate)
+    {
+        for (int t = 0; t < seconds; ++t)
+        {
+            int slots = q.slots();
+            int rate = slots ? (std::min)(slot_rate, link_rate / slots) : 0;
+
+            for (int n = 0; n < clients; ++n)
+            {
+                if (q.has_slot(client(n))) q.uploaded(client(n), rate);
+            }
+
+            now += libed2k::seconds(1);
+            libed2k::upload_queue::tick_result res;
+            q.second_tick(now, res);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_upload_queue)
+
+BOOST_AUTO_TEST_CASE(test_upload_queue_ranking)
+{
+    using namespace libed2k;
+    session_settings s = queue_settings(2, 2);
+    upload_queue q(s);
+    ptime now = time_now_hires();
+    md4_hash file;
+    int rank = 0;
+
+    BOOST_CHECK_EQUAL(q.request(client(0), file, now, rank), upload_queue::granted);
+    BOOST_CHECK_EQUAL(q.request(client(1), file, now, rank), upload_queue::granted);
+    BOOST_CHECK_EQUAL(q.request(client(2), file, now, rank), upload_queue::queued);
+    BOOST_CHECK_EQUAL(rank, 1);
+
+    // client which uploaded to us goes before the one waiting longer
+    now += seconds(2);
+    q.downloaded(client(3), 10 * 1024 * 1024);
+    BOOST_CHECK(q.credit_modifier(client(3)) > 3);
+    BOOST_CHECK_EQUAL(q.credit_modifier(client(2)), 1.f);
+    BOOST_CHECK_EQUAL(q.request(client(3), file, now, rank), upload_queue::queued);
+    BOOST_CHECK_EQUAL(rank, 1);
+    BOOST_CHECK_EQUAL(q.rank(client(2), now), 2);
+    BOOST_CHECK_EQUAL(q.waiting(), 2);
+
+    s.upload_queue_size = 2;
+    BOOST_CHECK_EQUAL(q.request(client(4), file, now, rank), upload_queue::queue_full);
+
+    // released slot is given to the best waiting client on tick
+    q.release(client(0));
+    upload_queue::tick_result res;
+    q.second_tick(now, res);
+    BOOST_REQUIRE_EQUAL(res.granted.size(), 1u);
+    BOOST_CHECK(res.granted[0] == client(3));
+    BOOST_CHECK(q.has_slot(client(3)));
+
+    // disconnected client keeps its place, but doesn't get slot
+    q.disconnected(client(2));
+    q.release(client(1));
+    res = upload_queue::tick_result();
+    q.second_tick(now, res);
+    BOOST_CHECK(res.granted.empty());
+    BOOST_CHECK_EQUAL(q.rank(client(2), now), 1);
+    BOOST_CHECK_EQUAL(q.request(client(2), file, now, rank), upload_queue::granted);
+}
+
+BOOST_AUTO_TEST_CASE(test_upload_queue_slot_control)
+{
+    using namespace libed2k;
+    session_settings s = queue_settings(1, -1);
+    upload_queue q(s);
+    ptime now = time_now_hires();
+    const int clients = 10;
+    int rank = 0;
+
+    for (int n = 0; n < clients; ++n) q.request(client(n), md4_hash(), now, rank);
+    BOOST_CHECK_EQUAL(q.slots(), 1);
+
+    // slots are added while total rate rises and the one over link capacity is taken back
+    run(q, clients, now, 300, 10000, 50000);
+    BOOST_CHECK(q.target_slots() >= 5 && q.target_slots() <= 6);
+
+    int at_capacity = 0;
+
+    for (int t = 0; t < 30; ++t)
+    {
+        run(q, clients, now, upload_queue::adjust_interval, 10000, 50000);
+        if (q.target_slots() == 5) ++at_capacity;
+    }
+
+    BOOST_CHECK(at_capacity > 20);
+
+    // rate per slot collapses under minimal slot rate
+    run(q, clients, now, 300, 10000, 1500);
+    BOOST_CHECK_EQUAL(q.target_slots(), 1);
+    BOOST_CHECK_EQUAL(q.slots(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_upload_queue_clients)
+{
+    using namespace libed2k;
+    session_settings s = queue_settings(1, 1);
+    upload_queue q(s);
+    ptime now = time_now_hires();
+    md4_hash file;
+    int rank = 0;
+
+    // client without hash can't be told apart from others
+    upload_queue::client_id anonymous(md4_hash(), address::from_string("10.0.0.1"));
+    BOOST_CHECK_EQUAL(q.request(anonymous, file, now, rank), upload_queue::queue_full);
+    q.downloaded(anonymous, 10 * 1024 * 1024);
+    BOOST_CHECK_EQUAL(q.credit_modifier(anonymous), 1.f);
+    BOOST_CHECK_EQUAL(q.waiting(), 0);
+
+    // the same hash from another address is another client
+    BOOST_CHECK_EQUAL(q.request(client(0), file, now, rank), upload_queue::granted);
+    BOOST_CHECK_EQUAL(q.request(client(0, "10.0.0.2"), file, now, rank), upload_queue::queued);
+    BOOST_CHECK(!q.has_slot(client(0, "10.0.0.2")));
+
+    q.downloaded(client(0), 10 * 1024 * 1024);
+    BOOST_CHECK(q.credit_modifier(client(0)) > 3);
+    BOOST_CHECK_EQUAL(q.credit_modifier(client(0, "10.0.0.2")), 1.f);
+
+    q.disconnected(client(0, "10.0.0.2"));
+    BOOST_CHECK(q.has_slot(client(0)));
+}
+
+BOOST_AUTO_TEST_CASE(test_upload_queue_revoke)
+{
+    using namespace libed2k;
+    session_settings s = queue_settings(1, 1);
+    s.upload_slot_bytes = 1000;
+    upload_queue q(s);
+    ptime now = time_now_hires();
+    md4_hash file;
+    int rank = 0;
+
+    BOOST_CHECK_EQUAL(q.request(client(0), file, now, rank), upload_queue::granted);
+
+    // slot isn't taken back while nobody waits
+    q.uploaded(client(0), 2000);
+    upload_queue::tick_result res;
+    q.second_tick(now, res);
+    BOOST_CHECK(res.revoked.empty());
+    BOOST_CHECK(q.has_slot(client(0)));
+
+    // client which uploaded enough goes to the end of queue
+    BOOST_CHECK_EQUAL(q.request(client(1), file, now, rank), upload_queue::queued);
+    now += seconds(1);
+    res = upload_queue::tick_result();
+    q.second_tick(now, res);
+    BOOST_REQUIRE_EQUAL(res.revoked.size(), 1u);
+    BOOST_CHECK(res.revoked[0] == client(0));
+    BOOST_REQUIRE_EQUAL(res.granted.size(), 1u);
+    BOOST_CHECK(res.granted[0] == client(1));
+    BOOST_CHECK_EQUAL(q.rank(client(0), now), 1);
+
+    // idle slot is taken back
+    now += seconds(upload_queue::slot_idle_time);
+    res = upload_queue::tick_result();
+    q.second_tick(now, res);
+    BOOST_REQUIRE_EQUAL(res.revoked.size(), 1u);
+    BOOST_CHECK(res.revoked[0] == client(1));
+    BOOST_CHECK(q.has_slot(client(0)));
+
+    // slot lasting too long is taken back
+    s.upload_slot_time = 5;
+    q.uploaded(client(0), 10);
+    now += seconds(5);
+    res = upload_queue::tick_result();
+    q.second_tick(now, res);
+    BOOST_REQUIRE_EQUAL(res.revoked.size(), 1u);
+    BOOST_CHECK(res.revoked[0] == client(0));
+}
+
+BOOST_AUTO_TEST_CASE(test_upload_queue_adjust_slots)
+{
+    using namespace libed2k;
+    session_settings s = queue_settings(1, 3);
+    upload_queue q(s);
+    ptime now = time_now_hires();
+    const int clients = 5;
+    int rank = 0;
+
+    for (int n = 0; n < clients; ++n) q.request(client(n), md4_hash(), now, rank);
+    BOOST_CHECK_EQUAL(q.target_slots(), 1);
+
+    // rising rate adds a slot per adjustment
+    run(q, clients, now, upload_queue::adjust_interval, 10000, 1000000);
+    BOOST_CHECK_EQUAL(q.target_slots(), 2);
+    run(q, clients, now, upload_queue::adjust_interval, 10000, 1000000);
+    BOOST_CHECK_EQUAL(q.target_slots(), 3);
+
+    // unchoke_slots_limit caps slot count
+    run(q, clients, now, 5 * upload_queue::adjust_interval, 10000, 1000000);
+    BOOST_CHECK_EQUAL(q.target_slots(), 3);
+    BOOST_CHECK_EQUAL(q.slots(), 3);
+
+    // slot probed when link is full doesn't raise total rate and is removed
+    s.unchoke_slots_limit = -1;
+    const int target = q.target_slots();
+
+    for (int i = 0; i <= upload_queue::probe_interval && q.target_slots() == target; ++i)
+        run(q, clients, now, upload_queue::adjust_interval, 10000, 30000);
+
+    BOOST_REQUIRE_EQUAL(q.target_slots(), target + 1);
+    run(q, clients, now, upload_queue::adjust_interval, 10000, 30000);
+    BOOST_CHECK_EQUAL(q.target_slots(), target);
+    BOOST_CHECK_EQUAL(q.slots(), target);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "libed2k/io_service.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/session_status.hpp"
+#include "libed2k/connection_queue.hpp"
+#include "libed2k/udp_socket.hpp"
+#include "libed2k/slab_arena.hpp"
+#include "libed2k/utp_socket_manager.hpp"
+
+namespace
+{
+    struct manager_fixture
+    {
+        manager_fixture():
+            cq(ios),
+            sock(ios, libed2k::udp_socket::callback_t(), libed2k::udp_socket::callback2_t(), cq),
+            manager(settings, sock, libed2k::incoming_utp_callback_t())
+        {}
+
+        libed2k::utp_status status() const
+        {
+            libed2k::utp_status s;
+            manager.get_status(s);
+            return s;
+        }
+
+        libed2k::io_service ios;
+        libed2k::connection_queue cq;
+        libed2k::session_settings settings;
+        libed2k::udp_socket sock;
+        libed2k::utp_socket_manager manager;
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(test_utp_socket_manager)
+
+BOOST_FIXTURE_TEST_CASE(test_packet_size_classes, manager_fixture)
+{
+    typedef libed2k::utp_socket_manager mgr;
+    const int sizes[] = { 20, mgr::small_packet_size, mgr::small_packet_size + 1, mgr::mtu_packet_size };
+
+    std::vector<char*> packets;
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            char* p = manager.allocate_packet(sizes[i]);
+            BOOST_REQUIRE(p);
+            p[0] = 1;
+            p[sizes[i] - 1] = 1;
+            packets.push_back(p);
+        }
+    }
+
+    libed2k::utp_status s = status();
+    BOOST_CHECK_EQUAL(s.packet_buffers_in_use, 12);
+    BOOST_CHECK_EQUAL(s.small_packet_buffers_peak, 6);
+    BOOST_CHECK_EQUAL(s.mtu_packet_buffers_peak, 6);
+    BOOST_CHECK_EQUAL(s.heap_packets, 0);
+    BOOST_CHECK_EQUAL(s.packet_pool_fallbacks, 0);
+
+    for (std::size_t n = 0; n < packets.size(); ++n)
+        manager.release_packet(packets[n], sizes[n % 4]);
+
+    // peaks of the pools are kept apart
+    for (int i = 0; i < 2; ++i) packets[i] = manager.allocate_packet(20);
+    s = status();
+    BOOST_CHECK_EQUAL(s.packet_buffers_in_use, 2);
+    BOOST_CHECK_EQUAL(s.small_packet_buffers_peak, 6);
+    BOOST_CHECK_EQUAL(s.mtu_packet_buffers_peak, 6);
+    for (int i = 0; i < 2; ++i) manager.release_packet(packets[i], 20);
+
+    char* big = manager.allocate_packet(mgr::mtu_packet_size + 1);
+    BOOST_REQUIRE(big);
+    big[mgr::mtu_packet_size] = 1;
+    BOOST_CHECK_EQUAL(status().heap_packets, 1);
+    BOOST_CHECK_EQUAL(status().packet_buffers_in_use, 0);
+    manager.release_packet(big, mgr::mtu_packet_size + 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_packet_pool_fallback, manager_fixture)
+{
+    typedef libed2k::utp_socket_manager mgr;
+    const int per_slab = libed2k::slab_arena::hugepage_size / mgr::mtu_packet_size;
+    manager.set_packet_pool_limit(1);
+
+    std::vector<char*> packets;
+    for (int i = 0; i < per_slab + 3; ++i)
+    {
+        char* p = manager.allocate_packet(mgr::mtu_packet_size);
+        BOOST_REQUIRE(p);
+        p[mgr::mtu_packet_size - 1] = 1;
+        packets.push_back(p);
+    }
+
+    libed2k::utp_status s = status();
+    BOOST_CHECK_EQUAL(s.packet_buffers_in_use, per_slab);
+    BOOST_CHECK_EQUAL(s.packet_pool_fallbacks, 3);
+    BOOST_CHECK_EQUAL(s.heap_packets, 0);
+
+    // the small pool has its own slab
+    char* small = manager.allocate_packet(mgr::small_packet_size);
+    BOOST_REQUIRE(small);
+    BOOST_CHECK_EQUAL(status().packet_pool_fallbacks, 3);
+    manager.release_packet(small, mgr::small_packet_size);
+
+    // heap packets are told from pooled ones on release
+    for (std::size_t n = packets.size(); n > 0; --n)
+        manager.release_packet(packets[n - 1], mgr::mtu_packet_size);
+
+    s = status();
+    BOOST_CHECK_EQUAL(s.packet_buffers_in_use, 0);
+    BOOST_CHECK_EQUAL(s.packet_pool_fallbacks, 3);
+
+    // released buffers are reused before falling back again
+    char* p = manager.allocate_packet(mgr::mtu_packet_size);
+    BOOST_REQUIRE(p);
+    BOOST_CHECK_EQUAL(status().packet_pool_fallbacks, 3);
+    BOOST_CHECK_EQUAL(status().packet_buffers_in_use, 1);
+    manager.release_packet(p, mgr::mtu_packet_size);
+}
+
+BOOST_AUTO_TEST_SUITE_END()